@@ -0,0 +1,105 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdlib.h>
+
+#include <unistd.h>
+
+#include "bench_util.h"
+
+
+int write_all(int fd, const void* data, size_t size) {
+    const char* bytes = data;
+    while (size > 0) {
+        ssize_t res = write(fd, bytes, size);
+        if (res == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+
+        bytes += res;
+        size -= res;
+    }
+
+    return 0;
+}
+
+
+int read_all(int fd, void* data, size_t size) {
+    char* bytes = data;
+    while (size > 0) {
+        ssize_t res = read(fd, bytes, size);
+        if (res == -1 && errno == EINTR) {
+            continue;
+        } else if (res <= 0) {
+            return -1;
+        }
+
+        bytes += res;
+        size -= res;
+    }
+
+    return 0;
+}
+
+
+int parse_list(const char* list, int* values, int max_values) {
+    int count = 0;
+    const char* value = list;
+    while (*value != '\0') {
+        if (count == max_values) {
+            return -1;
+        }
+
+        char* end;
+        values[count++] = (int)strtol(value, &end, 10);
+        if (end == value || (*end != ',' && *end != '\0')) {
+            return -1;
+        }
+
+        value = *end == ',' ? end + 1 : end;
+    }
+
+    return count;
+}
+
+
+int parse_sizes(const char* list, uint64_t* sizes, int max_sizes, uint64_t max_size) {
+    int count = 0;
+    const char* value = list;
+    while (*value != '\0') {
+        if (count == max_sizes) {
+            return -1;
+        }
+
+        char* end;
+        uint64_t size = strtoull(value, &end, 10);
+        if (end == value) {
+            return -1;
+        }
+
+        switch (*end) {
+        case 'K': size <<= 10; end++; break;
+        case 'M': size <<= 20; end++; break;
+        case 'G': size <<= 30; end++; break;
+        }
+
+        if ((*end != ',' && *end != '\0') || size == 0 || size > max_size) {
+            return -1;
+        }
+
+        sizes[count++] = size;
+        value = *end == ',' ? end + 1 : end;
+    }
+
+    return count;
+}
+
+
+int compare_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
@@ -0,0 +1,40 @@
+#ifndef BENCH_UTIL_H
+#define BENCH_UTIL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/* Helpers shared by the benchmarks. */
+
+
+/*
+ * Write the size bytes of data in fd, or read exactly size bytes from fd into
+ * data, going on after a signal. Used to exchange a single byte or a structure
+ * through a pipe. Return -1 on error (or end of file), 0 otherwise.
+ */
+int write_all(int fd, const void* data, size_t size);
+int read_all(int fd, void* data, size_t size);
+
+
+/*
+ * Parse a comma separated list of at most max_values integers in values.
+ * Return the number of values, -1 on error.
+ */
+int parse_list(const char* list, int* values, int max_values);
+
+
+/*
+ * Parse a comma separated list of at most max_sizes sizes in sizes. A size may
+ * end with K, M or G (powers of 1024), and must be between 1 and max_size.
+ * Return the number of sizes, -1 on error.
+ */
+int parse_sizes(const char* list, uint64_t* sizes, int max_sizes, uint64_t max_size);
+
+
+/*
+ * Comparison of two uint64_t, for qsort.
+ */
+int compare_u64(const void* a, const void* b);
+
+#endif /* BENCH_UTIL_H */
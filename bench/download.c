@@ -0,0 +1,557 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "bench_util.h"
+#include "gnutella.h"
+#include "log.h"
+#include "metrics.h"
+#include "server_defines.h"
+
+
+/*
+ * Download benchmark: times CMSG_DOWNLOAD end to end, for files of growing
+ * sizes, between two servents on loopback.
+ *
+ * For each size, a fresh pair of processes is started (each running the
+ * library), so that the peak RSS of a process only reflects that transfer: an
+ * uploader, which has the file in its SEARCH_DIRECTORY, and a downloader, which
+ * joins it and downloads the file from it. Each side reports:
+ *  - its peak RSS before the transfer and at the end of it (getrusage),
+ *  - the CPU time (user and system) it used from the start of the transfer to
+ *    the end, which includes the few polls of an idle main loop,
+ * and the downloader reports the time between gnutella_download and the end of
+ * the download, which gives the throughput.
+ *
+ * A transfer that fails or takes longer than the timeout ends the sweep: the
+ * larger sizes would not do better. Sizes are capped at 4 GiB - 1, the file
+ * length being a 32 bits field of SMSG_DOWNLOAD.
+ */
+
+
+/* Default values of the parameters. */
+#define DEFAULT_SIZES "1K,16K,256K,1M,4M,16M,64M,256M,1G"
+#define DEFAULT_TIMEOUT 60
+#define DEFAULT_BASE_PORT 32000
+#define DEFAULT_DIRECTORY "/tmp/gnutella-download"
+
+/* Time (milliseconds) a servent has to reach its main loop. */
+#define JOIN_TIMEOUT 30000
+/* Bytes written at once when the files are created. */
+#define WRITE_CHUNK (1 << 20)
+
+/* Maximum number of sizes. */
+#define MAX_SIZES 32
+
+
+typedef struct parameters_s {
+    uint64_t sizes[MAX_SIZES];
+    int nb_sizes;
+    /* Time (seconds) a transfer has to complete. */
+    int timeout;
+    int base_port;
+    const char* directory;
+    int log_level;
+    /* Keep the files of the uploader between two runs. */
+    int keep;
+} parameters_t;
+
+
+/* A servent of the benchmark. */
+typedef struct node_s {
+    pid_t pid;
+    /* Benchmark to servent (commands), servent to benchmark (reports). */
+    int commands;
+    int reports;
+} node_t;
+
+
+/* What each side reports once the transfer is over. */
+typedef struct report_s {
+    int succeeded;
+    /* Duration of the transfer (downloader only), in nanoseconds. */
+    uint64_t elapsed;
+    /* CPU time used during the transfer, in nanoseconds. */
+    uint64_t cpu;
+    /* Peak RSS of the process before and after the transfer, in KiB. */
+    long rss_before;
+    long rss_peak;
+} report_t;
+
+
+/* State of the download, inside the downloader. */
+typedef struct transfer_s {
+    int done;
+    int succeeded;
+} transfer_t;
+
+
+/* Roles of the servents. */
+#define ROLE_UPLOADER 0
+#define ROLE_DOWNLOADER 1
+
+/* Commands sent to the servents. */
+#define COMMAND_GO 'g'
+#define COMMAND_REPORT 'r'
+/* Status of a servent after its start. */
+#define STATUS_READY 'r'
+#define STATUS_FAILED 'f'
+
+
+static void usage(const char* name);
+
+
+/*
+ * Format size in buffer, with the largest suffix that divides it.
+ */
+static void format_size(uint64_t size, char* buffer, size_t length);
+
+
+/*
+ * Create the directories of the servents, and the file of size bytes in the
+ * one of the uploader if it is not already there. Return -1 on error, 0
+ * otherwise.
+ */
+ERROR_CODES_USUAL static int prepare_files(const parameters_t* parameters, uint64_t size,
+                                           const char* filename);
+
+
+/*
+ * Run the transfer of one size and display its results. Return -1 if it failed
+ * or timed out, 0 otherwise.
+ */
+ERROR_CODES_USUAL static int run_transfer(const parameters_t* parameters, int index,
+                                          uint64_t size);
+
+
+/*
+ * Start a servent in a child process and wait until it reached its main loop.
+ * Return -1 if it did not, 0 otherwise.
+ */
+ERROR_CODES_USUAL static int start_node(const parameters_t* parameters, int role,
+                                        int port, const char* filename, node_t* node);
+
+
+/*
+ * Entry point of the process of a servent. Never returns.
+ */
+static void run_node(const parameters_t* parameters, int role, int port,
+                     const char* filename, int commands, int reports);
+
+
+/*
+ * Callback of the download (user_data is a transfer_t).
+ */
+static void on_download(void* user_data, gnutella_download_event_t event,
+                        const char* filename, const gnutella_source_t* source);
+
+
+/*
+ * CPU time (user and system) used by the process so far, in nanoseconds.
+ */
+static uint64_t cpu_time(void);
+
+
+/******************************************************************************/
+
+
+int main(int argc, char** argv) {
+    parameters_t parameters = {
+        .timeout = DEFAULT_TIMEOUT, .base_port = DEFAULT_BASE_PORT,
+        .directory = DEFAULT_DIRECTORY, .log_level = LOG_LEVEL_WARNING, .keep = 0
+    };
+    parameters.nb_sizes = parse_sizes(DEFAULT_SIZES, parameters.sizes, MAX_SIZES,
+                                      UINT32_MAX);
+
+    int opt;
+    while ((opt = getopt(argc, argv, "S:T:p:w:kvh")) != -1) {
+        switch (opt) {
+        case 'S':
+            parameters.nb_sizes = parse_sizes(optarg, parameters.sizes, MAX_SIZES,
+                                              UINT32_MAX);
+            break;
+        case 'T': parameters.timeout = atoi(optarg); break;
+        case 'p': parameters.base_port = atoi(optarg); break;
+        case 'w': parameters.directory = optarg; break;
+        case 'k': parameters.keep = 1; break;
+        case 'v': parameters.log_level = LOG_LEVEL_INFO; break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (parameters.nb_sizes <= 0 || parameters.timeout < 1 ||
+        parameters.base_port < 1 || parameters.base_port + 2 * MAX_SIZES > 65535) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    log_set_level(parameters.log_level);
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("%-8s %-10s %-10s | %-10s %-10s %-10s | %-10s %-10s %-10s\n", "", "", "",
+           "uploader", "", "", "downloader", "", "");
+    printf("%-8s %-10s %-10s | %-10s %-10s %-10s | %-10s %-10s %-10s\n", "size", "time (s)",
+           "MiB/s", "RSS (MiB)", "peak", "CPU ns/B", "RSS (MiB)", "peak", "CPU ns/B");
+    fflush(stdout);
+
+    for (int i = 0; i < parameters.nb_sizes; i++) {
+        if (run_transfer(&parameters, i, parameters.sizes[i]) == -1) {
+            break;
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+
+void usage(const char* name) {
+    fprintf(stderr, "Usage: %s [-S size,size...] [-T timeout (s)] [-p base port] "
+                    "[-w directory] [-k] [-v]\n", name);
+    fprintf(stderr, "Sizes take a K, M or G suffix (default %s); -k keeps the files of "
+                    "the uploader for the next runs.\n", DEFAULT_SIZES);
+}
+
+
+void format_size(uint64_t size, char* buffer, size_t length) {
+    if (size % (1 << 30) == 0) {
+        snprintf(buffer, length, "%luG", (unsigned long)(size >> 30));
+    } else if (size % (1 << 20) == 0) {
+        snprintf(buffer, length, "%luM", (unsigned long)(size >> 20));
+    } else if (size % (1 << 10) == 0) {
+        snprintf(buffer, length, "%luK", (unsigned long)(size >> 10));
+    } else {
+        snprintf(buffer, length, "%lu", (unsigned long)size);
+    }
+}
+
+
+int prepare_files(const parameters_t* parameters, uint64_t size, const char* filename) {
+    char path[4096];
+    const char* roles[2] = { "uploader", "downloader" };
+
+    mkdir(parameters->directory, 0777);
+    for (int i = 0; i < 2; i++) {
+        snprintf(path, sizeof(path), "%s/%s", parameters->directory, roles[i]);
+        mkdir(path, 0777);
+        snprintf(path, sizeof(path), "%s/%s/%s", parameters->directory, roles[i],
+                 SEARCH_DIRECTORY);
+        if (mkdir(path, 0777) == -1 && errno != EEXIST) {
+            return -1;
+        }
+    }
+
+    /* The downloader must not have the file already. */
+    snprintf(path, sizeof(path), "%s/downloader/%s/%s", parameters->directory,
+             SEARCH_DIRECTORY, filename);
+    unlink(path);
+
+    snprintf(path, sizeof(path), "%s/uploader/%s/%s", parameters->directory,
+             SEARCH_DIRECTORY, filename);
+    struct stat status;
+    if (stat(path, &status) == 0 && (uint64_t)status.st_size == size) {
+        return 0;
+    }
+
+    int fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0666);
+    if (fd == -1) {
+        return -1;
+    }
+
+    /* Not compressible nor sparse: every byte has to be read and sent. */
+    char* chunk = malloc(WRITE_CHUNK);
+    uint32_t state = 2463534242u;
+    for (size_t i = 0; i < WRITE_CHUNK; i++) {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        chunk[i] = (char)state;
+    }
+
+    int res = 0;
+    for (uint64_t written = 0; written < size && res == 0; ) {
+        size_t length = size - written < WRITE_CHUNK ? size - written : WRITE_CHUNK;
+        res = write_all(fd, chunk, length);
+        written += length;
+    }
+
+    free(chunk);
+    close(fd);
+    return res;
+}
+
+
+int run_transfer(const parameters_t* parameters, int index, uint64_t size) {
+    char size_name[16], filename[32];
+    format_size(size, size_name, sizeof(size_name));
+    snprintf(filename, sizeof(filename), "blob-%s", size_name);
+
+    if (prepare_files(parameters, size, filename) == -1) {
+        fprintf(stderr, "Cannot create %s in %s: %s\n", filename, parameters->directory,
+                strerror(errno));
+        return -1;
+    }
+
+    /* New ports for each size, the previous ones may still be in TIME_WAIT. */
+    int port = parameters->base_port + 2 * index;
+    node_t uploader = { -1, -1, -1 }, downloader = { -1, -1, -1 };
+    report_t uploaded = { 0 }, downloaded = { 0 };
+    int res = -1;
+
+    if (start_node(parameters, ROLE_UPLOADER, port, filename, &uploader) == 0 &&
+        start_node(parameters, ROLE_DOWNLOADER, port, filename, &downloader) == 0) {
+        char command = COMMAND_GO;
+        write_all(uploader.commands, &command, 1);
+        write_all(downloader.commands, &command, 1);
+
+        /* The downloader reports once the download is over, or timed out. */
+        command = COMMAND_REPORT;
+        if (read_all(downloader.reports, &downloaded, sizeof(report_t)) == 0 &&
+            write_all(uploader.commands, &command, 1) == 0 &&
+            read_all(uploader.reports, &uploaded, sizeof(report_t)) == 0 &&
+            downloaded.succeeded) {
+            res = 0;
+        }
+    }
+
+    /*
+     * Closing the pipes stops the servents. After a failure, the servent
+     * threads may still be stuck in the transfer: kill them.
+     */
+    node_t* nodes[2] = { &uploader, &downloader };
+    for (int i = 0; i < 2; i++) {
+        if (nodes[i]->pid == -1) {
+            continue;
+        }
+
+        if (res == -1) {
+            kill(nodes[i]->pid, SIGKILL);
+        }
+        close(nodes[i]->commands);
+        close(nodes[i]->reports);
+    }
+
+    /* The downloader holds the pipes of the uploader too, wait for both. */
+    for (int i = 0; i < 2; i++) {
+        if (nodes[i]->pid != -1) {
+            waitpid(nodes[i]->pid, NULL, 0);
+        }
+    }
+
+    if (res == -1) {
+        int timed_out = downloaded.elapsed >= (uint64_t)parameters->timeout * 1000000000ull;
+        printf("%-8s %s\n", size_name, timed_out ? "timed out" : "failed");
+        fflush(stdout);
+        return -1;
+    }
+
+    char path[4096];
+    struct stat status;
+    snprintf(path, sizeof(path), "%s/downloader/%s/%s", parameters->directory,
+             SEARCH_DIRECTORY, filename);
+    if (stat(path, &status) == -1 || (uint64_t)status.st_size != size) {
+        printf("%-8s truncated (%ld bytes)\n", size_name,
+               stat(path, &status) == -1 ? 0L : (long)status.st_size);
+        fflush(stdout);
+        return -1;
+    }
+
+    /* Downloaded files are large and useless afterwards. */
+    unlink(path);
+    if (parameters->keep == 0) {
+        snprintf(path, sizeof(path), "%s/uploader/%s/%s", parameters->directory,
+                 SEARCH_DIRECTORY, filename);
+        unlink(path);
+    }
+
+    double seconds = downloaded.elapsed / 1e9;
+    printf("%-8s %-10.3f %-10.2f | %-10.1f %-10.1f %-10.2f | %-10.1f %-10.1f %-10.2f\n",
+           size_name, seconds, size / (1024.0 * 1024.0) / seconds,
+           uploaded.rss_before / 1024.0, uploaded.rss_peak / 1024.0,
+           (double)uploaded.cpu / size,
+           downloaded.rss_before / 1024.0, downloaded.rss_peak / 1024.0,
+           (double)downloaded.cpu / size);
+    fflush(stdout);
+
+    return 0;
+}
+
+
+int start_node(const parameters_t* parameters, int role, int port, const char* filename,
+               node_t* node) {
+    int commands[2], reports[2];
+    if (pipe(commands) == -1 || pipe(reports) == -1) {
+        perror("pipe");
+        exit(EXIT_FAILURE);
+    }
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    } else if (pid == 0) {
+        close(commands[1]);
+        close(reports[0]);
+        run_node(parameters, role, port, filename, commands[0], reports[1]);
+    }
+
+    close(commands[0]);
+    close(reports[1]);
+    node->pid = pid;
+    node->commands = commands[1];
+    node->reports = reports[0];
+
+    char status = STATUS_FAILED;
+    if (read_all(node->reports, &status, 1) == -1 || status != STATUS_READY) {
+        fprintf(stderr, "The %s did not start, see its logs in %s.\n",
+                role == ROLE_UPLOADER ? "uploader" : "downloader", parameters->directory);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+void run_node(const parameters_t* parameters, int role, int port, const char* filename,
+              int commands, int reports) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", parameters->directory,
+             role == ROLE_UPLOADER ? "uploader" : "downloader");
+    if (chdir(path) == -1) {
+        _exit(EXIT_FAILURE);
+    }
+
+    freopen("stdout.log", "w", stdout);
+    freopen("stderr.log", "w", stderr);
+
+    char listen_port[8], contact_port[8];
+    snprintf(listen_port, sizeof(listen_port), "%d", port + role);
+    snprintf(contact_port, sizeof(contact_port), "%d", port);
+
+    gnutella_config_t config = {
+        .first_machine = role == ROLE_UPLOADER,
+        .listen_port = listen_port,
+        .contact_ip = "127.0.0.1",
+        .contact_port = contact_port,
+        .metrics_file = NULL,
+        .log_level = parameters->log_level,
+        .search_ttl = 0,
+        .max_neighbours = 0
+    };
+
+    gnutella_t* gnutella = gnutella_init(&config);
+    char status = STATUS_FAILED;
+    if (gnutella != NULL) {
+        uint64_t deadline = metrics_now() + (uint64_t)JOIN_TIMEOUT * 1000000;
+        while (metric_get(METRIC_LOOP_ITERATIONS) == 0 && metrics_now() < deadline) {
+            if (gnutella_poll(gnutella, 10) == -1) {
+                break;
+            }
+        }
+
+        if (metric_get(METRIC_LOOP_ITERATIONS) > 0) {
+            status = STATUS_READY;
+        }
+    }
+    write_all(reports, &status, 1);
+
+    char command;
+    if (status != STATUS_READY || read_all(commands, &command, 1) == -1 ||
+        command != COMMAND_GO) {
+        _exit(EXIT_FAILURE);
+    }
+
+    /* The peak so far is the footprint of an idle servent. */
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    report_t report = { 0, 0, 0, usage.ru_maxrss, 0 };
+    uint64_t cpu_begin = cpu_time();
+    uint64_t begin = metrics_now();
+    struct pollfd poller = { .fd = commands, .events = POLLIN, .revents = 0 };
+
+    if (role == ROLE_DOWNLOADER) {
+        gnutella_source_t source = { "127.0.0.1", contact_port };
+        transfer_t transfer = { 0, 0 };
+        uint64_t deadline = begin + (uint64_t)parameters->timeout * 1000000000ull;
+
+        if (gnutella_download(gnutella, filename, &source, 1, on_download, &transfer) == 0) {
+            while (transfer.done == 0 && metrics_now() < deadline) {
+                if (gnutella_poll(gnutella, 50) == -1) {
+                    break;
+                }
+            }
+        }
+
+        report.succeeded = transfer.succeeded;
+        report.elapsed = metrics_now() - begin;
+    } else {
+        /* Serve until the benchmark asks for the report. */
+        while (poll(&poller, 1, 0) == 0) {
+            if (gnutella_poll(gnutella, 50) == -1) {
+                break;
+            }
+        }
+        read_all(commands, &command, 1);
+        report.succeeded = 1;
+    }
+
+    getrusage(RUSAGE_SELF, &usage);
+    report.cpu = cpu_time() - cpu_begin;
+    report.rss_peak = usage.ru_maxrss;
+    write_all(reports, &report, sizeof(report_t));
+
+    /* Stay until the benchmark closes the pipe. */
+    while (poll(&poller, 1, 0) == 0) {
+        if (gnutella_poll(gnutella, 50) == -1) {
+            break;
+        }
+    }
+
+    /*
+     * A timed out transfer may still hold the servent: do not wait for it to
+     * leave the network.
+     */
+    if (role == ROLE_DOWNLOADER && report.succeeded == 0) {
+        _exit(EXIT_FAILURE);
+    }
+
+    gnutella_shutdown(&gnutella);
+    exit(EXIT_SUCCESS);
+}
+
+
+void on_download(void* user_data, gnutella_download_event_t event,
+                 const char* filename, const gnutella_source_t* source) {
+    UNUSED(filename);
+    UNUSED(source);
+
+    transfer_t* transfer = (transfer_t*)user_data;
+    if (event == GNUTELLA_DOWNLOAD_DONE) {
+        transfer->done = 1;
+        transfer->succeeded = 1;
+    } else if (event == GNUTELLA_DOWNLOAD_FAILED) {
+        transfer->done = 1;
+    }
+}
+
+
+uint64_t cpu_time(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
@@ -0,0 +1,903 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "bench_util.h"
+#include "gnutella.h"
+#include "log.h"
+#include "metrics.h"
+#include "networking.h"
+#include "packet.h"
+#include "packets_decode.h"
+#include "packets_defines.h"
+#include "server_defines.h"
+#include "util.h"
+
+
+/*
+ * Query flood: finds how many searches per second a servent forwards before
+ * its main loop saturates.
+ *
+ * The generator joins the target servent as several fake neighbours, with the
+ * real CMSG_JOIN exchange (rescue flag set, so that the coin flip of the target
+ * does not refuse them). It then sends CMSG_SEARCH_REQUEST frames through them,
+ * in turn, at each rate of the sweep, and watches what the target sends back to
+ * the other fake neighbours:
+ *  - a query whose TTL is not 0 is forwarded, with the TTL decreased, to every
+ *    neighbour but the one it came from: the copies are matched to the query
+ *    through its source port, which is a sequence number.
+ *  - a query whose TTL is 0 is answered with an SMSG_SEARCH_REQUEST sent to
+ *    the same neighbours. Answers only carry the name of the file: they are
+ *    matched to the oldest query of that name still waiting for one.
+ * The turnaround of a query is the time until its first copy or answer comes
+ * back, which is how long it waited inside the target.
+ *
+ * By default the target is the first servent of a stand-in network started on
+ * loopback (one process per servent, each running the library), whose files
+ * are named after the workload: name i is held by servent i % nodes, so that a
+ * share of the queries hits on the target. The metrics of the target are
+ * written in its directory (metrics.prom), for the duration of its loop. -c
+ * floods an external servent instead.
+ *
+ * A step saturates when less than SATURATION_HANDLED percents of its queries
+ * came back before the end of the grace period, or when the 99th percentile of
+ * the turnaround exceeds SATURATION_LATENCY: the sweep stops there.
+ */
+
+
+/* Default values of the parameters. */
+#define DEFAULT_NODES 3
+#define DEFAULT_FAKES 2
+#define DEFAULT_NAMES 100
+#define DEFAULT_DURATION 5
+#define DEFAULT_BASE_PORT 31000
+#define DEFAULT_DIRECTORY "/tmp/gnutella-flood"
+#define DEFAULT_RATES "25,50,100,200,400,800"
+
+/* Time (milliseconds) the stragglers of a step are waited for. */
+#define GRACE_PERIOD 3000
+/* Time (milliseconds) a servent has to reach its main loop. */
+#define JOIN_TIMEOUT 30000
+
+/* Thresholds of a saturated step (percents, milliseconds). */
+#define SATURATION_HANDLED 95
+#define SATURATION_LATENCY 1000
+
+/* Maximum number of rates, TTLs and fake neighbours. */
+#define MAX_SWEEP 16
+#define MAX_FAKES MAX_NEIGHBOURS
+
+/* Bytes a fake neighbour buffers for the target before dropping queries. */
+#define OUTBOUND_CAPACITY 65536
+/* Bytes read at once from the target. */
+#define READ_CHUNK 16384
+
+
+typedef struct parameters_s {
+    /* Servents of the stand-in network, 0 with an external target. */
+    int nodes;
+    int fakes;
+    int names;
+    /* Exponent of the Zipf distribution of the names, 0 for a uniform one. */
+    double zipf;
+    /* Duration of a step, in seconds. */
+    int duration;
+    int base_port;
+    unsigned int seed;
+    const char* directory;
+    int log_level;
+    /* External target, when nodes is 0. */
+    char target_ip[INET6_ADDRSTRLEN];
+    char target_port[8];
+
+    int rates[MAX_SWEEP];
+    int nb_rates;
+    /* TTL of each query, drawn uniformly in this list. */
+    int ttls[MAX_SWEEP];
+    int nb_ttls;
+} parameters_t;
+
+
+/* A servent of the stand-in network. */
+typedef struct node_s {
+    pid_t pid;
+    /* Closing it stops the servent. */
+    int commands;
+} node_t;
+
+
+/* A fake neighbour of the target. */
+typedef struct fake_s {
+    int sock;
+    /* Where the target would contact us, only accepted then closed. */
+    int listener;
+    char contact_port[8];
+    /* Bytes received from the target, not decoded yet (opcode included). */
+    packet_t* inbound;
+    char outbound[OUTBOUND_CAPACITY];
+    size_t outbound_size;
+} fake_t;
+
+
+/* A query of the current step. */
+typedef struct query_s {
+    uint64_t sent;
+    /* Time until the first copy or answer came back, 0 if none yet. */
+    uint64_t turnaround;
+    int name;
+    int ttl;
+    int hit;
+    /* Next query of the same name waiting for an answer, -1 if none. */
+    int next_waiting;
+} query_t;
+
+
+/* State of a step. */
+typedef struct step_s {
+    query_t* queries;
+    int nb_queries;
+    int capacity;
+    /* Sequence number of the first query of the step. */
+    unsigned int first_sequence;
+    int names;
+    /* Oldest and newest queries of each name waiting for an answer. */
+    int* waiting_head;
+    int* waiting_tail;
+
+    long dropped;
+    long copies;
+    long answers;
+} step_t;
+
+
+/* Status of a servent after its start. */
+#define STATUS_READY 'r'
+#define STATUS_FAILED 'f'
+
+
+static void usage(const char* name);
+
+
+/*
+ * Parse "ip:port" into the target of parameters. Return -1 on error, 0
+ * otherwise.
+ */
+ERROR_CODES_USUAL static int parse_target(const char* target, parameters_t* parameters);
+
+
+/*
+ * Start the stand-in network, one servent after the other. Return the number
+ * of servents that reached their main loop.
+ */
+static int start_network(const parameters_t* parameters, node_t* nodes);
+
+
+/*
+ * Entry point of the process of a servent. Never returns.
+ */
+static void run_node(const parameters_t* parameters, int index, int contact,
+                     int commands, int reports);
+
+
+/*
+ * Stop the servents of the stand-in network and wait for them.
+ */
+static void stop_network(const parameters_t* parameters, node_t* nodes);
+
+
+/*
+ * Join the target as fake, with a CMSG_JOIN whose contact port is the one of a
+ * listening socket opened for the occasion. Return -1 if the target could not
+ * be reached or refused, 0 otherwise.
+ */
+ERROR_CODES_USUAL static int join_target(const parameters_t* parameters, int index,
+                                         fake_t* fake);
+
+
+/*
+ * Send CMSG_LEAVE to the target and release fake.
+ */
+static void leave_target(fake_t* fake);
+
+
+/*
+ * Flood the target at rate queries per second for a step, then wait for the
+ * stragglers, and display the results. Return 1 if the step saturated the
+ * target, 0 otherwise.
+ */
+static int run_step(const parameters_t* parameters, fake_t* fakes, int nb_fakes,
+                    const double* cdf, const char* self_ip, unsigned int* sequence,
+                    int rate);
+
+
+/*
+ * Queue a query in the outbound buffer of fake. Return -1 if the buffer is
+ * full, 0 otherwise.
+ */
+ERROR_CODES_USUAL static int send_query(fake_t* fake, const char* self_ip,
+                                        unsigned int sequence, int name, int ttl);
+
+
+/*
+ * Read what the target sent to fake and match the frames with the queries of
+ * step. Return -1 if the target closed the connection or sent something that
+ * is not expected from a neighbour, 0 otherwise.
+ */
+ERROR_CODES_USUAL static int receive_frames(fake_t* fake, step_t* step, const char* self_ip,
+                                            uint64_t now);
+
+
+/*
+ * Draw a name according to the cumulative distribution cdf (names elements).
+ */
+static int draw_name(const double* cdf, int names);
+
+
+/*
+ * Parse the index of the name name-<index>, -1 if filename is not one of ours.
+ */
+static int parse_name(const string_view_t* filename);
+
+
+/******************************************************************************/
+
+
+int main(int argc, char** argv) {
+    parameters_t parameters = {
+        .nodes = DEFAULT_NODES, .fakes = DEFAULT_FAKES, .names = DEFAULT_NAMES,
+        .zipf = 0, .duration = DEFAULT_DURATION, .base_port = DEFAULT_BASE_PORT,
+        .seed = 1, .directory = DEFAULT_DIRECTORY, .log_level = LOG_LEVEL_WARNING,
+        .ttls = { 1 }, .nb_ttls = 1
+    };
+    parameters.nb_rates = parse_list(DEFAULT_RATES, parameters.rates, MAX_SWEEP);
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:c:k:f:z:r:t:d:p:s:w:vh")) != -1) {
+        switch (opt) {
+        case 'n': parameters.nodes = atoi(optarg); break;
+        case 'c':
+            if (parse_target(optarg, &parameters) == -1) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            parameters.nodes = 0;
+            break;
+        case 'k': parameters.fakes = atoi(optarg); break;
+        case 'f': parameters.names = atoi(optarg); break;
+        case 'z': parameters.zipf = atof(optarg); break;
+        case 'r': parameters.nb_rates = parse_list(optarg, parameters.rates, MAX_SWEEP); break;
+        case 't': parameters.nb_ttls = parse_list(optarg, parameters.ttls, MAX_SWEEP); break;
+        case 'd': parameters.duration = atoi(optarg); break;
+        case 'p': parameters.base_port = atoi(optarg); break;
+        case 's': parameters.seed = (unsigned int)atoi(optarg); break;
+        case 'w': parameters.directory = optarg; break;
+        case 'v': parameters.log_level = LOG_LEVEL_INFO; break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (parameters.nodes < 0 || parameters.fakes < 2 || parameters.fakes > MAX_FAKES ||
+        parameters.names < 1 || parameters.zipf < 0 || parameters.duration < 1 ||
+        parameters.base_port + parameters.nodes + parameters.fakes > 65535 ||
+        parameters.nb_rates <= 0 || parameters.nb_ttls <= 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    for (int i = 0; i < parameters.nb_ttls; i++) {
+        if (parameters.ttls[i] < 0 || parameters.ttls[i] > UINT8_MAX) {
+            fprintf(stderr, "The TTL must be between 0 and %d.\n", UINT8_MAX);
+            return EXIT_FAILURE;
+        }
+    }
+
+    log_set_level(parameters.log_level);
+
+    /* A fake neighbour the target closed on must not kill the generator. */
+    signal(SIGPIPE, SIG_IGN);
+    srand(parameters.seed);
+
+    node_t* nodes = calloc(parameters.nodes + 1, sizeof(node_t));
+    if (parameters.nodes > 0) {
+        int started = start_network(&parameters, nodes);
+        printf("Stand-in network: %d/%d servents started, target on port %d\n",
+               started, parameters.nodes, parameters.base_port);
+        snprintf(parameters.target_ip, sizeof(parameters.target_ip), "127.0.0.1");
+        snprintf(parameters.target_port, sizeof(parameters.target_port), "%d",
+                 parameters.base_port);
+    }
+
+    fake_t* fakes = calloc(parameters.fakes, sizeof(fake_t));
+    int nb_fakes = 0;
+    for (int i = 0; i < parameters.fakes; i++) {
+        if (join_target(&parameters, i, fakes + nb_fakes) == 0) {
+            nb_fakes++;
+        }
+    }
+
+    printf("%d/%d fake neighbours joined %s:%s\n", nb_fakes, parameters.fakes,
+           parameters.target_ip, parameters.target_port);
+    if (nb_fakes < 2) {
+        fprintf(stderr, "At least two fake neighbours are needed to see what the "
+                        "target sends back.\n");
+        for (int i = 0; i < nb_fakes; i++) {
+            leave_target(fakes + i);
+        }
+        stop_network(&parameters, nodes);
+        return EXIT_FAILURE;
+    }
+
+    /* Our address, as seen by the target: the source IP of the queries. */
+    char self_ip[INET6_ADDRSTRLEN];
+    extract_ip_from_socket(fakes[0].sock, self_ip, 0);
+
+    double* cdf = malloc(parameters.names * sizeof(double));
+    double total = 0;
+    for (int i = 0; i < parameters.names; i++) {
+        total += 1.0 / pow(i + 1, parameters.zipf);
+        cdf[i] = total;
+    }
+    for (int i = 0; i < parameters.names; i++) {
+        cdf[i] /= total;
+    }
+
+    printf("\n%d names (zipf %.2f), %d s per step, seed %u\n\n", parameters.names,
+           parameters.zipf, parameters.duration, parameters.seed);
+    printf("%-8s %-8s %-8s %-8s %-8s %-9s %-10s %-10s %-7s\n", "rate", "sent/s",
+           "drop/s", "fwd/s", "ans/s", "handled", "p50 (ms)", "p99 (ms)", "hits");
+    fflush(stdout);
+
+    unsigned int sequence = 0;
+    int saturated_at = -1;
+    for (int i = 0; i < parameters.nb_rates; i++) {
+        if (run_step(&parameters, fakes, nb_fakes, cdf, self_ip, &sequence,
+                     parameters.rates[i]) == 1) {
+            saturated_at = parameters.rates[i];
+            break;
+        }
+    }
+
+    if (saturated_at == -1) {
+        printf("\nNot saturated up to %d queries/s.\n",
+               parameters.rates[parameters.nb_rates - 1]);
+    } else {
+        printf("\nSaturated at %d queries/s.\n", saturated_at);
+    }
+    if (parameters.nodes > 0) {
+        printf("Metrics of the target: %s/node-0/metrics.prom\n", parameters.directory);
+    }
+
+    for (int i = 0; i < nb_fakes; i++) {
+        leave_target(fakes + i);
+    }
+    stop_network(&parameters, nodes);
+
+    free(cdf);
+    free(fakes);
+    free(nodes);
+    return EXIT_SUCCESS;
+}
+
+
+void usage(const char* name) {
+    fprintf(stderr, "Usage: %s [-n stand-in servents | -c ip:port] [-k fake neighbours] "
+                    "[-f names] [-z zipf exponent] [-r rate,rate...] [-t ttl,ttl...] "
+                    "[-d seconds per step] [-p base port] [-s seed] [-w directory] [-v]\n",
+            name);
+    fprintf(stderr, "The TTL of each query is drawn uniformly in the list given to -t "
+                    "(repeat a value to weight it).\n");
+}
+
+
+int parse_target(const char* target, parameters_t* parameters) {
+    const char* colon = strrchr(target, ':');
+    if (colon == NULL || colon == target ||
+        (size_t)(colon - target) >= sizeof(parameters->target_ip)) {
+        return -1;
+    }
+
+    memcpy(parameters->target_ip, target, colon - target);
+    parameters->target_ip[colon - target] = '\0';
+    snprintf(parameters->target_port, sizeof(parameters->target_port), "%s", colon + 1);
+
+    return check_ip(parameters->target_ip) == 1 && check_port(parameters->target_port) == 1
+           ? 0 : -1;
+}
+
+
+int start_network(const parameters_t* parameters, node_t* nodes) {
+    char path[4096];
+    mkdir(parameters->directory, 0777);
+
+    int started = 0;
+    for (int i = 0; i < parameters->nodes; i++) {
+        snprintf(path, sizeof(path), "%s/node-%d", parameters->directory, i);
+        mkdir(path, 0777);
+        snprintf(path, sizeof(path), "%s/node-%d/%s", parameters->directory, i,
+                 SEARCH_DIRECTORY);
+        mkdir(path, 0777);
+
+        /* Name n is held by servent n % nodes, and only by it. */
+        for (int n = 0; n < parameters->names; n++) {
+            snprintf(path, sizeof(path), "%s/node-%d/%s/name-%d", parameters->directory,
+                     i, SEARCH_DIRECTORY, n);
+            if (n % parameters->nodes == i) {
+                int fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0666);
+                if (fd != -1) {
+                    close(fd);
+                }
+            } else {
+                unlink(path);
+            }
+        }
+
+        int commands[2], reports[2];
+        if (pipe(commands) == -1 || pipe(reports) == -1) {
+            perror("pipe");
+            exit(EXIT_FAILURE);
+        }
+
+        /* Drawn here, so that the topology only depends on the seed. */
+        int contact = i == 0 ? 0 : rand() % i;
+
+        pid_t pid = fork();
+        if (pid == -1) {
+            perror("fork");
+            exit(EXIT_FAILURE);
+        } else if (pid == 0) {
+            for (int j = 0; j < i; j++) {
+                close(nodes[j].commands);
+            }
+            close(commands[1]);
+            close(reports[0]);
+            run_node(parameters, i, contact, commands[0], reports[1]);
+        }
+
+        close(commands[0]);
+        close(reports[1]);
+        nodes[i].pid = pid;
+        nodes[i].commands = commands[1];
+
+        char status = STATUS_FAILED;
+        if (read_all(reports[0], &status, 1) == 0 && status == STATUS_READY) {
+            started++;
+        }
+        close(reports[0]);
+    }
+
+    return started;
+}
+
+
+void run_node(const parameters_t* parameters, int index, int contact,
+              int commands, int reports) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/node-%d", parameters->directory, index);
+    if (chdir(path) == -1) {
+        _exit(EXIT_FAILURE);
+    }
+
+    freopen("stdout.log", "w", stdout);
+    freopen("stderr.log", "w", stderr);
+
+    char listen_port[8], contact_port[8];
+    snprintf(listen_port, sizeof(listen_port), "%d", parameters->base_port + index);
+    snprintf(contact_port, sizeof(contact_port), "%d", parameters->base_port + contact);
+
+    gnutella_config_t config = {
+        .first_machine = index == 0,
+        .listen_port = listen_port,
+        .contact_ip = "127.0.0.1",
+        .contact_port = contact_port,
+        .metrics_file = index == 0 ? "metrics.prom" : NULL,
+        .log_level = parameters->log_level,
+        .search_ttl = 0,
+        .max_neighbours = 0
+    };
+
+    gnutella_t* gnutella = gnutella_init(&config);
+    char status = STATUS_FAILED;
+    if (gnutella != NULL) {
+        uint64_t deadline = metrics_now() + (uint64_t)JOIN_TIMEOUT * 1000000;
+        while (metric_get(METRIC_LOOP_ITERATIONS) == 0 && metrics_now() < deadline) {
+            if (gnutella_poll(gnutella, 10) == -1) {
+                break;
+            }
+        }
+
+        if (metric_get(METRIC_LOOP_ITERATIONS) > 0) {
+            status = STATUS_READY;
+        }
+    }
+    write_all(reports, &status, 1);
+    close(reports);
+
+    /* Serve until the generator closes the pipe. */
+    struct pollfd poller = { .fd = commands, .events = POLLIN, .revents = 0 };
+    while (poll(&poller, 1, 0) == 0 && gnutella != NULL) {
+        if (gnutella_poll(gnutella, 50) == -1) {
+            break;
+        }
+    }
+
+    if (gnutella != NULL) {
+        gnutella_shutdown(&gnutella);
+    }
+
+    exit(EXIT_SUCCESS);
+}
+
+
+void stop_network(const parameters_t* parameters, node_t* nodes) {
+    for (int i = 0; i < parameters->nodes; i++) {
+        close(nodes[i].commands);
+    }
+
+    for (int i = 0; i < parameters->nodes; i++) {
+        waitpid(nodes[i].pid, NULL, 0);
+    }
+}
+
+
+int join_target(const parameters_t* parameters, int index, fake_t* fake) {
+    int port = parameters->base_port + parameters->nodes + index;
+    snprintf(fake->contact_port, sizeof(fake->contact_port), "%d", port);
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+
+    int yes = 1;
+    fake->listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (fake->listener == -1 ||
+        setsockopt(fake->listener, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) == -1 ||
+        bind(fake->listener, (struct sockaddr*)&addr, sizeof(addr)) == -1 ||
+        listen(fake->listener, 8) == -1) {
+        perror("listen");
+        if (fake->listener != -1) {
+            close(fake->listener);
+        }
+        return -1;
+    }
+
+    fake->sock = -1;
+    if (connect_to(parameters->target_ip, parameters->target_port, &fake->sock) != CONNECT_OK) {
+        close(fake->listener);
+        return -1;
+    }
+
+    packet_t* packet = packet_begin(CMSG_JOIN);
+    packet_append_u8(packet, 1);
+    packet_append_string(packet, fake->contact_port);
+    int res = packet_send(packet, fake->sock);
+    packet_release(packet);
+
+    opcode_t opcode = 0;
+    uint8_t answer = 0;
+    if (res == -1 || read_from_fd(fake->sock, &opcode, PKT_ID_SIZE) == -1 ||
+        opcode != SMSG_JOIN || read_from_fd(fake->sock, &answer, sizeof(uint8_t)) == -1 ||
+        answer != 1) {
+        close(fake->sock);
+        close(fake->listener);
+        return -1;
+    }
+
+    /* The contact port of the target follows. */
+    uint8_t length;
+    char target_port[UINT8_MAX];
+    if (read_from_fd(fake->sock, &length, sizeof(uint8_t)) == -1 ||
+        read_from_fd(fake->sock, target_port, length) == -1) {
+        close(fake->sock);
+        close(fake->listener);
+        return -1;
+    }
+
+    fcntl(fake->sock, F_SETFL, fcntl(fake->sock, F_GETFL) | O_NONBLOCK);
+    fcntl(fake->listener, F_SETFL, fcntl(fake->listener, F_GETFL) | O_NONBLOCK);
+    fake->inbound = packet_create(READ_CHUNK);
+    fake->outbound_size = 0;
+    return 0;
+}
+
+
+void leave_target(fake_t* fake) {
+    /* Whatever is still queued is lost, the target is going to drop us. */
+    fcntl(fake->sock, F_SETFL, fcntl(fake->sock, F_GETFL) & ~O_NONBLOCK);
+    opcode_t opcode = CMSG_LEAVE;
+    write_to_fd(fake->sock, &opcode, PKT_ID_SIZE);
+
+    close(fake->sock);
+    close(fake->listener);
+    packet_release(fake->inbound);
+}
+
+
+int run_step(const parameters_t* parameters, fake_t* fakes, int nb_fakes,
+             const double* cdf, const char* self_ip, unsigned int* sequence, int rate) {
+    step_t step;
+    step.capacity = rate * parameters->duration + 1;
+    step.queries = malloc(step.capacity * sizeof(query_t));
+    step.nb_queries = 0;
+    step.first_sequence = *sequence;
+    step.names = parameters->names;
+    step.waiting_head = malloc(parameters->names * sizeof(int));
+    step.waiting_tail = malloc(parameters->names * sizeof(int));
+    for (int i = 0; i < parameters->names; i++) {
+        step.waiting_head[i] = -1;
+        step.waiting_tail[i] = -1;
+    }
+    step.dropped = 0;
+    step.copies = 0;
+    step.answers = 0;
+
+    struct pollfd pollers[2 * MAX_FAKES];
+    uint64_t interval = 1000000000ull / rate;
+    uint64_t begin = metrics_now();
+    uint64_t end = begin + (uint64_t)parameters->duration * 1000000000ull;
+    uint64_t deadline = end + (uint64_t)GRACE_PERIOD * 1000000;
+    uint64_t next_send = begin;
+    int next_fake = 0;
+    int broken = 0;
+
+    while (!broken) {
+        uint64_t now = metrics_now();
+
+        /* Send every query that is due, one fake neighbour after the other. */
+        while (now < end && next_send <= now && step.nb_queries < step.capacity) {
+            query_t* query = step.queries + step.nb_queries;
+            query->sent = now;
+            query->turnaround = 0;
+            query->name = draw_name(cdf, parameters->names);
+            query->ttl = parameters->ttls[rand() % parameters->nb_ttls];
+            query->hit = 0;
+            query->next_waiting = -1;
+
+            if (send_query(fakes + next_fake, self_ip, *sequence, query->name,
+                           query->ttl) == -1) {
+                step.dropped++;
+            } else {
+                if (query->ttl == 0) {
+                    if (step.waiting_tail[query->name] == -1) {
+                        step.waiting_head[query->name] = step.nb_queries;
+                    } else {
+                        step.queries[step.waiting_tail[query->name]].next_waiting =
+                            step.nb_queries;
+                    }
+                    step.waiting_tail[query->name] = step.nb_queries;
+                }
+                step.nb_queries++;
+                (*sequence)++;
+            }
+
+            next_fake = (next_fake + 1) % nb_fakes;
+            next_send += interval;
+        }
+
+        if (now >= deadline) {
+            break;
+        }
+
+        /* Once the flood is over, stop as soon as every query came back. */
+        if (now >= end) {
+            int pending = 0;
+            for (int i = 0; i < step.nb_queries && pending == 0; i++) {
+                pending = step.queries[i].turnaround == 0;
+            }
+            if (pending == 0) {
+                break;
+            }
+        }
+
+        for (int i = 0; i < nb_fakes; i++) {
+            pollers[2 * i].fd = fakes[i].sock;
+            pollers[2 * i].events = POLLIN | (fakes[i].outbound_size > 0 ? POLLOUT : 0);
+            pollers[2 * i].revents = 0;
+            pollers[2 * i + 1].fd = fakes[i].listener;
+            pollers[2 * i + 1].events = POLLIN;
+            pollers[2 * i + 1].revents = 0;
+        }
+
+        uint64_t wake_up = now < end ? next_send : deadline;
+        int timeout = wake_up > now ? (int)((wake_up - now) / 1000000) : 0;
+        if (poll(pollers, 2 * nb_fakes, timeout) == -1 && errno != EINTR) {
+            perror("poll");
+            break;
+        }
+
+        now = metrics_now();
+        for (int i = 0; i < nb_fakes; i++) {
+            fake_t* fake = fakes + i;
+
+            if (pollers[2 * i + 1].revents & POLLIN) {
+                int s = accept(fake->listener, NULL, NULL);
+                if (s != -1) {
+                    close(s);
+                }
+            }
+
+            if (pollers[2 * i].revents & POLLOUT) {
+                ssize_t res = write(fake->sock, fake->outbound, fake->outbound_size);
+                if (res > 0) {
+                    memmove(fake->outbound, fake->outbound + res, fake->outbound_size - res);
+                    fake->outbound_size -= res;
+                }
+            }
+
+            if (pollers[2 * i].revents & (POLLIN | POLLHUP | POLLERR)) {
+                if (receive_frames(fake, &step, self_ip, now) == -1) {
+                    fprintf(stderr, "The target dropped fake neighbour %d.\n", i);
+                    broken = 1;
+                }
+            }
+        }
+    }
+
+    uint64_t* turnarounds = malloc((step.nb_queries + 1) * sizeof(uint64_t));
+    int handled = 0, hits = 0;
+    for (int i = 0; i < step.nb_queries; i++) {
+        if (step.queries[i].turnaround > 0) {
+            turnarounds[handled++] = step.queries[i].turnaround;
+            hits += step.queries[i].hit;
+        }
+    }
+
+    qsort(turnarounds, handled, sizeof(uint64_t), compare_u64);
+    double p50 = handled > 0 ? turnarounds[(int)(0.5 * (handled - 1) + 0.5)] / 1e6 : 0;
+    double p99 = handled > 0 ? turnarounds[(int)(0.99 * (handled - 1) + 0.5)] / 1e6 : 0;
+    double handled_ratio = step.nb_queries > 0 ? 100.0 * handled / step.nb_queries : 0;
+
+    /* Every frame of the target reaches each of the other fake neighbours. */
+    double seconds = parameters->duration;
+    double copies = (double)(nb_fakes - 1);
+    printf("%-8d %-8.1f %-8.1f %-8.1f %-8.1f %7.1f%%  %-10.1f %-10.1f %5.1f%%\n", rate,
+           step.nb_queries / seconds, step.dropped / seconds, step.copies / copies / seconds,
+           step.answers / copies / seconds, handled_ratio, p50, p99,
+           handled > 0 ? 100.0 * hits / handled : 0.0);
+    fflush(stdout);
+
+    free(turnarounds);
+    free(step.waiting_tail);
+    free(step.waiting_head);
+    free(step.queries);
+
+    return broken || handled_ratio < SATURATION_HANDLED || p99 > SATURATION_LATENCY;
+}
+
+
+int send_query(fake_t* fake, const char* self_ip, unsigned int sequence, int name, int ttl) {
+    /* The source port only identifies the query: the target never uses it. */
+    char filename[32], source[16];
+    snprintf(filename, sizeof(filename), "name-%d", name);
+    snprintf(source, sizeof(source), "q%u", sequence);
+
+    packet_t* packet = packet_begin(CMSG_SEARCH_REQUEST);
+    packet_append_string(packet, self_ip);
+    packet_append_string(packet, source);
+    packet_append_string(packet, filename);
+    packet_append_u8(packet, ttl);
+    packet_append_u8(packet, 0);
+
+    int res = -1;
+    if (fake->outbound_size + packet->size <= OUTBOUND_CAPACITY) {
+        memcpy(fake->outbound + fake->outbound_size, packet->data, packet->size);
+        fake->outbound_size += packet->size;
+        res = 0;
+    }
+
+    packet_release(packet);
+    return res;
+}
+
+
+int receive_frames(fake_t* fake, step_t* step, const char* self_ip, uint64_t now) {
+    packet_t* inbound = fake->inbound;
+    packet_reserve(inbound, READ_CHUNK);
+    ssize_t res = read(fake->sock, inbound->data + inbound->size, READ_CHUNK);
+    if (res == 0 || (res == -1 && errno != EAGAIN && errno != EINTR)) {
+        return -1;
+    } else if (res > 0) {
+        inbound->size += res;
+    }
+
+    while (inbound->size > 0) {
+        opcode_t opcode = (opcode_t)inbound->data[0];
+        packet_reader_t reader;
+        packet_reader_wrap(&reader, inbound);
+        int query = -1;
+
+        if (opcode == CMSG_SEARCH_REQUEST) {
+            search_query_t copy;
+            if (decode_search_query(&reader, &copy) == -1) {
+                break;
+            }
+
+            /* Only the copies of our own queries are expected. */
+            step->copies++;
+            if (copy.port_source.length > 1 && copy.port_source.data[0] == 'q' &&
+                string_view_equals(&copy.ip_source, self_ip)) {
+                unsigned int sequence = (unsigned int)strtoul(copy.port_source.data + 1,
+                                                              NULL, 10);
+                if (sequence - step->first_sequence < (unsigned int)step->nb_queries) {
+                    query = sequence - step->first_sequence;
+                    step->queries[query].hit |= copy.nb_hits > 0;
+                }
+            }
+        } else if (opcode == SMSG_SEARCH_REQUEST) {
+            search_answer_t answer;
+            if (decode_search_answer(&reader, &answer) == -1) {
+                break;
+            }
+
+            /* Match the answer with the oldest query of its name. */
+            step->answers++;
+            int name = parse_name(&answer.filename);
+            if (name >= 0 && name < step->names && step->waiting_head[name] != -1) {
+                query = step->waiting_head[name];
+                step->waiting_head[name] = step->queries[query].next_waiting;
+                if (step->waiting_head[name] == -1) {
+                    step->waiting_tail[name] = -1;
+                }
+                step->queries[query].hit = answer.nb_hits > 0;
+            }
+        } else {
+            /* CMSG_LEAVE, or anything a neighbour does not send. */
+            return -1;
+        }
+
+        if (query != -1 && step->queries[query].turnaround == 0) {
+            step->queries[query].turnaround = now - step->queries[query].sent;
+        }
+
+        memmove(inbound->data, inbound->data + reader.cursor, inbound->size - reader.cursor);
+        inbound->size -= reader.cursor;
+    }
+
+    return 0;
+}
+
+
+int draw_name(const double* cdf, int names) {
+    double value = (double)rand() / ((double)RAND_MAX + 1);
+    int low = 0, high = names - 1;
+    while (low < high) {
+        int middle = (low + high) / 2;
+        if (cdf[middle] <= value) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    return low;
+}
+
+
+int parse_name(const string_view_t* filename) {
+    char name[UINT8_MAX + 1];
+    string_view_to_cstring(filename, name);
+    if (strncmp(name, "name-", 5) != 0) {
+        return -1;
+    }
+
+    return atoi(name + 5);
+}
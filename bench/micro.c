@@ -0,0 +1,806 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "hashmap.h"
+#include "list.h"
+#include "log.h"
+#include "metrics.h"
+#include "packet.h"
+#include "packets_decode.h"
+#include "packets_defines.h"
+#include "server_defines.h"
+#include "server_internal.h"
+#include "util.h"
+
+
+/*
+ * Microbenchmarks of the primitives on the hot paths of the servent: the
+ * containers (list.c, the request log of hashmap.c), the encoding and decoding
+ * of the search packets, the lookup of a file (search_file) and the address
+ * helpers of util.c.
+ *
+ * Each benchmark runs a fixed number of operations, REPEATS times, and the
+ * fastest run is kept, which is the most repeatable figure on a busy machine.
+ * The allocations are counted by wrapping malloc, calloc, realloc and free at
+ * link time (see the Makefile): only the calls made by the servent code are
+ * seen, not the ones the C library makes internally.
+ *
+ * The results can be written to a baseline file (-w), and compared against one
+ * (-b): the program then exits with a failure status if a benchmark became
+ * slower than the baseline by more than the threshold, or allocates more.
+ */
+
+
+/*
+ * Default values of the parameters. On a shared machine the fastest of ten runs
+ * still moves by a third from one invocation to the other on the shortest
+ * benchmarks, hence a threshold that only catches real slowdowns; the
+ * allocations, on the other hand, are exact.
+ */
+#define DEFAULT_REPEATS 10
+#define DEFAULT_THRESHOLD 50
+
+/* Maximum length of the name of a benchmark. */
+#define NAME_LENGTH 32
+/* Maximum number of benchmarks inside a baseline file. */
+#define MAX_BASELINE 64
+
+/* Directory search_file looks into, and number of files inside it. */
+#define SEARCH_ROOT "/tmp/gnutella-micro"
+#define SEARCH_FILES 256
+
+/* Number of entries of the request log, as a busy servent has. */
+#define REQUEST_LOG_SIZE 4096
+/* Number of elements pushed, then popped, at once in the lists. */
+#define LIST_BATCH 64
+/* Number of machines inside the decoded answers. */
+#define ANSWER_HITS 8
+
+
+typedef struct parameters_s {
+    int repeats;
+    /* Maximum slowdown (percents) before a benchmark is a regression. */
+    int threshold;
+    const char* baseline;
+    const char* output;
+    /* Only the benchmarks whose name contains filter are run. */
+    const char* filter;
+} parameters_t;
+
+
+/* Result of a benchmark. */
+typedef struct result_s {
+    char name[NAME_LENGTH];
+    double ns_per_op;
+    double allocs_per_op;
+} result_t;
+
+
+/*
+ * A benchmark runs ops operations on state. setup and teardown (which can be
+ * NULL) are not timed.
+ */
+typedef struct benchmark_s {
+    const char* name;
+    long ops;
+    void* (*setup)(void);
+    void (*run)(void* state, long ops);
+    void (*teardown)(void* state);
+} benchmark_t;
+
+
+/* Allocations made since the start of the program. */
+static long allocations = 0;
+
+
+/*
+ * Defeat the optimizer: the results of the benchmarked functions are folded
+ * into this variable so that their calls cannot be removed.
+ */
+static volatile long sink = 0;
+
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+void __real_free(void* ptr);
+
+void* __wrap_malloc(size_t size);
+void* __wrap_calloc(size_t count, size_t size);
+void* __wrap_realloc(void* ptr, size_t size);
+void __wrap_free(void* ptr);
+
+
+static void usage(const char* name);
+
+
+/*
+ * Run benchmark params->repeats times and fill result with its fastest run.
+ */
+static void run_benchmark(const parameters_t* params, const benchmark_t* benchmark,
+                          result_t* result);
+
+
+/*
+ * Read the baseline file path into results (at most MAX_BASELINE of them).
+ * Return the number of results read, or -1 if the file could not be opened.
+ */
+static int read_baseline(const char* path, result_t* results);
+
+
+/*
+ * Write the results in the baseline file path. Return -1 on error, 0 otherwise.
+ */
+ERROR_CODES_USUAL static int write_baseline(const char* path, const result_t* results,
+                                            int nb_results);
+
+
+/*
+ * Build a CMSG_SEARCH_REQUEST carrying nb_hits machines, the way the servent
+ * builds the ones it forwards.
+ */
+static packet_t* build_search_query(int nb_hits);
+
+
+/*
+ * Build an SMSG_SEARCH_REQUEST answer carrying nb_hits machines.
+ */
+static packet_t* build_search_answer(int nb_hits);
+
+
+LIST_CREATE_FN static void* copy_int(void* data);
+static void* setup_lists(void);
+static void bench_list(void* state, long ops);
+static void bench_intrusive_list(void* state, long ops);
+static void teardown_lists(void* state);
+
+static void* setup_request_log(void);
+static void bench_request_log_lookup(void* state, long ops);
+static void bench_request_log_insert(void* state, long ops);
+static void teardown_request_log(void* state);
+
+static void bench_write_to_packet(void* state, long ops);
+static void bench_encode_search_query(void* state, long ops);
+
+static void* setup_search_query(void);
+static void* setup_search_answer(void);
+static void bench_decode_search_query(void* state, long ops);
+static void bench_decode_search_answer(void* state, long ops);
+static void teardown_packet(void* state);
+
+static void* setup_search_file(void);
+static void bench_search_file(void* state, long ops);
+static void teardown_search_file(void* state);
+
+static void bench_check_ip(void* state, long ops);
+static void bench_check_port(void* state, long ops);
+
+static void* setup_sockets(void);
+static void bench_extract_ip_port(void* state, long ops);
+static void bench_extract_ip_port_s(void* state, long ops);
+static void teardown_sockets(void* state);
+
+
+static const benchmark_t benchmarks[] = {
+    { "list_push_pop", 1 << 20, setup_lists, bench_list, teardown_lists },
+    { "intrusive_list_push_pop", 1 << 22, setup_lists, bench_intrusive_list, teardown_lists },
+    { "request_log_lookup", 1 << 20, setup_request_log, bench_request_log_lookup, teardown_request_log },
+    { "request_log_insert", 1 << 18, setup_request_log, bench_request_log_insert, teardown_request_log },
+    { "write_to_packet", 1 << 22, NULL, bench_write_to_packet, NULL },
+    { "encode_search_query", 1 << 20, NULL, bench_encode_search_query, NULL },
+    { "decode_search_query", 1 << 21, setup_search_query, bench_decode_search_query, teardown_packet },
+    { "decode_search_answer", 1 << 20, setup_search_answer, bench_decode_search_answer, teardown_packet },
+    { "search_file", 1 << 11, setup_search_file, bench_search_file, teardown_search_file },
+    { "check_ip", 1 << 20, NULL, bench_check_ip, NULL },
+    { "check_port", 1 << 20, NULL, bench_check_port, NULL },
+    { "extract_ip_port", 1 << 18, setup_sockets, bench_extract_ip_port, teardown_sockets },
+    { "extract_ip_port_s", 1 << 18, setup_sockets, bench_extract_ip_port_s, teardown_sockets },
+};
+
+#define NB_BENCHMARKS ((int)(sizeof(benchmarks) / sizeof(benchmarks[0])))
+
+
+/******************************************************************************/
+
+
+void* __wrap_malloc(size_t size) {
+    ++allocations;
+    return __real_malloc(size);
+}
+
+
+void* __wrap_calloc(size_t count, size_t size) {
+    ++allocations;
+    return __real_calloc(count, size);
+}
+
+
+void* __wrap_realloc(void* ptr, size_t size) {
+    ++allocations;
+    return __real_realloc(ptr, size);
+}
+
+
+void __wrap_free(void* ptr) {
+    __real_free(ptr);
+}
+
+
+int main(int argc, char** argv) {
+    parameters_t params = {
+        .repeats = DEFAULT_REPEATS,
+        .threshold = DEFAULT_THRESHOLD,
+        .baseline = NULL,
+        .output = NULL,
+        .filter = NULL
+    };
+
+    int option;
+    while ((option = getopt(argc, argv, "r:t:b:w:f:h")) != -1) {
+        switch (option) {
+        case 'r':
+            params.repeats = atoi(optarg);
+            break;
+        case 't':
+            params.threshold = atoi(optarg);
+            break;
+        case 'b':
+            params.baseline = optarg;
+            break;
+        case 'w':
+            params.output = optarg;
+            break;
+        case 'f':
+            params.filter = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return option == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    if (params.repeats <= 0 || params.threshold < 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    /* The code measured logs what it does, which is not what we measure. */
+    log_set_level(LOG_LEVEL_WARNING);
+
+    result_t baseline[MAX_BASELINE];
+    int nb_baseline = 0;
+    if (params.baseline != NULL) {
+        nb_baseline = read_baseline(params.baseline, baseline);
+        if (nb_baseline == -1) {
+            fprintf(stderr, "Impossible de lire la référence %s : %s\n", params.baseline,
+                    strerror(errno));
+            return EXIT_FAILURE;
+        }
+    }
+
+    result_t results[NB_BENCHMARKS];
+    int nb_results = 0;
+    int regressions = 0;
+
+    printf("%-26s %12s %12s", "benchmark", "ns/op", "allocs/op");
+    if (params.baseline != NULL) {
+        printf(" %12s %10s", "baseline", "delta");
+    }
+    printf("\n");
+
+    for (int i = 0; i < NB_BENCHMARKS; i++) {
+        if (params.filter != NULL && strstr(benchmarks[i].name, params.filter) == NULL) {
+            continue;
+        }
+
+        result_t* result = &results[nb_results++];
+        run_benchmark(&params, &benchmarks[i], result);
+        printf("%-26s %12.1f %12.2f", result->name, result->ns_per_op, result->allocs_per_op);
+
+        const result_t* reference = NULL;
+        for (int j = 0; j < nb_baseline; j++) {
+            if (strcmp(baseline[j].name, result->name) == 0) {
+                reference = &baseline[j];
+                break;
+            }
+        }
+
+        if (reference != NULL) {
+            double delta = 100.0 * (result->ns_per_op - reference->ns_per_op) / reference->ns_per_op;
+            printf(" %12.1f %+9.1f%%", reference->ns_per_op, delta);
+
+            if (delta > params.threshold) {
+                printf("  REGRESSION (temps)");
+                ++regressions;
+            }
+            /* Allocations are deterministic, half an allocation is not noise. */
+            if (result->allocs_per_op > reference->allocs_per_op + 0.5) {
+                printf("  REGRESSION (allocations)");
+                ++regressions;
+            }
+        } else if (params.baseline != NULL) {
+            printf(" %12s", "-");
+        }
+        printf("\n");
+        fflush(stdout);
+    }
+
+    if (params.output != NULL) {
+        if (write_baseline(params.output, results, nb_results) == -1) {
+            fprintf(stderr, "Impossible d'écrire la référence %s : %s\n", params.output,
+                    strerror(errno));
+            return EXIT_FAILURE;
+        }
+        printf("Référence écrite dans %s\n", params.output);
+    }
+
+    if (regressions > 0) {
+        printf("%d régression(s) au-delà de %d%%\n", regressions, params.threshold);
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+
+void usage(const char* name) {
+    fprintf(stderr,
+            "Usage : %s [options]\n"
+            "  -r repeats    runs of each benchmark, the fastest is kept (%d)\n"
+            "  -t percents   slowdown allowed against the baseline (%d)\n"
+            "  -b file       compare against the baseline file\n"
+            "  -w file       write the results as a baseline file\n"
+            "  -f substring  only run the benchmarks whose name contains substring\n",
+            name, DEFAULT_REPEATS, DEFAULT_THRESHOLD);
+}
+
+
+void run_benchmark(const parameters_t* params, const benchmark_t* benchmark,
+                   result_t* result) {
+    snprintf(result->name, NAME_LENGTH, "%s", benchmark->name);
+    result->ns_per_op = -1;
+    result->allocs_per_op = 0;
+
+    void* state = benchmark->setup != NULL ? benchmark->setup() : NULL;
+
+    /* Warm up the caches, and the pools of cells and packets. */
+    benchmark->run(state, benchmark->ops / 16 + 1);
+
+    for (int i = 0; i < params->repeats; i++) {
+        long allocations_before = allocations;
+        uint64_t begin = metrics_now();
+        benchmark->run(state, benchmark->ops);
+        uint64_t duration = metrics_now() - begin;
+        long allocated = allocations - allocations_before;
+
+        double ns_per_op = (double)duration / benchmark->ops;
+        if (result->ns_per_op < 0 || ns_per_op < result->ns_per_op) {
+            result->ns_per_op = ns_per_op;
+            result->allocs_per_op = (double)allocated / benchmark->ops;
+        }
+    }
+
+    if (benchmark->teardown != NULL) {
+        benchmark->teardown(state);
+    }
+}
+
+
+int read_baseline(const char* path, result_t* results) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        return -1;
+    }
+
+    int nb_results = 0;
+    char line[256];
+    while (nb_results < MAX_BASELINE && fgets(line, sizeof(line), file) != NULL) {
+        if (line[0] == '#' || line[0] == '\n') {
+            continue;
+        }
+
+        result_t* result = &results[nb_results];
+        if (sscanf(line, "%31s %lf %lf", result->name, &result->ns_per_op,
+                   &result->allocs_per_op) == 3 && result->ns_per_op > 0) {
+            ++nb_results;
+        }
+    }
+
+    fclose(file);
+    return nb_results;
+}
+
+
+int write_baseline(const char* path, const result_t* results, int nb_results) {
+    FILE* file = fopen(path, "w");
+    if (file == NULL) {
+        return -1;
+    }
+
+    fprintf(file, "# benchmark ns/op allocs/op (written by bench/micro -w)\n");
+    for (int i = 0; i < nb_results; i++) {
+        fprintf(file, "%s %.1f %.2f\n", results[i].name, results[i].ns_per_op,
+                results[i].allocs_per_op);
+    }
+
+    return fclose(file) == 0 ? 0 : -1;
+}
+
+
+packet_t* build_search_query(int nb_hits) {
+    packet_t* packet = packet_begin(CMSG_SEARCH_REQUEST);
+    packet_append_string(packet, "192.168.100.200");
+    packet_append_string(packet, "10000");
+    packet_append_string(packet, "some-rather-long-file-name.tar.gz");
+    packet_append_u8(packet, DEFAULT_TTL);
+    packet_append_u8(packet, nb_hits);
+    for (int i = 0; i < nb_hits; i++) {
+        packet_append_string(packet, "10.0.0.1");
+        packet_append_string(packet, "10001");
+    }
+
+    return packet;
+}
+
+
+packet_t* build_search_answer(int nb_hits) {
+    packet_t* packet = packet_begin(SMSG_SEARCH_REQUEST);
+    packet_append_string(packet, "some-rather-long-file-name.tar.gz");
+    packet_append_u8(packet, nb_hits);
+    for (int i = 0; i < nb_hits; i++) {
+        packet_append_string(packet, "10.0.0.1");
+        packet_append_string(packet, "10001");
+    }
+
+    return packet;
+}
+
+
+/* State of the list benchmarks. */
+typedef struct lists_state_s {
+    list_t* list;
+    intrusive_list_t intrusive;
+    int values[LIST_BATCH];
+    /* One element per value of the intrusive list. */
+    struct {
+        list_node_t node;
+        int value;
+    } elements[LIST_BATCH];
+} lists_state_t;
+
+
+void* copy_int(void* data) {
+    int* copy = malloc(sizeof(int));
+    *copy = *(int*)data;
+    return copy;
+}
+
+
+void* setup_lists(void) {
+    lists_state_t* state = malloc(sizeof(lists_state_t));
+    state->list = list_create(NULL, copy_int);
+    intrusive_list_init(&state->intrusive);
+    for (int i = 0; i < LIST_BATCH; i++) {
+        state->values[i] = i;
+        state->elements[i].value = i;
+    }
+
+    return state;
+}
+
+
+void bench_list(void* state, long ops) {
+    lists_state_t* lists = state;
+
+    /*
+     * Push a batch, then walk the list and pop every cell, the way the servent
+     * goes through its awaiting sockets.
+     */
+    for (long done = 0; done < ops; done += LIST_BATCH) {
+        for (int i = 0; i < LIST_BATCH; i++) {
+            list_push_back(lists->list, &lists->values[i]);
+        }
+
+        cell_t* prev = NULL;
+        cell_t* head = lists->list->head;
+        while (head != NULL) {
+            sink += *(int*)head->data;
+            list_pop_at(lists->list, &prev, &head);
+        }
+    }
+
+    sink += lists->list->length;
+}
+
+
+void bench_intrusive_list(void* state, long ops) {
+    lists_state_t* lists = state;
+
+    for (long done = 0; done < ops; done += LIST_BATCH) {
+        for (int i = 0; i < LIST_BATCH; i++) {
+            intrusive_list_push_back(&lists->intrusive, &lists->elements[i].node);
+        }
+        for (int i = 0; i < LIST_BATCH; i++) {
+            intrusive_list_pop_front(&lists->intrusive);
+        }
+    }
+
+    sink += lists->intrusive.length;
+}
+
+
+void teardown_lists(void* state) {
+    lists_state_t* lists = state;
+    list_destroy(&lists->list);
+    free(lists);
+}
+
+
+/* State of the request log benchmarks. */
+typedef struct request_log_state_s {
+    hashmap_t* map;
+    /* Keys of the entries, composed like the ones of check_unique_request. */
+    char keys[REQUEST_LOG_SIZE][64];
+    size_t key_lengths[REQUEST_LOG_SIZE];
+} request_log_state_t;
+
+
+void* setup_request_log(void) {
+    request_log_state_t* state = malloc(sizeof(request_log_state_t));
+    state->map = hashmap_create(NULL);
+
+    for (int i = 0; i < REQUEST_LOG_SIZE; i++) {
+        char filename[32];
+        snprintf(filename, sizeof(filename), "file-%d.txt", i);
+        state->key_lengths[i] = hashmap_compose_key(state->keys[i], 3, filename,
+                                                    "192.168.1.17", "10000");
+        hashmap_put(state->map, state->keys[i], state->key_lengths[i], state);
+    }
+
+    return state;
+}
+
+
+void bench_request_log_lookup(void* state, long ops) {
+    request_log_state_t* log = state;
+
+    for (long i = 0; i < ops; i++) {
+        int index = i % REQUEST_LOG_SIZE;
+        sink += hashmap_get(log->map, log->keys[index], log->key_lengths[index]) != NULL;
+    }
+}
+
+
+void bench_request_log_insert(void* state, long ops) {
+    request_log_state_t* log = state;
+
+    /* Remove an entry and insert it back, keeping the map at its usual size. */
+    for (long i = 0; i < ops; i++) {
+        int index = i % REQUEST_LOG_SIZE;
+        hashmap_remove(log->map, log->keys[index], log->key_lengths[index]);
+        hashmap_put(log->map, log->keys[index], log->key_lengths[index], log);
+    }
+
+    sink += log->map->size;
+}
+
+
+void teardown_request_log(void* state) {
+    request_log_state_t* log = state;
+    hashmap_destroy(&log->map);
+    free(log);
+}
+
+
+void bench_write_to_packet(void* state, long ops) {
+    (void)state;
+    static const char filename[] = "some-rather-long-file-name.tar.gz";
+    char buffer[PACKET_DEFAULT_CAPACITY];
+
+    for (long i = 0; i < ops; i++) {
+        char* ptr = buffer;
+        uint8_t length = sizeof(filename) - 1;
+        write_to_packet(&ptr, &length, sizeof(uint8_t));
+        write_to_packet(&ptr, filename, length);
+        sink += ptr - buffer;
+    }
+}
+
+
+void bench_encode_search_query(void* state, long ops) {
+    (void)state;
+
+    for (long i = 0; i < ops; i++) {
+        packet_t* packet = build_search_query(1);
+        sink += packet->size;
+        packet_release(packet);
+    }
+}
+
+
+void* setup_search_query(void) {
+    return build_search_query(ANSWER_HITS);
+}
+
+
+void* setup_search_answer(void) {
+    return build_search_answer(ANSWER_HITS);
+}
+
+
+void bench_decode_search_query(void* state, long ops) {
+    packet_reader_t reader;
+    search_query_t query;
+
+    for (long i = 0; i < ops; i++) {
+        packet_reader_wrap(&reader, state);
+        if (decode_search_query(&reader, &query) == 0) {
+            sink += query.filename.length;
+        }
+    }
+}
+
+
+void bench_decode_search_answer(void* state, long ops) {
+    packet_reader_t reader;
+    search_answer_t answer;
+
+    for (long i = 0; i < ops; i++) {
+        packet_reader_wrap(&reader, state);
+        if (decode_search_answer(&reader, &answer) == 0) {
+            sink += answer.nb_hits;
+        }
+    }
+}
+
+
+void teardown_packet(void* state) {
+    packet_release(state);
+}
+
+
+/* Working directory to come back to after search_file. */
+static char previous_directory[4096];
+
+
+void* setup_search_file(void) {
+    mkdir(SEARCH_ROOT, 0777);
+    mkdir(SEARCH_ROOT "/" SEARCH_DIRECTORY, 0777);
+    for (int i = 0; i < SEARCH_FILES; i++) {
+        char path[128];
+        snprintf(path, sizeof(path), "%s/%s/file-%d.txt", SEARCH_ROOT, SEARCH_DIRECTORY, i);
+        FILE* file = fopen(path, "w");
+        if (file != NULL) {
+            fclose(file);
+        }
+    }
+
+    if (getcwd(previous_directory, sizeof(previous_directory)) == NULL
+        || chdir(SEARCH_ROOT) == -1) {
+        perror("search_file");
+        exit(EXIT_FAILURE);
+    }
+
+    return NULL;
+}
+
+
+void bench_search_file(void* state, long ops) {
+    (void)state;
+
+    /* Half of the lookups miss, and have to go through the whole directory. */
+    for (long i = 0; i < ops; i++) {
+        char filename[32];
+        snprintf(filename, sizeof(filename), "file-%ld.txt", i % (2 * SEARCH_FILES));
+        sink += search_file(filename);
+    }
+}
+
+
+void teardown_search_file(void* state) {
+    (void)state;
+    if (chdir(previous_directory) == -1) {
+        perror("search_file");
+    }
+}
+
+
+void bench_check_ip(void* state, long ops) {
+    (void)state;
+    static const char* ips[] = { "192.168.1.17", "fe80::1ff:fe23:4567:890a", "not-an-ip" };
+
+    for (long i = 0; i < ops; i++) {
+        sink += check_ip(ips[i % 3]);
+    }
+}
+
+
+void bench_check_port(void* state, long ops) {
+    (void)state;
+    static const char* ports[] = { "10000", "65536", "http" };
+
+    for (long i = 0; i < ops; i++) {
+        sink += check_port(ports[i % 3]);
+    }
+}
+
+
+/* A connected pair of loopback sockets, and the listening socket. */
+typedef struct sockets_state_s {
+    int listener;
+    int client;
+    int server;
+} sockets_state_t;
+
+
+void* setup_sockets(void) {
+    sockets_state_t* sockets = malloc(sizeof(sockets_state_t));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    socklen_t addr_len = sizeof(addr);
+
+    sockets->listener = socket(AF_INET, SOCK_STREAM, 0);
+    sockets->client = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockets->listener == -1 || sockets->client == -1
+        || bind(sockets->listener, (struct sockaddr*)&addr, sizeof(addr)) == -1
+        || listen(sockets->listener, 1) == -1
+        || getsockname(sockets->listener, (struct sockaddr*)&addr, &addr_len) == -1
+        || connect(sockets->client, (struct sockaddr*)&addr, sizeof(addr)) == -1
+        || (sockets->server = accept(sockets->listener, NULL, NULL)) == -1) {
+        perror("extract_ip_port");
+        exit(EXIT_FAILURE);
+    }
+
+    return sockets;
+}
+
+
+void bench_extract_ip_port(void* state, long ops) {
+    sockets_state_t* sockets = state;
+    char ip[INET6_ADDRSTRLEN];
+    char port[6];
+
+    for (long i = 0; i < ops; i++) {
+        extract_ip_port_from_socket(sockets->server, ip, port, i & 1);
+        sink += port[0];
+    }
+}
+
+
+void bench_extract_ip_port_s(void* state, long ops) {
+    sockets_state_t* sockets = state;
+
+    for (long i = 0; i < ops; i++) {
+        char* ip;
+        char* port;
+        extract_ip_port_from_socket_s(sockets->server, &ip, &port, i & 1);
+        sink += port[0];
+        free(ip);
+        free(port);
+    }
+}
+
+
+void teardown_sockets(void* state) {
+    sockets_state_t* sockets = state;
+    close(sockets->server);
+    close(sockets->client);
+    close(sockets->listener);
+    free(sockets);
+}
@@ -0,0 +1,517 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "bench_util.h"
+#include "gnutella.h"
+#include "log.h"
+#include "metrics.h"
+#include "server_defines.h"
+
+
+/*
+ * Overlay benchmark: starts N servents on loopback, one process per servent
+ * (each running the library, see gnutella.h), and measures how searches behave
+ * for every combination of TTL and degree given on the command line.
+ *
+ * For each combination:
+ *  - every servent gets its own directory, with its own SEARCH_DIRECTORY. The
+ *    files of the workload are spread over the servents, each one on
+ *    "replicas" random servents.
+ *  - the servents are started one after the other, each one joining the
+ *    network through a random servent already started, with the real join code.
+ *  - once every servent is in its main loop, each of them searches "queries"
+ *    files it does not have, one every SEARCH_INTERVAL milliseconds.
+ *  - each search is over after GNUTELLA_SEARCH_LIFETIME milliseconds. It
+ *    succeeded if at least one machine having the file was reported, and its
+ *    latency is the time until the first such answer.
+ *
+ * The messages per query are the search frames and answers sent by every
+ * servent (gnutella_queries_out_total and gnutella_query_answers_out_total),
+ * divided by the number of searches.
+ */
+
+
+/* Default values of the parameters. */
+#define DEFAULT_NODES 50
+#define DEFAULT_QUERIES 5
+#define DEFAULT_FILES 100
+#define DEFAULT_REPLICAS 2
+#define DEFAULT_BASE_PORT 30000
+#define DEFAULT_DIRECTORY "/tmp/gnutella-overlay"
+
+/* Time (milliseconds) between two searches of a servent. */
+#define SEARCH_INTERVAL 200
+/* Time (milliseconds) a servent has to reach its main loop. */
+#define JOIN_TIMEOUT 30000
+
+/* Maximum number of TTLs and degrees. */
+#define MAX_SWEEP 16
+
+
+typedef struct parameters_s {
+    int nodes;
+    int queries;
+    int files;
+    int replicas;
+    int base_port;
+    unsigned int seed;
+    const char* directory;
+    /* Minimum level of the logs of the servents. */
+    int log_level;
+
+    int ttls[MAX_SWEEP];
+    int nb_ttls;
+    int degrees[MAX_SWEEP];
+    int nb_degrees;
+} parameters_t;
+
+
+/* A servent, from the point of view of the benchmark. */
+typedef struct node_s {
+    pid_t pid;
+    /* Benchmark to servent (commands), servent to benchmark (reports). */
+    int commands;
+    int reports;
+} node_t;
+
+
+/* A search of the workload, inside the process of a servent. */
+typedef struct query_s {
+    char filename[32];
+    uint64_t started;
+    /* Latency (nanoseconds) of the first hit, 0 if none yet. */
+    uint64_t latency;
+    int done;
+} query_t;
+
+
+/* What a servent reports once its workload is over. */
+typedef struct report_s {
+    int queries;
+    int successes;
+    long messages;
+} report_t;
+
+
+/* Commands sent to the servents. */
+#define COMMAND_GO 'g'
+#define COMMAND_STOP 's'
+/* Status of a servent after its start. */
+#define STATUS_READY 'r'
+#define STATUS_FAILED 'f'
+
+
+static void usage(const char* name);
+
+
+/*
+ * Run the benchmark for one TTL and one degree, and display the results.
+ */
+static void run_overlay(const parameters_t* parameters, int ttl, int degree);
+
+
+/*
+ * Create the directories of the servents and spread the files. owners[f * nodes
+ * + n] is set to 1 if node n has file f.
+ */
+static int seed_directories(const parameters_t* parameters, char* owners);
+
+
+/*
+ * Entry point of the process of a servent. Never returns.
+ */
+static void run_node(const parameters_t* parameters, int index, int contact,
+                     int ttl, int degree, const char* owners, int commands, int reports);
+
+
+/*
+ * Callback of the searches of the workload (user_data is a query_t).
+ */
+static void on_search(void* user_data, gnutella_search_event_t event,
+                      const char* filename, const gnutella_source_t* sources,
+                      int nb_sources);
+
+
+/******************************************************************************/
+
+
+int main(int argc, char** argv) {
+    parameters_t parameters = {
+        .nodes = DEFAULT_NODES, .queries = DEFAULT_QUERIES, .files = DEFAULT_FILES,
+        .replicas = DEFAULT_REPLICAS, .base_port = DEFAULT_BASE_PORT,
+        .seed = 1, .directory = DEFAULT_DIRECTORY, .log_level = LOG_LEVEL_WARNING,
+        .ttls = { DEFAULT_TTL }, .nb_ttls = 1,
+        .degrees = { MAX_NEIGHBOURS }, .nb_degrees = 1
+    };
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:q:f:r:p:s:w:t:d:vh")) != -1) {
+        switch (opt) {
+        case 'n': parameters.nodes = atoi(optarg); break;
+        case 'q': parameters.queries = atoi(optarg); break;
+        case 'f': parameters.files = atoi(optarg); break;
+        case 'r': parameters.replicas = atoi(optarg); break;
+        case 'p': parameters.base_port = atoi(optarg); break;
+        case 's': parameters.seed = (unsigned int)atoi(optarg); break;
+        case 'w': parameters.directory = optarg; break;
+        case 't': parameters.nb_ttls = parse_list(optarg, parameters.ttls, MAX_SWEEP); break;
+        case 'd': parameters.nb_degrees = parse_list(optarg, parameters.degrees, MAX_SWEEP); break;
+        case 'v': parameters.log_level = LOG_LEVEL_INFO; break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (parameters.nodes < 2 || parameters.nodes + parameters.base_port > 65535 ||
+        parameters.queries < 1 || parameters.files < parameters.queries ||
+        parameters.replicas < 1 || parameters.replicas >= parameters.nodes ||
+        parameters.nb_ttls <= 0 || parameters.nb_degrees <= 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    for (int i = 0; i < parameters.nb_degrees; i++) {
+        if (parameters.degrees[i] < 1 || parameters.degrees[i] > MAX_NEIGHBOURS) {
+            fprintf(stderr, "The degree must be between 1 and %d.\n", MAX_NEIGHBOURS);
+            return EXIT_FAILURE;
+        }
+    }
+
+    printf("%d servents, %d searches each, %d files with %d replicas, seed %u\n\n",
+           parameters.nodes, parameters.queries, parameters.files,
+           parameters.replicas, parameters.seed);
+    printf("%-5s %-7s %-7s %-9s %-10s %-10s %-10s %-10s\n", "ttl", "degree",
+           "joined", "success", "p50 (ms)", "p90 (ms)", "p99 (ms)", "msg/query");
+    fflush(stdout);
+
+    for (int t = 0; t < parameters.nb_ttls; t++) {
+        for (int d = 0; d < parameters.nb_degrees; d++) {
+            run_overlay(&parameters, parameters.ttls[t], parameters.degrees[d]);
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+
+void usage(const char* name) {
+    fprintf(stderr, "Usage: %s [-n nodes] [-q searches per node] [-f files] "
+                    "[-r replicas per file] [-p base port] [-s seed] [-w directory] "
+                    "[-t ttl,ttl...] [-d degree,degree...] [-v]\n", name);
+    fprintf(stderr, "The logs of each servent are in its directory (node-<index>), "
+                    "-v keeps the informations too.\n");
+}
+
+
+void run_overlay(const parameters_t* parameters, int ttl, int degree) {
+    int nodes = parameters->nodes;
+    char* owners = calloc((size_t)parameters->files * nodes, 1);
+    node_t* children = calloc(nodes, sizeof(node_t));
+
+    srand(parameters->seed);
+    if (seed_directories(parameters, owners) == -1) {
+        fprintf(stderr, "Cannot create the directories in %s.\n", parameters->directory);
+        exit(EXIT_FAILURE);
+    }
+
+    /* Start the servents one by one, each joining through a running one. */
+    int joined = 0;
+    for (int i = 0; i < nodes; i++) {
+        int commands[2], reports[2];
+        if (pipe(commands) == -1 || pipe(reports) == -1) {
+            perror("pipe");
+            exit(EXIT_FAILURE);
+        }
+
+        /* Drawn here, so that the topology only depends on the seed. */
+        int contact = i == 0 ? 0 : rand() % i;
+        unsigned int node_seed = (unsigned int)rand();
+
+        pid_t pid = fork();
+        if (pid == -1) {
+            perror("fork");
+            exit(EXIT_FAILURE);
+        } else if (pid == 0) {
+            /* Only keep our own pipes. */
+            for (int j = 0; j < i; j++) {
+                close(children[j].commands);
+                close(children[j].reports);
+            }
+            close(commands[1]);
+            close(reports[0]);
+
+            srand(node_seed);
+            run_node(parameters, i, contact, ttl, degree, owners, commands[0], reports[1]);
+        }
+
+        close(commands[0]);
+        close(reports[1]);
+        children[i].pid = pid;
+        children[i].commands = commands[1];
+        children[i].reports = reports[0];
+
+        char status = STATUS_FAILED;
+        if (read_all(children[i].reports, &status, 1) == 0 && status == STATUS_READY) {
+            joined++;
+        }
+    }
+
+    /* Everybody is in its main loop: start the searches everywhere at once. */
+    char command = COMMAND_GO;
+    for (int i = 0; i < nodes; i++) {
+        write_all(children[i].commands, &command, 1);
+    }
+
+    int total_queries = 0, successes = 0;
+    long messages = 0;
+    uint64_t* latencies = calloc((size_t)nodes * parameters->queries, sizeof(uint64_t));
+    int nb_latencies = 0;
+    for (int i = 0; i < nodes; i++) {
+        report_t report;
+        if (read_all(children[i].reports, &report, sizeof(report_t)) == -1) {
+            continue;
+        }
+
+        total_queries += report.queries;
+        successes += report.successes;
+        messages += report.messages;
+        if (report.successes > 0) {
+            read_all(children[i].reports, latencies + nb_latencies,
+                     report.successes * sizeof(uint64_t));
+            nb_latencies += report.successes;
+        }
+    }
+
+    /* Leave only once every search is over, not to disturb the others. */
+    command = COMMAND_STOP;
+    for (int i = 0; i < nodes; i++) {
+        write_all(children[i].commands, &command, 1);
+        close(children[i].commands);
+    }
+
+    for (int i = 0; i < nodes; i++) {
+        waitpid(children[i].pid, NULL, 0);
+        close(children[i].reports);
+    }
+
+    qsort(latencies, nb_latencies, sizeof(uint64_t), compare_u64);
+    double percentiles[3] = { 0.5, 0.9, 0.99 };
+    double values[3] = { 0 };
+    for (int p = 0; p < 3 && nb_latencies > 0; p++) {
+        int index = (int)(percentiles[p] * (nb_latencies - 1) + 0.5);
+        values[p] = latencies[index] / 1e6;
+    }
+
+    printf("%-5d %-7d %3d/%-3d %8.1f%% %-10.1f %-10.1f %-10.1f %-10.1f\n", ttl, degree,
+           joined, nodes,
+           total_queries == 0 ? 0.0 : 100.0 * successes / total_queries,
+           values[0], values[1], values[2],
+           total_queries == 0 ? 0.0 : (double)messages / total_queries);
+    fflush(stdout);
+
+    free(latencies);
+    free(children);
+    free(owners);
+}
+
+
+int seed_directories(const parameters_t* parameters, char* owners) {
+    int nodes = parameters->nodes;
+    mkdir(parameters->directory, 0777);
+
+    char path[4096];
+    for (int i = 0; i < nodes; i++) {
+        snprintf(path, sizeof(path), "%s/node-%d", parameters->directory, i);
+        mkdir(path, 0777);
+        snprintf(path, sizeof(path), "%s/node-%d/%s", parameters->directory, i,
+                 SEARCH_DIRECTORY);
+        if (mkdir(path, 0777) == -1 && errno != EEXIST) {
+            return -1;
+        }
+
+        /* Remove the files of the previous run. */
+        for (int f = 0; f < parameters->files; f++) {
+            snprintf(path, sizeof(path), "%s/node-%d/%s/file-%d", parameters->directory,
+                     i, SEARCH_DIRECTORY, f);
+            unlink(path);
+        }
+    }
+
+    for (int f = 0; f < parameters->files; f++) {
+        int placed = 0;
+        while (placed < parameters->replicas) {
+            int node = rand() % nodes;
+            if (owners[f * nodes + node] == 1) {
+                continue;
+            }
+
+            owners[f * nodes + node] = 1;
+            placed++;
+
+            snprintf(path, sizeof(path), "%s/node-%d/%s/file-%d", parameters->directory,
+                     node, SEARCH_DIRECTORY, f);
+            int fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0666);
+            if (fd == -1) {
+                return -1;
+            }
+            write_all(fd, path, strlen(path));
+            close(fd);
+        }
+    }
+
+    return 0;
+}
+
+
+void run_node(const parameters_t* parameters, int index, int contact,
+              int ttl, int degree, const char* owners, int commands, int reports) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/node-%d", parameters->directory, index);
+    if (chdir(path) == -1) {
+        _exit(EXIT_FAILURE);
+    }
+
+    /* The servent talks a lot: keep its logs in its directory. */
+    freopen("stdout.log", "w", stdout);
+    freopen("stderr.log", "w", stderr);
+
+    char listen_port[8], contact_port[8];
+    snprintf(listen_port, sizeof(listen_port), "%d", parameters->base_port + index);
+    snprintf(contact_port, sizeof(contact_port), "%d", parameters->base_port + contact);
+
+    gnutella_config_t config = {
+        .first_machine = index == 0,
+        .listen_port = listen_port,
+        .contact_ip = "127.0.0.1",
+        .contact_port = contact_port,
+        .metrics_file = NULL,
+        .log_level = parameters->log_level,
+        .search_ttl = ttl,
+        .max_neighbours = degree
+    };
+
+    gnutella_t* gnutella = gnutella_init(&config);
+    char status = STATUS_FAILED;
+    if (gnutella != NULL) {
+        /* The join is over once the servent reached its main loop. */
+        uint64_t deadline = metrics_now() + (uint64_t)JOIN_TIMEOUT * 1000000;
+        while (metric_get(METRIC_LOOP_ITERATIONS) == 0 && metrics_now() < deadline) {
+            if (gnutella_poll(gnutella, 10) == -1) {
+                break;
+            }
+        }
+
+        if (metric_get(METRIC_LOOP_ITERATIONS) > 0) {
+            status = STATUS_READY;
+        }
+    }
+    write_all(reports, &status, 1);
+
+    char command;
+    if (read_all(commands, &command, 1) == -1 || command != COMMAND_GO) {
+        _exit(EXIT_FAILURE);
+    }
+
+    /* Search files we do not have, each one once. */
+    int nodes = parameters->nodes;
+    int queries = status == STATUS_READY ? parameters->queries : 0;
+    query_t* workload = calloc(queries + 1, sizeof(query_t));
+    char* picked = calloc(parameters->files, 1);
+    int nb_queries = 0;
+    for (int attempt = 0; nb_queries < queries && attempt < 100 * queries; attempt++) {
+        int file = rand() % parameters->files;
+        if (picked[file] == 1 || owners[file * nodes + index] == 1) {
+            continue;
+        }
+
+        picked[file] = 1;
+        snprintf(workload[nb_queries].filename, sizeof(workload[nb_queries].filename),
+                 "file-%d", file);
+        nb_queries++;
+    }
+
+    int sent = 0, done = 0;
+    uint64_t next_search = metrics_now();
+    while (done < nb_queries) {
+        uint64_t now = metrics_now();
+        if (sent < nb_queries && now >= next_search) {
+            query_t* query = workload + sent;
+            query->started = now;
+            if (gnutella_search(gnutella, query->filename, on_search, query) == -1) {
+                query->done = 1;
+                done++;
+            }
+            sent++;
+            next_search = now + (uint64_t)SEARCH_INTERVAL * 1000000;
+        }
+
+        int timeout = sent < nb_queries ? SEARCH_INTERVAL : gnutella_timeout(gnutella);
+        if (gnutella_poll(gnutella, timeout) == -1) {
+            break;
+        }
+
+        done = 0;
+        for (int i = 0; i < sent; i++) {
+            done += workload[i].done;
+        }
+    }
+
+    report_t report = { nb_queries, 0, 0 };
+    uint64_t* latencies = calloc(nb_queries + 1, sizeof(uint64_t));
+    for (int i = 0; i < nb_queries; i++) {
+        if (workload[i].latency > 0) {
+            latencies[report.successes++] = workload[i].latency;
+        }
+    }
+    report.messages = metric_get(METRIC_QUERIES_OUT) + metric_get(METRIC_QUERY_ANSWERS_OUT);
+
+    write_all(reports, &report, sizeof(report_t));
+    write_all(reports, latencies, report.successes * sizeof(uint64_t));
+
+    /* Stay in the network until every servent is done. */
+    struct pollfd poller = { .fd = commands, .events = POLLIN, .revents = 0 };
+    while (poll(&poller, 1, 0) == 0 && gnutella != NULL) {
+        if (gnutella_poll(gnutella, 50) == -1) {
+            break;
+        }
+    }
+    read_all(commands, &command, 1);
+
+    if (gnutella != NULL) {
+        gnutella_shutdown(&gnutella);
+    }
+
+    free(latencies);
+    free(picked);
+    free(workload);
+    exit(EXIT_SUCCESS);
+}
+
+
+void on_search(void* user_data, gnutella_search_event_t event,
+               const char* filename, const gnutella_source_t* sources,
+               int nb_sources) {
+    UNUSED(filename);
+    UNUSED(sources);
+
+    query_t* query = (query_t*)user_data;
+    if (event == GNUTELLA_SEARCH_DONE) {
+        query->done = 1;
+    } else if (nb_sources > 0 && query->latency == 0) {
+        query->latency = metrics_now() - query->started;
+    }
+}
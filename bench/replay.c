@@ -0,0 +1,669 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "metrics.h"
+#include "networking.h"
+#include "packet.h"
+#include "packets_defines.h"
+#include "server.h"
+#include "trace.h"
+#include "util.h"
+
+
+/*
+ * Replay of a capture (see trace.h and the --record option of the servent):
+ * the frames a servent received are sent again to a target servent, with the
+ * same timing or faster, so that a load seen in production can be reproduced
+ * on a development machine and several builds compared on the same traffic.
+ *
+ * Each connection of the capture gets its own connection to the target:
+ *  - a frame read on an accepted socket (CMSG_NEIGHBOURS, CMSG_DOWNLOAD...) is
+ *    sent on a new connection, as the first frame of that connection ;
+ *  - a frame read from a neighbour is sent through a fake neighbour, which
+ *    joins the target the first time the connection is seen, with the rescue
+ *    flag set so that the coin flip of the target does not refuse it. A
+ *    captured CMSG_JOIN is replaced by such a join, whose contact port is a
+ *    listening socket of the replayer, so that the joins accepted during the
+ *    capture are accepted again.
+ * The frames of the local client and the answers to the downloads of the
+ * captured servent cannot be sent through the network: they are skipped and
+ * counted.
+ *
+ * The replayer never blocks on the target: the frames wait in a buffer per
+ * connection until the target reads them, and what the target sends back is
+ * read and thrown away. At the end, the fake neighbours leave: since the target
+ * handles the frames of a connection in order and closes it after CMSG_LEAVE
+ * (or after the first request, for an accepted socket), once every connection
+ * is closed the target has read the whole capture. The time it needs for that,
+ * compared to the duration of the capture, tells whether it keeps up. The
+ * latency of each dispatch is in the metrics of the target (--metrics), and
+ * with -P, the CPU time the target used during the replay is displayed.
+ */
+
+
+/* Default values of the parameters. */
+#define DEFAULT_TARGET_IP "127.0.0.1"
+#define DEFAULT_SPEED 1.0
+
+/* Time (milliseconds) to wait for the answer to a join. */
+#define JOIN_TIMEOUT 5000
+/* Time (milliseconds) the target has to read the last frames and close the
+ * connections. */
+#define DRAIN_TIMEOUT 60000
+/* Bytes read at once from the target. */
+#define READ_CHUNK 16384
+
+
+typedef struct parameters_s {
+    const char* trace;
+    char target_ip[INET6_ADDRSTRLEN];
+    char target_port[8];
+    /* Factor applied to the pace of the capture, 0 to send as fast as possible. */
+    double speed;
+    /* Process of the target whose CPU time is measured, 0 for none. */
+    pid_t pid;
+    /* Only display the records instead of replaying them. */
+    int list;
+    int log_level;
+} parameters_t;
+
+
+typedef enum connection_state_e {
+    /* Not seen yet, or closed. */
+    CONNECTION_NONE,
+    /* Connected, as an accepted socket of the target. */
+    CONNECTION_OPEN,
+    /* Connected, as a neighbour of the target. */
+    CONNECTION_NEIGHBOUR,
+    /* The target refused it: its frames are lost. */
+    CONNECTION_FAILED
+} connection_state_t;
+
+
+/* A connection of the capture, and the one that stands for it. */
+typedef struct connection_s {
+    connection_state_t state;
+    int sock;
+    /* Contact port given to the target by a fake neighbour, -1 if none. */
+    int listener;
+    /* 1 once CMSG_LEAVE is queued: the target closes the connection after it. */
+    int left;
+    /* Frames not read by the target yet. */
+    char* outbound;
+    size_t outbound_size;
+    size_t outbound_capacity;
+} connection_t;
+
+
+/* What happened during the replay. */
+typedef struct statistics_s {
+    long records;
+    long sent[TRACE_CHANNELS_COUNT];
+    long skipped[TRACE_CHANNELS_COUNT];
+    long lost;
+    /* Connections closed by the target before it read all their frames. */
+    long cut;
+    long joins;
+    long refused_joins;
+    uint64_t bytes_sent;
+    uint64_t bytes_received;
+    size_t max_backlog;
+    /* Time (microseconds) the sending fell behind the capture, at most. */
+    uint64_t max_lag;
+} statistics_t;
+
+
+static void usage(const char* name);
+
+
+/*
+ * Parse "ip:port" into the target of parameters. Return -1 on error, 0
+ * otherwise.
+ */
+ERROR_CODES_USUAL static int parse_target(const char* target, parameters_t* parameters);
+
+
+/*
+ * Display the records of the capture, one per line.
+ */
+static int list_records(FILE* trace);
+
+
+/*
+ * Replay the capture on the target and display what happened.
+ */
+static int replay(const parameters_t* parameters, FILE* trace);
+
+
+/*
+ * Send the frame of record through its connection, opening it if necessary.
+ */
+static void replay_record(const parameters_t* parameters, connection_t* connection,
+                          const trace_record_t* record, const char* frame,
+                          statistics_t* statistics);
+
+
+/*
+ * Connect connection to the target and, if neighbour is 1, join it as a
+ * neighbour. Return -1 if the target cannot be reached or refused the join, 0
+ * otherwise.
+ */
+ERROR_CODES_USUAL static int open_connection(const parameters_t* parameters,
+                                             connection_t* connection, int neighbour);
+
+
+/*
+ * Close the sockets of connection and forget its frames.
+ */
+static void close_connection(connection_t* connection);
+
+
+/*
+ * Queue size bytes of data to be sent through connection.
+ */
+static void queue_bytes(connection_t* connection, const void* data, size_t size);
+
+
+/*
+ * Send what the connections have for the target and read what it sends back,
+ * for at most timeout milliseconds (0 to only do what can be done right away).
+ * A connection is closed once the target closed it. Return the number of
+ * connections still open.
+ */
+static size_t pump(connection_t* connections, uint32_t nb_connections, int timeout,
+                   statistics_t* statistics);
+
+
+/*
+ * Return the CPU time (microseconds) used by the process pid so far, 0 if it
+ * cannot be read.
+ */
+static uint64_t get_cpu_time(pid_t pid);
+
+
+/* Current time in microseconds, on the monotonic clock. */
+static uint64_t now_us(void);
+
+
+/******************************************************************************/
+
+
+int main(int argc, char** argv) {
+    parameters_t parameters = {
+        .trace = NULL, .target_ip = DEFAULT_TARGET_IP, .target_port = SERVER_LISTEN_PORT,
+        .speed = DEFAULT_SPEED, .pid = 0, .list = 0, .log_level = LOG_LEVEL_WARNING
+    };
+
+    int opt;
+    while ((opt = getopt(argc, argv, "c:x:P:lvh")) != -1) {
+        switch (opt) {
+        case 'c':
+            if (parse_target(optarg, &parameters) == -1) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'x': parameters.speed = atof(optarg); break;
+        case 'P': parameters.pid = (pid_t)atoi(optarg); break;
+        case 'l': parameters.list = 1; break;
+        case 'v': parameters.log_level = LOG_LEVEL_INFO; break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (optind != argc - 1 || parameters.speed < 0 || parameters.pid < 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    parameters.trace = argv[optind];
+
+    FILE* trace = trace_reader_open(parameters.trace);
+    if (trace == NULL) {
+        fprintf(stderr, "%s is not a capture of this version.\n", parameters.trace);
+        return EXIT_FAILURE;
+    }
+
+    log_set_level(parameters.log_level);
+
+    /* A connection the target closed must not kill the replayer. */
+    signal(SIGPIPE, SIG_IGN);
+
+    int res = parameters.list ? list_records(trace) : replay(&parameters, trace);
+    fclose(trace);
+    return res;
+}
+
+
+void usage(const char* name) {
+    fprintf(stderr, "Usage: %s [-c ip:port] [-x speed] [-P pid of the target] [-l] [-v] "
+                    "capture\n", name);
+}
+
+
+int parse_target(const char* target, parameters_t* parameters) {
+    const char* colon = strrchr(target, ':');
+    if (colon == NULL || (size_t)(colon - target) >= sizeof(parameters->target_ip) ||
+        strlen(colon + 1) >= sizeof(parameters->target_port)) {
+        return -1;
+    }
+
+    memcpy(parameters->target_ip, target, colon - target);
+    parameters->target_ip[colon - target] = '\0';
+    snprintf(parameters->target_port, sizeof(parameters->target_port), "%s", colon + 1);
+
+    return check_ip(parameters->target_ip) == 1 && check_port(parameters->target_port) == 1
+           ? 0 : -1;
+}
+
+
+int list_records(FILE* trace) {
+    static const char* channels[TRACE_CHANNELS_COUNT] = {
+        [TRACE_AWAITING]  = "awaiting",
+        [TRACE_NEIGHBOUR] = "neighbour",
+        [TRACE_CLIENT]    = "client",
+        [TRACE_DOWNLOAD]  = "download",
+    };
+
+    char* frame = malloc(TRACE_MAX_FRAME_SIZE);
+    trace_record_t record;
+    int res;
+    while ((res = trace_read_record(trace, &record, frame)) == 1) {
+        printf("%10.6f  %-6u %-10s opcode 0x%02x  %u bytes\n", record.time / 1e6,
+               record.connection, channels[record.channel],
+               record.length > 0 ? (uint8_t)frame[0] : 0, record.length);
+    }
+
+    free(frame);
+    if (res == -1) {
+        fprintf(stderr, "The capture is truncated.\n");
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+
+int replay(const parameters_t* parameters, FILE* trace) {
+    statistics_t statistics;
+    memset(&statistics, 0, sizeof(statistics));
+
+    connection_t* connections = NULL;
+    uint32_t nb_connections = 0;
+    char* frame = malloc(TRACE_MAX_FRAME_SIZE);
+
+    uint64_t cpu_begin = get_cpu_time(parameters->pid);
+    uint64_t begin = now_us();
+    uint64_t last_time = 0;
+    trace_record_t record;
+    int res;
+
+    while ((res = trace_read_record(trace, &record, frame)) == 1) {
+        statistics.records++;
+        last_time = record.time;
+
+        /* Wait for the time of the record, serving the connections meanwhile. */
+        if (parameters->speed > 0) {
+            uint64_t due = begin + (uint64_t)(record.time / parameters->speed);
+            uint64_t now;
+            while ((now = now_us()) < due) {
+                pump(connections, nb_connections, (int)((due - now + 999) / 1000), &statistics);
+            }
+
+            if (now - due > statistics.max_lag) {
+                statistics.max_lag = now - due;
+            }
+        }
+
+        if (record.connection >= nb_connections) {
+            uint32_t size = nb_connections == 0 ? 64 : nb_connections;
+            while (size <= record.connection) {
+                size *= 2;
+            }
+
+            connections = realloc(connections, size * sizeof(connection_t));
+            for (uint32_t i = nb_connections; i < size; i++) {
+                connections[i] = (connection_t){ CONNECTION_NONE, -1, -1, 0, NULL, 0, 0 };
+            }
+            nb_connections = size;
+        }
+
+        replay_record(parameters, connections + record.connection, &record, frame, &statistics);
+        pump(connections, nb_connections, 0, &statistics);
+    }
+
+    uint64_t sent = now_us();
+
+    /* Leave, then give the target the time to read everything and close. */
+    opcode_t leave = CMSG_LEAVE;
+    for (uint32_t i = 0; i < nb_connections; i++) {
+        if (connections[i].state == CONNECTION_NEIGHBOUR && !connections[i].left) {
+            queue_bytes(connections + i, &leave, PKT_ID_SIZE);
+            connections[i].left = 1;
+        }
+    }
+
+    int open;
+    while ((open = pump(connections, nb_connections, 100, &statistics)) > 0 &&
+           now_us() - sent < DRAIN_TIMEOUT * 1000ull) {
+    }
+
+    uint64_t end = now_us();
+    uint64_t cpu_end = get_cpu_time(parameters->pid);
+
+    if (res == -1) {
+        fprintf(stderr, "The capture is truncated, replayed up to the last complete record.\n");
+    }
+
+    char speed[32] = "as fast as possible";
+    if (parameters->speed > 0) {
+        snprintf(speed, sizeof(speed), "x%.1f", parameters->speed);
+    }
+    printf("Replayed %ld records (%.1f s of capture) on %s:%s, speed %s\n",
+           statistics.records, last_time / 1e6, parameters->target_ip, parameters->target_port,
+           speed);
+    printf("Sent: %ld from accepted sockets, %ld from neighbours (%lu bytes)\n",
+           statistics.sent[TRACE_AWAITING], statistics.sent[TRACE_NEIGHBOUR],
+           (unsigned long)statistics.bytes_sent);
+    printf("Skipped: %ld from the local client, %ld download answers\n",
+           statistics.skipped[TRACE_CLIENT], statistics.skipped[TRACE_DOWNLOAD]);
+    printf("Fake neighbours: %ld joined, %ld refused; %ld frames lost, %ld connections "
+           "closed by the target with frames unread\n", statistics.joins,
+           statistics.refused_joins, statistics.lost, statistics.cut);
+    printf("Sending took %.2f s, %.1f ms late at most; the target read everything "
+           "%.2f s after the start%s\n", (sent - begin) / 1e6, statistics.max_lag / 1e3,
+           (end - begin) / 1e6, open > 0 ? " (not quite: it stopped reading)" : "");
+    printf("Backlog: %zu bytes at most; received %lu bytes from the target\n",
+           statistics.max_backlog, (unsigned long)statistics.bytes_received);
+    if (parameters->pid > 0) {
+        printf("CPU time of the target: %.3f s\n", (cpu_end - cpu_begin) / 1e6);
+    }
+
+    for (uint32_t i = 0; i < nb_connections; i++) {
+        close_connection(connections + i);
+    }
+    free(connections);
+    free(frame);
+
+    return open > 0 || statistics.lost > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+
+void replay_record(const parameters_t* parameters, connection_t* connection,
+                   const trace_record_t* record, const char* frame,
+                   statistics_t* statistics) {
+    if (record->channel == TRACE_CLIENT || record->channel == TRACE_DOWNLOAD ||
+        record->length == 0) {
+        statistics->skipped[record->channel]++;
+        return;
+    }
+
+    opcode_t opcode = (opcode_t)frame[0];
+    int neighbour = record->channel == TRACE_NEIGHBOUR || opcode == CMSG_JOIN;
+
+    if (connection->state == CONNECTION_NONE ||
+        (neighbour && connection->state == CONNECTION_OPEN)) {
+        close_connection(connection);
+
+        if (open_connection(parameters, connection, neighbour) == -1) {
+            connection->state = CONNECTION_FAILED;
+        } else if (neighbour) {
+            statistics->joins++;
+        }
+
+        if (connection->state == CONNECTION_FAILED && neighbour) {
+            statistics->refused_joins++;
+        }
+    }
+
+    if (connection->state == CONNECTION_FAILED) {
+        statistics->lost++;
+        return;
+    }
+
+    statistics->sent[record->channel]++;
+
+    /* The join was just replaced by ours. */
+    if (opcode == CMSG_JOIN) {
+        return;
+    }
+
+    queue_bytes(connection, frame, record->length);
+    statistics->bytes_sent += record->length;
+    if (opcode == CMSG_LEAVE) {
+        connection->left = 1;
+    }
+}
+
+
+int open_connection(const parameters_t* parameters, connection_t* connection, int neighbour) {
+    connection->sock = -1;
+    connection->listener = -1;
+
+    if (neighbour) {
+        struct sockaddr_in addr;
+        socklen_t addr_len = sizeof(addr);
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = 0;
+
+        connection->listener = socket(AF_INET, SOCK_STREAM, 0);
+        if (connection->listener == -1 ||
+            bind(connection->listener, (struct sockaddr*)&addr, sizeof(addr)) == -1 ||
+            listen(connection->listener, 8) == -1 ||
+            getsockname(connection->listener, (struct sockaddr*)&addr, &addr_len) == -1) {
+            perror("listen");
+            close_connection(connection);
+            return -1;
+        }
+    }
+
+    if (connect_to(parameters->target_ip, parameters->target_port, &connection->sock) != CONNECT_OK) {
+        connection->sock = -1;
+        close_connection(connection);
+        return -1;
+    }
+
+    if (neighbour) {
+        struct sockaddr_in addr;
+        socklen_t addr_len = sizeof(addr);
+        getsockname(connection->listener, (struct sockaddr*)&addr, &addr_len);
+        char contact_port[8];
+        snprintf(contact_port, sizeof(contact_port), "%d", ntohs(addr.sin_port));
+
+        packet_t* packet = packet_begin(CMSG_JOIN);
+        packet_append_u8(packet, 1);
+        packet_append_string(packet, contact_port);
+        int res = packet_send(packet, connection->sock);
+        packet_release(packet);
+
+        struct pollfd poller;
+        opcode_t opcode = 0;
+        uint8_t answer = 0, length = 0;
+        char target_port[UINT8_MAX];
+        if (res == -1 || poll_fd(&poller, connection->sock, POLLIN, JOIN_TIMEOUT) != 1 ||
+            read_from_fd(connection->sock, &opcode, PKT_ID_SIZE) != PKT_ID_SIZE ||
+            opcode != SMSG_JOIN ||
+            read_from_fd(connection->sock, &answer, sizeof(uint8_t)) != sizeof(uint8_t) ||
+            answer != 1 ||
+            read_from_fd(connection->sock, &length, sizeof(uint8_t)) != sizeof(uint8_t) ||
+            read_from_fd(connection->sock, target_port, length) != length) {
+            close_connection(connection);
+            return -1;
+        }
+
+        fcntl(connection->listener, F_SETFL, fcntl(connection->listener, F_GETFL) | O_NONBLOCK);
+    }
+
+    fcntl(connection->sock, F_SETFL, fcntl(connection->sock, F_GETFL) | O_NONBLOCK);
+    connection->state = neighbour ? CONNECTION_NEIGHBOUR : CONNECTION_OPEN;
+    return 0;
+}
+
+
+void close_connection(connection_t* connection) {
+    if (connection->sock != -1) {
+        close(connection->sock);
+        connection->sock = -1;
+    }
+    if (connection->listener != -1) {
+        close(connection->listener);
+        connection->listener = -1;
+    }
+
+    free(connection->outbound);
+    connection->outbound = NULL;
+    connection->outbound_size = 0;
+    connection->outbound_capacity = 0;
+    connection->left = 0;
+    connection->state = CONNECTION_NONE;
+}
+
+
+void queue_bytes(connection_t* connection, const void* data, size_t size) {
+    if (connection->outbound_size + size > connection->outbound_capacity) {
+        size_t capacity = connection->outbound_capacity == 0 ? 4096 : connection->outbound_capacity;
+        while (capacity < connection->outbound_size + size) {
+            capacity *= 2;
+        }
+
+        connection->outbound = realloc(connection->outbound, capacity);
+        connection->outbound_capacity = capacity;
+    }
+
+    memcpy(connection->outbound + connection->outbound_size, data, size);
+    connection->outbound_size += size;
+}
+
+
+size_t pump(connection_t* connections, uint32_t nb_connections, int timeout,
+            statistics_t* statistics) {
+    struct pollfd* pollers = malloc((2 * nb_connections + 1) * sizeof(struct pollfd));
+    connection_t** owners = malloc((2 * nb_connections + 1) * sizeof(connection_t*));
+    int nb_pollers = 0;
+
+    for (uint32_t i = 0; i < nb_connections; i++) {
+        connection_t* connection = connections + i;
+        if (connection->sock == -1) {
+            continue;
+        }
+
+        pollers[nb_pollers] = (struct pollfd){
+            connection->sock, POLLIN | (connection->outbound_size > 0 ? POLLOUT : 0), 0
+        };
+        owners[nb_pollers++] = connection;
+
+        /* The target may try to contact us: accepted, then closed. */
+        if (connection->listener != -1) {
+            pollers[nb_pollers] = (struct pollfd){ connection->listener, POLLIN, 0 };
+            owners[nb_pollers++] = connection;
+        }
+    }
+
+    if (poll(pollers, nb_pollers, timeout) > 0) {
+        for (int i = 0; i < nb_pollers; i++) {
+            connection_t* connection = owners[i];
+            if (pollers[i].revents == 0 || connection->sock == -1) {
+                continue;
+            }
+
+            if (pollers[i].fd == connection->listener) {
+                int sock = accept(connection->listener, NULL, NULL);
+                if (sock != -1) {
+                    close(sock);
+                }
+                continue;
+            }
+
+            if (pollers[i].revents & POLLOUT) {
+                ssize_t res = send(connection->sock, connection->outbound,
+                                   connection->outbound_size, MSG_NOSIGNAL);
+                if (res > 0) {
+                    memmove(connection->outbound, connection->outbound + res,
+                            connection->outbound_size - res);
+                    connection->outbound_size -= res;
+                }
+            }
+
+            if (pollers[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+                char buffer[READ_CHUNK];
+                ssize_t res = recv(connection->sock, buffer, sizeof(buffer), 0);
+                if (res > 0) {
+                    statistics->bytes_received += res;
+                } else if (res == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+                    /* Closed by the target: what it did not read is lost. */
+                    if (connection->outbound_size > 0) {
+                        statistics->cut++;
+                    }
+                    close_connection(connection);
+                }
+            }
+        }
+    }
+
+    size_t backlog = 0;
+    int open = 0;
+    for (uint32_t i = 0; i < nb_connections; i++) {
+        backlog += connections[i].outbound_size;
+        open += connections[i].sock != -1;
+    }
+    if (backlog > statistics->max_backlog) {
+        statistics->max_backlog = backlog;
+    }
+
+    free(owners);
+    free(pollers);
+    return open;
+}
+
+
+uint64_t get_cpu_time(pid_t pid) {
+    if (pid <= 0) {
+        return 0;
+    }
+
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        return 0;
+    }
+
+    /* utime and stime are the 14th and 15th fields, after the command name. */
+    char line[1024];
+    unsigned long utime = 0, stime = 0;
+    if (fgets(line, sizeof(line), file) != NULL) {
+        char* fields = strrchr(line, ')');
+        if (fields != NULL) {
+            sscanf(fields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+                   &utime, &stime);
+        }
+    }
+    fclose(file);
+
+    long ticks = sysconf(_SC_CLK_TCK);
+    return (uint64_t)(utime + stime) * 1000000 / (ticks > 0 ? ticks : 100);
+}
+
+
+uint64_t now_us(void) {
+    return metrics_now() / 1000;
+}
@@ -0,0 +1,847 @@
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+
+#include "bench_util.h"
+#include "gnutella.h"
+#include "server_defines.h"
+
+
+/*
+ * Discrete-event simulator of large overlays. Nothing goes through sockets:
+ * the servents are entries of an array, and the rules of the servent are
+ * replayed on them in virtual time, with a seeded generator, so that a run only
+ * depends on its parameters.
+ *
+ * The rules mirror the code of the servent:
+ *  - joining (join_network_through): ask the contact point for its neighbours,
+ *    send a join request to each of them and, if the contact point has fewer
+ *    than MAX_NEIGHBOURS neighbours, to the contact point (with the rescue flag
+ *    if it has none). If the servent still has fewer than MIN_NEIGHBOURS
+ *    neighbours afterwards, start again through each of the machines it asked,
+ *    JOIN_MAX_ATTEMPTS levels deep.
+ *  - answering a join (handle_join_request): refuse when full, accept a rescue,
+ *    otherwise accept with a probability of JOIN_CHANCE / JOIN_CHANCE_MOD. The
+ *    joiner only keeps the neighbour if it still has room: otherwise the edge
+ *    only exists on the side of the target (a one-sided edge, whose socket the
+ *    joiner never reads).
+ *  - leaving (handle_leave): the neighbours of the leaving servent drop it and,
+ *    below MIN_NEIGHBOURS, join again through their first neighbour. Those
+ *    which had the leaving servent as a one-sided neighbour keep a dead link.
+ *  - searching (answer_local_search_request and answer_remote_search_request):
+ *    a query is flooded to every neighbour but the one it came from, its TTL
+ *    decreasing at each hop, and collects the servents that have the file. A
+ *    servent that already saw it, or receives it with a TTL of 0, answers to
+ *    every neighbour but the sender instead, and these neighbours hand the
+ *    answer to their own client: the source only gets it if it is one of them,
+ *    or if the query comes back to it through a cycle.
+ * A frame sent on a one-sided edge or a dead link is counted but lost.
+ *
+ * The simulation grows the overlay one servent at a time, each joining through
+ * a random servent already there, then applies churn (departures and arrivals
+ * in equal parts). After each phase it reports the graph (degree distribution,
+ * partitions, diameter) and, for each TTL, the cost of searches: success rate,
+ * latency and frames per search.
+ */
+
+
+/* Default values of the parameters. */
+#define DEFAULT_NODES 10000
+#define DEFAULT_QUERIES 200
+#define DEFAULT_REPLICAS 10
+#define DEFAULT_TTLS "2,4,6,8,10"
+
+/* Delay of a hop, in virtual milliseconds: the network and the main loop. */
+#define HOP_DELAY_MIN 10
+#define HOP_DELAY_MAX 60
+
+/* Number of breadth-first searches sampled for the mean distance. */
+#define DISTANCE_SAMPLES 16
+
+/* Maximum number of TTLs. */
+#define MAX_SWEEP 16
+
+/* Maximum number of machines in the list of a frame. */
+#define MAX_HITS UINT8_MAX
+
+
+typedef struct parameters_s {
+    int nodes;
+    /* Number of departures and arrivals after the growth. */
+    int churn;
+    int queries;
+    /* Number of servents that have the file of a search. */
+    int replicas;
+    /* Maximum number of neighbours (see server_options_t). */
+    int max_neighbours;
+    uint64_t seed;
+
+    int ttls[MAX_SWEEP];
+    int nb_ttls;
+} parameters_t;
+
+
+/* A simulated servent. */
+typedef struct node_s {
+    /* Neighbours, as the servent knows them; an entry can be listed twice. */
+    int neighbours[MAX_NEIGHBOURS];
+    int nb_neighbours;
+    int alive;
+} node_t;
+
+
+/* A frame in flight. */
+typedef struct event_s {
+    uint64_t time;
+    int from;
+    int to;
+    /* CMSG_SEARCH_REQUEST (1) or SMSG_SEARCH_REQUEST (0). */
+    int query;
+    int ttl;
+    int hits;
+} event_t;
+
+
+typedef struct simulation_s {
+    const parameters_t* parameters;
+    uint64_t random;
+
+    node_t* nodes;
+    int nb_nodes;
+    int capacity;
+    /* Living servents, to draw one in constant time. */
+    int* alive;
+    int* alive_index;
+    int nb_alive;
+
+    /* Join statistics. */
+    long joins;
+    long join_frames;
+    long max_join_frames;
+    long joins_below_min;
+
+    /* Frames in flight (binary heap on time). */
+    event_t* events;
+    int nb_events;
+    int events_capacity;
+
+    /* A servent saw the current query, or has its file, if its stamp is it. */
+    unsigned int* seen;
+    unsigned int* holders;
+    unsigned int stamp;
+
+    /* Scratch arrays of the graph metrics. */
+    int* parents;
+    int* distances;
+    int* queue;
+} simulation_t;
+
+
+/* Results of the searches of one TTL. */
+typedef struct query_results_s {
+    int successes;
+    long frames;
+    long lost;
+    long reached;
+    uint64_t* latencies;
+} query_results_t;
+
+
+static void usage(const char* name);
+
+
+/* Seeded generator (xorshift64*), not to depend on the one of the C library. */
+static uint64_t next_random(simulation_t* simulation);
+static int random_below(simulation_t* simulation, int bound);
+
+
+/*
+ * Add a servent. If it is not the first one, it joins through a random living
+ * servent.
+ */
+static void arrive(simulation_t* simulation);
+
+
+/*
+ * Remove a random living servent, which leaves the network.
+ */
+static void depart(simulation_t* simulation);
+
+
+/*
+ * Mirror of join_network_through: self joins through contact. frames counts
+ * the frames exchanged.
+ */
+static void join_through(simulation_t* simulation, int self, int contact, int nb_attempts,
+                         long* frames);
+
+
+/*
+ * Mirror of join and handle_join_request: send a join request from self to
+ * target. Return 1 if target accepted (and added self), 0 otherwise.
+ */
+static int join(simulation_t* simulation, int self, int target, int force, long* frames);
+
+
+/*
+ * Index of neighbour inside the neighbours of self, -1 if absent.
+ */
+static int find_neighbour(const node_t* self, int neighbour);
+
+
+/*
+ * Remove the first entry of neighbour from the neighbours of self.
+ */
+static void remove_neighbour(node_t* self, int neighbour);
+
+
+/*
+ * Return 1 if a frame sent by from to to is read by to: to is alive and has
+ * from as a neighbour.
+ */
+static int delivered(const simulation_t* simulation, int from, int to);
+
+
+/*
+ * Display the degree distribution, the partitions and the diameter of the
+ * overlay.
+ */
+static void report_graph(simulation_t* simulation, const char* phase);
+
+
+/*
+ * Breadth-first search from source over the edges known on both sides.
+ * Return the farthest servent and store its distance in eccentricity.
+ */
+static int breadth_first(simulation_t* simulation, int source, int* eccentricity,
+                         long* total_distance, int* reached);
+
+
+static int find_root(int* parents, int node);
+
+
+/*
+ * Run the searches for every TTL and display their cost.
+ */
+static void report_queries(simulation_t* simulation);
+
+
+/*
+ * Run one search from source with ttl, and fill results.
+ */
+static void run_query(simulation_t* simulation, int source, int ttl, query_results_t* results);
+
+
+/*
+ * Send a frame from from to every neighbour of from but except (-1 for none).
+ */
+static void broadcast(simulation_t* simulation, int from, int except, uint64_t time,
+                      int query, int ttl, int hits, query_results_t* results);
+
+
+static void push_event(simulation_t* simulation, const event_t* event);
+static void pop_event(simulation_t* simulation, event_t* event);
+
+
+/******************************************************************************/
+
+
+int main(int argc, char** argv) {
+    parameters_t parameters = {
+        .nodes = DEFAULT_NODES, .churn = -1, .queries = DEFAULT_QUERIES,
+        .replicas = DEFAULT_REPLICAS, .max_neighbours = MAX_NEIGHBOURS, .seed = 1
+    };
+    parameters.nb_ttls = parse_list(DEFAULT_TTLS, parameters.ttls, MAX_SWEEP);
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:c:q:r:d:t:s:h")) != -1) {
+        switch (opt) {
+        case 'n': parameters.nodes = atoi(optarg); break;
+        case 'c': parameters.churn = atoi(optarg); break;
+        case 'q': parameters.queries = atoi(optarg); break;
+        case 'r': parameters.replicas = atoi(optarg); break;
+        case 'd': parameters.max_neighbours = atoi(optarg); break;
+        case 't': parameters.nb_ttls = parse_list(optarg, parameters.ttls, MAX_SWEEP); break;
+        case 's': parameters.seed = strtoull(optarg, NULL, 10); break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (parameters.churn == -1) {
+        parameters.churn = parameters.nodes / 10;
+    }
+
+    if (parameters.nodes < 2 || parameters.churn < 0 || parameters.queries < 0 ||
+        parameters.replicas < 1 || parameters.replicas > parameters.nodes ||
+        parameters.max_neighbours < 1 || parameters.max_neighbours > MAX_NEIGHBOURS ||
+        parameters.nb_ttls <= 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    simulation_t simulation;
+    memset(&simulation, 0, sizeof(simulation));
+    simulation.parameters = &parameters;
+    /* xorshift must not start from 0. */
+    simulation.random = parameters.seed * 0x9E3779B97F4A7C15ull + 1;
+    simulation.capacity = parameters.nodes + parameters.churn + 1;
+    simulation.nodes = calloc(simulation.capacity, sizeof(node_t));
+    simulation.alive = malloc(simulation.capacity * sizeof(int));
+    simulation.alive_index = malloc(simulation.capacity * sizeof(int));
+    simulation.seen = calloc(simulation.capacity, sizeof(unsigned int));
+    simulation.holders = calloc(simulation.capacity, sizeof(unsigned int));
+    simulation.parents = malloc(simulation.capacity * sizeof(int));
+    simulation.distances = malloc(simulation.capacity * sizeof(int));
+    simulation.queue = malloc(simulation.capacity * sizeof(int));
+
+    printf("%d servents (at most %d neighbours), %d departures and arrivals, "
+           "%d searches per TTL, %d replicas per file, seed %lu\n", parameters.nodes,
+           parameters.max_neighbours, parameters.churn, parameters.queries,
+           parameters.replicas, (unsigned long)parameters.seed);
+
+    for (int i = 0; i < parameters.nodes; i++) {
+        arrive(&simulation);
+    }
+    report_graph(&simulation, "growth");
+    report_queries(&simulation);
+
+    if (parameters.churn > 0) {
+        for (int i = 0; i < parameters.churn; i++) {
+            if (simulation.nb_alive > 2 && random_below(&simulation, 2) == 0) {
+                depart(&simulation);
+            } else {
+                arrive(&simulation);
+            }
+        }
+        report_graph(&simulation, "churn");
+        report_queries(&simulation);
+    }
+
+    free(simulation.queue);
+    free(simulation.distances);
+    free(simulation.parents);
+    free(simulation.holders);
+    free(simulation.seen);
+    free(simulation.events);
+    free(simulation.alive_index);
+    free(simulation.alive);
+    free(simulation.nodes);
+    return EXIT_SUCCESS;
+}
+
+
+void usage(const char* name) {
+    fprintf(stderr, "Usage: %s [-n servents] [-c departures and arrivals] "
+                    "[-q searches per TTL] [-r replicas per file] [-d max neighbours] "
+                    "[-t ttl,ttl...] [-s seed]\n", name);
+}
+
+
+uint64_t next_random(simulation_t* simulation) {
+    uint64_t x = simulation->random;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    simulation->random = x;
+    return x * 0x2545F4914F6CDD1Dull;
+}
+
+
+int random_below(simulation_t* simulation, int bound) {
+    return (int)((next_random(simulation) >> 33) % (uint64_t)bound);
+}
+
+
+void arrive(simulation_t* simulation) {
+    if (simulation->nb_nodes == simulation->capacity) {
+        return;
+    }
+
+    int self = simulation->nb_nodes++;
+    node_t* node = simulation->nodes + self;
+    node->nb_neighbours = 0;
+
+    /* Drawn before self is alive, not to join through ourselves. */
+    int contact = simulation->nb_alive > 0
+                  ? simulation->alive[random_below(simulation, simulation->nb_alive)] : -1;
+
+    node->alive = 1;
+    simulation->alive_index[self] = simulation->nb_alive;
+    simulation->alive[simulation->nb_alive++] = self;
+
+    if (contact != -1) {
+        long frames = 0;
+        join_through(simulation, self, contact, JOIN_MAX_ATTEMPTS, &frames);
+
+        simulation->joins++;
+        simulation->join_frames += frames;
+        if (frames > simulation->max_join_frames) {
+            simulation->max_join_frames = frames;
+        }
+        if (node->nb_neighbours < MIN_NEIGHBOURS) {
+            simulation->joins_below_min++;
+        }
+    }
+}
+
+
+void depart(simulation_t* simulation) {
+    int self = simulation->alive[random_below(simulation, simulation->nb_alive)];
+    node_t* node = simulation->nodes + self;
+
+    /* Remove self from the living servents. */
+    int index = simulation->alive_index[self];
+    int last = simulation->alive[--simulation->nb_alive];
+    simulation->alive[index] = last;
+    simulation->alive_index[last] = index;
+    node->alive = 0;
+
+    /* CMSG_LEAVE to each neighbour, which only reads it if it knows us. */
+    for (int i = 0; i < node->nb_neighbours; i++) {
+        int neighbour = node->neighbours[i];
+        if (!delivered(simulation, self, neighbour)) {
+            continue;
+        }
+
+        node_t* other = simulation->nodes + neighbour;
+        remove_neighbour(other, self);
+
+        if (other->nb_neighbours < MIN_NEIGHBOURS && other->nb_neighbours > 0) {
+            long frames = 0;
+            join_through(simulation, neighbour, other->neighbours[0], JOIN_MAX_ATTEMPTS,
+                         &frames);
+            simulation->joins++;
+            simulation->join_frames += frames;
+            if (frames > simulation->max_join_frames) {
+                simulation->max_join_frames = frames;
+            }
+            if (other->nb_neighbours < MIN_NEIGHBOURS) {
+                simulation->joins_below_min++;
+            }
+        }
+    }
+
+    node->nb_neighbours = 0;
+}
+
+
+void join_through(simulation_t* simulation, int self, int contact, int nb_attempts,
+                  long* frames) {
+    if (nb_attempts < 0 || !simulation->nodes[contact].alive) {
+        return;
+    }
+
+    /* CMSG_NEIGHBOURS and its answer. */
+    *frames += 2;
+
+    node_t* node = simulation->nodes + self;
+    const node_t* contact_node = simulation->nodes + contact;
+    int nb_neighbours = contact_node->nb_neighbours;
+    int asked[MAX_NEIGHBOURS + 1];
+    int nb_asked = 0;
+    int accepted[MAX_NEIGHBOURS + 1];
+    int nb_accepted = 0;
+
+    for (int i = 0; i < nb_neighbours; i++) {
+        int neighbour = contact_node->neighbours[i];
+        if (neighbour == self) {
+            continue;
+        }
+
+        asked[nb_asked++] = neighbour;
+        if (join(simulation, self, neighbour, 0, frames) == 1) {
+            accepted[nb_accepted++] = neighbour;
+        }
+    }
+
+    if (nb_neighbours < MAX_NEIGHBOURS) {
+        asked[nb_asked++] = contact;
+        if (join(simulation, self, contact, nb_neighbours == 0, frames) == 1) {
+            accepted[nb_accepted++] = contact;
+        }
+    }
+
+    /* handle_join_responses: only kept while there is room. */
+    for (int i = 0; i < nb_accepted; i++) {
+        if (node->nb_neighbours < simulation->parameters->max_neighbours) {
+            node->neighbours[node->nb_neighbours++] = accepted[i];
+        }
+    }
+
+    if (nb_neighbours > 0 && node->nb_neighbours < MIN_NEIGHBOURS) {
+        for (int i = 0; i < nb_asked; i++) {
+            join_through(simulation, self, asked[i], nb_attempts - 1, frames);
+        }
+    }
+}
+
+
+int join(simulation_t* simulation, int self, int target, int force, long* frames) {
+    if (find_neighbour(simulation->nodes + self, target) != -1) {
+        return 0;
+    }
+
+    node_t* node = simulation->nodes + target;
+    if (!node->alive) {
+        return 0;
+    }
+
+    /* CMSG_JOIN and SMSG_JOIN. */
+    *frames += 2;
+
+    int max_neighbours = simulation->parameters->max_neighbours;
+    if (node->nb_neighbours >= max_neighbours) {
+        return 0;
+    }
+
+    if (!force && random_below(simulation, JOIN_CHANCE_MOD) >= JOIN_CHANCE) {
+        return 0;
+    }
+
+    node->neighbours[node->nb_neighbours++] = self;
+    return 1;
+}
+
+
+int find_neighbour(const node_t* self, int neighbour) {
+    for (int i = 0; i < self->nb_neighbours; i++) {
+        if (self->neighbours[i] == neighbour) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+
+void remove_neighbour(node_t* self, int neighbour) {
+    int index = find_neighbour(self, neighbour);
+    if (index == -1) {
+        return;
+    }
+
+    /* Keep the order: the first neighbour is the one rejoined through. */
+    memmove(self->neighbours + index, self->neighbours + index + 1,
+            (self->nb_neighbours - index - 1) * sizeof(int));
+    self->nb_neighbours--;
+}
+
+
+int delivered(const simulation_t* simulation, int from, int to) {
+    const node_t* node = simulation->nodes + to;
+    return node->alive && find_neighbour(node, from) != -1;
+}
+
+
+void report_graph(simulation_t* simulation, const char* phase) {
+    int max_neighbours = simulation->parameters->max_neighbours;
+    long degrees[MAX_NEIGHBOURS + 1] = { 0 };
+    long one_sided = 0, dead = 0;
+    int* parents = simulation->parents;
+
+    for (int i = 0; i < simulation->nb_nodes; i++) {
+        parents[i] = i;
+    }
+
+    for (int a = 0; a < simulation->nb_alive; a++) {
+        int self = simulation->alive[a];
+        const node_t* node = simulation->nodes + self;
+        int degree = 0;
+
+        for (int i = 0; i < node->nb_neighbours; i++) {
+            int neighbour = node->neighbours[i];
+            if (!simulation->nodes[neighbour].alive) {
+                dead++;
+            } else if (!delivered(simulation, self, neighbour)) {
+                one_sided++;
+            } else {
+                degree++;
+                int x = find_root(parents, self), y = find_root(parents, neighbour);
+                if (x != y) {
+                    parents[x] = y;
+                }
+            }
+        }
+
+        degrees[degree > max_neighbours ? max_neighbours : degree]++;
+    }
+
+    /* Partitions: components of the edges known on both sides. */
+    int* sizes = simulation->distances;
+    memset(sizes, 0, simulation->nb_nodes * sizeof(int));
+    int components = 0, largest = 0, largest_root = -1;
+    for (int a = 0; a < simulation->nb_alive; a++) {
+        int root = find_root(parents, simulation->alive[a]);
+        if (sizes[root]++ == 0) {
+            components++;
+        }
+        if (sizes[root] > largest) {
+            largest = sizes[root];
+            largest_root = root;
+        }
+    }
+
+    /*
+     * Diameter of the largest partition: a double sweep gives a lower bound
+     * which is tight on such graphs, the sampled searches the mean distance.
+     */
+    int start = largest_root;
+    int eccentricity = 0, diameter = 0, reached = 0;
+    long total_distance = 0, total_pairs = 0;
+    for (int i = 0; i < DISTANCE_SAMPLES && largest > 1; i++) {
+        long distance = 0;
+        int farthest = breadth_first(simulation, start, &eccentricity, &distance, &reached);
+        if (eccentricity > diameter) {
+            diameter = eccentricity;
+        }
+        total_distance += distance;
+        total_pairs += reached - 1;
+
+        /* First the farthest servent (the sweep), then random ones. */
+        if (i == 0) {
+            start = farthest;
+        } else {
+            do {
+                start = simulation->alive[random_below(simulation, simulation->nb_alive)];
+            } while (find_root(parents, start) != find_root(parents, largest_root));
+        }
+    }
+
+    printf("\n=== After %s: %d servents alive\n", phase, simulation->nb_alive);
+    printf("Joins: %ld, %.1f frames on average, %ld at most, %ld below %d neighbours\n",
+           simulation->joins,
+           simulation->joins > 0 ? (double)simulation->join_frames / simulation->joins : 0.0,
+           simulation->max_join_frames, simulation->joins_below_min, MIN_NEIGHBOURS);
+    printf("Degree (edges known on both sides):");
+    for (int i = 0; i <= max_neighbours; i++) {
+        printf("  %d: %.1f%%", i, 100.0 * degrees[i] / simulation->nb_alive);
+    }
+    printf("\nOne-sided edges: %ld, dead links: %ld\n", one_sided, dead);
+    printf("Partitions: %d, largest %d servents (%.1f%%), diameter >= %d, "
+           "mean distance %.2f\n", components, largest, 100.0 * largest / simulation->nb_alive,
+           diameter, total_pairs > 0 ? (double)total_distance / total_pairs : 0.0);
+}
+
+
+int breadth_first(simulation_t* simulation, int source, int* eccentricity,
+                  long* total_distance, int* reached) {
+    int* distances = simulation->distances;
+    int* queue = simulation->queue;
+    for (int i = 0; i < simulation->nb_nodes; i++) {
+        distances[i] = -1;
+    }
+
+    int head = 0, tail = 0, farthest = source;
+    distances[source] = 0;
+    queue[tail++] = source;
+    *total_distance = 0;
+
+    while (head < tail) {
+        int self = queue[head++];
+        const node_t* node = simulation->nodes + self;
+        *total_distance += distances[self];
+        if (distances[self] > distances[farthest]) {
+            farthest = self;
+        }
+
+        for (int i = 0; i < node->nb_neighbours; i++) {
+            int neighbour = node->neighbours[i];
+            if (distances[neighbour] == -1 && delivered(simulation, self, neighbour)) {
+                distances[neighbour] = distances[self] + 1;
+                queue[tail++] = neighbour;
+            }
+        }
+    }
+
+    *eccentricity = distances[farthest];
+    *reached = tail;
+    return farthest;
+}
+
+
+int find_root(int* parents, int node) {
+    while (parents[node] != node) {
+        parents[node] = parents[parents[node]];
+        node = parents[node];
+    }
+
+    return node;
+}
+
+
+void report_queries(simulation_t* simulation) {
+    const parameters_t* parameters = simulation->parameters;
+    if (parameters->queries == 0) {
+        return;
+    }
+
+    printf("\n%-5s %-9s %-11s %-11s %-11s %-10s %-8s\n", "ttl", "success", "p50 (ms)",
+           "p99 (ms)", "frames", "lost", "reach");
+
+    for (int t = 0; t < parameters->nb_ttls; t++) {
+        query_results_t results = { 0, 0, 0, 0, NULL };
+        results.latencies = malloc(parameters->queries * sizeof(uint64_t));
+
+        for (int q = 0; q < parameters->queries; q++) {
+            int source = simulation->alive[random_below(simulation, simulation->nb_alive)];
+            run_query(simulation, source, parameters->ttls[t], &results);
+        }
+
+        qsort(results.latencies, results.successes, sizeof(uint64_t), compare_u64);
+        double p50 = 0, p99 = 0;
+        if (results.successes > 0) {
+            p50 = results.latencies[(int)(0.5 * (results.successes - 1) + 0.5)];
+            p99 = results.latencies[(int)(0.99 * (results.successes - 1) + 0.5)];
+        }
+
+        printf("%-5d %7.1f%%  %-11.0f %-11.0f %-11.1f %-10.1f %6.1f%%\n", parameters->ttls[t],
+               100.0 * results.successes / parameters->queries, p50, p99,
+               (double)results.frames / parameters->queries,
+               (double)results.lost / parameters->queries,
+               100.0 * results.reached / parameters->queries / simulation->nb_alive);
+        fflush(stdout);
+
+        free(results.latencies);
+    }
+}
+
+
+void run_query(simulation_t* simulation, int source, int ttl, query_results_t* results) {
+    unsigned int stamp = ++simulation->stamp;
+
+    /* The file is on random servents, maybe the source itself. */
+    for (int i = 0; i < simulation->parameters->replicas; i++) {
+        int holder = simulation->alive[random_below(simulation, simulation->nb_alive)];
+        simulation->holders[holder] = stamp;
+    }
+
+    if (simulation->holders[source] == stamp) {
+        results->latencies[results->successes++] = 0;
+        return;
+    }
+
+    uint64_t found = 0;
+    long reached = 0;
+    broadcast(simulation, source, -1, 0, 1, ttl, 0, results);
+
+    while (simulation->nb_events > 0) {
+        event_t event;
+        pop_event(simulation, &event);
+        int self = event.to;
+
+        if (!event.query) {
+            /* The client of self gets the answer: only useful to the source. */
+            if (self == source && event.hits > 0 && found == 0) {
+                found = event.time;
+            }
+            continue;
+        }
+
+        if (self == source) {
+            /* The query came back: forward_to_local. */
+            if (event.hits > 0 && found == 0) {
+                found = event.time;
+            }
+            continue;
+        }
+
+        int unique = simulation->seen[self] != stamp;
+        if (unique) {
+            simulation->seen[self] = stamp;
+            reached++;
+        }
+
+        int has_file = unique && simulation->holders[self] == stamp && event.hits < MAX_HITS;
+        int hits = event.hits + has_file;
+
+        if (unique && event.ttl > 0) {
+            broadcast(simulation, self, event.from, event.time, 1, event.ttl - 1, hits, results);
+        } else {
+            broadcast(simulation, self, event.from, event.time, 0, 0, hits, results);
+        }
+    }
+
+    results->reached += reached;
+    if (found > 0 && found <= GNUTELLA_SEARCH_LIFETIME) {
+        results->latencies[results->successes++] = found;
+    }
+}
+
+
+void broadcast(simulation_t* simulation, int from, int except, uint64_t time,
+               int query, int ttl, int hits, query_results_t* results) {
+    const node_t* node = simulation->nodes + from;
+    int skipped = 0;
+
+    for (int i = 0; i < node->nb_neighbours; i++) {
+        int neighbour = node->neighbours[i];
+        /* broadcast_packet_except skips the socket the frame came from. */
+        if (neighbour == except && !skipped) {
+            skipped = 1;
+            continue;
+        }
+
+        results->frames++;
+        if (!delivered(simulation, from, neighbour)) {
+            results->lost++;
+            continue;
+        }
+
+        event_t event = {
+            .time = time + HOP_DELAY_MIN +
+                    random_below(simulation, HOP_DELAY_MAX - HOP_DELAY_MIN),
+            .from = from, .to = neighbour, .query = query, .ttl = ttl, .hits = hits
+        };
+        push_event(simulation, &event);
+    }
+}
+
+
+void push_event(simulation_t* simulation, const event_t* event) {
+    if (simulation->nb_events == simulation->events_capacity) {
+        simulation->events_capacity = simulation->events_capacity == 0
+                                      ? 1024 : 2 * simulation->events_capacity;
+        simulation->events = realloc(simulation->events,
+                                     simulation->events_capacity * sizeof(event_t));
+    }
+
+    event_t* events = simulation->events;
+    int i = simulation->nb_events++;
+    while (i > 0 && events[(i - 1) / 2].time > event->time) {
+        events[i] = events[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    events[i] = *event;
+}
+
+
+void pop_event(simulation_t* simulation, event_t* event) {
+    event_t* events = simulation->events;
+    *event = events[0];
+
+    event_t last = events[--simulation->nb_events];
+    int size = simulation->nb_events;
+    int i = 0;
+    while (2 * i + 1 < size) {
+        int child = 2 * i + 1;
+        if (child + 1 < size && events[child + 1].time < events[child].time) {
+            child++;
+        }
+        if (events[child].time >= last.time) {
+            break;
+        }
+        events[i] = events[child];
+        i = child;
+    }
+
+    if (size > 0) {
+        events[i] = last;
+    }
+}
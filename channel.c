@@ -0,0 +1,188 @@
+#define _GNU_SOURCE
+
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "channel.h"
+#include "util.h"
+
+
+/* Time (milliseconds) we wait before pushing again inside a full queue. */
+#define PACKET_QUEUE_FULL_WAIT 1
+
+
+/******************************************************************************/
+
+
+packet_queue_t* packet_queue_create(void) {
+    int event_fd = eventfd(0, EFD_SEMAPHORE | EFD_NONBLOCK | EFD_CLOEXEC);
+    if (event_fd == -1) {
+        return NULL;
+    }
+
+    packet_queue_t* queue = aligned_alloc(CHANNEL_CACHE_LINE, sizeof(packet_queue_t));
+    atomic_init(&queue->head, 0);
+    atomic_init(&queue->tail, 0);
+    queue->event_fd = event_fd;
+    return queue;
+}
+
+
+void packet_queue_destroy(packet_queue_t** queue) {
+    packet_t* packet;
+    while (packet_queue_pop(*queue, &packet) == 1) {
+        packet_release(packet);
+    }
+
+    close((*queue)->event_fd);
+    free(*queue);
+    *queue = NULL;
+}
+
+
+void packet_queue_push(packet_queue_t* queue, packet_t* packet) {
+    size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    while (tail - atomic_load_explicit(&queue->head, memory_order_acquire) == PACKET_QUEUE_CAPACITY) {
+        millisleep(PACKET_QUEUE_FULL_WAIT);
+    }
+
+    queue->slots[tail & (PACKET_QUEUE_CAPACITY - 1)] = packet;
+    atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+
+    /* Wake up the consumer, one count per packet. */
+    uint64_t one = 1;
+    write_to_fd(queue->event_fd, &one, sizeof(uint64_t));
+}
+
+
+int packet_queue_pop(packet_queue_t* queue, packet_t** packet) {
+    size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    if (head == atomic_load_explicit(&queue->tail, memory_order_acquire)) {
+        return 0;
+    }
+
+    /*
+     * Consume the count of the packet. The producer counts the packet right
+     * after publishing it, so the count may not be there yet: the consumer is
+     * then woken up once more for nothing, which is harmless.
+     */
+    uint64_t count;
+    ssize_t res = read(queue->event_fd, &count, sizeof(uint64_t));
+    UNUSED(res);
+
+    *packet = queue->slots[head & (PACKET_QUEUE_CAPACITY - 1)];
+    atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+    return 1;
+}
+
+
+void local_link_init(local_link_t* link) {
+    link->sock = -1;
+    link->in = NULL;
+    link->out = NULL;
+}
+
+
+void local_link_from_socket(local_link_t* link, int sock) {
+    link->sock = sock;
+    link->in = NULL;
+    link->out = NULL;
+}
+
+
+void local_link_from_queues(local_link_t* link, packet_queue_t* in, packet_queue_t* out) {
+    link->sock = -1;
+    link->in = in;
+    link->out = out;
+}
+
+
+int local_link_is_open(const local_link_t* link) {
+    return link->sock != -1 || link->in != NULL;
+}
+
+
+int local_link_fd(const local_link_t* link) {
+    if (link->in != NULL) {
+        return link->in->event_fd;
+    }
+
+    return link->sock;
+}
+
+
+int local_link_can_send(const local_link_t* link) {
+    if (link->out != NULL) {
+        size_t tail = atomic_load_explicit(&link->out->tail, memory_order_relaxed);
+        return tail - atomic_load_explicit(&link->out->head, memory_order_acquire) <
+               PACKET_QUEUE_CAPACITY;
+    }
+
+    /* A closed link does not wait: sending fails right away. */
+    if (link->sock == -1) {
+        return 1;
+    }
+
+    struct pollfd poller;
+    return poll_fd(&poller, link->sock, POLLOUT, 0) == 1;
+}
+
+
+int local_link_send(local_link_t* link, packet_t* packet) {
+    if (link->out != NULL) {
+        packet_retain(packet);
+        packet_queue_push(link->out, packet);
+        return 0;
+    }
+
+    if (link->sock == -1) {
+        return -1;
+    }
+
+    return packet_send(packet, link->sock);
+}
+
+
+int local_link_receive(local_link_t* link, packet_reader_t* reader, opcode_t* opcode) {
+    if (link->in != NULL) {
+        packet_t* packet;
+        if (packet_queue_pop(link->in, &packet) == 0) {
+            return 0;
+        }
+
+        /* A NULL packet marks the end of the link. */
+        if (packet == NULL) {
+            return -1;
+        }
+
+        packet_reader_wrap(reader, packet);
+        *opcode = (opcode_t)packet->data[0];
+        return 1;
+    }
+
+    if (link->sock == -1) {
+        return -1;
+    }
+
+    if (read_from_fd(link->sock, opcode, PKT_ID_SIZE) != PKT_ID_SIZE) {
+        return -1;
+    }
+
+    packet_reader_begin(reader, link->sock, *opcode);
+    return 1;
+}
+
+
+void local_link_close(local_link_t* link) {
+    if (link->out != NULL) {
+        packet_queue_push(link->out, NULL);
+    } else if (link->sock != -1) {
+        close(link->sock);
+    }
+
+    local_link_init(link);
+}
@@ -0,0 +1,136 @@
+#ifndef CHANNEL_H
+#define CHANNEL_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+#include "common.h"
+#include "packet.h"
+#include "packets_defines.h"
+
+
+/*
+ * Local link between the client and the servent. When they run in different
+ * processes, the link is the control socket (see create_local_listening_socket).
+ * When they run as threads of the same process, the link is a pair of
+ * lock-free queues of packets, one per direction, and the packets are handed
+ * over without being copied nor going through the kernel.
+ *
+ * Both sides only deal with local_link_t, and always receive complete packets
+ * through a packet_reader_t, whatever the underlying transport.
+ */
+
+
+/* Size of a cache line, to keep the indexes of the producer and the consumer apart. */
+#define CHANNEL_CACHE_LINE 64
+
+
+/* Number of packets a queue can hold. Must be a power of two. */
+#define PACKET_QUEUE_CAPACITY 1024
+
+
+/*
+ * Lock-free queue of packets, with a single producer and a single consumer.
+ * Each packet pushed is also counted in an eventfd (in semaphore mode), so the
+ * consumer can poll the queue along with its sockets: the eventfd is readable
+ * as long as the queue is not empty.
+ */
+typedef struct packet_queue_s {
+    /* Index of the next packet to pop, only written by the consumer. */
+    _Alignas(CHANNEL_CACHE_LINE) atomic_size_t head;
+    /* Index of the next packet to push, only written by the producer. */
+    _Alignas(CHANNEL_CACHE_LINE) atomic_size_t tail;
+    _Alignas(CHANNEL_CACHE_LINE) packet_t* slots[PACKET_QUEUE_CAPACITY];
+    /* Counts the packets inside the queue. */
+    int event_fd;
+} packet_queue_t;
+
+
+/*
+ * Create an empty queue. Return NULL if the eventfd could not be created.
+ */
+packet_queue_t* packet_queue_create(void);
+
+
+/*
+ * Release the packets still inside the queue and free it.
+ */
+void packet_queue_destroy(packet_queue_t** queue);
+
+
+/*
+ * Push packet (NULL included) at the end of the queue. The queue takes over the
+ * reference of the caller. If the queue is full, the function waits for the
+ * consumer to make room.
+ */
+void packet_queue_push(packet_queue_t* queue, packet_t* packet);
+
+
+/*
+ * Pop the oldest packet of the queue and store it in *packet. The function
+ * returns 0 if the queue was empty, 1 otherwise.
+ */
+int packet_queue_pop(packet_queue_t* queue, packet_t** packet);
+
+
+typedef struct local_link_s {
+    /* Socket to the other side, -1 when the queues are used. */
+    int sock;
+    /* Packets coming from the other side. */
+    packet_queue_t* in;
+    /* Packets going to the other side. */
+    packet_queue_t* out;
+} local_link_t;
+
+
+/* No link (the client is not connected yet). */
+void local_link_init(local_link_t* link);
+void local_link_from_socket(local_link_t* link, int sock);
+void local_link_from_queues(local_link_t* link, packet_queue_t* in, packet_queue_t* out);
+
+
+/*
+ * Return 1 if the link is connected, 0 otherwise.
+ */
+int local_link_is_open(const local_link_t* link);
+
+
+/*
+ * Return the file descriptor to poll (for POLLIN) to know when something can
+ * be received, or -1 if the link is closed.
+ */
+int local_link_fd(const local_link_t* link);
+
+
+/*
+ * Return 1 if a packet can be sent right away, 0 if local_link_send would wait
+ * for the other side to receive what was already sent.
+ */
+int local_link_can_send(const local_link_t* link);
+
+
+/*
+ * Send packet to the other side. The caller keeps its reference. Return -1 on
+ * error, 0 otherwise.
+ */
+ERROR_CODES_USUAL int local_link_send(local_link_t* link, packet_t* packet);
+
+
+/*
+ * Receive the next packet from the other side, and prepare reader to decode it
+ * after its opcode, stored in opcode. The caller releases reader->packet.
+ *
+ * The function returns 1 if a packet was received, 0 if there is nothing to
+ * receive yet (the function does not block on queues), -1 if the other side
+ * closed the link.
+ */
+int local_link_receive(local_link_t* link, packet_reader_t* reader, opcode_t* opcode);
+
+
+/*
+ * Close our side of the link. On queues, the other side receives the end of
+ * the link after the packets already sent.
+ */
+void local_link_close(local_link_t* link);
+
+#endif /* CHANNEL_H */
@@ -41,7 +41,9 @@ ERROR_CODES_USUAL static int handshake(const client_t* client);
 
 
 /*
- * Main client loop.
+ * Main client loop. The standard input and the socket of the servent are
+ * watched together, so the answers of the servent are displayed as soon as they
+ * arrive, and several searches or downloads can be running at once.
  */
 static int loop(client_t* client);
 
@@ -68,21 +70,57 @@ static void display_help();
 
 
 /*
- * Read a line on the standard input and return it as a mallocated string.
+ * Display the prompt, waiting for the next command. Nothing is displayed in
+ * batch mode.
  */
-static char* read_command();
+static void display_prompt(const client_t* client);
 
 
 /*
- * Read the new packets sent by the local servent.
+ * Read what is available on the standard input and handle the complete lines
+ * (see handle_lines). The function returns 1 if the user asked to exit (or
+ * closed the standard input), 0 otherwise.
  */
-static void handle_servent(client_t* client);
+static int handle_input(client_t* client);
 
 
 /*
- * Handle the command passed as a parameter.
+ * Handle the complete lines of client->input, and the last one once the input
+ * is over. The lines are held back while the servent does not receive the
+ * commands as fast as they come: blocking on the link would keep the client
+ * from reading the answers the servent is blocked on. The function returns 1
+ * if the user asked to exit (or every line of a closed input was handled), 0
+ * otherwise.
  */
-static void handle_command(client_t* client, char* command);
+static int handle_lines(client_t* client);
+
+
+/*
+ * Return 1 if client->input holds lines to handle right away, 0 if the input
+ * has to be read first.
+ */
+static int has_pending_lines(const client_t* client);
+
+
+/*
+ * Handle one line typed by the user. The function returns 1 if the line is
+ * the exit command, 0 otherwise.
+ */
+static int handle_line(client_t* client, char* line);
+
+
+/*
+ * Read one packet sent by the local servent, if any. The function returns -1
+ * if the servent closed the connection, 0 otherwise.
+ */
+ERROR_CODES_USUAL static int handle_servent(client_t* client);
+
+
+/*
+ * Handle the command passed as a parameter. Return -1 if the command is
+ * unknown or malformed, 0 otherwise.
+ */
+static int handle_command(client_t* client, char* command);
 
 
 #define SEARCH_COMMAND "search"
@@ -103,38 +141,77 @@ static const char* commands[][2] = {
 /******************************************************************************/
 
 
-int run_client(const char* connection_port) {
+int run_client(const char* connection_port, const char* batch_file,
+               const local_link_t* server_link) {
     client_t client;
+    client.input_fd = STDIN_FILENO;
+    client.batch = NULL;
+
+    if (batch_file != NULL && strcmp(batch_file, BATCH_STDIN) != 0) {
+        client.input_fd = open(batch_file, O_RDONLY);
+        if (client.input_fd == -1) {
+            applog(LOG_LEVEL_ERROR, "[User] Impossible d'ouvrir %s : %s.\n",
+                   batch_file, strerror(errno));
+            return -1;
+        }
+    }
+
+    int res;
+    if (server_link != NULL) {
+        /* Same process as the servent: nothing to connect to. */
+        client.server = *server_link;
+    } else {
+        int sock;
+        res = attempt_connect_local(connection_port == NULL ? SERVER_LISTEN_PORT : connection_port,
+                                    &sock, MAX_SERVER_UP_CHECK, SERVER_UP_CHECK_TIMEOUT);
+        if (res == -1) {
+            applog(LOG_LEVEL_ERROR, "[User] Serveur innaccessible. Extinction.\n");
+            return EXIT_FAILURE;
+        }
+
+        local_link_from_socket(&client.server, sock);
+
+        res = handshake(&client);
+        if (res == -1) {
+            return -1;
+        }
 
-    int res = attempt_connect_to("127.0.0.1", connection_port == NULL ? SERVER_LISTEN_PORT : connection_port,
-                                 &(client.server_socket), MAX_SERVER_UP_CHECK,
-                                 SERVER_UP_CHECK_TIMEOUT);
-    if (res == -1) {
-        applog(LOG_LEVEL_ERROR, "[User] Serveur innaccessible. Extinction.\n");
-        return EXIT_FAILURE;
+        applog(LOG_LEVEL_INFO, "[User] Serveur OK (Handshake).\n");
     }
 
-    res = handshake(&client);
-    if (res == -1) {
-        return -1;
+    client.machines_by_files = hashmap_create(destroy_lookup);
+    intrusive_list_init(&client.lookups_lru);
+    client.lookups_memory = 0;
+    client.input_length = 0;
+    client.input_over = 0;
+    if (batch_file != NULL) {
+        client.batch = batch_create();
     }
 
-    applog(LOG_LEVEL_INFO, "[User] Serveur OK (Handshake).\n");
-    client.machines_by_files = list_create(NULL, create_lookup);
     loop(&client);
 
+    res = EXIT_SUCCESS;
+    if (client.batch != NULL) {
+        res = batch_report(client.batch);
+        batch_destroy(&client.batch);
+    }
+
+    if (client.input_fd != STDIN_FILENO) {
+        close(client.input_fd);
+    }
+
     clear_client(&client);
 
-    return EXIT_SUCCESS;
+    return res;
 }
 
 
 int handshake(const client_t* client) {
     opcode_t data = CMSG_INT_HANDSHAKE;
-    write_to_fd(client->server_socket, &data, PKT_ID_SIZE);
+    write_to_fd(client->server.sock, &data, PKT_ID_SIZE);
 
     opcode_t server_data = 0;
-    read_from_fd(client->server_socket, &server_data, PKT_ID_SIZE);
+    read_from_fd(client->server.sock, &server_data, PKT_ID_SIZE);
 
     if (server_data != SMSG_INT_HANDSHAKE) {
         return -1;
@@ -145,91 +222,128 @@ int handshake(const client_t* client) {
 
 
 int loop(client_t* client) {
+    if (client->batch == NULL) {
+        display_help();
+    }
+    display_prompt(client);
+
+    struct pollfd pollers[2];
+    pollers[0].fd = client->input_fd;
+    pollers[0].events = POLLIN;
+    pollers[1].fd = local_link_fd(&client->server);
+    pollers[1].events = POLLIN;
+
     int continue_loop = 1;
-    display_help();
+    int input_done = 0;
     while (continue_loop == 1) {
-        printf("@gnutella$ ");
-        char* temp = read_command();
-        char* command = malloc(strlen(temp));
-        strncpy(command, temp, strlen(temp) - 1);
-        command[strlen(temp) - 1] = '\0';
-        if (strcmp(command, "") == 0) {
-            applog(LOG_LEVEL_WARNING, "Commande vide\n");
-            free(temp);
-            free(command);
-            continue;
-        } else if (strcmp(command, EXIT_COMMAND) == 0) {
-            continue_loop = 0;
-        }
+        /* Held back lines are tried again soon, without reading more input. */
+        int pending = input_done == 0 && has_pending_lines(client);
+        pollers[0].fd = input_done == 0 && pending == 0 ? client->input_fd : -1;
 
-        handle_command(client, command);
-        handle_servent(client);
-        free(temp);
-        free(command);
-    }
-    return 0;
-}
+        int timeout = client->batch == NULL ? -1 : batch_poll_timeout(client->batch);
+        if (pending == 1) {
+            timeout = CLIENT_SEND_RETRY;
+        }
 
+        int res = poll(pollers, 2, timeout);
+        if (res == 0 && pending == 0) {
+            applog(LOG_LEVEL_WARNING, "[User] Plus de réponse du servent, abandon des "
+                                      "commandes en attente.\n");
+            break;
+        } else if (res == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
 
-void clear_client(client_t* client) {
-    write_exit_packet(client);
+            applog(LOG_LEVEL_ERROR, "[User] Erreur durant poll() : %s.\n",
+                   strerror(errno));
+            break;
+        }
 
-    cell_t* files_head = client->machines_by_files->head;
-    while (files_head != NULL) {
-        file_lookup_t* lookup = (file_lookup_t*)files_head->data;
+        /* Answers first, so that a command typed meanwhile sees them. */
+        if ((pollers[1].revents & (POLLIN | POLLHUP)) != 0) {
+            if (handle_servent(client) == -1) {
+                applog(LOG_LEVEL_ERROR, "[User] Le servent a fermé la connexion.\n");
+                local_link_close(&client->server);
+                break;
+            }
+        }
 
-        cell_t* machines_head = lookup->machines->head;
-        while (machines_head != NULL) {
-            machine_t* machine = (machine_t*)machines_head->data;
-            const_free(machine->ip);
-            const_free(machine->port);
+        int exit = 0;
+        if (pending == 1) {
+            exit = handle_lines(client);
+        } else if ((pollers[0].revents & (POLLIN | POLLHUP)) != 0) {
+            exit = handle_input(client);
+        }
 
-            machines_head = machines_head->next;
+        if (exit == 1) {
+            if (client->batch == NULL) {
+                continue_loop = 0;
+            } else {
+                /* Every command was sent, wait for the remaining answers. */
+                client->batch->input_closed = 1;
+                input_done = 1;
+            }
         }
 
-        const_free(lookup->filename);
-        list_destroy(&lookup->machines);
-        files_head = files_head->next;
+        if (client->batch != NULL && batch_is_over(client->batch)) {
+            continue_loop = 0;
+        }
     }
 
-    list_destroy(&client->machines_by_files);
+    return 0;
+}
+
 
-    close(client->server_socket);
-    client->server_socket = -1;
+void clear_client(client_t* client) {
+    hashmap_destroy(&client->machines_by_files);
 
+    if (!local_link_is_open(&client->server)) {
+        return;
+    }
 
+    write_exit_packet(client);
+
+    local_link_close(&client->server);
 }
 
 
 void write_exit_packet(client_t* client) {
-    opcode_t opcode = CMSG_INT_EXIT;
-    write_to_fd(client->server_socket, &opcode, PKT_ID_SIZE);
+    packet_t* packet = packet_begin(CMSG_INT_EXIT);
+    local_link_send(&client->server, packet);
+    packet_release(packet);
 
     applog(LOG_LEVEL_INFO, "[User] Sent CMSG_INT_EXIT\n");
 }
 
 
-void handle_servent(client_t* client) {
-    struct pollfd poller;
-    int res = poll_fd(&poller, client->server_socket, POLLIN, SERVENT_AWAIT_TIMEOUT);
+int handle_servent(client_t* client) {
+    opcode_t opcode;
+    packet_reader_t reader;
+    int res = local_link_receive(&client->server, &reader, &opcode);
+    if (res != 1) {
+        return res;
+    }
 
-    if (res == 1) {
-        opcode_t opcode;
-        read_from_fd(client->server_socket, &opcode, PKT_ID_SIZE);
+    /* The answer is displayed on its own lines, the prompt comes back after. */
+    printf("\n");
 
-        switch (opcode) {
-        case SMSG_INT_SEARCH:
-            handle_search_answer(client);
-            break;
+    switch (opcode) {
+    case SMSG_INT_SEARCH:
+        handle_search_answer(client, &reader);
+        break;
 
-        case SMSG_INT_DOWNLOAD:
-            handle_download_answer(client);
-            break;
+    case SMSG_INT_DOWNLOAD:
+        handle_download_answer(client, &reader);
+        break;
 
-        default:
-            break;
-        }
+    default:
+        break;
     }
+
+    packet_release(reader.packet);
+    display_prompt(client);
+    return 0;
 }
 
 
@@ -245,26 +359,113 @@ void display_help() {
 }
 
 
-char* read_command() {
-    char* command = NULL;
-    size_t length = 0;
-    getline(&command, &length, stdin);
-    return command;
+void display_prompt(const client_t* client) {
+    if (client->batch != NULL) {
+        return;
+    }
+
+    printf("@gnutella$ ");
+    fflush(stdout);
+}
+
+
+int handle_input(client_t* client) {
+    ssize_t res = read(client->input_fd, client->input + client->input_length,
+                       CLIENT_INPUT_SIZE - client->input_length);
+    if (res <= 0) {
+        /* End of the standard input: handle the last lines, then exit. */
+        client->input_over = 1;
+    } else {
+        client->input_length += res;
+    }
+
+    return handle_lines(client);
 }
 
 
-void handle_command(client_t* client, char* command) {
+int handle_lines(client_t* client) {
+    int exit = 0;
+    char* line = client->input;
+    char* end = client->input + client->input_length;
+    char* newline;
+    while (exit == 0 && (newline = memchr(line, '\n', end - line)) != NULL &&
+           local_link_can_send(&client->server) == 1) {
+        *newline = '\0';
+        exit = handle_line(client, line);
+        line = newline + 1;
+    }
+
+    /* Keep the lines held back and the beginning of the next one. */
+    size_t remaining = end - line;
+    if (remaining == CLIENT_INPUT_SIZE && memchr(line, '\n', remaining) == NULL) {
+        applog(LOG_LEVEL_WARNING, "[User] Commande trop longue, ignorée.\n");
+        remaining = 0;
+    }
+
+    memmove(client->input, line, remaining);
+    client->input_length = remaining;
+
+    if (exit == 1 || client->input_over == 0 ||
+        memchr(client->input, '\n', client->input_length) != NULL) {
+        return exit;
+    }
+
+    if (client->input_length > 0) {
+        client->input[client->input_length] = '\0';
+        handle_line(client, client->input);
+        client->input_length = 0;
+    }
+
+    return 1;
+}
+
+
+int has_pending_lines(const client_t* client) {
+    return client->input_over == 1 ||
+           memchr(client->input, '\n', client->input_length) != NULL;
+}
+
+
+int handle_line(client_t* client, char* line) {
+    if (strcmp(line, "") == 0) {
+        applog(LOG_LEVEL_WARNING, "[User] Commande vide\n");
+        display_prompt(client);
+        return 0;
+    } else if (strcmp(line, EXIT_COMMAND) == 0) {
+        return 1;
+    }
+
+    if (client->batch != NULL) {
+        batch_command_begin(client->batch, line);
+        int res = handle_command(client, line);
+        batch_command_end(client->batch, res == -1);
+    } else {
+        handle_command(client, line);
+    }
+
+    display_prompt(client);
+    return 0;
+}
+
+
+int handle_command(client_t* client, char* command) {
     if (strcmp(command, HELP_COMMAND) == 0) {
         display_help();
-        return;
+        return 0;
     }
 
     char* command_name = strtok(command, " ");
+    if (command_name == NULL) {
+        return -1;
+    }
+
     if (strcmp(command_name, DOWNLOAD_COMMAND) == 0) {
-        handle_download(client);
+        return handle_download(client);
     } else if (strcmp(command_name, SEARCH_COMMAND) == 0) {
-        handle_search(client);
+        return handle_search(client);
     } else if (strcmp(command_name, LOOKUP_COMMAND) == 0) {
-        handle_lookup(client);
+        return handle_lookup(client);
     }
+
+    return -1;
 }
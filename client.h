@@ -1,7 +1,21 @@
 #ifndef CLIENT_H
 #define CLIENT_H
 
-/* Run the client application. */
-int run_client(const char* connection_port);
+#include "channel.h"
+
+/* Value of batch_file to read the commands from the standard input. */
+#define BATCH_STDIN "-"
+
+
+/*
+ * Run the client application. If batch_file is not NULL, the client runs in
+ * batch mode and reads its commands from this file (see client_internal.h).
+ *
+ * If server_link is NULL, the client connects to the control socket of the
+ * servent listening on connection_port. Otherwise the servent runs in the same
+ * process and server_link is used to talk to it.
+ */
+int run_client(const char* connection_port, const char* batch_file,
+               const local_link_t* server_link);
 
 #endif /* CLIENT_H */
@@ -0,0 +1,210 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "client_internal.h"
+#include "log.h"
+#include "util.h"
+
+
+/*
+ * Commands waiting for the same answer, oldest first. The commands are linked
+ * through their next field, by index, since the array of commands may move.
+ */
+typedef struct batch_queue_s {
+    size_t first;
+    size_t last;
+} batch_queue_t;
+
+
+/*
+ * Build the key of the queue of the commands waiting for answer about filename.
+ */
+static size_t get_queue_key(char* dest, opcode_t answer, const char* filename);
+
+
+/*
+ * Return the number of microseconds elapsed between begin and end.
+ */
+static long get_elapsed_us(const struct timespec* begin, const struct timespec* end);
+
+
+/******************************************************************************/
+
+
+batch_t* batch_create(void) {
+    batch_t* batch = malloc(sizeof(batch_t));
+    batch->capacity = 64;
+    batch->commands = malloc(batch->capacity * sizeof(batch_command_t));
+    batch->nb_commands = 0;
+    batch->nb_pending = 0;
+    batch->pending = hashmap_create(free);
+    batch->input_closed = 0;
+    clock_gettime(CLOCK_MONOTONIC, &batch->last_activity);
+    return batch;
+}
+
+
+void batch_destroy(batch_t** batch) {
+    for (size_t i = 0; i < (*batch)->nb_commands; i++) {
+        free((*batch)->commands[i].text);
+    }
+
+    free((*batch)->commands);
+    hashmap_destroy(&(*batch)->pending);
+    free(*batch);
+    *batch = NULL;
+}
+
+
+void batch_command_begin(batch_t* batch, const char* line) {
+    if (batch->nb_commands == batch->capacity) {
+        batch->capacity *= 2;
+        batch->commands = realloc(batch->commands, batch->capacity * sizeof(batch_command_t));
+    }
+
+    batch_command_t* command = batch->commands + batch->nb_commands;
+    set_string(&command->text, line);
+    command->answer = 0;
+    command->duration = -1;
+    command->failed = 0;
+    command->next = BATCH_NO_COMMAND;
+    clock_gettime(CLOCK_MONOTONIC, &command->sent);
+
+    ++batch->nb_commands;
+    batch->last_activity = command->sent;
+}
+
+
+void batch_expect_answer(batch_t* batch, opcode_t answer, const char* filename) {
+    size_t index = batch->nb_commands - 1;
+    batch->commands[index].answer = answer;
+    ++batch->nb_pending;
+
+    char key[HASHMAP_MAX_KEY_SIZE];
+    size_t key_length = get_queue_key(key, answer, filename);
+
+    batch_queue_t* queue = hashmap_get(batch->pending, key, key_length);
+    if (queue == NULL) {
+        queue = malloc(sizeof(batch_queue_t));
+        queue->first = index;
+        hashmap_put(batch->pending, key, key_length, queue);
+    } else {
+        batch->commands[queue->last].next = index;
+    }
+
+    queue->last = index;
+}
+
+
+void batch_command_end(batch_t* batch, int failed) {
+    batch_command_t* command = batch->commands + batch->nb_commands - 1;
+    command->failed = failed;
+
+    /* Commands handled locally are over as soon as they are handled. */
+    if (command->answer == 0) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        command->duration = get_elapsed_us(&command->sent, &now);
+    }
+}
+
+
+void batch_answer(batch_t* batch, opcode_t answer, const char* filename, int failed) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    batch->last_activity = now;
+
+    char key[HASHMAP_MAX_KEY_SIZE];
+    size_t key_length = get_queue_key(key, answer, filename);
+
+    /* Only the first answer completes a command, the others are late hits. */
+    batch_queue_t* queue = hashmap_get(batch->pending, key, key_length);
+    if (queue == NULL) {
+        return;
+    }
+
+    batch_command_t* command = batch->commands + queue->first;
+    command->duration = get_elapsed_us(&command->sent, &now);
+    command->failed = failed;
+    --batch->nb_pending;
+
+    if (command->next == BATCH_NO_COMMAND) {
+        free(hashmap_remove(batch->pending, key, key_length));
+    } else {
+        queue->first = command->next;
+    }
+}
+
+
+int batch_is_over(const batch_t* batch) {
+    return batch->input_closed == 1 && batch->nb_pending == 0;
+}
+
+
+int batch_poll_timeout(const batch_t* batch) {
+    if (batch->input_closed == 0) {
+        return -1;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    long remaining = BATCH_ANSWER_TIMEOUT - get_elapsed_us(&batch->last_activity, &now) / 1000;
+    return remaining < 0 ? 0 : (int)remaining;
+}
+
+
+int batch_report(const batch_t* batch) {
+    int nb_failed = 0;
+    long total = 0;
+
+    printf("\n%-6s %-12s %-8s %s\n", "#", "ms", "statut", "commande");
+    for (size_t i = 0; i < batch->nb_commands; i++) {
+        const batch_command_t* command = batch->commands + i;
+
+        const char* status = "ok";
+        if (command->duration == -1) {
+            status = "timeout";
+            ++nb_failed;
+        } else if (command->failed == 1) {
+            status = "erreur";
+            ++nb_failed;
+        }
+
+        if (command->duration == -1) {
+            printf("%-6zu %-12s %-8s %s\n", i + 1, "-", status, command->text);
+        } else {
+            total += command->duration;
+            printf("%-6zu %-12.3f %-8s %s\n", i + 1, command->duration / 1000.0,
+                   status, command->text);
+        }
+    }
+
+    size_t nb_answered = batch->nb_commands - batch->nb_pending;
+    printf("\n%zu commande(s), %zu terminée(s), %d en échec", batch->nb_commands,
+           nb_answered, nb_failed);
+    if (nb_answered != 0) {
+        printf(", durée moyenne %.3f ms", total / 1000.0 / nb_answered);
+    }
+    printf(".\n");
+
+    return nb_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+
+size_t get_queue_key(char* dest, opcode_t answer, const char* filename) {
+    size_t length = strlen(filename);
+    dest[0] = answer;
+    memcpy(dest + 1, filename, length);
+    return length + 1;
+}
+
+
+long get_elapsed_us(const struct timespec* begin, const struct timespec* end) {
+    return (end->tv_sec - begin->tv_sec) * 1000000L +
+           (end->tv_nsec - begin->tv_nsec) / 1000L;
+}
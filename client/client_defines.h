@@ -1,11 +1,42 @@
 #ifndef CLIENT_DEFINES_H
 #define CLIENT_DEFINES_H
 
+#include "common.h"
+
+
+/*
+ * Size of the buffer holding what the user typed. A command longer than this
+ * is ignored.
+ */
+#define CLIENT_INPUT_SIZE 1024
+
+
+/*
+ * In batch mode, once every command was sent, time (milliseconds) we wait for
+ * an answer before giving up on the commands that were not answered.
+ */
+#define BATCH_ANSWER_TIMEOUT 10000
+
+
+/*
+ * Time (milliseconds) after which the client tries again to send the commands
+ * it holds back while the servent does not keep up (see handle_lines).
+ */
+#define CLIENT_SEND_RETRY 10
+
+
+/*
+ * Time (milliseconds) during which a machine found by a search is considered
+ * to still have the file. Past this delay, the machine is forgotten, unless a
+ * new search found it meanwhile.
+ */
+#define LOOKUP_CACHE_TTL (5 * 60 * IN_MILLISECONDS)
+
 
 /*
- * Timeout when we check if the local servent sent us something. Time is in
- * milliseconds.
+ * Memory (bytes) the records of the files found by the searches can use. Once
+ * it is reached, the least recently used files are forgotten.
  */
-#define SERVENT_AWAIT_TIMEOUT 10
+#define LOOKUP_CACHE_MAX_MEMORY (1024 * 1024)
 
 #endif /* CLIENT_DEFINES_H */
@@ -4,113 +4,100 @@
 
 #include "client_internal.h"
 #include "log.h"
+#include "packet.h"
+#include "packets_decode.h"
 #include "packets_defines.h"
 #include "util.h"
 
 
-void handle_download(client_t* client) {
+int handle_download(client_t* client) {
     char* ip = strtok(NULL, " ");
     if (ip == NULL) {
         printf("Invalid command\n");
-        return;
+        return -1;
     }
 
     char* port = strtok(NULL, " ");
     if (port == NULL) {
         printf("Invalid command\n");
-        return;
+        return -1;
     }
 
     char* file = strtok(NULL, "\0");
     if (file == NULL) {
         printf("Invalid command\n");
-        return;
+        return -1;
     }
 
-    applog(LOG_LEVEL_INFO, "Downloading file %s from %s:%s\n", file, ip, port);
-
-    void* data = malloc(PKT_ID_SIZE + sizeof(uint8_t) + strlen(ip) +
-                        sizeof(uint8_t) + strlen(port) +
-                        sizeof(uint8_t) + strlen(file));
-    char* ptr = data;
-
-    opcode_t opcode = CMSG_INT_DOWNLOAD;
-    write_to_packet(&ptr, &opcode, PKT_ID_SIZE);
-
-    uint8_t ip_length = strlen(ip);
-    write_to_packet(&ptr, &ip_length, sizeof(uint8_t));
-    write_to_packet(&ptr, ip, ip_length);
+    applog(LOG_LEVEL_INFO, "[User] Downloading file %s from %s:%s\n", file, ip, port);
 
-    uint8_t port_length = strlen(port);
-    write_to_packet(&ptr, &port_length, sizeof(uint8_t));
-    write_to_packet(&ptr, port, port_length);
+    packet_t* packet = packet_begin(CMSG_INT_DOWNLOAD);
+    packet_append_string(packet, ip);
+    packet_append_string(packet, port);
+    packet_append_string(packet, file);
+    local_link_send(&client->server, packet);
 
-    uint8_t filename_length = strlen(file);
-    write_to_packet(&ptr, &filename_length, sizeof(uint8_t));
-    write_to_packet(&ptr, file, filename_length);
-
-    write_to_fd(client->server_socket, data, (intptr_t)ptr - (intptr_t)data);
+    if (client->batch != NULL) {
+        batch_expect_answer(client->batch, SMSG_INT_DOWNLOAD, file);
+    }
 
-    free(data);
+    packet_release(packet);
+    return 0;
 }
 
 
-void handle_download_answer(client_t* client) {
+void handle_download_answer(client_t* client, packet_reader_t* reader) {
     uint8_t code;
-    read_from_fd(client->server_socket, &code, sizeof(uint8_t));
+    if (packet_read_u8(reader, &code) == -1) {
+        return;
+    }
 
     if (code != ANSWER_CODE_REMOTE_FOUND) {
-        uint8_t ip_length, port_length, filename_length;
-        read_from_fd(client->server_socket, &ip_length, sizeof(uint8_t));
-
-        char* ip = malloc(ip_length + 1);
-        read_from_fd(client->server_socket, ip, ip_length);
-
-        read_from_fd(client->server_socket, &port_length, sizeof(uint8_t));
-
-        char* port = malloc(port_length + 1);
-        read_from_fd(client->server_socket, port, port_length);
-
-        read_from_fd(client->server_socket, &filename_length, sizeof(uint8_t));
+        download_target_t target;
+        if (decode_download_target(reader, &target) == -1) {
+            return;
+        }
 
-        char* filename = malloc(filename_length + 1);
-        read_from_fd(client->server_socket, filename, filename_length);
+        if (client->batch != NULL) {
+            char name[UINT8_MAX + 1];
+            string_view_to_cstring(&target.filename, name);
+            batch_answer(client->batch, SMSG_INT_DOWNLOAD, name, 1);
+        }
 
-        ip[ip_length] = '\0';
-        port[port_length] = '\0';
-        filename[filename_length] = '\0';
+        const string_view_t* ip = &target.ip;
+        const string_view_t* port = &target.port;
+        const string_view_t* filename = &target.filename;
 
         switch (code) {
         case ANSWER_CODE_LOCAL:
-            printf("Le fichier %s se trouve déjà sur la machine locale.\n", filename);
+            printf("Le fichier %.*s se trouve déjà sur la machine locale.\n",
+                   filename->length, filename->data);
             break;
 
         case ANSWER_CODE_REMOTE_NOT_FOUND:
-            printf("La machine %s:%s ne possède pas le fichier %s.\n", ip, port, filename);
+            printf("La machine %.*s:%.*s ne possède pas le fichier %.*s.\n",
+                   ip->length, ip->data, port->length, port->data,
+                   filename->length, filename->data);
             break;
 
         case ANSWER_CODE_REMOTE_OFFLINE:
-            printf("La machine %s:%s est hors ligne.\n", ip, port);
+            printf("La machine %.*s:%.*s est hors ligne.\n",
+                   ip->length, ip->data, port->length, port->data);
             break;
 
         default:
             break;
         }
-
-        free(ip);
-        free(port);
-        free(filename);
     } else {
-        uint8_t filename_length;
-        read_from_fd(client->server_socket, &filename_length, sizeof(uint8_t));
-
-        char* filename = malloc(filename_length + 1);
-        read_from_fd(client->server_socket, filename, filename_length);
-        filename[filename_length] = '\0';
-
-        printf("Le fichier %s a été téléchargé.\n", filename);
-
-        free(filename);
+        string_view_t filename;
+        if (packet_read_view(reader, &filename) == 0) {
+            printf("Le fichier %.*s a été téléchargé.\n", filename.length, filename.data);
+
+            if (client->batch != NULL) {
+                char name[UINT8_MAX + 1];
+                string_view_to_cstring(&filename, name);
+                batch_answer(client->batch, SMSG_INT_DOWNLOAD, name, 0);
+            }
+        }
     }
-
 }
@@ -2,15 +2,44 @@
 #define CLIENT_INTERNAL_H
 
 
+#include <stddef.h>
+#include <time.h>
+
+#include "channel.h"
+#include "client_defines.h"
+#include "hashmap.h"
 #include "list.h"
+#include "packets_defines.h"
+
+
+typedef struct batch_s batch_t;
 
 
 /* The structure to represent the client. */
 typedef struct client_s {
-    /* Socket to communicate with the associated server. */
-    int server_socket;
-    /* List of files and the machines that possess them. */
-    list_t* machines_by_files;
+    /* Link to communicate with the associated server. */
+    local_link_t server;
+    /*
+     * Cache of the files and the machines that possess them, indexed by
+     * filename. The records are also linked in lookups_lru, from the least
+     * recently used to the most recently used, and use lookups_memory bytes.
+     */
+    hashmap_t* machines_by_files;
+    intrusive_list_t lookups_lru;
+    size_t lookups_memory;
+    /*
+     * What the user typed and was not yet handled (incomplete line, or lines
+     * held back while the servent does not keep up).
+     */
+    char input[CLIENT_INPUT_SIZE];
+    /* Number of bytes inside input. */
+    size_t input_length;
+    /* Where the commands are read from. */
+    int input_fd;
+    /* 1 once the end of the input is read, input may still hold lines. */
+    int input_over;
+    /* State of the batch mode, NULL when the client is interactive. */
+    batch_t* batch;
 } client_t;
 
 typedef struct machine_s {
@@ -18,6 +47,8 @@ typedef struct machine_s {
     const char* ip;
     /* Port to contact the machine. */
     const char* port;
+    /* Last time a search found the machine. */
+    struct timespec refreshed;
 } machine_t;
 
 
@@ -25,8 +56,12 @@ typedef struct machine_s {
 typedef struct file_lookup_s {
     /* Name of the file. */
     const char* filename;
-    /* List of machines that have the file. */
-    list_t* machines;
+    /* Machines that have the file, indexed by IP and port. */
+    hashmap_t* machines;
+    /* Link in client_t.lookups_lru. */
+    list_node_t lru_node;
+    /* Bytes used by the record and its machines. */
+    size_t memory;
 } file_lookup_t;
 
 
@@ -36,28 +71,35 @@ typedef struct file_lookup_s {
 
 
 /*
- * Handle the search of a file.
+ * Handle the search of a file. Return -1 if the command is malformed, 0
+ * otherwise.
  */
-void handle_search(client_t* client);
+int handle_search(client_t* client);
 
 
 /*
  * Handle the response (SMSG_INT_SEARCH) to a request. After reading the packet,
  * we create a new record or add the infos to an existing one (this prevents
- * machines duplication).
+ * machines duplication), and display the machines found.
  */
-void handle_search_answer(client_t* client);
+void handle_search_answer(client_t* client, packet_reader_t* reader);
 
 
 /*******************************************************************************
  * File lookup
+ *
+ * The answers to the searches are kept in a bounded cache. A machine is only
+ * kept LOOKUP_CACHE_TTL milliseconds after the last search that found it, and
+ * the least recently used files are evicted once the records use more than
+ * LOOKUP_CACHE_MAX_MEMORY bytes.
  */
 
 
 /*
  * Search if the client has already a list of machines for the given file. Return
  * 0 if there is no record, 1 if there is one. If there is one, *dest is set to
- * point to the record.
+ * point to the record, which becomes the most recently used one and loses its
+ * expired machines. A record with no machine left is removed.
  *
  * There is no need to malloc the underlying pointer, the function will set it.
  * Also, there is no need to free the underlying pointer, no memory allocation
@@ -69,27 +111,50 @@ int has_file_record(client_t* client, const char* filename, file_lookup_t** dest
 /*
  * Check if record contains a record (ahah, record in record) for the given
  * machine. If there is a record, the function returns 1, otherwise it
- * returns 1.
+ * returns 0.
  */
 int has_file_machine_record(const file_lookup_t* record, const char* ip, const char* port);
 
 
 /*
  * Display the informations about the machine that possess a given file.
+ * Return -1 if the command is malformed, 0 otherwise.
  */
-void handle_lookup(client_t* client);
+int handle_lookup(client_t* client);
 
 
 /*
- * Create a copy-in-heap of machine and return it.
+ * Create an empty record for filename and add it to the records of the client.
+ * filename is copied.
  */
-LIST_CREATE_FN void* create_machine(void* machine);
+file_lookup_t* add_file_record(client_t* client, const char* filename);
 
 
 /*
- * Create a copy-in-heap of lookup and return it.
+ * Add the machine ip:port to record, or refresh it if it is already there. ip
+ * and port are copied. Adding a machine may evict the least recently used
+ * records, but never record itself.
  */
-LIST_CREATE_FN void* create_lookup(void* lookup);
+void add_file_machine_record(client_t* client, file_lookup_t* record,
+                             const char* ip, const char* port);
+
+
+/*
+ * Remove record from the records of the client and free it.
+ */
+void remove_file_record(client_t* client, file_lookup_t* record);
+
+
+/*
+ * Free a machine_t and its strings (destroying function).
+ */
+HASHMAP_DESTROY_FN void destroy_machine(void* machine);
+
+
+/*
+ * Free a file_lookup_t and the machines it holds (destroying function).
+ */
+HASHMAP_DESTROY_FN void destroy_lookup(void* lookup);
 
 
 /*******************************************************************************
@@ -98,14 +163,114 @@ LIST_CREATE_FN void* create_lookup(void* lookup);
 
 
 /*
- * Handle the download of a file.
+ * Handle the download of a file. Return -1 if the command is malformed, 0
+ * otherwise.
  */
-void handle_download(client_t* client);
+int handle_download(client_t* client);
 
 
 /*
  * Read the answer to print something indicating the download is over.
  */
-void handle_download_answer(client_t* client);
+void handle_download_answer(client_t* client, packet_reader_t* reader);
+
+/*******************************************************************************
+ * Batch mode
+ *
+ * In batch mode, the commands are read from a file (or a pipe) and sent
+ * without waiting for the answers. Each command is timed from the moment it is
+ * sent to the moment its answer arrives, and a report is displayed once every
+ * command is answered, or once no answer arrived for BATCH_ANSWER_TIMEOUT
+ * milliseconds.
+ */
+
+
+/* Marks the end of a queue of commands. */
+#define BATCH_NO_COMMAND ((size_t)-1)
+
+
+typedef struct batch_command_s {
+    /* The command, as read. */
+    char* text;
+    /* Opcode of the answer we wait for, 0 if the command is handled locally. */
+    opcode_t answer;
+    /* Time at which the command was sent (CLOCK_MONOTONIC). */
+    struct timespec sent;
+    /* Time (microseconds) it took to get the answer, -1 if not answered yet. */
+    long duration;
+    /*
+     * 1 if the command is unknown or malformed, or if its answer reports an
+     * error (a failed download, or a search without any hit).
+     */
+    int failed;
+    /* Index of the next command waiting for the same answer. */
+    size_t next;
+} batch_command_t;
+
+
+struct batch_s {
+    /* Every command read, in order. */
+    batch_command_t* commands;
+    size_t nb_commands;
+    size_t capacity;
+    /* Number of commands waiting for their answer. */
+    size_t nb_pending;
+    /* Commands waiting for their answer, indexed by answer and filename. */
+    hashmap_t* pending;
+    /* 1 once every command was read. */
+    int input_closed;
+    /* Time of the last command sent or answer received (CLOCK_MONOTONIC). */
+    struct timespec last_activity;
+};
+
+
+batch_t* batch_create(void);
+void batch_destroy(batch_t** batch);
+
+
+/*
+ * Record a new command, read from line, before it is handled.
+ */
+void batch_command_begin(batch_t* batch, const char* line);
+
+
+/*
+ * Indicate that the command being handled was sent to the servent, and is
+ * over once answer about filename arrives.
+ */
+void batch_expect_answer(batch_t* batch, opcode_t answer, const char* filename);
+
+
+/*
+ * Indicate that the command being handled was handled. failed is 1 if it
+ * could not be, because it is unknown or malformed.
+ */
+void batch_command_end(batch_t* batch, int failed);
+
+
+/*
+ * Complete the oldest command waiting for answer about filename, if any.
+ */
+void batch_answer(batch_t* batch, opcode_t answer, const char* filename, int failed);
+
+
+/*
+ * Return 1 if every command was read and answered, 0 otherwise.
+ */
+int batch_is_over(const batch_t* batch);
+
+
+/*
+ * Return the time (milliseconds) to wait for the next answer before giving up,
+ * or -1 if the commands are still being read.
+ */
+int batch_poll_timeout(const batch_t* batch);
+
+
+/*
+ * Display the duration and status of every command. The function returns
+ * EXIT_SUCCESS if every command succeeded, EXIT_FAILURE otherwise.
+ */
+int batch_report(const batch_t* batch);
 
 #endif /* CLIENT_INTERNAL_H */
@@ -3,44 +3,172 @@
 #include <string.h>
 
 #include "client_internal.h"
-#include "list.h"
+#include "util.h"
+
+
+/*
+ * Return the number of bytes used by machine (with its key in the map of its
+ * record) or by record (without its machines). Only the allocations are
+ * counted, not the slots of the maps, so this is an estimate.
+ */
+static size_t get_machine_memory(const machine_t* machine);
+static size_t get_record_memory(const file_lookup_t* record);
+
+
+/*
+ * Remove from record the machines that were not refreshed for
+ * LOOKUP_CACHE_TTL milliseconds.
+ */
+static void expire_machines(client_t* client, file_lookup_t* record);
+
+
+/*
+ * Remove the least recently used records until the cache fits in
+ * LOOKUP_CACHE_MAX_MEMORY bytes. keep is never removed.
+ */
+static void evict_records(client_t* client, const file_lookup_t* keep);
+
+
+/******************************************************************************/
+
 
 int has_file_record(client_t* client, const char* filename, file_lookup_t** dest) {
-    cell_t* head = client->machines_by_files->head;
-    while (head != NULL) {
-        file_lookup_t* entry = (file_lookup_t*)head->data;
-        if (strcmp(entry->filename, filename) == 0) {
-            *dest = entry;
-            return 1;
-        }
+    file_lookup_t* entry = hashmap_get_string(client->machines_by_files, filename);
+    if (entry == NULL) {
+        return 0;
+    }
 
-        head = head->next;
+    expire_machines(client, entry);
+    if (entry->machines->size == 0) {
+        remove_file_record(client, entry);
+        return 0;
     }
 
-    return 0;
+    /* Most recently used records go at the end. */
+    intrusive_list_remove(&client->lookups_lru, &entry->lru_node);
+    intrusive_list_push_back(&client->lookups_lru, &entry->lru_node);
+
+    *dest = entry;
+    return 1;
 }
 
 
 int has_file_machine_record(const file_lookup_t* record, const char* ip, const char* port) {
-    cell_t* head = record->machines->head;
-    while (head != NULL) {
-        machine_t* entry = (machine_t*)head->data;
-        if (strcmp(entry->ip, ip) == 0 && strcmp(entry->port, port) == 0) {
-            return 1;
+    char key[HASHMAP_MAX_KEY_SIZE];
+    size_t key_length = hashmap_compose_key(key, 2, ip, port);
+
+    return hashmap_get(record->machines, key, key_length) != NULL;
+}
+
+
+file_lookup_t* add_file_record(client_t* client, const char* filename) {
+    file_lookup_t* lookup = malloc(sizeof(file_lookup_t));
+    char* filename_copy;
+    set_string(&filename_copy, filename);
+    lookup->filename = filename_copy;
+    lookup->machines = hashmap_create(destroy_machine);
+    lookup->memory = get_record_memory(lookup);
+
+    hashmap_put(client->machines_by_files, filename, strlen(filename), lookup);
+    intrusive_list_push_back(&client->lookups_lru, &lookup->lru_node);
+    client->lookups_memory += lookup->memory;
+
+    evict_records(client, lookup);
+    return lookup;
+}
+
+
+void add_file_machine_record(client_t* client, file_lookup_t* record,
+                             const char* ip, const char* port) {
+    char key[HASHMAP_MAX_KEY_SIZE];
+    size_t key_length = hashmap_compose_key(key, 2, ip, port);
+
+    machine_t* machine = hashmap_get(record->machines, key, key_length);
+    if (machine != NULL) {
+        clock_gettime(CLOCK_REALTIME, &machine->refreshed);
+        return;
+    }
+
+    char* ip_copy, *port_copy;
+    set_string(&ip_copy, ip);
+    set_string(&port_copy, port);
+
+    machine = malloc(sizeof(machine_t));
+    machine->ip = ip_copy;
+    machine->port = port_copy;
+    clock_gettime(CLOCK_REALTIME, &machine->refreshed);
+
+    hashmap_put(record->machines, key, key_length, machine);
+
+    size_t memory = get_machine_memory(machine);
+    record->memory += memory;
+    client->lookups_memory += memory;
+
+    evict_records(client, record);
+}
+
+
+void remove_file_record(client_t* client, file_lookup_t* record) {
+    hashmap_remove(client->machines_by_files, record->filename, strlen(record->filename));
+    intrusive_list_remove(&client->lookups_lru, &record->lru_node);
+    client->lookups_memory -= record->memory;
+
+    destroy_lookup(record);
+}
+
+
+void expire_machines(client_t* client, file_lookup_t* record) {
+    size_t index = 0;
+    hashmap_entry_t* entry;
+    while (hashmap_next(record->machines, &index, &entry) == 1) {
+        machine_t* machine = (machine_t*)entry->value;
+        if (elapsed_time_since(&machine->refreshed) < LOOKUP_CACHE_TTL) {
+            continue;
         }
 
-        head = head->next;
+        size_t memory = get_machine_memory(machine);
+        record->memory -= memory;
+        client->lookups_memory -= memory;
+
+        hashmap_remove_at(record->machines, entry);
+        destroy_machine(machine);
     }
+}
 
-    return 0;
+
+void evict_records(client_t* client, const file_lookup_t* keep) {
+    while (client->lookups_memory > LOOKUP_CACHE_MAX_MEMORY) {
+        file_lookup_t* oldest = LIST_ENTRY(client->lookups_lru.head, file_lookup_t, lru_node);
+        if (oldest == keep) {
+            /* keep is the most recent record, nothing else is left. */
+            break;
+        }
+
+        remove_file_record(client, oldest);
+    }
+}
+
+
+size_t get_machine_memory(const machine_t* machine) {
+    size_t ip_length = strlen(machine->ip) + 1;
+    size_t port_length = strlen(machine->port) + 1;
+
+    /* The key is a copy of the IP and the port. */
+    return sizeof(machine_t) + 2 * (ip_length + port_length);
+}
+
+
+size_t get_record_memory(const file_lookup_t* record) {
+    /* The key is a copy of the filename. */
+    return sizeof(file_lookup_t) + sizeof(hashmap_t) + 2 * strlen(record->filename);
 }
 
 
-void handle_lookup(client_t* client) {
+int handle_lookup(client_t* client) {
     char* file = strtok(NULL, "\0");
     if (file == NULL) {
         printf("Commande invalide\n");
-        return;
+        return -1;
     }
 
     file_lookup_t* entry;
@@ -48,36 +176,34 @@ void handle_lookup(client_t* client) {
     if (has_file_record(client, file, &entry) == 1) {
         printf("Machines possédant le fichier %s:\n", file);
 
-        cell_t* head = entry->machines->head;
-        while (head != NULL) {
-            machine_t* machine = (machine_t*)head->data;
+        size_t index = 0;
+        hashmap_entry_t* machine_entry;
+        while (hashmap_next(entry->machines, &index, &machine_entry) == 1) {
+            machine_t* machine = (machine_t*)machine_entry->value;
             printf("\t%s:%s\n", machine->ip, machine->port);
-            head = head->next;
         }
         printf("\n");
     } else {
         printf("Aucune machine ne possède le fichier %s\n", file);
     }
+
+    return 0;
 }
 
 
-LIST_CREATE_FN void* create_machine(void* machine){
+HASHMAP_DESTROY_FN void destroy_machine(void* machine) {
     machine_t* _machine = (machine_t*)machine;
 
-    machine_t* new_machine = malloc(sizeof(machine_t));
-    new_machine->ip = _machine->ip;
-    new_machine->port = _machine->port;
-
-    return new_machine;
+    const_free(_machine->ip);
+    const_free(_machine->port);
+    free(_machine);
 }
 
 
-LIST_CREATE_FN void* create_lookup(void* lookup) {
+HASHMAP_DESTROY_FN void destroy_lookup(void* lookup) {
     file_lookup_t* _lookup = (file_lookup_t*)lookup;
 
-    file_lookup_t* new_lookup = malloc(sizeof(file_lookup_t));
-    new_lookup->filename = _lookup->filename;
-    new_lookup->machines = _lookup->machines;
-
-    return new_lookup;
+    const_free(_lookup->filename);
+    hashmap_destroy(&_lookup->machines);
+    free(_lookup);
 }
@@ -1,85 +1,70 @@
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "client_internal.h"
 #include "log.h"
+#include "packet.h"
+#include "packets_decode.h"
 #include "packets_defines.h"
 #include "util.h"
 
-void handle_search(client_t* client) {
+int handle_search(client_t* client) {
     const char* name = strtok(NULL, "\0");
     if (name == NULL) {
         log_to_file(LOG_LEVEL_ERROR, stdout, "Erreur dans la commande de recherche. "
                                              "Tapez \"help\" pour vérifier la syntaxe.\n");
-        return;
+        return -1;
     } else {
-        applog(LOG_LEVEL_INFO, "Recherche du fichier %s\n", name);
+        applog(LOG_LEVEL_INFO, "[User] Recherche du fichier %s\n", name);
     }
 
-    void* data = malloc(PKT_ID_SIZE + sizeof(uint8_t) + strlen(name));
-    char* ptr = data;
-
-    opcode_t opcode = CMSG_INT_SEARCH;
-    write_to_packet(&ptr, &opcode, PKT_ID_SIZE);
+    packet_t* packet = packet_begin(CMSG_INT_SEARCH);
+    packet_append_string(packet, name);
+    local_link_send(&client->server, packet);
 
-    uint8_t name_length = strlen(name);
-    write_to_packet(&ptr, &name_length, sizeof(uint8_t));
-    write_to_packet(&ptr, name, name_length);
-
-    write_to_fd(client->server_socket, data, (intptr_t)ptr - (intptr_t)data);
+    if (client->batch != NULL) {
+        batch_expect_answer(client->batch, SMSG_INT_SEARCH, name);
+    }
 
-    free(data);
+    packet_release(packet);
+    return 0;
 }
 
 
-void handle_search_answer(client_t* client) {
-    uint8_t filename_length;
-    read_from_fd(client->server_socket, &filename_length, sizeof(uint8_t));
+void handle_search_answer(client_t* client, packet_reader_t* reader) {
+    search_answer_t answer;
+    if (decode_search_answer(reader, &answer) == -1) {
+        return;
+    }
 
-    char* filename = malloc(filename_length + 1);
-    read_from_fd(client->server_socket, filename, filename_length);
-    filename[filename_length] = '\0';
+    char filename[UINT8_MAX + 1];
+    string_view_to_cstring(&answer.filename, filename);
 
+    if (client->batch != NULL) {
+        batch_answer(client->batch, SMSG_INT_SEARCH, filename, answer.nb_hits == 0);
+    }
 
+    if (answer.nb_hits == 0) {
+        printf("Aucune machine ne possède le fichier %s\n", filename);
+        return;
+    }
+
+    /* Only the records we keep are copied out of the frame. */
     file_lookup_t* lookup;
-    int has_file = 1;
     if (has_file_record(client, filename, &lookup) == 0) {
-        has_file = 0;
-        lookup = malloc(sizeof(file_lookup_t));
-        lookup->filename = filename;
-        lookup->machines = list_create(NULL, create_machine);
-        list_push_back_no_create(client->machines_by_files, lookup);
+        lookup = add_file_record(client, filename);
     }
 
-    uint8_t nb_ips;
-    read_from_fd(client->server_socket, &nb_ips, sizeof(uint8_t));
-
-    for (int i = 0; i < nb_ips; i++) {
-        uint8_t ip_length, port_length;
-        read_from_fd(client->server_socket, &ip_length, sizeof(uint8_t));
-
-        char* ip = malloc(ip_length + 1);
-        read_from_fd(client->server_socket, ip, ip_length);
-        ip[ip_length] = '\0';
-
-        read_from_fd(client->server_socket, &port_length, sizeof(uint8_t));
-
-        char* port = malloc(port_length + 1);
-        read_from_fd(client->server_socket, port, port_length);
-        port[port_length] = '\0';
-
-        machine_t* machine = malloc(sizeof(machine_t));
-        machine->ip = ip;
-        machine->port = port;
+    printf("Machines possédant le fichier %s:\n", filename);
 
-        if (has_file == 1) {
-            if (has_file_machine_record(lookup, ip, port) == 0) {
-                list_push_back_no_create(lookup->machines, machine);
-            }
-        } else {
+    for (int i = 0; i < answer.nb_hits; i++) {
+        char ip[UINT8_MAX + 1], port[UINT8_MAX + 1];
+        string_view_to_cstring(&answer.hits[i].ip, ip);
+        string_view_to_cstring(&answer.hits[i].port, port);
+        printf("\t%s:%s\n", ip, port);
 
-            list_push_back_no_create(lookup->machines, machine);
-        }
+        add_file_machine_record(client, lookup, ip, port);
     }
 }
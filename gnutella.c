@@ -0,0 +1,545 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "channel.h"
+#include "gnutella.h"
+#include "hashmap.h"
+#include "log.h"
+#include "metrics.h"
+#include "packet.h"
+#include "packets_decode.h"
+#include "packets_defines.h"
+#include "server.h"
+#include "trace.h"
+#include "util.h"
+
+
+/* A search waiting for answers. */
+typedef struct search_s {
+    char* filename;
+    gnutella_search_cb_t callback;
+    void* user_data;
+    /* When the search was sent. */
+    struct timespec started;
+    /* Next expired search, while expired searches are collected. */
+    struct search_s* next;
+} search_t;
+
+
+/* A download waiting for the answer of its current source. */
+typedef struct download_s {
+    char* filename;
+    gnutella_download_cb_t callback;
+    void* user_data;
+    gnutella_source_t* sources;
+    int nb_sources;
+    /* Index of the source being asked for the file. */
+    int current;
+} download_t;
+
+
+struct gnutella_s {
+    /* Parameters of the servent. */
+    int first_machine;
+    char* listen_port;
+    char* contact_ip;
+    char* contact_port;
+    char* metrics_file;
+    char* trace_file;
+    server_options_t options;
+    /* 1 if the handle writes the metrics or a trace (see exclusive_handle). */
+    int exclusive;
+
+    pthread_t thread;
+    packet_queue_t* to_server;
+    packet_queue_t* to_client;
+    /* Link used by the servent. */
+    local_link_t server_link;
+    /* Link used by the library. */
+    local_link_t link;
+    /* 1 once the servent stopped, or the handle is being shut down. */
+    int stopped;
+
+    /* Searches by filename. */
+    hashmap_t* searches;
+    /* Downloads by filename. */
+    hashmap_t* downloads;
+};
+
+
+/*
+ * Number of handles alive in the process. The metrics and the trace are
+ * process-wide, so a handle writing them must be the only one: exclusive_handle
+ * is 1 while such a handle is alive.
+ */
+static int nb_handles = 0;
+static int exclusive_handle = 0;
+static pthread_mutex_t handles_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/*
+ * Entry point of the thread of the servent (args is the gnutella_t).
+ */
+static void* servent_main(void* args);
+
+
+/*
+ * Send CMSG_INT_DOWNLOAD for the current source of download.
+ */
+static void send_download_request(gnutella_t* gnutella, download_t* download);
+
+
+/*
+ * Handle one packet sent by the servent. The function returns the number of
+ * callbacks called.
+ */
+static int handle_packet(gnutella_t* gnutella, opcode_t opcode, packet_reader_t* reader);
+static int handle_search_answer(gnutella_t* gnutella, packet_reader_t* reader);
+static int handle_download_answer(gnutella_t* gnutella, packet_reader_t* reader);
+
+
+/*
+ * End the searches that expired, or all of them if all is 1. The function
+ * returns the number of callbacks called.
+ */
+static int expire_searches(gnutella_t* gnutella, int all);
+
+
+static void destroy_search(search_t* search);
+static void destroy_download(download_t* download);
+
+
+/******************************************************************************/
+
+
+gnutella_t* gnutella_init(const gnutella_config_t* config) {
+    int exclusive = config->metrics_file != NULL || config->trace_file != NULL;
+    pthread_mutex_lock(&handles_lock);
+    if (exclusive_handle == 1 || (exclusive == 1 && nb_handles > 0)) {
+        pthread_mutex_unlock(&handles_lock);
+        applog(LOG_LEVEL_ERROR, "[Library] Les métriques et la capture sont "
+                                "communes au processus : un seul servent peut "
+                                "tourner avec elles.\n");
+        return NULL;
+    }
+
+    ++nb_handles;
+    exclusive_handle = exclusive;
+    pthread_mutex_unlock(&handles_lock);
+
+    gnutella_t* gnutella = malloc(sizeof(gnutella_t));
+    memset(gnutella, 0, sizeof(gnutella_t));
+    local_link_init(&gnutella->server_link);
+    local_link_init(&gnutella->link);
+
+    gnutella->first_machine = config->first_machine;
+    gnutella->exclusive = exclusive;
+    gnutella->options.search_ttl = config->search_ttl;
+    gnutella->options.max_neighbours = config->max_neighbours;
+    gnutella->options.workers = config->workers;
+    if (config->listen_port != NULL) {
+        set_string(&gnutella->listen_port, config->listen_port);
+    }
+    if (config->contact_ip != NULL) {
+        set_string(&gnutella->contact_ip, config->contact_ip);
+    }
+    if (config->contact_port != NULL) {
+        set_string(&gnutella->contact_port, config->contact_port);
+    }
+    if (config->metrics_file != NULL) {
+        set_string(&gnutella->metrics_file, config->metrics_file);
+    }
+    if (config->trace_file != NULL) {
+        set_string(&gnutella->trace_file, config->trace_file);
+    }
+
+    log_set_level(config->log_level);
+    if (log_start() == -1) {
+        applog(LOG_LEVEL_WARNING, "[Library] Impossible de démarrer le thread des logs, "
+                                  "écriture synchrone.\n");
+    }
+
+    gnutella->to_server = packet_queue_create();
+    gnutella->to_client = packet_queue_create();
+    if (gnutella->to_server == NULL || gnutella->to_client == NULL) {
+        applog(LOG_LEVEL_ERROR, "[Library] Impossible de créer les files de paquets.\n");
+        gnutella_shutdown(&gnutella);
+        return NULL;
+    }
+
+    local_link_from_queues(&gnutella->server_link, gnutella->to_server, gnutella->to_client);
+    local_link_from_queues(&gnutella->link, gnutella->to_client, gnutella->to_server);
+    gnutella->searches = hashmap_create(NULL);
+    gnutella->downloads = hashmap_create(NULL);
+
+    metrics_set_output(gnutella->metrics_file);
+    trace_set_output(gnutella->trace_file);
+    if (pthread_create(&gnutella->thread, NULL, servent_main, gnutella) != 0) {
+        applog(LOG_LEVEL_ERROR, "[Library] Erreur lors de la création du thread du "
+                                "servent.\n");
+        local_link_init(&gnutella->link);
+        gnutella_shutdown(&gnutella);
+        return NULL;
+    }
+
+    return gnutella;
+}
+
+
+void* servent_main(void* args) {
+    gnutella_t* gnutella = (gnutella_t*)args;
+
+    run_server(gnutella->first_machine, gnutella->listen_port, gnutella->contact_ip,
+               gnutella->contact_port, &gnutella->options, &gnutella->server_link);
+    return NULL;
+}
+
+
+int gnutella_search(gnutella_t* gnutella, const char* filename,
+                    gnutella_search_cb_t callback, void* user_data) {
+    size_t length = strlen(filename);
+    if (gnutella->stopped == 1 || length > UINT8_MAX ||
+        hashmap_get(gnutella->searches, filename, length) != NULL) {
+        return -1;
+    }
+
+    search_t* search = malloc(sizeof(search_t));
+    set_string(&search->filename, filename);
+    search->callback = callback;
+    search->user_data = user_data;
+    clock_gettime(CLOCK_REALTIME, &search->started);
+    search->next = NULL;
+    hashmap_put(gnutella->searches, filename, length, search);
+
+    packet_t* packet = packet_begin(CMSG_INT_SEARCH);
+    packet_append_string(packet, filename);
+    local_link_send(&gnutella->link, packet);
+    packet_release(packet);
+
+    return 0;
+}
+
+
+int gnutella_download(gnutella_t* gnutella, const char* filename,
+                      const gnutella_source_t* sources, int nb_sources,
+                      gnutella_download_cb_t callback, void* user_data) {
+    size_t length = strlen(filename);
+    if (gnutella->stopped == 1 || nb_sources <= 0 || length > UINT8_MAX ||
+        hashmap_get(gnutella->downloads, filename, length) != NULL) {
+        return -1;
+    }
+
+    download_t* download = malloc(sizeof(download_t));
+    set_string(&download->filename, filename);
+    download->callback = callback;
+    download->user_data = user_data;
+    download->sources = malloc(nb_sources * sizeof(gnutella_source_t));
+    for (int i = 0; i < nb_sources; i++) {
+        char* ip;
+        char* port;
+        set_string(&ip, sources[i].ip);
+        set_string(&port, sources[i].port);
+        download->sources[i].ip = ip;
+        download->sources[i].port = port;
+    }
+    download->nb_sources = nb_sources;
+    download->current = 0;
+    hashmap_put(gnutella->downloads, filename, length, download);
+
+    send_download_request(gnutella, download);
+    return 0;
+}
+
+
+void send_download_request(gnutella_t* gnutella, download_t* download) {
+    const gnutella_source_t* source = download->sources + download->current;
+
+    packet_t* packet = packet_begin(CMSG_INT_DOWNLOAD);
+    packet_append_string(packet, source->ip);
+    packet_append_string(packet, source->port);
+    packet_append_string(packet, download->filename);
+    local_link_send(&gnutella->link, packet);
+    packet_release(packet);
+
+    download->callback(download->user_data, GNUTELLA_DOWNLOAD_TRYING,
+                       download->filename, source);
+}
+
+
+int gnutella_fd(const gnutella_t* gnutella) {
+    return local_link_fd(&gnutella->link);
+}
+
+
+int gnutella_poll(gnutella_t* gnutella, int timeout) {
+    if (gnutella->stopped == 1) {
+        return -1;
+    }
+
+    /* Do not sleep past the next expiration. */
+    int next_expiration = gnutella_timeout(gnutella);
+    if (next_expiration != -1 && (timeout == -1 || next_expiration < timeout)) {
+        timeout = next_expiration;
+    }
+
+    struct pollfd poller;
+    poller.fd = gnutella_fd(gnutella);
+    poller.events = POLLIN;
+    if (poll(&poller, 1, timeout) == -1 && errno != EINTR) {
+        applog(LOG_LEVEL_ERROR, "[Library] Erreur durant poll() : %s.\n",
+               strerror(errno));
+    }
+
+    int nb_callbacks = 0;
+    opcode_t opcode;
+    packet_reader_t reader;
+    int res;
+    while ((res = local_link_receive(&gnutella->link, &reader, &opcode)) == 1) {
+        nb_callbacks += handle_packet(gnutella, opcode, &reader);
+        packet_release(reader.packet);
+    }
+
+    nb_callbacks += expire_searches(gnutella, 0);
+
+    if (res == -1) {
+        applog(LOG_LEVEL_ERROR, "[Library] Le servent s'est arrêté.\n");
+        gnutella->stopped = 1;
+        return -1;
+    }
+
+    return nb_callbacks;
+}
+
+
+int handle_packet(gnutella_t* gnutella, opcode_t opcode, packet_reader_t* reader) {
+    switch (opcode) {
+    case SMSG_INT_SEARCH:
+        return handle_search_answer(gnutella, reader);
+
+    case SMSG_INT_DOWNLOAD:
+        return handle_download_answer(gnutella, reader);
+
+    default:
+        return 0;
+    }
+}
+
+
+int handle_search_answer(gnutella_t* gnutella, packet_reader_t* reader) {
+    search_answer_t answer;
+    if (decode_search_answer(reader, &answer) == -1 || answer.nb_hits == 0) {
+        return 0;
+    }
+
+    search_t* search = hashmap_get(gnutella->searches, answer.filename.data,
+                                   answer.filename.length);
+    if (search == NULL) {
+        return 0;
+    }
+
+    /* The strings of the frame are not terminated, copy them. */
+    char ips[UINT8_MAX][UINT8_MAX + 1];
+    char ports[UINT8_MAX][UINT8_MAX + 1];
+    gnutella_source_t sources[UINT8_MAX];
+    for (int i = 0; i < answer.nb_hits; i++) {
+        string_view_to_cstring(&answer.hits[i].ip, ips[i]);
+        string_view_to_cstring(&answer.hits[i].port, ports[i]);
+        sources[i].ip = ips[i];
+        sources[i].port = ports[i];
+    }
+
+    search->callback(search->user_data, GNUTELLA_SEARCH_RESULTS, search->filename,
+                     sources, answer.nb_hits);
+    return 1;
+}
+
+
+int handle_download_answer(gnutella_t* gnutella, packet_reader_t* reader) {
+    uint8_t code;
+    string_view_t filename;
+    if (packet_read_u8(reader, &code) == -1) {
+        return 0;
+    }
+
+    if (code == ANSWER_CODE_REMOTE_FOUND) {
+        if (packet_read_view(reader, &filename) == -1) {
+            return 0;
+        }
+    } else {
+        download_target_t target;
+        if (decode_download_target(reader, &target) == -1) {
+            return 0;
+        }
+
+        filename = target.filename;
+    }
+
+    download_t* download = hashmap_get(gnutella->downloads, filename.data, filename.length);
+    if (download == NULL) {
+        return 0;
+    }
+
+    const gnutella_source_t* source = download->sources + download->current;
+    switch (code) {
+    case ANSWER_CODE_REMOTE_FOUND:
+    case ANSWER_CODE_LOCAL:
+        hashmap_remove(gnutella->downloads, filename.data, filename.length);
+        download->callback(download->user_data, GNUTELLA_DOWNLOAD_DONE, download->filename,
+                           code == ANSWER_CODE_LOCAL ? NULL : source);
+        destroy_download(download);
+        return 1;
+
+    default:
+        download->callback(download->user_data, GNUTELLA_DOWNLOAD_SOURCE_FAILED,
+                           download->filename, source);
+
+        if (++download->current < download->nb_sources) {
+            send_download_request(gnutella, download);
+            return 2;
+        }
+
+        hashmap_remove(gnutella->downloads, filename.data, filename.length);
+        download->callback(download->user_data, GNUTELLA_DOWNLOAD_FAILED,
+                           download->filename, NULL);
+        destroy_download(download);
+        return 2;
+    }
+}
+
+
+int expire_searches(gnutella_t* gnutella, int all) {
+    /*
+     * The callbacks may start new searches, so they are only called once the
+     * iteration over the map is over.
+     */
+    search_t* expired = NULL;
+    size_t index = 0;
+    hashmap_entry_t* entry;
+    while (hashmap_next(gnutella->searches, &index, &entry) == 1) {
+        search_t* search = entry->value;
+        if (all == 1 || elapsed_time_since(&search->started) >= GNUTELLA_SEARCH_LIFETIME) {
+            hashmap_remove_at(gnutella->searches, entry);
+            search->next = expired;
+            expired = search;
+        }
+    }
+
+    int nb_callbacks = 0;
+    while (expired != NULL) {
+        search_t* search = expired;
+        expired = search->next;
+
+        search->callback(search->user_data, GNUTELLA_SEARCH_DONE, search->filename, NULL, 0);
+        destroy_search(search);
+        ++nb_callbacks;
+    }
+
+    return nb_callbacks;
+}
+
+
+int gnutella_timeout(const gnutella_t* gnutella) {
+    int next = -1;
+    size_t index = 0;
+    hashmap_entry_t* entry;
+    while (hashmap_next(gnutella->searches, &index, &entry) == 1) {
+        const search_t* search = entry->value;
+        int remaining = GNUTELLA_SEARCH_LIFETIME - elapsed_time_since(&search->started);
+        if (remaining < 0) {
+            remaining = 0;
+        }
+
+        if (next == -1 || remaining < next) {
+            next = remaining;
+        }
+    }
+
+    return next;
+}
+
+
+void gnutella_shutdown(gnutella_t** gnutella) {
+    gnutella_t* g = *gnutella;
+    /* The last callbacks cannot start anything new. */
+    g->stopped = 1;
+
+    if (local_link_is_open(&g->link)) {
+        packet_t* packet = packet_begin(CMSG_INT_EXIT);
+        local_link_send(&g->link, packet);
+        packet_release(packet);
+
+        local_link_close(&g->link);
+        pthread_join(g->thread, NULL);
+    }
+
+    if (g->searches != NULL) {
+        expire_searches(g, 1);
+        hashmap_destroy(&g->searches);
+    }
+
+    if (g->downloads != NULL) {
+        size_t index = 0;
+        hashmap_entry_t* entry;
+        while (hashmap_next(g->downloads, &index, &entry) == 1) {
+            download_t* download = hashmap_remove_at(g->downloads, entry);
+            download->callback(download->user_data, GNUTELLA_DOWNLOAD_FAILED,
+                               download->filename, NULL);
+            destroy_download(download);
+        }
+        hashmap_destroy(&g->downloads);
+    }
+
+    if (g->to_server != NULL) {
+        packet_queue_destroy(&g->to_server);
+    }
+    if (g->to_client != NULL) {
+        packet_queue_destroy(&g->to_client);
+    }
+
+    if (g->metrics_file != NULL) {
+        metrics_set_output(NULL);
+    }
+    if (g->trace_file != NULL) {
+        trace_set_output(NULL);
+    }
+
+    pthread_mutex_lock(&handles_lock);
+    --nb_handles;
+    if (g->exclusive == 1) {
+        exclusive_handle = 0;
+    }
+    pthread_mutex_unlock(&handles_lock);
+
+    free_not_null(g->listen_port);
+    free_not_null(g->contact_ip);
+    free_not_null(g->contact_port);
+    free_not_null(g->metrics_file);
+    free_not_null(g->trace_file);
+    free(g);
+    *gnutella = NULL;
+}
+
+
+void destroy_search(search_t* search) {
+    free(search->filename);
+    free(search);
+}
+
+
+void destroy_download(download_t* download) {
+    for (int i = 0; i < download->nb_sources; i++) {
+        const_free(download->sources[i].ip);
+        const_free(download->sources[i].port);
+    }
+
+    free(download->sources);
+    free(download->filename);
+    free(download);
+}
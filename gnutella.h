@@ -0,0 +1,178 @@
+#ifndef GNUTELLA_H
+#define GNUTELLA_H
+
+#include "common.h"
+
+/*
+ * Library interface of the servent, built as libgnutella.a.
+ *
+ * gnutella_init starts a servent in a thread of the calling process, exactly
+ * like the threaded mode of the application. Searches and downloads are then
+ * issued through function calls instead of commands typed on the standard
+ * input, and their results come back as callbacks.
+ *
+ * Callbacks are never called from the thread of the servent: they are called
+ * by gnutella_poll, from the thread of the caller, which only has to poll
+ * gnutella_fd along with its own file descriptors (or call gnutella_poll with a
+ * timeout) to receive them.
+ *
+ * Every function of a given handle must be called from the same thread.
+ * Several handles can run in the same process, each with its own servent, but
+ * the metrics and the trace are process-wide: a handle writing them must be
+ * the only one.
+ */
+
+
+typedef struct gnutella_s gnutella_t;
+
+
+/*
+ * How to start the servent. The strings are copied by gnutella_init.
+ */
+typedef struct gnutella_config_s {
+    /* 1 if this machine is the first one of the network. */
+    int first_machine;
+    /* Port to listen on, NULL for the default one. */
+    const char* listen_port;
+    /* Contact point, ignored for the first machine. */
+    const char* contact_ip;
+    const char* contact_port;
+    /* File the metrics are written to every second (see metrics.h), or NULL. */
+    const char* metrics_file;
+    /* File the received frames are captured in (see trace.h), or NULL. */
+    const char* trace_file;
+    /*
+     * Minimum level of the log messages, 0 for all of them (see LOG_LEVEL_* in
+     * log.h). The messages are written by a background thread of the process.
+     */
+    int log_level;
+    /* TTL of the searches, 0 for the default one. */
+    int search_ttl;
+    /* Maximum number of neighbours, 0 for the default (and highest) one. */
+    int max_neighbours;
+    /*
+     * Number of threads looking up the files, 0 for the default one, negative
+     * to do it on the thread of the servent.
+     */
+    int workers;
+} gnutella_config_t;
+
+
+/*
+ * A machine that has a file.
+ */
+typedef struct gnutella_source_s {
+    const char* ip;
+    const char* port;
+} gnutella_source_t;
+
+
+/*
+ * Events of a search. The network never says when a search is over: answers
+ * are delivered as they arrive (GNUTELLA_SEARCH_RESULTS, possibly several
+ * times), until the search expires (GNUTELLA_SEARCH_DONE, always called once,
+ * with no source).
+ */
+typedef enum gnutella_search_event_e {
+    GNUTELLA_SEARCH_RESULTS,
+    GNUTELLA_SEARCH_DONE
+} gnutella_search_event_t;
+
+
+/* Time after which a search expires, in milliseconds. */
+#define GNUTELLA_SEARCH_LIFETIME 10000
+
+
+/*
+ * Called for each event of a search. sources (nb_sources elements) and the
+ * strings it points to are only valid during the call.
+ */
+typedef void (*gnutella_search_cb_t)(void* user_data, gnutella_search_event_t event,
+                                     const char* filename,
+                                     const gnutella_source_t* sources, int nb_sources);
+
+
+/*
+ * Events of a download. The sources are tried one after the other:
+ * GNUTELLA_DOWNLOAD_TRYING is reported when a source is asked for the file,
+ * and GNUTELLA_DOWNLOAD_SOURCE_FAILED when it could not provide it. The
+ * download ends with GNUTELLA_DOWNLOAD_DONE (the file is in the files
+ * directory) or GNUTELLA_DOWNLOAD_FAILED (no source provided the file).
+ */
+typedef enum gnutella_download_event_e {
+    GNUTELLA_DOWNLOAD_TRYING,
+    GNUTELLA_DOWNLOAD_SOURCE_FAILED,
+    GNUTELLA_DOWNLOAD_DONE,
+    GNUTELLA_DOWNLOAD_FAILED
+} gnutella_download_event_t;
+
+
+/*
+ * Called for each event of a download. source is the source concerned by the
+ * event (NULL for GNUTELLA_DOWNLOAD_FAILED, and for GNUTELLA_DOWNLOAD_DONE when
+ * the file was already there), only valid during the call.
+ */
+typedef void (*gnutella_download_cb_t)(void* user_data, gnutella_download_event_t event,
+                                       const char* filename,
+                                       const gnutella_source_t* source);
+
+
+/*
+ * Start a servent. The function returns NULL if the servent could not be
+ * started, or if the metrics or a trace are asked for while another handle is
+ * alive (or the other way around). If the servent stops by itself later on (it could not join the
+ * network for instance), gnutella_poll returns -1.
+ */
+gnutella_t* gnutella_init(const gnutella_config_t* config);
+
+
+/*
+ * Search filename accross the network. Return -1 if filename is too long or
+ * already being searched, 0 otherwise.
+ */
+ERROR_CODES_USUAL int gnutella_search(gnutella_t* gnutella, const char* filename,
+                                      gnutella_search_cb_t callback, void* user_data);
+
+
+/*
+ * Download filename from the first of the nb_sources sources able to provide
+ * it. Return -1 if there is no source, if filename is too long or already being
+ * downloaded, 0 otherwise.
+ */
+ERROR_CODES_USUAL int gnutella_download(gnutella_t* gnutella, const char* filename,
+                                        const gnutella_source_t* sources, int nb_sources,
+                                        gnutella_download_cb_t callback, void* user_data);
+
+
+/*
+ * Return the file descriptor that becomes readable (POLLIN) when gnutella_poll
+ * has callbacks to call.
+ */
+int gnutella_fd(const gnutella_t* gnutella);
+
+
+/*
+ * Return how long (in milliseconds) the caller can wait on gnutella_fd before
+ * calling gnutella_poll, so that the searches expire on time, or -1 if there is
+ * no limit.
+ */
+int gnutella_timeout(const gnutella_t* gnutella);
+
+
+/*
+ * Call the callbacks of the events that happened, waiting at most timeout
+ * milliseconds for the first one (-1 to wait forever, 0 not to wait). The
+ * function returns the number of callbacks called, or -1 if the servent
+ * stopped.
+ */
+int gnutella_poll(gnutella_t* gnutella, int timeout);
+
+
+/*
+ * Leave the network, stop the servent and free the handle. The searches and
+ * downloads still running end with GNUTELLA_SEARCH_DONE and
+ * GNUTELLA_DOWNLOAD_FAILED.
+ */
+void gnutella_shutdown(gnutella_t** gnutella);
+
+#endif /* GNUTELLA_H */
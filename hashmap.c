@@ -0,0 +1,250 @@
+#include <assert.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashmap.h"
+
+
+/* Capacity of a new map. */
+#define HASHMAP_INITIAL_CAPACITY 16
+
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+
+/*
+ * Marks a slot whose entry was removed: lookups must probe past it, insertions
+ * may reuse it.
+ */
+static char tombstone;
+
+
+/*
+ * FNV-1a hash of the length bytes of key.
+ */
+static uint64_t hash_key(const void* key, size_t length);
+
+
+/*
+ * Return the slot holding key, or NULL if key is not in the map.
+ */
+static hashmap_entry_t* find_entry(const hashmap_t* map, const void* key,
+                                   size_t key_length, uint64_t hash);
+
+
+/*
+ * Move every entry into a new array of capacity slots, dropping the tombstones.
+ */
+static void rehash(hashmap_t* map, size_t capacity);
+
+
+/******************************************************************************/
+
+
+hashmap_t* hashmap_create(destroy_fn destroy) {
+    hashmap_t* map = malloc(sizeof(hashmap_t));
+    map->capacity = HASHMAP_INITIAL_CAPACITY;
+    map->entries = calloc(map->capacity, sizeof(hashmap_entry_t));
+    map->size = 0;
+    map->nb_tombstones = 0;
+    map->destroy = destroy;
+    return map;
+}
+
+
+void* hashmap_get(const hashmap_t* map, const void* key, size_t key_length) {
+    hashmap_entry_t* entry = find_entry(map, key, key_length, hash_key(key, key_length));
+    return entry == NULL ? NULL : entry->value;
+}
+
+
+void* hashmap_get_string(const hashmap_t* map, const char* str) {
+    return hashmap_get(map, str, strlen(str));
+}
+
+
+void* hashmap_put(hashmap_t* map, const void* key, size_t key_length, void* value) {
+    uint64_t hash = hash_key(key, key_length);
+
+    hashmap_entry_t* entry = find_entry(map, key, key_length, hash);
+    if (entry != NULL) {
+        void* previous = entry->value;
+        entry->value = value;
+        return previous;
+    }
+
+    /* Keep at least one quarter of the slots free so that probing stays short. */
+    if ((map->size + map->nb_tombstones + 1) * 4 > map->capacity * 3) {
+        size_t capacity = map->capacity;
+        if ((map->size + 1) * 2 > capacity) {
+            capacity *= 2;
+        }
+
+        rehash(map, capacity);
+    }
+
+    size_t mask = map->capacity - 1;
+    size_t index = hash & mask;
+    while (map->entries[index].key != NULL && map->entries[index].key != &tombstone) {
+        index = (index + 1) & mask;
+    }
+
+    entry = map->entries + index;
+    if (entry->key == &tombstone) {
+        --map->nb_tombstones;
+    }
+
+    entry->hash = hash;
+    entry->key = malloc(key_length == 0 ? 1 : key_length);
+    memcpy(entry->key, key, key_length);
+    entry->key_length = key_length;
+    entry->value = value;
+    ++map->size;
+
+    return NULL;
+}
+
+
+void* hashmap_remove(hashmap_t* map, const void* key, size_t key_length) {
+    hashmap_entry_t* entry = find_entry(map, key, key_length, hash_key(key, key_length));
+    if (entry == NULL) {
+        return NULL;
+    }
+
+    return hashmap_remove_at(map, entry);
+}
+
+
+int hashmap_next(const hashmap_t* map, size_t* index, hashmap_entry_t** entry) {
+    while (*index < map->capacity) {
+        hashmap_entry_t* current = map->entries + *index;
+        ++*index;
+
+        if (current->key != NULL && current->key != &tombstone) {
+            *entry = current;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+void* hashmap_remove_at(hashmap_t* map, hashmap_entry_t* entry) {
+    assert(entry->key != NULL && entry->key != &tombstone);
+
+    void* value = entry->value;
+    free(entry->key);
+    entry->key = &tombstone;
+    entry->value = NULL;
+
+    --map->size;
+    ++map->nb_tombstones;
+    return value;
+}
+
+
+size_t hashmap_compose_key(char* dest, int nb_parts, ...) {
+    va_list parts;
+    va_start(parts, nb_parts);
+
+    size_t length = 0;
+    for (int i = 0; i < nb_parts; i++) {
+        const char* part = va_arg(parts, const char*);
+        size_t part_length = strlen(part) + 1;
+        assert(length + part_length <= HASHMAP_MAX_KEY_SIZE);
+
+        memcpy(dest + length, part, part_length);
+        length += part_length;
+    }
+
+    va_end(parts);
+    return length;
+}
+
+
+void hashmap_clear(hashmap_t* map) {
+    for (size_t i = 0; i < map->capacity; i++) {
+        hashmap_entry_t* entry = map->entries + i;
+        if (entry->key != NULL && entry->key != &tombstone) {
+            free(entry->key);
+            if (map->destroy != NULL) {
+                map->destroy(entry->value);
+            }
+        }
+
+        entry->key = NULL;
+        entry->value = NULL;
+    }
+
+    map->size = 0;
+    map->nb_tombstones = 0;
+}
+
+
+void hashmap_destroy(hashmap_t** map) {
+    hashmap_clear(*map);
+    free((*map)->entries);
+    free(*map);
+    *map = NULL;
+}
+
+
+uint64_t hash_key(const void* key, size_t length) {
+    const unsigned char* bytes = key;
+    uint64_t hash = FNV_OFFSET_BASIS;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= bytes[i];
+        hash *= FNV_PRIME;
+    }
+
+    return hash;
+}
+
+
+hashmap_entry_t* find_entry(const hashmap_t* map, const void* key,
+                            size_t key_length, uint64_t hash) {
+    size_t mask = map->capacity - 1;
+    size_t index = hash & mask;
+
+    /* There is always at least one empty slot, so the probing ends. */
+    while (map->entries[index].key != NULL) {
+        hashmap_entry_t* entry = map->entries + index;
+        if (entry->key != &tombstone && entry->hash == hash &&
+            entry->key_length == key_length && memcmp(entry->key, key, key_length) == 0) {
+            return entry;
+        }
+
+        index = (index + 1) & mask;
+    }
+
+    return NULL;
+}
+
+
+void rehash(hashmap_t* map, size_t capacity) {
+    hashmap_entry_t* entries = map->entries;
+    size_t old_capacity = map->capacity;
+
+    map->entries = calloc(capacity, sizeof(hashmap_entry_t));
+    map->capacity = capacity;
+    map->nb_tombstones = 0;
+
+    size_t mask = capacity - 1;
+    for (size_t i = 0; i < old_capacity; i++) {
+        hashmap_entry_t* entry = entries + i;
+        if (entry->key == NULL || entry->key == &tombstone) {
+            continue;
+        }
+
+        size_t index = entry->hash & mask;
+        while (map->entries[index].key != NULL) {
+            index = (index + 1) & mask;
+        }
+
+        map->entries[index] = *entry;
+    }
+
+    free(entries);
+}
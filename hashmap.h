@@ -0,0 +1,115 @@
+#ifndef HASHMAP_H
+#define HASHMAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/*
+ * Hash map with byte string keys, using open addressing (linear probing) and
+ * FNV-1a. Keys are copied inside the map, values are only referenced. The map
+ * doubles its capacity when it is three quarters full, so lookups stay in
+ * constant time whatever the number of entries.
+ *
+ * Strings are used as keys without their trailing '\0'. Keys made of several
+ * strings (an IP and a port for instance) are built by hashmap_compose_key.
+ */
+
+
+typedef void(*destroy_fn)(void* value);
+
+
+/*
+ * Dummy macro to identify that a function is used as a destroy_fn inside a map.
+ */
+#define HASHMAP_DESTROY_FN
+
+
+/* Maximum size of a key built by hashmap_compose_key. */
+#define HASHMAP_MAX_KEY_SIZE 1024
+
+
+typedef struct hashmap_entry_s {
+    /* Hash of the key. */
+    uint64_t hash;
+    /* Copy of the key, NULL if the slot is empty. */
+    char* key;
+    size_t key_length;
+    void* value;
+} hashmap_entry_t;
+
+
+typedef struct hashmap_s {
+    /* Slots, capacity is always a power of two. */
+    hashmap_entry_t* entries;
+    size_t capacity;
+    /* Number of entries. */
+    size_t size;
+    /* Number of slots whose entry has been removed. */
+    size_t nb_tombstones;
+    /* Function called on the values still present when the map is cleared. */
+    destroy_fn destroy;
+} hashmap_t;
+
+
+/*
+ * Create an empty map. If destroy is not NULL, it is called on every value
+ * still inside the map when it is cleared or destroyed.
+ */
+hashmap_t* hashmap_create(destroy_fn destroy);
+
+
+/*
+ * Return the value associated with key, or NULL if there is none.
+ */
+void* hashmap_get(const hashmap_t* map, const void* key, size_t key_length);
+
+
+/*
+ * Same as hashmap_get, the key being the nul-terminated string str.
+ */
+void* hashmap_get_string(const hashmap_t* map, const char* str);
+
+
+/*
+ * Associate value with key. If key was already present, its previous value is
+ * returned (and is not destroyed), otherwise NULL is returned.
+ */
+void* hashmap_put(hashmap_t* map, const void* key, size_t key_length, void* value);
+
+
+/*
+ * Remove key from the map and return its value (which is not destroyed), or
+ * NULL if key was not present.
+ */
+void* hashmap_remove(hashmap_t* map, const void* key, size_t key_length);
+
+
+/*
+ * Iterate over the entries of the map. *index must be set to 0 before the first
+ * call. Return 1 and store the next entry in *entry, or return 0 once every
+ * entry has been visited. The map must not be modified during the iteration,
+ * except through hashmap_remove_at on the current entry.
+ */
+int hashmap_next(const hashmap_t* map, size_t* index, hashmap_entry_t** entry);
+
+
+/*
+ * Remove the entry returned by the last call to hashmap_next and return its
+ * value (which is not destroyed).
+ */
+void* hashmap_remove_at(hashmap_t* map, hashmap_entry_t* entry);
+
+
+/*
+ * Concatenate the nb_parts nul-terminated strings passed after nb_parts into
+ * dest, each of them followed by its '\0', and return the length of the
+ * result. dest must be at least HASHMAP_MAX_KEY_SIZE bytes long.
+ */
+size_t hashmap_compose_key(char* dest, int nb_parts, ...);
+
+
+void hashmap_clear(hashmap_t* map);
+void hashmap_destroy(hashmap_t** map);
+
+#endif /* HASHMAP_H */
@@ -1,11 +1,116 @@
 #include <stdlib.h>
 
+#include <pthread.h>
+
 #include "list.h"
 
+
+/* Cells that are not in use, linked through their next field. */
+static _Thread_local cell_t* free_cells;
+/* 1 once the free cells of the thread are registered to be handed over. */
+static _Thread_local int cells_registered;
+
+/*
+ * Free cells left by the threads that exited. A cell may belong to a list of
+ * another thread when its thread exits, so slabs cannot be given back to the
+ * system: their free cells are put there instead, and reused by the next
+ * thread that runs out of cells.
+ */
+static cell_t* orphan_cells;
+static pthread_mutex_t orphan_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_once_t cells_once = PTHREAD_ONCE_INIT;
+static pthread_key_t cells_key;
+
 static int dummy_compare(void* a, void* b) {
     return a == b;
 }
 
+
+/*
+ * Destructor of cells_key: hand the free cells of the exiting thread over to
+ * orphan_cells.
+ */
+static void release_free_cells(void* unused) {
+    (void)unused;
+
+    cells_registered = 0;
+    if (free_cells == NULL) {
+        return;
+    }
+
+    cell_t* last = free_cells;
+    while (last->next != NULL) {
+        last = last->next;
+    }
+
+    pthread_mutex_lock(&orphan_lock);
+    last->next = orphan_cells;
+    orphan_cells = free_cells;
+    pthread_mutex_unlock(&orphan_lock);
+    free_cells = NULL;
+}
+
+
+static void create_cells_key(void) {
+    pthread_key_create(&cells_key, release_free_cells);
+}
+
+
+/*
+ * Make sure the free cells of the calling thread are handed over when it
+ * exits.
+ */
+static void register_free_cells(void) {
+    if (cells_registered == 1) {
+        return;
+    }
+
+    pthread_once(&cells_once, create_cells_key);
+    pthread_setspecific(cells_key, &cells_registered);
+    cells_registered = 1;
+}
+
+
+/*
+ * Take a cell from the free list. If it is empty, take the cells left by the
+ * threads that exited, or allocate a new slab if there are none.
+ */
+static cell_t* acquire_cell(void) {
+    if (free_cells == NULL) {
+        register_free_cells();
+        pthread_mutex_lock(&orphan_lock);
+        free_cells = orphan_cells;
+        orphan_cells = NULL;
+        pthread_mutex_unlock(&orphan_lock);
+    }
+
+    if (free_cells == NULL) {
+        cell_t* slab = malloc(LIST_CELLS_PER_SLAB * sizeof(cell_t));
+        for (int i = 0; i < LIST_CELLS_PER_SLAB - 1; i++) {
+            slab[i].next = slab + i + 1;
+        }
+        slab[LIST_CELLS_PER_SLAB - 1].next = NULL;
+        free_cells = slab;
+    }
+
+    cell_t* cell = free_cells;
+    free_cells = cell->next;
+    return cell;
+}
+
+
+/*
+ * Put a cell back inside the free list. Slabs are never given back to the
+ * system: the lists of the server only grow up to their usual size.
+ */
+static void give_back_cell(cell_t* cell) {
+    register_free_cells();
+    cell->next = free_cells;
+    free_cells = cell;
+}
+
+
 list_t* list_create(compare_fn compare, create_fn create) {
     list_t* list = malloc(sizeof(list_t));
     if (compare != NULL) {
@@ -15,6 +120,8 @@ list_t* list_create(compare_fn compare, create_fn create) {
     }
     list->create = create;
     list->head = NULL;
+    list->tail = NULL;
+    list->length = 0;
     return list;
 }
 
@@ -25,69 +132,57 @@ void list_push_back(list_t* list, void* value) {
 
 
 void list_push_back_no_create(list_t *list, void* data) {
-    cell_t* head = list->head;
-    cell_t* prev = NULL;
+    cell_t* cell = acquire_cell();
+    cell->data = data;
+    cell->next = NULL;
 
-    while (head != NULL) {
-        prev = head;
-        head = head->next;
-    }
-
-    if (prev == NULL) {
-        list->head = malloc(sizeof(cell_t));
-        list->head->data = data;
-        list->head->next = NULL;
+    if (list->tail == NULL) {
+        list->head = cell;
     } else {
-        prev->next = malloc(sizeof(cell_t));
-        prev->next->data = data;
-        prev->next->next = NULL;
+        list->tail->next = cell;
     }
+
+    list->tail = cell;
+    ++list->length;
 }
 
 
 void list_pop(list_t* list, void* data, int once) {
     cell_t* prev = NULL;
-    for (cell_t* head = list->head; head != NULL; ) {
+    cell_t* head = list->head;
+    while (head != NULL) {
         if (list->compare(data, head->data) == 1) {
-            free(head->data);
-
-            if (prev == NULL) {
-                list->head = head->next;
-            } else {
-                prev->next = head->next;
-
-            }
-
-            cell_t* next = head->next;
-            free(head);
-            head = next;
+            list_pop_at(list, &prev, &head);
 
             if (once) {
                 return;
             }
+        } else {
+            prev = head;
+            head = head->next;
         }
-
-        prev = head;
-        head = head->next;
     }
 }
 
 
 void list_pop_at(list_t *list, cell_t **prev, cell_t** at) {
+    cell_t* cell = *at;
+
     if (*prev != NULL) {
-        (*prev)->next = (*at)->next;
+        (*prev)->next = cell->next;
     } else {
-        if ((*at)->next == NULL) {
-            list->head = NULL;
-        }
+        list->head = cell->next;
     }
 
-    free((*at)->data);
-    cell_t* copy_at = *at;
-    *at = (*at)->next;
-    free(copy_at);
+    if (list->tail == cell) {
+        list->tail = *prev;
+    }
 
+    --list->length;
 
+    free(cell->data);
+    *at = cell->next;
+    give_back_cell(cell);
 }
 
 
@@ -95,9 +190,13 @@ void list_clear(list_t* list) {
     for (cell_t* head = list->head; head != NULL; ) {
         free(head->data);
         cell_t* next = head->next;
-        free(head);
+        give_back_cell(head);
         head = next;
     }
+
+    list->head = NULL;
+    list->tail = NULL;
+    list->length = 0;
 }
 
 
@@ -106,3 +205,55 @@ void list_destroy(list_t** list) {
     free(*list);
     *list = NULL;
 }
+
+
+void intrusive_list_init(intrusive_list_t* list) {
+    list->head = NULL;
+    list->tail = NULL;
+    list->length = 0;
+}
+
+
+void intrusive_list_push_back(intrusive_list_t* list, list_node_t* node) {
+    node->next = NULL;
+    node->prev = list->tail;
+
+    if (list->tail == NULL) {
+        list->head = node;
+    } else {
+        list->tail->next = node;
+    }
+
+    list->tail = node;
+    ++list->length;
+}
+
+
+list_node_t* intrusive_list_pop_front(intrusive_list_t* list) {
+    list_node_t* node = list->head;
+    if (node == NULL) {
+        return NULL;
+    }
+
+    intrusive_list_remove(list, node);
+    return node;
+}
+
+
+void intrusive_list_remove(intrusive_list_t* list, list_node_t* node) {
+    if (node->prev == NULL) {
+        list->head = node->next;
+    } else {
+        node->prev->next = node->next;
+    }
+
+    if (node->next == NULL) {
+        list->tail = node->prev;
+    } else {
+        node->next->prev = node->prev;
+    }
+
+    --list->length;
+    node->next = NULL;
+    node->prev = NULL;
+}
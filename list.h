@@ -1,6 +1,8 @@
 #ifndef LIST_H
 #define LIST_H
 
+#include <stddef.h>
+
 typedef int(*compare_fn)(void* lhs, void* rhs);
 typedef void*(*create_fn)(void* data);
 
@@ -16,6 +18,15 @@ typedef void*(*create_fn)(void* data);
  */
 #define LIST_CREATE_FN
 
+
+/*
+ * Number of cells allocated at once. Cells are carved out of slabs of this many
+ * cells and recycled through a thread local free list, so pushing and popping
+ * does not hit malloc once the list reached its usual size. The free cells of
+ * a thread that exits are reused by the other threads.
+ */
+#define LIST_CELLS_PER_SLAB 64
+
 typedef struct cell_s {
     struct cell_s* next;
     void* data;
@@ -24,6 +35,10 @@ typedef struct cell_s {
 
 typedef struct list_s {
     cell_t* head;
+    /* Last cell, to append in constant time. */
+    cell_t* tail;
+    /* Number of cells. */
+    size_t length;
     compare_fn compare;
     create_fn create;
 } list_t;
@@ -37,4 +52,52 @@ void list_pop_at(list_t* list, cell_t** prev, cell_t** at);
 void list_clear(list_t* list);
 void list_destroy(list_t** list);
 
+
+/*******************************************************************************
+ * Intrusive lists
+ */
+
+
+/*
+ * Link embedded inside the structures stored in an intrusive_list_t. Contrary
+ * to list_t, an intrusive list allocates nothing: the element is its own cell.
+ * An element can be inside at most one list per embedded link.
+ */
+typedef struct list_node_s {
+    struct list_node_s* next;
+    struct list_node_s* prev;
+} list_node_t;
+
+
+typedef struct intrusive_list_s {
+    list_node_t* head;
+    list_node_t* tail;
+    size_t length;
+} intrusive_list_t;
+
+
+/*
+ * Get the structure of type type that embeds the list_node_t node as its field
+ * member.
+ */
+#define LIST_ENTRY(node, type, member) \
+    ((type*)((char*)(node) - offsetof(type, member)))
+
+
+void intrusive_list_init(intrusive_list_t* list);
+void intrusive_list_push_back(intrusive_list_t* list, list_node_t* node);
+
+
+/*
+ * Unlink the first element of the list and return it, or NULL if the list is
+ * empty.
+ */
+list_node_t* intrusive_list_pop_front(intrusive_list_t* list);
+
+
+/*
+ * Unlink node, which must be inside list, in constant time.
+ */
+void intrusive_list_remove(intrusive_list_t* list, list_node_t* node);
+
 #endif /* LIST_H */
@@ -1,9 +1,15 @@
 #include <assert.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
 
 #include "common.h"
 #include "log.h"
+#include "metrics.h"
 #include "util.h"
 
 
@@ -38,6 +44,151 @@ static void log_critical(FILE* file, const char* message);
 static void log_fatal(FILE* file, const char* message);
 
 
+/*
+ * A message waiting for the writer thread. Only the text given by the caller
+ * is stored, the decoration is added by the writer.
+ */
+typedef struct log_record_s {
+    int level;
+    char text[LOG_RECORD_LENGTH];
+} log_record_t;
+
+
+/* Size of a cache line, to keep the indexes of the producer and the consumer apart. */
+#define LOG_CACHE_LINE 64
+
+
+/*
+ * Ring of the messages of one thread, with a single producer (the thread) and
+ * a single consumer (whoever holds registry_lock, usually the writer thread).
+ */
+typedef struct log_ring_s {
+    /* Index of the next record to write, only written by the consumer. */
+    _Alignas(LOG_CACHE_LINE) atomic_size_t head;
+    /* Index of the next record to fill, only written by the producer. */
+    _Alignas(LOG_CACHE_LINE) atomic_size_t tail;
+    /* Set when the thread exits: the ring is freed once it is empty. */
+    atomic_int orphan;
+    /* Next ring of the registry. */
+    struct log_ring_s* next;
+    log_record_t records[LOG_RING_CAPACITY];
+} log_ring_t;
+
+
+/*
+ * Return the subsystem named name on the command line, -1 if there is none.
+ */
+static int subsystem_from_name(const char* name);
+
+
+/*
+ * Return true if a message of level log_level and format format is below the
+ * level of its subsystem.
+ */
+static bool is_filtered(int log_level, const char* format);
+
+
+/*
+ * Create the key of the rings and the fork handlers. Called once per process.
+ */
+static void log_init(void);
+
+
+/*
+ * Return the ring of the calling thread, creating and registering it the first
+ * time. Return NULL if it could not be allocated.
+ */
+static log_ring_t* get_thread_ring(void);
+
+
+/*
+ * Destructor of the ring of a thread, called when the thread exits.
+ */
+static void release_thread_ring(void* ring);
+
+
+/*
+ * Push a message in the ring of the calling thread. The function returns -1 if
+ * the message was dropped, 0 otherwise.
+ */
+static int push_record(int log_level, const char* format, va_list va);
+
+
+/*
+ * Entry point of the writer thread.
+ */
+static void* writer_main(void* args);
+
+
+/*
+ * Write the messages of every ring, the number of messages dropped since the
+ * previous batch if any, then flush the standard streams written to. Must be
+ * called with registry_lock taken.
+ */
+static void write_batch(void);
+
+
+/* Fork handlers: the child does not inherit the writer thread. */
+static void before_fork(void);
+static void after_fork_parent(void);
+static void after_fork_child(void);
+
+
+/* Protects the registry of rings, taken by the producers only once per thread. */
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Rings of every thread that logged something. */
+static log_ring_t* rings = NULL;
+/* Number of messages dropped that were already reported. */
+static long dropped_reported = 0;
+
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ring_key;
+static _Thread_local log_ring_t* thread_ring = NULL;
+
+static pthread_t writer;
+static atomic_int writer_running = 0;
+static atomic_int writer_stop = 0;
+
+static atomic_int min_level = LOG_LEVEL_INFO;
+static atomic_long dropped = 0;
+
+
+/* Level of each subsystem, -1 to use min_level. */
+static atomic_int subsystem_levels[LOG_SUBSYSTEMS_COUNT] = {
+    [LOG_SUBSYSTEM_SERVER]       = -1,
+    [LOG_SUBSYSTEM_CLIENT]       = -1,
+    [LOG_SUBSYSTEM_NETWORK]      = -1,
+    [LOG_SUBSYSTEM_LOCAL_SERVER] = -1,
+    [LOG_SUBSYSTEM_OTHER]        = -1
+};
+
+
+/* Names of the subsystems on the command line, and prefixes of their messages. */
+static const char* subsystem_names[LOG_SUBSYSTEMS_COUNT] = {
+    [LOG_SUBSYSTEM_SERVER]       = "server",
+    [LOG_SUBSYSTEM_CLIENT]       = "client",
+    [LOG_SUBSYSTEM_NETWORK]      = "network",
+    [LOG_SUBSYSTEM_LOCAL_SERVER] = "local-server",
+    [LOG_SUBSYSTEM_OTHER]        = NULL
+};
+
+static const char* subsystem_prefixes[LOG_SUBSYSTEMS_COUNT] = {
+    [LOG_SUBSYSTEM_SERVER]       = "Server",
+    [LOG_SUBSYSTEM_CLIENT]       = "Client",
+    [LOG_SUBSYSTEM_NETWORK]      = "Network",
+    [LOG_SUBSYSTEM_LOCAL_SERVER] = "Local Server",
+    [LOG_SUBSYSTEM_OTHER]        = NULL
+};
+
+
+static const char* level_names[LOG_LEVEL_MAX] = {
+    [LOG_LEVEL_INFO]    = "info",
+    [LOG_LEVEL_WARNING] = "warning",
+    [LOG_LEVEL_ERROR]   = "error",
+    [LOG_LEVEL_FATAL]   = "fatal"
+};
+
+
 /* Maximum length of a message we want to log. */
 #define MAX_BUFFER_LENGTH 4096
 /* As string. Note that this MUST be the same as MAX_BUFFER_LENGTH. */
@@ -84,28 +235,41 @@ void debug_file_assert(bool condition, FILE* file, const char* format, ...) {
 
 #endif /* DEBUG */
 
-int applog(int log_level, const char* format, ...) {
+int log_message(int log_level, const char* format, ...) {
     if (log_level >= LOG_LEVEL_MAX || log_level < 0 || format == NULL) {
         return -1;
     }
 
+    if (is_filtered(log_level, format)) {
+        return 0;
+    }
+
+    int res = 0;
     va_list va;
     va_start(va, format);
-    FILE* log_file = get_log_file_by_level(log_level);
-    log_internal(get_log_function_by_level(log_level), format,
-                 log_file, va);
-    fflush(log_file);
+    if (atomic_load_explicit(&writer_running, memory_order_acquire) == 1) {
+        res = push_record(log_level, format, va);
+    } else {
+        FILE* log_file = get_log_file_by_level(log_level);
+        log_internal(get_log_function_by_level(log_level), format,
+                     log_file, va);
+        fflush(log_file);
+    }
     va_end(va);
 
-    return 0;
+    return res;
 }
 
 
-int log_to_file(int log_level, FILE* file, const char* format, ...) {
+int log_message_to_file(int log_level, FILE* file, const char* format, ...) {
     if (log_level >= LOG_LEVEL_MAX || log_level < 0 || format == NULL) {
         return -1;
     }
 
+    if (is_filtered(log_level, format)) {
+        return 0;
+    }
+
     va_list va;
     va_start(va, format);
     log_internal(get_log_function_by_level(log_level), format, file, va);
@@ -116,6 +280,329 @@ int log_to_file(int log_level, FILE* file, const char* format, ...) {
 }
 
 
+int log_start(void) {
+    pthread_once(&init_once, log_init);
+
+    int res = 0;
+    pthread_mutex_lock(&registry_lock);
+    if (atomic_load(&writer_running) == 0) {
+        atomic_store(&writer_stop, 0);
+        if (pthread_create(&writer, NULL, writer_main, NULL) != 0) {
+            res = -1;
+        } else {
+            atomic_store_explicit(&writer_running, 1, memory_order_release);
+        }
+    }
+    pthread_mutex_unlock(&registry_lock);
+
+    return res;
+}
+
+
+void log_stop(void) {
+    if (atomic_load(&writer_running) == 0) {
+        return;
+    }
+
+    atomic_store(&writer_stop, 1);
+    pthread_join(writer, NULL);
+    atomic_store_explicit(&writer_running, 0, memory_order_release);
+
+    /* Messages pushed while the writer was finishing. */
+    pthread_mutex_lock(&registry_lock);
+    write_batch();
+    pthread_mutex_unlock(&registry_lock);
+}
+
+
+void log_set_level(int log_level) {
+    if (log_level < 0 || log_level >= LOG_LEVEL_MAX) {
+        return;
+    }
+
+    atomic_store_explicit(&min_level, log_level, memory_order_relaxed);
+}
+
+
+int log_get_level(void) {
+    return atomic_load_explicit(&min_level, memory_order_relaxed);
+}
+
+
+void log_set_subsystem_level(log_subsystem_t subsystem, int log_level) {
+    if (subsystem >= LOG_SUBSYSTEMS_COUNT || log_level < -1 || log_level >= LOG_LEVEL_MAX) {
+        return;
+    }
+
+    atomic_store_explicit(&subsystem_levels[subsystem], log_level, memory_order_relaxed);
+}
+
+
+int log_parse_levels(const char* spec) {
+    int global = -1;
+    int levels[LOG_SUBSYSTEMS_COUNT];
+    for (int i = 0; i < LOG_SUBSYSTEMS_COUNT; i++) {
+        levels[i] = -2; /* Unchanged. */
+    }
+
+    char item[MAX_BUFFER_LENGTH];
+    const char* begin = spec;
+    while (1) {
+        const char* end = strchr(begin, ',');
+        size_t length = end == NULL ? strlen(begin) : (size_t)(end - begin);
+        if (length == 0 || length >= MAX_BUFFER_LENGTH) {
+            return -1;
+        }
+
+        memcpy(item, begin, length);
+        item[length] = '\0';
+
+        char* equal = strchr(item, '=');
+        if (equal == NULL) {
+            global = log_level_from_name(item);
+            if (global == -1) {
+                return -1;
+            }
+        } else {
+            *equal = '\0';
+            int subsystem = subsystem_from_name(item);
+            int level = log_level_from_name(equal + 1);
+            if (subsystem == -1 || subsystem == LOG_SUBSYSTEM_OTHER || level == -1) {
+                return -1;
+            }
+            levels[subsystem] = level;
+        }
+
+        if (end == NULL) {
+            break;
+        }
+        begin = end + 1;
+    }
+
+    if (global != -1) {
+        log_set_level(global);
+    }
+
+    for (int i = 0; i < LOG_SUBSYSTEMS_COUNT; i++) {
+        if (levels[i] != -2) {
+            log_set_subsystem_level(i, levels[i]);
+        }
+    }
+
+    return 0;
+}
+
+
+int log_level_from_name(const char* name) {
+    for (int i = 0; i < LOG_LEVEL_MAX; i++) {
+        if (strcmp(name, level_names[i]) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+
+long log_dropped(void) {
+    return atomic_load_explicit(&dropped, memory_order_relaxed);
+}
+
+
+int subsystem_from_name(const char* name) {
+    for (int i = 0; i < LOG_SUBSYSTEMS_COUNT; i++) {
+        if (subsystem_names[i] != NULL && strcmp(name, subsystem_names[i]) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+
+bool is_filtered(int log_level, const char* format) {
+    int subsystem = LOG_SUBSYSTEM_OTHER;
+    if (format[0] == '[') {
+        for (int i = 0; i < LOG_SUBSYSTEM_OTHER; i++) {
+            size_t length = strlen(subsystem_prefixes[i]);
+            if (strncmp(format + 1, subsystem_prefixes[i], length) == 0 &&
+                format[1 + length] == ']') {
+                subsystem = i;
+                break;
+            }
+        }
+    }
+
+    int min = atomic_load_explicit(&subsystem_levels[subsystem], memory_order_relaxed);
+    if (min == -1) {
+        min = atomic_load_explicit(&min_level, memory_order_relaxed);
+    }
+
+    return log_level < min;
+}
+
+
+void log_init(void) {
+    pthread_key_create(&ring_key, release_thread_ring);
+    pthread_atfork(before_fork, after_fork_parent, after_fork_child);
+    atexit(log_stop);
+}
+
+
+log_ring_t* get_thread_ring(void) {
+    if (thread_ring != NULL) {
+        return thread_ring;
+    }
+
+    log_ring_t* ring = malloc(sizeof(log_ring_t));
+    if (ring == NULL) {
+        return NULL;
+    }
+
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->orphan, 0);
+
+    pthread_mutex_lock(&registry_lock);
+    ring->next = rings;
+    rings = ring;
+    pthread_mutex_unlock(&registry_lock);
+
+    pthread_setspecific(ring_key, ring);
+    thread_ring = ring;
+    return ring;
+}
+
+
+void release_thread_ring(void* ring) {
+    atomic_store(&((log_ring_t*)ring)->orphan, 1);
+}
+
+
+int push_record(int log_level, const char* format, va_list va) {
+    log_ring_t* ring = get_thread_ring();
+    if (ring == NULL) {
+        atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+        metric_inc(METRIC_LOG_DROPPED);
+        return -1;
+    }
+
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if (tail - atomic_load_explicit(&ring->head, memory_order_acquire) == LOG_RING_CAPACITY) {
+        /* Never wait for the writer: the caller is on a hot path. */
+        atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+        metric_inc(METRIC_LOG_DROPPED);
+        return -1;
+    }
+
+    log_record_t* record = &ring->records[tail & (LOG_RING_CAPACITY - 1)];
+    record->level = log_level;
+    vsnprintf(record->text, LOG_RECORD_LENGTH, format, va);
+
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    return 0;
+}
+
+
+void* writer_main(void* args) {
+    UNUSED(args);
+
+    while (atomic_load(&writer_stop) == 0) {
+        millisleep(LOG_WRITE_PERIOD);
+
+        pthread_mutex_lock(&registry_lock);
+        write_batch();
+        pthread_mutex_unlock(&registry_lock);
+    }
+
+    pthread_mutex_lock(&registry_lock);
+    write_batch();
+    pthread_mutex_unlock(&registry_lock);
+
+    return NULL;
+}
+
+
+void write_batch(void) {
+    /* The messages of a thread stay in order, not the ones of different threads. */
+    int written[LOG_LEVEL_MAX] = { 0 };
+    log_ring_t** link = &rings;
+    while (*link != NULL) {
+        log_ring_t* ring = *link;
+        size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        for (; head != tail; head++) {
+            const log_record_t* record = &ring->records[head & (LOG_RING_CAPACITY - 1)];
+            get_log_function_by_level(record->level)(get_log_file_by_level(record->level),
+                                                     record->text);
+            written[record->level] = 1;
+        }
+        atomic_store_explicit(&ring->head, head, memory_order_release);
+
+        if (atomic_load(&ring->orphan) == 1 &&
+            atomic_load_explicit(&ring->tail, memory_order_acquire) == head) {
+            *link = ring->next;
+            free(ring);
+        } else {
+            link = &ring->next;
+        }
+    }
+
+    long total = atomic_load_explicit(&dropped, memory_order_relaxed);
+    if (total != dropped_reported) {
+        char buffer[MAX_BUFFER_LENGTH];
+        snprintf(buffer, MAX_BUFFER_LENGTH, "[Log] %ld messages perdus (file pleine).\n",
+                 total - dropped_reported);
+        log_warning(get_log_file_by_level(LOG_LEVEL_WARNING), buffer);
+        written[LOG_LEVEL_WARNING] = 1;
+        dropped_reported = total;
+    }
+
+    for (int i = 0; i < LOG_LEVEL_MAX; i++) {
+        if (written[i] == 1) {
+            fflush(get_log_file_by_level(i));
+        }
+    }
+}
+
+
+void before_fork(void) {
+    /*
+     * Only so that no batch is half written in the child. The rings are left to
+     * the writer: the child gets them empty, so no message is written twice.
+     */
+    pthread_mutex_lock(&registry_lock);
+}
+
+
+void after_fork_parent(void) {
+    pthread_mutex_unlock(&registry_lock);
+}
+
+
+void after_fork_child(void) {
+    /* Only the calling thread exists in the child: drop the rings of the others. */
+    log_ring_t* ring = rings;
+    while (ring != NULL) {
+        log_ring_t* next = ring->next;
+        if (ring != thread_ring) {
+            free(ring);
+        }
+        ring = next;
+    }
+
+    rings = thread_ring;
+    if (thread_ring != NULL) {
+        thread_ring->next = NULL;
+        /* The parent writes what it holds. */
+        atomic_store(&thread_ring->head, atomic_load(&thread_ring->tail));
+    }
+
+    atomic_store(&writer_running, 0);
+    pthread_mutex_unlock(&registry_lock);
+}
+
+
 void log_internal(log_function_t log_fn, const char* format,
                   FILE* file, va_list va) {
     assert(log_fn != NULL);
@@ -48,18 +48,136 @@ void debug_file_assert(bool condition, FILE* file, const char* format, ...);
 #define LOG_LEVEL_MAX       4
 
 
+/*
+ * Messages below LOG_MIN_LEVEL are removed at compile time: applog and
+ * log_to_file expand to a statement guarded by a constant false condition, and
+ * neither the arguments nor the call are compiled in. Without DEBUG, nothing
+ * is ever displayed, so every message is removed. The release target of the
+ * Makefile only keeps the warnings and above.
+ */
+#ifndef LOG_MIN_LEVEL
+#ifdef DEBUG
+#define LOG_MIN_LEVEL LOG_LEVEL_INFO
+#else
+#define LOG_MIN_LEVEL LOG_LEVEL_MAX
+#endif /* DEBUG */
+#endif /* LOG_MIN_LEVEL */
+
+
+/*
+ * Subsystems, each with its own runtime level. The subsystem of a message is
+ * given by the prefix of its format ("[Server] ...", "[Client] ...", etc...),
+ * messages with any other prefix belong to LOG_SUBSYSTEM_OTHER.
+ */
+typedef enum log_subsystem_e {
+    LOG_SUBSYSTEM_SERVER,
+    LOG_SUBSYSTEM_CLIENT,
+    LOG_SUBSYSTEM_NETWORK,
+    LOG_SUBSYSTEM_LOCAL_SERVER,
+    LOG_SUBSYSTEM_OTHER,
+
+    LOG_SUBSYSTEMS_COUNT
+} log_subsystem_t;
+
+
 /*
  * Display the message format, formatted like printf, in the most appropriate
- * standard flux, according to log_level.
+ * standard flux, according to log_level. Messages below the level of their
+ * subsystem (see log_set_level and log_set_subsystem_level) are ignored before
+ * any formatting.
+ *
+ * Once log_start has been called, the message is only formatted by the caller:
+ * it is pushed in a ring buffer owned by the calling thread, and the writer
+ * thread decorates and writes the messages of every thread in batches, with one
+ * flush per batch. If the ring of the thread is full, the message is dropped
+ * and counted (see log_dropped). Before log_start, or in a process forked after
+ * it, the message is written and flushed right away.
  */
-ERROR_CODES_USUAL int applog(int log_level, const char* format, ...);
+#define applog(log_level, ...) do { \
+        if ((log_level) >= LOG_MIN_LEVEL) { \
+            log_message(log_level, __VA_ARGS__); \
+        } \
+    } while (0)
+
+ERROR_CODES_USUAL int log_message(int log_level, const char* format, ...);
 
 
 /*
  * Display the message format, formatted like printf, in the file "file",
- * overriding usual considerations.
+ * overriding usual considerations (the levels still apply).
+ */
+#define log_to_file(log_level, file, ...) do { \
+        if ((log_level) >= LOG_MIN_LEVEL) { \
+            log_message_to_file(log_level, file, __VA_ARGS__); \
+        } \
+    } while (0)
+
+ERROR_CODES_USUAL int log_message_to_file(int log_level, FILE* file,
+                                          const char* format, ...);
+
+
+/*
+ * Maximum length of a message written by the writer thread, longer messages
+ * are truncated.
+ */
+#define LOG_RECORD_LENGTH 1024
+/* Number of messages the ring of a thread can hold. Must be a power of two. */
+#define LOG_RING_CAPACITY 256
+/* Time (milliseconds) between two batches of the writer thread. */
+#define LOG_WRITE_PERIOD 10
+
+
+/*
+ * Start the writer thread of the process, if it is not running yet. The
+ * remaining messages are written when the process exits (or on log_stop).
+ * Return -1 if the thread could not be created (the messages are then written
+ * synchronously), 0 otherwise.
+ */
+ERROR_CODES_USUAL int log_start(void);
+
+
+/*
+ * Stop the writer thread, after it wrote every message already pushed.
+ */
+void log_stop(void);
+
+
+/*
+ * Set the minimum level of the messages displayed by applog. Can be called at
+ * any time, from any thread.
+ */
+void log_set_level(int log_level);
+int log_get_level(void);
+
+
+/*
+ * Set the minimum level of the messages of subsystem, -1 (the default) to use
+ * the level set by log_set_level.
+ */
+void log_set_subsystem_level(log_subsystem_t subsystem, int log_level);
+
+
+/*
+ * Set the levels described by spec, a comma separated list of "level" (the
+ * level of every subsystem without its own) or "subsystem=level" items, where
+ * subsystem is server, client, network or local-server. For instance
+ * "warning,server=info". Return -1 if spec is invalid (nothing is changed
+ * then), 0 otherwise.
+ */
+ERROR_CODES_USUAL int log_parse_levels(const char* spec);
+
+
+/*
+ * Parse a level name ("info", "warning", "error" or "fatal"). Return -1 if name
+ * is not a level.
+ */
+int log_level_from_name(const char* name);
+
+
+/*
+ * Number of messages dropped since the start of the process, because the ring
+ * of their thread was full.
  */
-ERROR_CODES_USUAL int log_to_file(int log_level, FILE* file,
-                                  const char* format, ...);
+long log_dropped(void);
 
 #endif /* LOG_H */
@@ -1,6 +1,7 @@
 #define _GNU_SOURCE
 
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,6 +9,7 @@
 
 #include <arpa/inet.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
@@ -15,8 +17,12 @@
 #include "client.h"
 #include "common.h"
 #include "log.h"
+#include "metrics.h"
 #include "server.h"
+#include "server_defines.h"
+#include "trace.h"
 #include "util.h"
+#include "worker_pool.h"
 
 
 /* The minimum number of values we must find in argv. */
@@ -28,11 +34,34 @@
  */
 
 
+typedef struct boot_argv_s {
+    int threaded;
+
+    char* error;
+} boot_argv_t;
+
+
 /* Parameter to show help. */
 #define HELP_SHORT "-h"
 #define HELP_LONG "--help"
 
 
+/*
+ * Parameter to run the client and the servent as two threads of the same
+ * process, talking through in-memory queues, instead of forking.
+ */
+#define THREADED_SHORT "-t"
+#define THREADED_LONG "--threaded"
+
+
+/*
+ * Parameter to hide the log messages below a level (info, warning, error,
+ * fatal), for every subsystem or some of them (see log_parse_levels).
+ */
+#define LOG_LEVEL_SHORT "-L"
+#define LOG_LEVEL_LONG "--log-level"
+
+
 /*******************************************************************************
  * Client argv.
  */
@@ -40,6 +69,7 @@
 
 typedef struct client_argv_s {
     char* contact_port;
+    char* batch_file;
     char* stdout_redirect;
     char* stderr_redirect;
 
@@ -55,6 +85,11 @@ typedef struct client_argv_s {
  */
 
 
+/* Command to read the commands from a file ("-" for the standard input). */
+#define BATCH_SHORT "-b"
+#define BATCH_LONG "--batch"
+
+
 /*******************************************************************************
  * Server argv.
  */
@@ -65,6 +100,9 @@ typedef struct server_argv_s {
     char* contact_ip;
     char* contact_port;
     char* listen_port;
+    char* metrics_file;
+    char* trace_file;
+    server_options_t options;
 
     char* stdout_redirect;
     char* stderr_redirect;
@@ -90,6 +128,25 @@ typedef struct server_argv_s {
 #define LISTEN_LONG "--listen"
 
 
+/* Commands to set the TTL of our searches and the number of neighbours we keep. */
+#define TTL_LONG "--ttl"
+#define DEGREE_LONG "--degree"
+
+
+/* Command to set the number of threads looking up the files. */
+#define WORKERS_LONG "--workers"
+
+
+/* Command to write the metrics of the servent in a file, every second. */
+#define METRICS_SHORT "-m"
+#define METRICS_LONG "--metrics"
+
+
+/* Command to capture the frames received by the servent in a file. */
+#define RECORD_SHORT "-r"
+#define RECORD_LONG "--record"
+
+
 /* Commands to redirect the usual streams to custom files. */
 #define REDIRECT_CLIENT_STDOUT "-cout"
 #define REDIRECT_CLIENT_STDERR "-cerr"
@@ -121,6 +178,29 @@ static void clear_client_argv(client_argv_t* argv);
 static void clear_server_argv(server_argv_t* argv);
 
 
+/*
+ * Run the client in the calling thread and the servent in a new thread. The
+ * function returns the exit status of the application.
+ */
+static int run_threaded(int argc, char** argv);
+
+
+/* What the thread of the servent needs. */
+typedef struct server_thread_s {
+    server_argv_t* infos;
+    /* Link to the client, from the point of view of the servent. */
+    local_link_t link;
+    /* Value returned by run_server. */
+    int result;
+} server_thread_t;
+
+
+/*
+ * Entry point of the thread of the servent (args is a server_thread_t).
+ */
+static void* server_thread_main(void* args);
+
+
 /******************************************************************************/
 
 
@@ -145,7 +225,26 @@ int main(int argc, char** argv) {
 
     srand((unsigned int)time(NULL));
 
-    handle_argv(argc, argv, PHASE_BOOT, NULL);
+    boot_argv_t boot;
+    memset(&boot, 0, sizeof(boot_argv_t));
+    handle_argv(argc, argv, PHASE_BOOT, &boot);
+
+    if (boot.error != NULL) {
+        fprintf(stderr, "%s", boot.error);
+        usage();
+        free(boot.error);
+        return EXIT_FAILURE;
+    }
+
+    /* The forked servent does not inherit the writer thread, it starts its own. */
+    if (log_start() == -1) {
+        applog(LOG_LEVEL_WARNING, "[Boot] Impossible de démarrer le thread des logs, "
+                                  "écriture synchrone.\n");
+    }
+
+    if (boot.threaded == 1) {
+        return run_threaded(argc, argv);
+    }
 
     pid_t server_pid = fork();
     if (server_pid < 0) {
@@ -177,8 +276,15 @@ int main(int argc, char** argv) {
             close(infos.new_stdout);
         }
 
+        if (log_start() == -1) {
+            applog(LOG_LEVEL_WARNING, "[Boot] Impossible de démarrer le thread des logs, "
+                                      "écriture synchrone.\n");
+        }
+
+        metrics_set_output(infos.metrics_file);
+        trace_set_output(infos.trace_file);
         int res = run_server(infos.first_machine, infos.listen_port,
-                             infos.contact_ip, infos.contact_port);
+                             infos.contact_ip, infos.contact_port, &infos.options, NULL);
 
         clear_server_argv(&infos);
 
@@ -208,7 +314,7 @@ int main(int argc, char** argv) {
             close(infos.new_stdout);
         }
 
-        int res = run_client(infos.contact_port);
+        int res = run_client(infos.contact_port, infos.batch_file, NULL);
         if (res == -1) {
             kill(server_pid, SIGINT);
             return EXIT_FAILURE;
@@ -222,19 +328,137 @@ int main(int argc, char** argv) {
 }
 
 
+int run_threaded(int argc, char** argv) {
+    server_argv_t server_infos;
+    memset(&server_infos, 0, sizeof(server_argv_t));
+    handle_argv(argc, argv, PHASE_SERVER, &server_infos);
+
+    client_argv_t client_infos;
+    memset(&client_infos, 0, sizeof(client_argv_t));
+    handle_argv(argc, argv, PHASE_CLIENT, &client_infos);
+
+    const char* error = server_infos.error != NULL ? server_infos.error : client_infos.error;
+    if (error != NULL) {
+        fprintf(stderr, "%s", error);
+        usage();
+        clear_server_argv(&server_infos);
+        clear_client_argv(&client_infos);
+        return EXIT_FAILURE;
+    }
+
+    /* Both sides share the standard streams, only the client ones apply. */
+    if (client_infos.stderr_redirect != NULL) {
+        client_infos.new_stderr = open(client_infos.stderr_redirect, O_CREAT | O_TRUNC | O_WRONLY, 0666);
+        dup2(client_infos.new_stderr, STDERR_FILENO);
+        close(client_infos.new_stderr);
+    }
+
+    if (client_infos.stdout_redirect != NULL) {
+        client_infos.new_stdout = open(client_infos.stdout_redirect, O_CREAT | O_TRUNC | O_WRONLY, 0666);
+        dup2(client_infos.new_stdout, STDOUT_FILENO);
+        close(client_infos.new_stdout);
+    }
+
+    packet_queue_t* to_server = packet_queue_create();
+    packet_queue_t* to_client = packet_queue_create();
+    if (to_server == NULL || to_client == NULL) {
+        applog(LOG_LEVEL_FATAL, "[Boot] Impossible de créer les files de paquets. "
+                                "Extinction.\n");
+        return EXIT_LIBC_ERROR;
+    }
+
+    server_thread_t server_thread;
+    server_thread.infos = &server_infos;
+    local_link_from_queues(&server_thread.link, to_server, to_client);
+
+    local_link_t client_link;
+    local_link_from_queues(&client_link, to_client, to_server);
+
+    metrics_set_output(server_infos.metrics_file);
+    trace_set_output(server_infos.trace_file);
+
+    pthread_t server_id;
+    if (pthread_create(&server_id, NULL, server_thread_main, &server_thread) != 0) {
+        applog(LOG_LEVEL_FATAL, "[Boot] Erreur lors de la création du thread du "
+                                "serveur. Extinction.\n");
+        return EXIT_LIBC_ERROR;
+    }
+
+    int res = run_client(NULL, client_infos.batch_file, &client_link);
+    if (res == -1) {
+        /* The client did not say goodbye, tell the servent to stop. */
+        local_link_close(&client_link);
+        res = EXIT_FAILURE;
+    }
+
+    pthread_join(server_id, NULL);
+    if (server_thread.result != EXIT_SUCCESS) {
+        res = server_thread.result;
+    }
+
+    packet_queue_destroy(&to_server);
+    packet_queue_destroy(&to_client);
+    clear_server_argv(&server_infos);
+    clear_client_argv(&client_infos);
+
+    return res;
+}
+
+
+void* server_thread_main(void* args) {
+    server_thread_t* thread = (server_thread_t*)args;
+    server_argv_t* infos = thread->infos;
+
+    thread->result = run_server(infos->first_machine, infos->listen_port,
+                                infos->contact_ip, infos->contact_port,
+                                &infos->options, &thread->link);
+    return NULL;
+}
+
+
 void usage() {
     printf("Usage:\n");
-    printf("./%s [%s | %s] [%s || %s] [%s port || %s port] [%s ip port || %s ip port] [%s file] [%s file] [%s file] [%s file]\n",
-           EXEC_NAME, HELP_SHORT, HELP_LONG, FIRST_MACHINE_SHORT, FIRST_MACHINE_LONG,
+    printf("./%s [%s | %s] [%s || %s] [%s level || %s level] [%s || %s] [%s port || %s port] [%s ip port || %s ip port] [%s ttl] [%s degree] [%s n] [%s file || %s file] [%s file || %s file] [%s file || %s file] [%s file] [%s file] [%s file] [%s file]\n",
+           EXEC_NAME, HELP_SHORT, HELP_LONG, THREADED_SHORT, THREADED_LONG,
+           LOG_LEVEL_SHORT, LOG_LEVEL_LONG,
+           FIRST_MACHINE_SHORT, FIRST_MACHINE_LONG,
            LISTEN_SHORT, LISTEN_LONG, CONTACT_POINT_SHORT, CONTACT_POINT_LONG,
-           REDIRECT_CLIENT_STDOUT, REDIRECT_CLIENT_STDERR, REDIRECT_SERVER_STDOUT, REDIRECT_SERVER_STDERR);
+           TTL_LONG, DEGREE_LONG, WORKERS_LONG, BATCH_SHORT, BATCH_LONG, METRICS_SHORT, METRICS_LONG, RECORD_SHORT, RECORD_LONG, REDIRECT_CLIENT_STDOUT, REDIRECT_CLIENT_STDERR, REDIRECT_SERVER_STDOUT, REDIRECT_SERVER_STDERR);
     printf("\t%s / %s Display the present help and exit.\n", HELP_SHORT, HELP_LONG);
+    printf("\t%s / %s Run the client and the servent as two threads of the same "
+           "process instead of two processes. The %s and %s redirections are "
+           "ignored.\n", THREADED_SHORT, THREADED_LONG, REDIRECT_SERVER_STDOUT,
+           REDIRECT_SERVER_STDERR);
+    printf("\t%s / %s level Hide the log messages below level (info, warning, "
+           "error or fatal). level can also be a comma separated list of "
+           "subsystem=level, subsystem being server, client, network or "
+           "local-server, e.g. warning,server=info. The messages are written by "
+           "a background thread.\n", LOG_LEVEL_SHORT, LOG_LEVEL_LONG);
     printf("\t%s / %s Run this application as first machine. It means the servent "
            "won't search for neighbours.\n", FIRST_MACHINE_SHORT, FIRST_MACHINE_LONG);
     printf("\t%s / %s port Force the servent to listen on the given port.\n",
            LISTEN_SHORT, LISTEN_LONG);
     printf("\t%s / %s ip port Force the servent to contact this given IP and port "
            "to join the network.\n", CONTACT_POINT_SHORT, CONTACT_POINT_LONG);
+    printf("\t%s ttl Set the TTL of the searches started by the servent "
+           "(default %d).\n", TTL_LONG, DEFAULT_TTL);
+    printf("\t%s degree Keep at most degree neighbours (default and maximum "
+           "%d).\n", DEGREE_LONG, MAX_NEIGHBOURS);
+    printf("\t%s n Look up the files with n threads (default %d, at most %d), "
+           "0 to do it on the thread of the servent.\n", WORKERS_LONG,
+           WORKER_THREADS, WORKER_POOL_MAX_WORKERS);
+    printf("\t%s / %s file Run the client in batch mode: the commands are read from "
+           "file (%s for the standard input) and sent without waiting for the "
+           "answers, then the duration of each command is displayed. The exit "
+           "status is non-zero if a command was malformed, failed (a search "
+           "without any hit, a failed download) or was not answered.\n",
+           BATCH_SHORT, BATCH_LONG, BATCH_STDIN);
+    printf("\t%s / %s file Write the metrics of the servent (counters and queue "
+           "sizes) in file every second, in the Prometheus text format.\n",
+           METRICS_SHORT, METRICS_LONG);
+    printf("\t%s / %s file Capture every frame received by the servent in file, "
+           "with its time and connection, to replay it later (see bench/replay).\n",
+           RECORD_SHORT, RECORD_LONG);
     printf("\t[%s || %s || %s || %s] file will redirect the given stream to the "
            "file passed as parameter.\n"
            "\t\t%s redirects the standard output of the client\n"
@@ -266,7 +490,7 @@ void handle_argv(int argc, char **argv, int phase, void *context) {
 
 
 void handle_argv_boot(int argc, char** argv, void* context) {
-    UNUSED(context);
+    boot_argv_t* infos = (boot_argv_t*)context;
     for (int i = 0; i < argc; ) {
         int increment = 1;
         const char* value = argv[i];
@@ -275,6 +499,22 @@ void handle_argv_boot(int argc, char** argv, void* context) {
             strcmp(value, HELP_SHORT) == 0) {
             usage();
             exit(EXIT_SUCCESS);
+        } else if (strcmp(value, THREADED_LONG) == 0 ||
+                   strcmp(value, THREADED_SHORT) == 0) {
+            infos->threaded = 1;
+        } else if (strcmp(value, LOG_LEVEL_LONG) == 0 ||
+                   strcmp(value, LOG_LEVEL_SHORT) == 0) {
+            if (argc <= i + 1) {
+                set_string(&infos->error, "Not enough parameters for log level.\n");
+                return;
+            }
+
+            if (log_parse_levels(argv[i + 1]) == -1) {
+                set_string(&infos->error, "Invalid log level.\n");
+                return;
+            }
+
+            increment = 2;
         }
 
         i += increment;
@@ -301,6 +541,16 @@ void handle_argv_client(int argc, char** argv, void* context) {
             }
             set_string(&infos->contact_port, argv[i + 1]);
 
+            increment = 2;
+        } else if (strcmp(value, BATCH_LONG) == 0 ||
+                   strcmp(value, BATCH_SHORT) == 0) {
+            if (argc <= i + 1) {
+                set_string(&infos->error, "Not enough parameters for batch mode.\n");
+                return;
+            }
+
+            set_string(&infos->batch_file, argv[i + 1]);
+
             increment = 2;
         } else if (strcmp(value, REDIRECT_CLIENT_STDOUT) == 0) {
             if (argc <= i + 1) {
@@ -371,6 +621,70 @@ void handle_argv_server(int argc, char** argv, void* context) {
 
             set_string(&infos->listen_port, argv[i + 1]);
 
+            increment = 2;
+        } else if (strcmp(value, TTL_LONG) == 0) {
+            if (argc <= i + 1) {
+                set_string(&infos->error, "Not enough parameters for TTL.\n");
+                return;
+            }
+
+            int ttl = atoi(argv[i + 1]);
+            if (ttl < 1 || ttl > UINT8_MAX) {
+                set_string(&infos->error, "Invalid TTL.\n");
+                return;
+            }
+            infos->options.search_ttl = ttl;
+
+            increment = 2;
+        } else if (strcmp(value, DEGREE_LONG) == 0) {
+            if (argc <= i + 1) {
+                set_string(&infos->error, "Not enough parameters for degree.\n");
+                return;
+            }
+
+            int degree = atoi(argv[i + 1]);
+            if (degree < 1 || degree > MAX_NEIGHBOURS) {
+                set_string(&infos->error, "Invalid degree.\n");
+                return;
+            }
+            infos->options.max_neighbours = degree;
+
+            increment = 2;
+        } else if (strcmp(value, WORKERS_LONG) == 0) {
+            if (argc <= i + 1) {
+                set_string(&infos->error, "Not enough parameters for workers.\n");
+                return;
+            }
+
+            int workers = atoi(argv[i + 1]);
+            if (workers < 0 || workers > WORKER_POOL_MAX_WORKERS ||
+                (workers == 0 && strcmp(argv[i + 1], "0") != 0)) {
+                set_string(&infos->error, "Invalid number of workers.\n");
+                return;
+            }
+            /* 0 keeps the default in server_options_t. */
+            infos->options.workers = workers == 0 ? -1 : workers;
+
+            increment = 2;
+        } else if (strcmp(value, METRICS_LONG) == 0 ||
+                   strcmp(value, METRICS_SHORT) == 0) {
+            if (argc <= i + 1) {
+                set_string(&infos->error, "Not enough parameters for metrics file.\n");
+                return;
+            }
+
+            set_string(&infos->metrics_file, argv[i + 1]);
+
+            increment = 2;
+        } else if (strcmp(value, RECORD_LONG) == 0 ||
+                   strcmp(value, RECORD_SHORT) == 0) {
+            if (argc <= i + 1) {
+                set_string(&infos->error, "Not enough parameters for capture file.\n");
+                return;
+            }
+
+            set_string(&infos->trace_file, argv[i + 1]);
+
             increment = 2;
         } else if (strcmp(value, REDIRECT_SERVER_STDOUT) == 0) {
             if (argc <= i +1) {
@@ -399,6 +713,7 @@ void handle_argv_server(int argc, char** argv, void* context) {
 
 void clear_client_argv(client_argv_t* argv) {
     free_not_null(argv->contact_port);
+    free_not_null(argv->batch_file);
     free_not_null(argv->stdout_redirect);
     free_not_null(argv->stderr_redirect);
 
@@ -410,6 +725,8 @@ void clear_server_argv(server_argv_t* argv) {
     free_not_null(argv->contact_ip);
     free_not_null(argv->contact_port);
     free_not_null(argv->listen_port);
+    free_not_null(argv->metrics_file);
+    free_not_null(argv->trace_file);
 
     free_not_null(argv->stdout_redirect);
     free_not_null(argv->stderr_redirect);
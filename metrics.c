@@ -0,0 +1,392 @@
+#define _GNU_SOURCE
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "log.h"
+#include "metrics.h"
+#include "packets_defines.h"
+
+
+typedef enum metric_type_e {
+    METRIC_TYPE_COUNTER,
+    METRIC_TYPE_GAUGE
+} metric_type_t;
+
+
+typedef struct metric_descriptor_s {
+    const char* name;
+    metric_type_t type;
+    const char* help;
+} metric_descriptor_t;
+
+
+/* Indexed by metric_id_t. */
+static const metric_descriptor_t descriptors[METRICS_COUNT] = {
+    [METRIC_QUERIES_IN]         = { "gnutella_queries_in_total", METRIC_TYPE_COUNTER,
+                                    "Search requests received from the neighbours." },
+    [METRIC_QUERIES_OUT]        = { "gnutella_queries_out_total", METRIC_TYPE_COUNTER,
+                                    "Search requests sent to the neighbours (one per neighbour)." },
+    [METRIC_QUERIES_DUPLICATE]  = { "gnutella_queries_duplicate_total", METRIC_TYPE_COUNTER,
+                                    "Search requests received more than once, not forwarded." },
+    [METRIC_QUERY_ANSWERS_IN]   = { "gnutella_query_answers_in_total", METRIC_TYPE_COUNTER,
+                                    "Search answers received for our own searches." },
+    [METRIC_QUERY_ANSWERS_OUT]  = { "gnutella_query_answers_out_total", METRIC_TYPE_COUNTER,
+                                    "Search answers sent back to the neighbours." },
+    [METRIC_LOCAL_SEARCHES]     = { "gnutella_local_searches_total", METRIC_TYPE_COUNTER,
+                                    "Searches asked by the local client." },
+    [METRIC_LOCAL_DOWNLOADS]    = { "gnutella_local_downloads_total", METRIC_TYPE_COUNTER,
+                                    "Downloads asked by the local client." },
+    [METRIC_JOINS_ACCEPTED]     = { "gnutella_joins_accepted_total", METRIC_TYPE_COUNTER,
+                                    "Join requests accepted." },
+    [METRIC_JOINS_REFUSED]      = { "gnutella_joins_refused_total", METRIC_TYPE_COUNTER,
+                                    "Join requests refused." },
+    [METRIC_NEIGHBOURS_LEFT]    = { "gnutella_neighbours_left_total", METRIC_TYPE_COUNTER,
+                                    "Neighbours that left or were lost." },
+    [METRIC_EVICTED_IDLE]       = { "gnutella_evicted_idle_total", METRIC_TYPE_COUNTER,
+                                    "Sockets closed because the other side stayed silent past its deadline." },
+    [METRIC_EVICTED_OVERFLOW]   = { "gnutella_evicted_overflow_total", METRIC_TYPE_COUNTER,
+                                    "Accepted sockets closed to make room, past MAX_AWAITING_SOCKETS." },
+    [METRIC_REFUSED_CONNECTIONS] = { "gnutella_refused_connections_total", METRIC_TYPE_COUNTER,
+                                    "Accepted sockets closed because their IP connects too often." },
+    [METRIC_REFUSED_REQUESTS]   = { "gnutella_refused_requests_total", METRIC_TYPE_COUNTER,
+                                    "Remote requests dropped because their IP sends too many of them." },
+    [METRIC_SHED_REQUESTS]      = { "gnutella_shed_requests_total", METRIC_TYPE_COUNTER,
+                                    "Remote searches and downloads dropped while the servent was overloaded." },
+    [METRIC_DROPPED_TRANSFERS]  = { "gnutella_dropped_transfers_total", METRIC_TYPE_COUNTER,
+                                    "Transfers given up after waiting too long for a place in the transfer engine." },
+    [METRIC_BYTES_UPLOADED]     = { "gnutella_uploaded_bytes_total", METRIC_TYPE_COUNTER,
+                                    "Bytes of files sent to other machines." },
+    [METRIC_BYTES_DOWNLOADED]   = { "gnutella_downloaded_bytes_total", METRIC_TYPE_COUNTER,
+                                    "Bytes of files received from other machines." },
+    [METRIC_LOOP_ITERATIONS]    = { "gnutella_loop_iterations_total", METRIC_TYPE_COUNTER,
+                                    "Iterations of the main loop of the servent." },
+    [METRIC_LOG_DROPPED]        = { "gnutella_log_dropped_total", METRIC_TYPE_COUNTER,
+                                    "Log messages dropped because the ring of their thread was full." },
+    [METRIC_LOOP_DURATION]      = { "gnutella_loop_duration_ms", METRIC_TYPE_GAUGE,
+                                    "Time spent working in the last iteration, sleep excluded." },
+    [METRIC_NEIGHBOURS]         = { "gnutella_neighbours", METRIC_TYPE_GAUGE,
+                                    "Number of neighbours." },
+    [METRIC_PENDING_REQUESTS]   = { "gnutella_pending_requests", METRIC_TYPE_GAUGE,
+                                    "Requests queued during the last iteration, before being handled." },
+    [METRIC_AWAITING_SOCKETS]   = { "gnutella_awaiting_sockets", METRIC_TYPE_GAUGE,
+                                    "Accepted sockets whose first request is not handled yet." },
+    [METRIC_PENDING_DOWNLOADS]  = { "gnutella_pending_downloads", METRIC_TYPE_GAUGE,
+                                    "Downloads waiting for the answer of the remote machine." },
+    [METRIC_OUTBOUND_PACKETS]   = { "gnutella_outbound_packets", METRIC_TYPE_GAUGE,
+                                    "Packets queued for the neighbours, before the flush." },
+    [METRIC_INBOUND_BYTES]      = { "gnutella_inbound_bytes", METRIC_TYPE_GAUGE,
+                                    "Bytes sent by the neighbours and not read yet, at the end of the last iteration." },
+    [METRIC_OVERLOADED]         = { "gnutella_overloaded", METRIC_TYPE_GAUGE,
+                                    "1 while the servent sheds the remote searches and downloads." },
+    [METRIC_WORKER_JOBS]        = { "gnutella_worker_jobs", METRIC_TYPE_GAUGE,
+                                    "Searches given to the workers and not completed yet." },
+    [METRIC_ACTIVE_TRANSFERS]   = { "gnutella_active_transfers", METRIC_TYPE_GAUGE,
+                                    "Uploads and downloads moved by the transfer engine." },
+    [METRIC_WAITING_TRANSFERS]  = { "gnutella_waiting_transfers", METRIC_TYPE_GAUGE,
+                                    "Uploads and downloads waiting for a place in the transfer engine." },
+};
+
+
+static atomic_long values[METRICS_COUNT];
+
+
+typedef struct histogram_s {
+    atomic_ulong buckets[HISTOGRAM_BUCKETS];
+    atomic_ulong count;
+    atomic_ulong sum;
+    atomic_ulong max;
+} histogram_t;
+
+
+/* Histograms per site and key, NULL until the first record. */
+static _Atomic(histogram_t*) histograms[DISPATCH_SITES_COUNT][DISPATCH_KEYS_COUNT];
+
+
+/* Names of the sites, for the labels. */
+static const char* site_names[DISPATCH_SITES_COUNT] = {
+    [DISPATCH_AWAITING]  = "awaiting",
+    [DISPATCH_NEIGHBOUR] = "neighbour",
+    [DISPATCH_CLIENT]    = "client",
+    [DISPATCH_REQUEST]   = "request",
+};
+
+
+/*
+ * Names of the requests, indexed by request_type_t (see server/request.h).
+ */
+static const char* request_names[] = {
+    "REQUEST_SEARCH_LOCAL",
+    "REQUEST_DOWNLOAD_LOCAL",
+    "REQUEST_SEARCH_REMOTE",
+};
+
+
+/*
+ * Return the index of the bucket holding value.
+ */
+static int get_bucket_index(uint64_t value);
+
+
+/*
+ * Return the largest value held by the bucket index.
+ */
+static uint64_t get_bucket_max(int index);
+
+
+/*
+ * Return the smallest value v such that a proportion quantile of the values
+ * recorded in histogram are lower or equal to v (give or take the precision
+ * of the buckets).
+ */
+static uint64_t get_quantile(histogram_t* histogram, double quantile);
+
+
+/*
+ * Write the summary of every histogram used in file.
+ */
+static void write_histograms(FILE* file);
+
+
+/*
+ * Write the label identifying key on site into dest (at least 32 bytes).
+ */
+static void get_key_name(dispatch_site_t site, int key, char* dest);
+
+
+/* File the metrics are written to, NULL if none. */
+static const char* output_path = NULL;
+/* Time (milliseconds) before the next write of the output file. */
+static int output_timer = METRICS_WRITE_PERIOD;
+
+
+/******************************************************************************/
+
+
+void metric_add(metric_id_t id, long value) {
+    atomic_fetch_add_explicit(values + id, value, memory_order_relaxed);
+}
+
+
+void metric_set(metric_id_t id, long value) {
+    atomic_store_explicit(values + id, value, memory_order_relaxed);
+}
+
+
+long metric_get(metric_id_t id) {
+    return atomic_load_explicit(values + id, memory_order_relaxed);
+}
+
+
+uint64_t metrics_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+
+void histogram_record(dispatch_site_t site, int key, uint64_t duration) {
+    histogram_t* histogram = atomic_load_explicit(&histograms[site][key], memory_order_acquire);
+    if (histogram == NULL) {
+        histogram_t* created = calloc(1, sizeof(histogram_t));
+
+        /* Another thread may have created it meanwhile, keep the first one. */
+        histogram_t* expected = NULL;
+        if (atomic_compare_exchange_strong(&histograms[site][key], &expected, created)) {
+            histogram = created;
+        } else {
+            free(created);
+            histogram = expected;
+        }
+    }
+
+    atomic_fetch_add_explicit(histogram->buckets + get_bucket_index(duration), 1,
+                              memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->sum, duration, memory_order_relaxed);
+
+    unsigned long max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+    while (duration > max &&
+           !atomic_compare_exchange_weak_explicit(&histogram->max, &max, duration,
+                                                  memory_order_relaxed,
+                                                  memory_order_relaxed)) {
+    }
+}
+
+
+int get_bucket_index(uint64_t value) {
+    if (value < 2 * HISTOGRAM_SUB_BUCKETS) {
+        return value;
+    }
+
+    /* value >> shift is in [HISTOGRAM_SUB_BUCKETS, 2 * HISTOGRAM_SUB_BUCKETS[. */
+    int shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BUCKETS_BITS;
+    int sub_bucket = (value >> shift) - HISTOGRAM_SUB_BUCKETS;
+    return HISTOGRAM_SUB_BUCKETS + shift * HISTOGRAM_SUB_BUCKETS + sub_bucket;
+}
+
+
+uint64_t get_bucket_max(int index) {
+    if (index < 2 * HISTOGRAM_SUB_BUCKETS) {
+        return index;
+    }
+
+    int shift = (index - HISTOGRAM_SUB_BUCKETS) / HISTOGRAM_SUB_BUCKETS;
+    int sub_bucket = (index - HISTOGRAM_SUB_BUCKETS) % HISTOGRAM_SUB_BUCKETS;
+    uint64_t min = (uint64_t)(HISTOGRAM_SUB_BUCKETS + sub_bucket) << shift;
+    return min + ((uint64_t)1 << shift) - 1;
+}
+
+
+uint64_t get_quantile(histogram_t* histogram, double quantile) {
+    unsigned long count = atomic_load_explicit(&histogram->count, memory_order_relaxed);
+    unsigned long rank = (unsigned long)(quantile * count + 0.5);
+    if (rank == 0) {
+        rank = 1;
+    }
+
+    /* The bounds of a bucket may go past the largest value actually seen. */
+    uint64_t max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+
+    unsigned long seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += atomic_load_explicit(histogram->buckets + i, memory_order_relaxed);
+        if (seen >= rank) {
+            uint64_t value = get_bucket_max(i);
+            return value < max ? value : max;
+        }
+    }
+
+    /* Records happened during the walk. */
+    return max;
+}
+
+
+void metrics_write(FILE* file) {
+    for (int i = 0; i < METRICS_COUNT; i++) {
+        const metric_descriptor_t* descriptor = descriptors + i;
+        fprintf(file, "# HELP %s %s\n", descriptor->name, descriptor->help);
+        fprintf(file, "# TYPE %s %s\n", descriptor->name,
+                descriptor->type == METRIC_TYPE_COUNTER ? "counter" : "gauge");
+        fprintf(file, "%s %ld\n", descriptor->name, metric_get(i));
+    }
+
+    write_histograms(file);
+}
+
+
+void write_histograms(FILE* file) {
+    static const char* name = "gnutella_dispatch_duration_ns";
+
+    fprintf(file, "# HELP %s Time spent handling a packet or a request, per "
+                  "place of dispatch and opcode (or request type). The 1 quantile "
+                  "is the maximum.\n", name);
+    fprintf(file, "# TYPE %s summary\n", name);
+
+    for (int site = 0; site < DISPATCH_SITES_COUNT; site++) {
+        for (int key = 0; key < DISPATCH_KEYS_COUNT; key++) {
+            histogram_t* histogram = atomic_load_explicit(&histograms[site][key],
+                                                          memory_order_acquire);
+            if (histogram == NULL) {
+                continue;
+            }
+
+            char labels[128];
+            char key_name[32];
+            get_key_name(site, key, key_name);
+            snprintf(labels, sizeof(labels), "site=\"%s\",key=\"%s\"",
+                     site_names[site], key_name);
+
+            fprintf(file, "%s{%s,quantile=\"0.5\"} %lu\n", name, labels,
+                    (unsigned long)get_quantile(histogram, 0.5));
+            fprintf(file, "%s{%s,quantile=\"0.99\"} %lu\n", name, labels,
+                    (unsigned long)get_quantile(histogram, 0.99));
+            fprintf(file, "%s{%s,quantile=\"1\"} %lu\n", name, labels,
+                    atomic_load_explicit(&histogram->max, memory_order_relaxed));
+            fprintf(file, "%s_sum{%s} %lu\n", name, labels,
+                    atomic_load_explicit(&histogram->sum, memory_order_relaxed));
+            fprintf(file, "%s_count{%s} %lu\n", name, labels,
+                    atomic_load_explicit(&histogram->count, memory_order_relaxed));
+        }
+    }
+}
+
+
+void get_key_name(dispatch_site_t site, int key, char* dest) {
+    const char* name = NULL;
+
+    if (site == DISPATCH_REQUEST) {
+        if (key < (int)(sizeof(request_names) / sizeof(request_names[0]))) {
+            name = request_names[key];
+        }
+    } else {
+        switch (key) {
+        case CMSG_NEIGHBOURS:      name = "CMSG_NEIGHBOURS"; break;
+        case CMSG_JOIN:            name = "CMSG_JOIN"; break;
+        case CMSG_SEARCH_REQUEST:  name = "CMSG_SEARCH_REQUEST"; break;
+        case CMSG_LEAVE:           name = "CMSG_LEAVE"; break;
+        case CMSG_DOWNLOAD:        name = "CMSG_DOWNLOAD"; break;
+        case SMSG_SEARCH_REQUEST:  name = "SMSG_SEARCH_REQUEST"; break;
+        case CMSG_INT_EXIT:        name = "CMSG_INT_EXIT"; break;
+        case CMSG_INT_SEARCH:      name = "CMSG_INT_SEARCH"; break;
+        case CMSG_INT_DOWNLOAD:    name = "CMSG_INT_DOWNLOAD"; break;
+        default:                   break;
+        }
+    }
+
+    if (name != NULL) {
+        snprintf(dest, 32, "%s", name);
+    } else {
+        snprintf(dest, 32, "%d", key);
+    }
+}
+
+
+void metrics_set_output(const char* path) {
+    output_path = path;
+    output_timer = METRICS_WRITE_PERIOD;
+}
+
+
+void metrics_tick(int elapsed) {
+    if (output_path == NULL) {
+        return;
+    }
+
+    output_timer -= elapsed;
+    if (output_timer > 0) {
+        return;
+    }
+
+    output_timer = METRICS_WRITE_PERIOD;
+    metrics_write_output();
+}
+
+
+int metrics_write_output(void) {
+    if (output_path == NULL) {
+        return 0;
+    }
+
+    char temporary_path[strlen(output_path) + sizeof(".tmp")];
+    sprintf(temporary_path, "%s.tmp", output_path);
+
+    FILE* file = fopen(temporary_path, "w");
+    if (file == NULL) {
+        applog(LOG_LEVEL_WARNING, "[Metrics] Impossible d'écrire %s.\n", temporary_path);
+        return -1;
+    }
+
+    metrics_write(file);
+    fclose(file);
+
+    if (rename(temporary_path, output_path) == -1) {
+        applog(LOG_LEVEL_WARNING, "[Metrics] Impossible de renommer %s.\n", temporary_path);
+        return -1;
+    }
+
+    return 0;
+}
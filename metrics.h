@@ -0,0 +1,158 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "common.h"
+
+
+/*
+ * Process-wide registry of counters and gauges. Updating a metric is a single
+ * relaxed atomic operation, so metrics can be updated from any thread, on the
+ * hot paths, without any lock.
+ *
+ * The registry is exposed in the text exposition format of Prometheus: for
+ * each metric, a "# HELP" line, a "# TYPE" line and a "name value" line. When
+ * an output file is set (see metrics_set_output), the servent rewrites it
+ * every METRICS_WRITE_PERIOD milliseconds.
+ *
+ * The registry also holds latency histograms, one per place where the servent
+ * dispatches work and per key (opcode or request type), exported as summaries
+ * (median, 99th percentile and maximum).
+ */
+
+
+typedef enum metric_id_e {
+    /* Counters. */
+    METRIC_QUERIES_IN,
+    METRIC_QUERIES_OUT,
+    METRIC_QUERIES_DUPLICATE,
+    METRIC_QUERY_ANSWERS_IN,
+    METRIC_QUERY_ANSWERS_OUT,
+    METRIC_LOCAL_SEARCHES,
+    METRIC_LOCAL_DOWNLOADS,
+    METRIC_JOINS_ACCEPTED,
+    METRIC_JOINS_REFUSED,
+    METRIC_NEIGHBOURS_LEFT,
+    METRIC_EVICTED_IDLE,
+    METRIC_EVICTED_OVERFLOW,
+    METRIC_REFUSED_CONNECTIONS,
+    METRIC_REFUSED_REQUESTS,
+    METRIC_SHED_REQUESTS,
+    METRIC_DROPPED_TRANSFERS,
+    METRIC_BYTES_UPLOADED,
+    METRIC_BYTES_DOWNLOADED,
+    METRIC_LOOP_ITERATIONS,
+    METRIC_LOG_DROPPED,
+
+    /* Gauges. */
+    METRIC_LOOP_DURATION,
+    METRIC_NEIGHBOURS,
+    METRIC_PENDING_REQUESTS,
+    METRIC_AWAITING_SOCKETS,
+    METRIC_PENDING_DOWNLOADS,
+    METRIC_OUTBOUND_PACKETS,
+    METRIC_INBOUND_BYTES,
+    METRIC_OVERLOADED,
+    METRIC_WORKER_JOBS,
+    METRIC_ACTIVE_TRANSFERS,
+    METRIC_WAITING_TRANSFERS,
+
+    METRICS_COUNT
+} metric_id_t;
+
+
+/* Time (milliseconds) between two writes of the output file. */
+#define METRICS_WRITE_PERIOD 1000
+
+
+void metric_add(metric_id_t id, long value);
+void metric_set(metric_id_t id, long value);
+long metric_get(metric_id_t id);
+
+#define metric_inc(id) metric_add(id, 1)
+
+
+/*
+ * Places where the servent dispatches work. The key of a dispatch is the
+ * opcode of the packet received, or the type of the request for
+ * DISPATCH_REQUEST.
+ */
+typedef enum dispatch_site_e {
+    /* First request on an accepted socket (handle_awaiting_socket). */
+    DISPATCH_AWAITING,
+    /* Packet from a neighbour (handle_neighbour). */
+    DISPATCH_NEIGHBOUR,
+    /* Packet from the local client (handle_client). */
+    DISPATCH_CLIENT,
+    /* Pending request (handle_pending_request). */
+    DISPATCH_REQUEST,
+
+    DISPATCH_SITES_COUNT
+} dispatch_site_t;
+
+
+/* Number of keys per site. */
+#define DISPATCH_KEYS_COUNT 256
+
+
+/*
+ * Histograms are log-bucketed, like HDR histograms: each power of two is split
+ * in HISTOGRAM_SUB_BUCKETS buckets, so a recorded value is known with a
+ * relative error below 1 / HISTOGRAM_SUB_BUCKETS whatever its magnitude, and
+ * recording is a constant time operation.
+ */
+#define HISTOGRAM_SUB_BUCKETS_BITS 4
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BUCKETS_BITS)
+#define HISTOGRAM_BUCKETS (HISTOGRAM_SUB_BUCKETS * (64 - HISTOGRAM_SUB_BUCKETS_BITS + 1))
+
+
+/*
+ * Current time in nanoseconds, on the monotonic clock.
+ */
+uint64_t metrics_now(void);
+
+
+/*
+ * Record that a dispatch on site, for key, took duration nanoseconds. The
+ * histogram of a site and a key is allocated the first time it is used.
+ */
+void histogram_record(dispatch_site_t site, int key, uint64_t duration);
+
+
+/*
+ * Record the time elapsed since begin (a value returned by metrics_now).
+ */
+#define histogram_record_since(site, key, begin) \
+    histogram_record(site, key, metrics_now() - (begin))
+
+
+/*
+ * Write every metric in file, in the text exposition format.
+ */
+void metrics_write(FILE* file);
+
+
+/*
+ * Set the file the metrics are written to, NULL (the default) to write them
+ * nowhere. path is not copied. Must be called before the servent starts.
+ */
+void metrics_set_output(const char* path);
+
+
+/*
+ * Indicate that elapsed milliseconds went by. If the output file is due, it is
+ * rewritten.
+ */
+void metrics_tick(int elapsed);
+
+
+/*
+ * Rewrite the output file, if any. The metrics are written in a temporary file
+ * which is then renamed, so a reader never sees a partial file. Return -1 on
+ * error, 0 otherwise.
+ */
+ERROR_CODES_USUAL int metrics_write_output(void);
+
+#endif /* METRICS_H */
@@ -1,17 +1,34 @@
 #define _GNU_SOURCE
 
 #include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
 #include <string.h>
 
 #include <netdb.h>
 #include <poll.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <unistd.h>
 
 #include "log.h"
 #include "networking.h"
 
 
+/* Prefix of the name of the control sockets. */
+#define LOCAL_SOCKET_PREFIX "gnutella-"
+
+
+/*
+ * Fill addr with the abstract address of the control socket of the servent
+ * listening on port, and return the length of the address.
+ */
+static socklen_t get_local_address(const char* port, struct sockaddr_un* addr);
+
+
+/******************************************************************************/
+
+
 int connect_to(const char* ip, const char* port, int* sock) {
     struct addrinfo hints;
     struct addrinfo *result;
@@ -83,6 +100,66 @@ int connect_to(const char* ip, const char* port, int* sock) {
 }
 
 
+int start_connect_to(const char* ip, const char* port, int* sock) {
+    struct addrinfo hints;
+    struct addrinfo *result;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family     = AF_UNSPEC;
+    hints.ai_socktype   = SOCK_STREAM;
+    hints.ai_flags      = AI_NUMERICHOST | AI_NUMERICSERV;
+
+    int res = getaddrinfo(ip, port, &hints, &result);
+    if (res != 0) {
+        applog(LOG_LEVEL_ERROR, "[Network] Erreur lors de la recherche sur %s:%s."
+                                " Erreur : %s.\n", ip, port, gai_strerror(res));
+        return CONNECT_ERROR_NO_ADDRINFO;
+    }
+
+    int connect_res = CONNECT_ERROR_NO_SOCKET;
+    for (struct addrinfo* addr_info = result; addr_info != NULL &&
+         connect_res == CONNECT_ERROR_NO_SOCKET; addr_info = addr_info->ai_next) {
+        int attempted_socket = socket(addr_info->ai_family,
+                                      addr_info->ai_socktype | SOCK_NONBLOCK,
+                                      addr_info->ai_protocol);
+        if (attempted_socket == -1) {
+            continue;
+        }
+
+        if (connect(attempted_socket, addr_info->ai_addr, addr_info->ai_addrlen) == 0) {
+            connect_res = CONNECT_OK;
+        } else if (errno == EINPROGRESS) {
+            connect_res = CONNECT_IN_PROGRESS;
+        } else {
+            close(attempted_socket);
+            continue;
+        }
+
+        *sock = attempted_socket;
+    }
+
+    freeaddrinfo(result);
+
+    if (connect_res == CONNECT_ERROR_NO_SOCKET) {
+        applog(LOG_LEVEL_ERROR, "[Network] Impossible de se connecter au serveur "
+                                "%s:%s.\n", ip, port);
+    }
+
+    return connect_res;
+}
+
+
+int get_connect_result(int sock) {
+    int error;
+    socklen_t length = sizeof(error);
+    if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &error, &length) == -1 || error != 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+
 int attempt_connect_to(const char* ip, const char* port,
                        int* sock, int nb_attempt, int sleep_time) {
     for (int i = 0; i < nb_attempt; i++) {
@@ -189,3 +266,88 @@ int attempt_accept(int listening_socket, int timeout,
 
     return ACCEPT_ERR_TIMEOUT;
 }
+
+
+int create_local_listening_socket(const char* port, int max_requests) {
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == -1) {
+        return CL_ERROR_NO_SOCKET;
+    }
+
+    struct sockaddr_un addr;
+    socklen_t addr_len = get_local_address(port, &addr);
+    if (bind(sock, (struct sockaddr*)&addr, addr_len) == -1) {
+        applog(LOG_LEVEL_ERROR, "[Network] Impossible de créer la socket locale. "
+                                "Erreur : %s.\n", strerror(errno));
+        close(sock);
+        return CL_ERROR_NO_SOCKET;
+    }
+
+    if (listen(sock, max_requests) == -1) {
+        close(sock);
+        return CL_ERROR_NO_LISTEN;
+    }
+
+    return sock;
+}
+
+
+int connect_local(const char* port, int* sock) {
+    int attempted_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (attempted_socket == -1) {
+        applog(LOG_LEVEL_ERROR, "[Network] Erreur lors de la création de la "
+                                "socket. Erreur : %s.\n", strerror(errno));
+        return CONNECT_ERROR_NO_SOCKET;
+    }
+
+    struct sockaddr_un addr;
+    socklen_t addr_len = get_local_address(port, &addr);
+    if (connect(attempted_socket, (struct sockaddr*)&addr, addr_len) == -1) {
+        applog(LOG_LEVEL_ERROR, "[Network] Echec de la connexion locale. Erreur: %s."
+                                "\n", strerror(errno));
+        close(attempted_socket);
+        return CONNECT_ERROR_NO_SOCKET;
+    }
+
+    *sock = attempted_socket;
+    return CONNECT_OK;
+}
+
+
+int attempt_connect_local(const char* port, int* sock, int nb_attempt, int sleep_time) {
+    for (int i = 0; i < nb_attempt; i++) {
+        applog(LOG_LEVEL_INFO, "[Network] Tentative de connexion locale...\n");
+        if (connect_local(port, sock) == CONNECT_OK) {
+            return 0;
+        }
+
+        sleep(sleep_time);
+    }
+
+    return -1;
+}
+
+
+socklen_t get_local_address(const char* port, struct sockaddr_un* addr) {
+    memset(addr, 0, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+
+    /* A leading '\0' puts the socket in the abstract namespace. */
+    int length = snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1,
+                          LOCAL_SOCKET_PREFIX "%s", port);
+
+    return offsetof(struct sockaddr_un, sun_path) + 1 + length;
+}
+
+
+int is_local_peer_trusted(int sock) {
+    struct ucred credentials;
+    socklen_t length = sizeof(credentials);
+    if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &credentials, &length) == -1) {
+        applog(LOG_LEVEL_ERROR, "[Network] Impossible de lire l'identité du pair "
+                                "local. Erreur : %s.\n", strerror(errno));
+        return 0;
+    }
+
+    return credentials.uid == getuid();
+}
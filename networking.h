@@ -28,6 +28,25 @@ int connect_to(const char* ip, const char* port, int* sock);
 #define CONNECT_ERROR_NO_NAMEINFO   -3
 /* No valid socket was found. */
 #define CONNECT_ERROR_NO_SOCKET     -4
+/* The connection is being established (see start_connect_to). */
+#define CONNECT_IN_PROGRESS         -5
+
+
+/*
+ * Same as connect_to, without waiting: the socket stored in sock is
+ * non-blocking, and the function returns CONNECT_IN_PROGRESS if the connection
+ * is not established yet. It is once sock is writable (POLLOUT), see
+ * get_connect_result. ip and port must be numeric, so that nothing waits for a
+ * name resolution.
+ */
+int start_connect_to(const char* ip, const char* port, int* sock);
+
+
+/*
+ * Return 0 if the connection started by start_connect_to on sock, which is
+ * writable, succeeded, -1 otherwise.
+ */
+int get_connect_result(int sock);
 
 
 /*
@@ -79,4 +98,46 @@ int attempt_accept(int listening_socket, int timeout,
 /* Timeout reached. */
 #define ACCEPT_ERR_TIMEOUT -2
 
+
+/*******************************************************************************
+ * Local control channel
+ *
+ * The client talks to its servent through an AF_UNIX socket in the abstract
+ * namespace, named after the port the servent listens on. Nothing is created on
+ * the filesystem, but any process of the machine can connect to such a socket:
+ * the servent only accepts a peer running as the same user as itself (see
+ * is_local_peer_trusted).
+ */
+
+
+/*
+ * Create the control socket of the servent listening on port, ready to handle
+ * a maximum of max_requests requests. On success, the function returns the
+ * socket, on failure it returns one of the CL_-family error code (< 0).
+ */
+int create_local_listening_socket(const char* port, int max_requests);
+
+
+/*
+ * Connect to the control socket of the servent listening on port, and store
+ * the communicating socket in sock. The function returns CONNECT_OK or
+ * CONNECT_ERROR_NO_SOCKET.
+ */
+int connect_local(const char* port, int* sock);
+
+
+/*
+ * Same as attempt_connect_to, for the control socket of the servent listening
+ * on port.
+ */
+ERROR_CODES_USUAL int attempt_connect_local(const char* port, int* sock,
+                                            int nb_attempt, int sleep_time);
+
+
+/*
+ * Return 1 if the peer of sock, a connection accepted on a control socket,
+ * runs as the same user as the calling process, 0 otherwise.
+ */
+int is_local_peer_trusted(int sock);
+
 #endif /* NETWORKING_H */
@@ -0,0 +1,436 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+
+#include "packet.h"
+#include "util.h"
+
+
+/*
+ * Buffers are taken from size-classed free lists. Class i holds buffers of
+ * PACKET_SMALLEST_CLASS << (i * 2) bytes, i.e 64, 256, 1024, 4096, 16384 and
+ * 65536 bytes. Larger buffers are directly allocated and freed.
+ *
+ * The free lists are thread local, so a packet released by another thread than
+ * the one that created it simply migrates to the pool of the releasing thread.
+ * The pools of a thread are given back to the system when it exits.
+ */
+#define PACKET_SMALLEST_CLASS 64
+#define PACKET_NB_CLASSES 6
+
+
+/*
+ * Maximum number of free buffers kept in a single class. Beyond that, released
+ * buffers are given back to the system.
+ */
+#define PACKET_MAX_POOLED 64
+
+
+/* Buffer outgrown by a packet being decoded (see packet_t). */
+typedef struct retired_buffer_s {
+    struct retired_buffer_s* next;
+    char* data;
+    size_t capacity;
+} retired_buffer_t;
+
+
+/* Free buffer, linked through its first bytes. */
+typedef struct free_buffer_s {
+    struct free_buffer_s* next;
+} free_buffer_t;
+
+
+/* Free buffers, per class. */
+static _Thread_local free_buffer_t* free_buffers[PACKET_NB_CLASSES];
+/* Number of free buffers, per class. */
+static _Thread_local int nb_free_buffers[PACKET_NB_CLASSES];
+/* Free packet structures, linked through their next field. */
+static _Thread_local packet_t* free_packets;
+/* Number of free packet structures. */
+static _Thread_local int nb_free_packets;
+/* 1 once the pools of the thread are registered to be freed when it exits. */
+static _Thread_local int pools_registered;
+
+static pthread_once_t pools_once = PTHREAD_ONCE_INIT;
+static pthread_key_t pools_key;
+
+
+/*
+ * Return the index of the smallest class able to hold capacity bytes, or -1
+ * if capacity is larger than the largest class.
+ */
+static int get_class_for(size_t capacity);
+
+
+/*
+ * Get a buffer of at least capacity bytes, taking it from the pool if
+ * possible. The real capacity of the buffer is stored in real_capacity.
+ */
+static char* acquire_buffer(size_t capacity, size_t* real_capacity);
+
+
+/*
+ * Give back a buffer obtained through acquire_buffer.
+ */
+static void give_back_buffer(char* buffer, size_t capacity);
+
+
+/*
+ * Make sure the pools of the calling thread are freed when it exits. Called
+ * before a buffer or a packet structure is pooled.
+ */
+static void register_pools(void);
+
+
+/*
+ * Create pools_key, whose destructor frees the pools of an exiting thread.
+ */
+static void create_pools_key(void);
+
+
+/*
+ * Give back to the system every buffer and packet structure pooled by the
+ * calling thread.
+ */
+static void free_pools(void* unused);
+
+
+/*
+ * Move the content of packet to a buffer able to hold length more bytes. If
+ * retire is 1, the former buffer is kept until the packet is released,
+ * otherwise it is given back.
+ */
+static void grow_packet(packet_t* packet, size_t length, int retire);
+
+
+/*
+ * Return a pointer to the next length bytes of the frame and move the cursor
+ * past them, reading them from reader->fd if necessary. Return NULL if the
+ * frame is truncated or too large.
+ */
+static const char* reader_take(packet_reader_t* reader, size_t length);
+
+
+/******************************************************************************/
+
+
+packet_t* packet_create(size_t capacity) {
+    packet_t* packet = free_packets;
+    if (packet != NULL) {
+        free_packets = packet->next;
+        --nb_free_packets;
+    } else {
+        packet = malloc(sizeof(packet_t));
+    }
+
+    packet->data = acquire_buffer(capacity, &packet->capacity);
+    packet->size = 0;
+    atomic_init(&packet->references, 1);
+    packet->next = NULL;
+    packet->retired = NULL;
+    return packet;
+}
+
+
+packet_t* packet_begin(opcode_t opcode) {
+    packet_t* packet = packet_create(PACKET_DEFAULT_CAPACITY);
+    packet_append(packet, &opcode, PKT_ID_SIZE);
+    return packet;
+}
+
+
+void packet_retain(packet_t* packet) {
+    atomic_fetch_add_explicit(&packet->references, 1, memory_order_relaxed);
+}
+
+
+void packet_release(packet_t* packet) {
+    if (packet == NULL) {
+        return;
+    }
+
+    int references = atomic_fetch_sub_explicit(&packet->references, 1,
+                                               memory_order_acq_rel);
+    assert(references > 0);
+    if (references != 1) {
+        return;
+    }
+
+    give_back_buffer(packet->data, packet->capacity);
+    packet->data = NULL;
+
+    while (packet->retired != NULL) {
+        retired_buffer_t* retired = packet->retired;
+        packet->retired = retired->next;
+        give_back_buffer(retired->data, retired->capacity);
+        free(retired);
+    }
+
+    if (nb_free_packets < PACKET_MAX_POOLED) {
+        register_pools();
+        packet->next = free_packets;
+        free_packets = packet;
+        ++nb_free_packets;
+    } else {
+        free(packet);
+    }
+}
+
+
+void packet_reserve(packet_t* packet, size_t length) {
+    if (packet->size + length <= packet->capacity) {
+        return;
+    }
+
+    grow_packet(packet, length, 0);
+}
+
+
+void packet_append(packet_t* packet, const void* data, size_t length) {
+    packet_reserve(packet, length);
+
+    char* ptr = packet->data + packet->size;
+    write_to_packet(&ptr, data, length);
+    packet->size += length;
+}
+
+
+void packet_append_u8(packet_t* packet, uint8_t value) {
+    packet_append(packet, &value, sizeof(uint8_t));
+}
+
+
+void packet_append_string(packet_t* packet, const char* str) {
+    uint8_t length = strlen(str);
+    packet_reserve(packet, sizeof(uint8_t) + length);
+    packet_append(packet, &length, sizeof(uint8_t));
+    packet_append(packet, str, length);
+}
+
+
+int packet_send(const packet_t* packet, int fd) {
+    return write_to_fd(fd, packet->data, packet->size);
+}
+
+
+int packet_read_from_fd(packet_t* packet, int fd, size_t length) {
+    if (length == 0) {
+        return 0;
+    }
+
+    packet_reserve(packet, length);
+    if (read_from_fd(fd, packet->data + packet->size, length) != (int)length) {
+        return -1;
+    }
+
+    packet->size += length;
+    return 0;
+}
+
+
+int string_view_equals(const string_view_t* view, const char* str) {
+    return strlen(str) == view->length && memcmp(view->data, str, view->length) == 0;
+}
+
+
+void string_view_to_cstring(const string_view_t* view, char* dest) {
+    memcpy(dest, view->data, view->length);
+    dest[view->length] = '\0';
+}
+
+
+char* string_view_dup(const string_view_t* view) {
+    char* copy = malloc(view->length + 1);
+    string_view_to_cstring(view, copy);
+    return copy;
+}
+
+
+void packet_reader_begin(packet_reader_t* reader, int fd, opcode_t opcode) {
+    reader->packet = packet_create(PKT_ID_SIZE);
+    packet_append(reader->packet, &opcode, PKT_ID_SIZE);
+    reader->cursor = PKT_ID_SIZE;
+    reader->fd = fd;
+}
+
+
+void packet_reader_wrap(packet_reader_t* reader, packet_t* packet) {
+    reader->packet = packet;
+    reader->cursor = PKT_ID_SIZE;
+    reader->fd = -1;
+}
+
+
+int packet_read_u8(packet_reader_t* reader, uint8_t* value) {
+    return packet_read_bytes(reader, value, sizeof(uint8_t));
+}
+
+
+int packet_read_bytes(packet_reader_t* reader, void* dest, size_t length) {
+    const char* data = reader_take(reader, length);
+    if (data == NULL) {
+        return -1;
+    }
+
+    memcpy(dest, data, length);
+    return 0;
+}
+
+
+int packet_read_view(packet_reader_t* reader, string_view_t* view) {
+    uint8_t length;
+    if (packet_read_u8(reader, &length) == -1) {
+        return -1;
+    }
+
+    const char* data = reader_take(reader, length);
+    if (data == NULL) {
+        return -1;
+    }
+
+    view->data = data;
+    view->length = length;
+    return 0;
+}
+
+
+const char* reader_take(packet_reader_t* reader, size_t length) {
+    packet_t* packet = reader->packet;
+    size_t end = reader->cursor + length;
+
+    if (end > packet->size) {
+        if (reader->fd == -1 || end > PACKET_MAX_FRAME_SIZE) {
+            return NULL;
+        }
+
+        /* The views taken so far point into the current buffer. */
+        if (end > packet->capacity) {
+            grow_packet(packet, end - packet->size, 1);
+        }
+
+        if (packet_read_from_fd(packet, reader->fd, end - packet->size) == -1) {
+            return NULL;
+        }
+    }
+
+    const char* data = packet->data + reader->cursor;
+    reader->cursor = end;
+    return data;
+}
+
+
+void grow_packet(packet_t* packet, size_t length, int retire) {
+    size_t capacity;
+    char* data = acquire_buffer(packet->size + length, &capacity);
+    memcpy(data, packet->data, packet->size);
+
+    if (retire == 1) {
+        retired_buffer_t* retired = malloc(sizeof(retired_buffer_t));
+        retired->data = packet->data;
+        retired->capacity = packet->capacity;
+        retired->next = packet->retired;
+        packet->retired = retired;
+    } else {
+        give_back_buffer(packet->data, packet->capacity);
+    }
+
+    packet->data = data;
+    packet->capacity = capacity;
+}
+
+
+int get_class_for(size_t capacity) {
+    size_t class_capacity = PACKET_SMALLEST_CLASS;
+    for (int i = 0; i < PACKET_NB_CLASSES; i++) {
+        if (capacity <= class_capacity) {
+            return i;
+        }
+
+        class_capacity <<= 2;
+    }
+
+    return -1;
+}
+
+
+char* acquire_buffer(size_t capacity, size_t* real_capacity) {
+    int class = get_class_for(capacity);
+    if (class == -1) {
+        *real_capacity = capacity;
+        return malloc(capacity);
+    }
+
+    *real_capacity = (size_t)PACKET_SMALLEST_CLASS << (class * 2);
+
+    free_buffer_t* buffer = free_buffers[class];
+    if (buffer == NULL) {
+        return malloc(*real_capacity);
+    }
+
+    free_buffers[class] = buffer->next;
+    --nb_free_buffers[class];
+    return (char*)buffer;
+}
+
+
+void give_back_buffer(char* buffer, size_t capacity) {
+    int class = get_class_for(capacity);
+
+    /*
+     * Only buffers whose capacity is exactly the one of a class come from a
+     * pool.
+     */
+    if (class == -1 || capacity != (size_t)PACKET_SMALLEST_CLASS << (class * 2) ||
+        nb_free_buffers[class] == PACKET_MAX_POOLED) {
+        free(buffer);
+        return;
+    }
+
+    register_pools();
+    free_buffer_t* free_buffer = (free_buffer_t*)buffer;
+    free_buffer->next = free_buffers[class];
+    free_buffers[class] = free_buffer;
+    ++nb_free_buffers[class];
+}
+
+
+void register_pools(void) {
+    if (pools_registered == 1) {
+        return;
+    }
+
+    pthread_once(&pools_once, create_pools_key);
+    pthread_setspecific(pools_key, &pools_registered);
+    pools_registered = 1;
+}
+
+
+void create_pools_key(void) {
+    pthread_key_create(&pools_key, free_pools);
+}
+
+
+void free_pools(void* unused) {
+    (void)unused;
+
+    for (int i = 0; i < PACKET_NB_CLASSES; i++) {
+        while (free_buffers[i] != NULL) {
+            free_buffer_t* buffer = free_buffers[i];
+            free_buffers[i] = buffer->next;
+            free(buffer);
+        }
+
+        nb_free_buffers[i] = 0;
+    }
+
+    while (free_packets != NULL) {
+        packet_t* packet = free_packets;
+        free_packets = packet->next;
+        free(packet);
+    }
+
+    nb_free_packets = 0;
+    pools_registered = 0;
+}
@@ -0,0 +1,219 @@
+#ifndef PACKET_H
+#define PACKET_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common.h"
+#include "packets_defines.h"
+
+
+/* Reference counted packets, built on top of write_to_packet. */
+
+
+/*
+ * A buffer holding a single packet, opcode included. A packet is created with
+ * one reference, owned by its creator. Each additional owner (an outbound queue
+ * for instance) takes its own reference through packet_retain and gives it back
+ * through packet_release. The buffer goes back to its pool once the last
+ * reference is gone, which allows the same packet to be sent to several sockets
+ * without copying it, and the next packet to reuse the memory.
+ *
+ * Packets grow as they are written, so there is no need to guess their size
+ * beforehand.
+ */
+typedef struct packet_s {
+    /* Content of the packet. */
+    char* data;
+    /* Number of bytes written in data. */
+    size_t size;
+    /* Number of bytes allocated for data. */
+    size_t capacity;
+    /*
+     * Number of owners of the packet. Atomic since, in threaded mode, the
+     * client and the servent may own the same packet.
+     */
+    atomic_int references;
+    /* Next packet in the pool, when the packet is not in use. */
+    struct packet_s* next;
+    /*
+     * Buffers the packet outgrew while a frame was decoded into it, kept until
+     * the packet goes back to its pool since views may point into them.
+     */
+    struct retired_buffer_s* retired;
+} packet_t;
+
+
+/* Capacity of the packets created by packet_begin. */
+#define PACKET_DEFAULT_CAPACITY 256
+
+
+/*
+ * Create an empty packet, able to hold at least capacity bytes without being
+ * reallocated. The packet has one reference.
+ */
+packet_t* packet_create(size_t capacity);
+
+
+/*
+ * Create a packet of PACKET_DEFAULT_CAPACITY bytes and write opcode in it.
+ * This is the usual way to start building a packet before sending it.
+ */
+packet_t* packet_begin(opcode_t opcode);
+
+
+/*
+ * Add a reference to packet.
+ */
+void packet_retain(packet_t* packet);
+
+
+/*
+ * Remove a reference from packet. When the last reference is removed, the
+ * packet goes back to its pool. Passing NULL does nothing.
+ */
+void packet_release(packet_t* packet);
+
+
+/*
+ * Ensure that at least length more bytes can be written inside the packet
+ * without reallocating it. Pointers to the content of the packet are
+ * invalidated if the packet has to grow.
+ */
+void packet_reserve(packet_t* packet, size_t length);
+
+
+/*
+ * Write length bytes of data at the end of the packet, growing it if necessary.
+ */
+void packet_append(packet_t* packet, const void* data, size_t length);
+
+
+/*
+ * Write value at the end of the packet.
+ */
+void packet_append_u8(packet_t* packet, uint8_t value);
+
+
+/*
+ * Write the length of str on one byte, followed by str (trailing '\0' not
+ * included), at the end of the packet. This is how every string is sent.
+ */
+void packet_append_string(packet_t* packet, const char* str);
+
+
+/*
+ * Write the whole content of the packet in fd. Return -1 on error, 0
+ * otherwise.
+ */
+ERROR_CODES_USUAL int packet_send(const packet_t* packet, int fd);
+
+
+/*
+ * Read exactly length bytes from fd and write them at the end of the packet,
+ * growing it if necessary. The function returns -1 if the bytes could not be
+ * read (error or end of file), 0 otherwise.
+ */
+ERROR_CODES_USUAL int packet_read_from_fd(packet_t* packet, int fd, size_t length);
+
+
+/*******************************************************************************
+ * Decoding
+ */
+
+
+/*
+ * A string borrowed from a packet: data points inside the packet and is NOT
+ * nul-terminated. A view remains valid as long as the packet it points into
+ * is alive and is not written to.
+ */
+typedef struct string_view_s {
+    const char* data;
+    uint8_t length;
+} string_view_t;
+
+
+/*
+ * Return 1 if view holds the same characters as the nul-terminated string str,
+ * 0 otherwise.
+ */
+int string_view_equals(const string_view_t* view, const char* str);
+
+
+/*
+ * Copy the content of view into dest and add the trailing '\0'. dest must be
+ * at least view->length + 1 bytes long (UINT8_MAX + 1 is always enough).
+ */
+void string_view_to_cstring(const string_view_t* view, char* dest);
+
+
+/*
+ * Return a mallocated, nul-terminated copy of view. Use this only when the
+ * string must outlive the packet.
+ */
+char* string_view_dup(const string_view_t* view);
+
+
+/*
+ * Largest frame that can be decoded. A frame grows as it is received, starting
+ * from the smallest buffer: a larger one is a protocol error, after which the
+ * stream cannot be decoded anymore.
+ */
+#define PACKET_MAX_FRAME_SIZE 65536
+
+
+/*
+ * Cursor used to decode a frame. If fd is not -1, the bytes that are not yet
+ * inside packet are read from fd as the decoding goes, so a frame can be decoded
+ * while it is received, without knowing its size beforehand.
+ */
+typedef struct packet_reader_s {
+    /* The frame being decoded. */
+    packet_t* packet;
+    /* Offset of the next byte to decode inside packet. */
+    size_t cursor;
+    /* Where the rest of the frame is read from, -1 if packet is complete. */
+    int fd;
+} packet_reader_t;
+
+
+/*
+ * Prepare reader to decode a frame from fd, whose opcode (already read) is
+ * opcode. A packet is created to hold the frame, starting with the opcode ; the
+ * caller releases it (reader->packet) once it is done with the views that point
+ * into it.
+ */
+void packet_reader_begin(packet_reader_t* reader, int fd, opcode_t opcode);
+
+
+/*
+ * Prepare reader to decode packet, a complete frame, after its opcode. The
+ * reader takes over the reference of the caller.
+ */
+void packet_reader_wrap(packet_reader_t* reader, packet_t* packet);
+
+
+/*
+ * Read one byte. Return -1 if the frame is truncated or larger than
+ * PACKET_MAX_FRAME_SIZE, 0 otherwise. The other packet_read_* functions fail
+ * the same way.
+ */
+ERROR_CODES_USUAL int packet_read_u8(packet_reader_t* reader, uint8_t* value);
+
+
+/*
+ * Read length bytes and copy them into dest. Return -1 if the frame is
+ * truncated, 0 otherwise.
+ */
+ERROR_CODES_USUAL int packet_read_bytes(packet_reader_t* reader, void* dest,
+                                        size_t length);
+
+
+/*
+ * Read a string (1 byte length, followed by the characters) and store it in
+ * view, without copying it. Return -1 if the frame is truncated, 0 otherwise.
+ */
+ERROR_CODES_USUAL int packet_read_view(packet_reader_t* reader, string_view_t* view);
+
+#endif /* PACKET_H */
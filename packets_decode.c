@@ -0,0 +1,58 @@
+#include "packets_decode.h"
+
+
+int decode_search_query(packet_reader_t* reader, search_query_t* query) {
+    if (packet_read_view(reader, &query->ip_source) == -1 ||
+        packet_read_view(reader, &query->port_source) == -1 ||
+        packet_read_view(reader, &query->filename) == -1) {
+        return -1;
+    }
+
+    query->ttl_offset = reader->cursor;
+    if (packet_read_u8(reader, &query->ttl) == -1) {
+        return -1;
+    }
+
+    query->hits_offset = reader->cursor;
+    if (packet_read_u8(reader, &query->nb_hits) == -1) {
+        return -1;
+    }
+
+    for (int i = 0; i < query->nb_hits; i++) {
+        string_view_t ip, port;
+        if (packet_read_view(reader, &ip) == -1 ||
+            packet_read_view(reader, &port) == -1) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+int decode_search_answer(packet_reader_t* reader, search_answer_t* answer) {
+    if (packet_read_view(reader, &answer->filename) == -1 ||
+        packet_read_u8(reader, &answer->nb_hits) == -1) {
+        return -1;
+    }
+
+    for (int i = 0; i < answer->nb_hits; i++) {
+        if (packet_read_view(reader, &answer->hits[i].ip) == -1 ||
+            packet_read_view(reader, &answer->hits[i].port) == -1) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+int decode_download_target(packet_reader_t* reader, download_target_t* target) {
+    if (packet_read_view(reader, &target->ip) == -1 ||
+        packet_read_view(reader, &target->port) == -1 ||
+        packet_read_view(reader, &target->filename) == -1) {
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,78 @@
+#ifndef PACKETS_DECODE_H
+#define PACKETS_DECODE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common.h"
+#include "packet.h"
+
+
+/*
+ * Decoded packets. The decoders below fill fixed-layout structures whose
+ * strings are views into the frame being decoded: nothing is allocated, and the
+ * structures are only valid as long as the frame is. See packets_doc.h for the
+ * layout of each packet.
+ *
+ * Every decoder expects the opcode to be already consumed, and returns -1 if
+ * the frame is truncated, 0 otherwise.
+ */
+
+
+/*
+ * A machine inside the list of machines that have a file.
+ */
+typedef struct search_hit_s {
+    string_view_t ip;
+    string_view_t port;
+} search_hit_t;
+
+
+/*
+ * CMSG_SEARCH_REQUEST. The list of machines is only skipped, since the request
+ * is forwarded as it is: hits_offset allows to copy it in one go.
+ */
+typedef struct search_query_s {
+    string_view_t ip_source;
+    string_view_t port_source;
+    string_view_t filename;
+    uint8_t ttl;
+    uint8_t nb_hits;
+
+    /* Offset of the TTL inside the frame. */
+    size_t ttl_offset;
+    /* Offset of the number of machines inside the frame (the machines follow). */
+    size_t hits_offset;
+} search_query_t;
+
+ERROR_CODES_USUAL int decode_search_query(packet_reader_t* reader,
+                                          search_query_t* query);
+
+
+/*
+ * SMSG_SEARCH_REQUEST and SMSG_INT_SEARCH, which share the same layout.
+ */
+typedef struct search_answer_s {
+    string_view_t filename;
+    uint8_t nb_hits;
+    search_hit_t hits[UINT8_MAX];
+} search_answer_t;
+
+ERROR_CODES_USUAL int decode_search_answer(packet_reader_t* reader,
+                                           search_answer_t* answer);
+
+
+/*
+ * CMSG_INT_DOWNLOAD, and the end of SMSG_DOWNLOAD / SMSG_INT_DOWNLOAD when
+ * the answer is an error.
+ */
+typedef struct download_target_s {
+    string_view_t ip;
+    string_view_t port;
+    string_view_t filename;
+} download_target_t;
+
+ERROR_CODES_USUAL int decode_download_target(packet_reader_t* reader,
+                                             download_target_t* target);
+
+#endif /* PACKETS_DECODE_H */
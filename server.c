@@ -19,15 +19,27 @@
 #include "common.h"
 #include "list.h"
 #include "log.h"
+#include "metrics.h"
 #include "networking.h"
 #include "packets_defines.h"
 #include "server.h"
 #include "server_internal.h"
+#include "trace.h"
 #include "util.h"
 
 
-/* As long as this equals 1, the server continues it's loop. */
-sig_atomic_t _loop = 1;
+/*
+ * Set by SIGINT, which is only handled by the servent of a forked process, the
+ * only one of the process.
+ */
+static volatile sig_atomic_t interrupted = 0;
+
+/*
+ * Set the tunables of server from options (NULL for the default ones), and
+ * return the number of worker threads to start.
+ */
+static int apply_options(server_t* server, const server_options_t* options);
+
 
 /*
  * SIGINT handler.
@@ -45,7 +57,7 @@ static void handle_sigint(int sigint);
  * the other.
  *
  * The function will return one of the HANDSHAKE_-family error codes to
- * indicate what happened. On success, the server->client_socket will become
+ * indicate what happened. On success, the server->client link will become
  * the socket used to communicate with the client.
  */
 static int handshake(server_t *server, int client_socket);
@@ -75,6 +87,29 @@ static int loop(server_t* server);
 #define LOOP_MIN_DURATION 50
 
 
+/*
+ * Update the gauges of the metrics (number of neighbours, size of the queues).
+ * Return the number of packets waiting to be sent to the neighbours.
+ */
+static int update_metrics(const server_t* server);
+
+
+/*
+ * Complete the jobs finished by the workers and the downloads finished by the
+ * transfer engine, and send the packets they queued for the neighbours. Called
+ * between the steps of the loop which can block, so that an answer does not
+ * wait for the next iteration.
+ */
+static void complete_jobs(server_t* server);
+
+
+/*
+ * Sleep until LOOP_MIN_DURATION milliseconds have passed since begin,
+ * completing the jobs as soon as the workers finish them.
+ */
+static void wait_for_workers(server_t* server, const struct timespec* begin);
+
+
 /*
  * Close all sockets on the server. After a call to this function, the server
  * is ready to exit.
@@ -83,23 +118,30 @@ static void clear_server(server_t* server);
 
 
 /*
- * Loop over the whole list of awaiting sockets and answers to their requests
- * if any. If the other extremity of a socket has been closed, we don't answer
- * and we close it as well.
+ * Release what run_server set up when it has to stop before entering its loop.
+ * The link to the client is closed, so a client in the same process learns
+ * that the servent is gone instead of waiting for it.
+ */
+static void abort_server(server_t* server);
+
+
+/*
+ * Close the awaiting sockets that stayed silent past their deadline, then poll
+ * the others, all at once, and answer to their requests if any. If the other
+ * extremity of a socket has been closed, we don't answer and we close it as
+ * well.
  */
 static void handle_awaiting_sockets(server_t* server);
 
 
 /*
- * Check if the socket has something for us and answer the request if necessary.
- * If there is nothing to read, the function returns 0, otherwise it return one
- * of AWAIT_-family values to indicate if we must close the socket and remove it
- * from the awaiting list, or only remove it from the list.
+ * Read the request of a socket that has something for us and answer it, unless
+ * ip (the other extremity) is not admitted or the request is shed. The
+ * function returns one of AWAIT_-family values to indicate if we must close the
+ * socket and remove it from the awaiting list, or only remove it from the list.
  */
-static int handle_awaiting_socket(server_t* server, int socket);
+static int handle_awaiting_socket(server_t* server, int socket, const char* ip);
 
-/* Do nothing. */
-#define AWAIT_EMPTY 0
 /* Close and remove. */
 #define AWAIT_CLOSE 1
 /* Don't close and remove. */
@@ -107,9 +149,10 @@ static int handle_awaiting_socket(server_t* server, int socket);
 
 
 /*
- * Loop over the neighbours sockets and answers to their requests if any. If the
- * other extremity of a socket has been closed, we set it to -1 and decrease our
- * number of neighbours by one.
+ * Loop over the neighbours sockets and answers to their requests if any (up to
+ * NEIGHBOUR_FRAMES_PER_LOOP per neighbour). If the other extremity of a socket
+ * has been closed, we set it to -1 and decrease our number of neighbours by
+ * one.
  *
  * The function returns 0 to indicate nothing special happened, or 1 if we ran
  * out of neighbours. In that case, we shutdown.
@@ -118,11 +161,20 @@ static int handle_neighbours(server_t* server);
 
 
 /*
- * Handle a single neighbour. The function returns 1 to indicate we must remove
- * the neighbour from the list of neighbours, and 0 if we have nothing special
- * to do.
+ * Handle a single frame of a neighbour, waiting for it at most timeout
+ * milliseconds. The function returns one of NEIGHBOUR_-family values.
+ */
+static int handle_neighbour(server_t* server, socket_contact_t* neighbour, int timeout);
+
+/* Nothing to read. */
+#define NEIGHBOUR_IDLE 0
+/*
+ * The neighbour left, or sent a frame we cannot read: remove it from the list
+ * of neighbours.
  */
-static int handle_neighbour(server_t* server, socket_contact_t* neighbour);
+#define NEIGHBOUR_REMOVE 1
+/* A frame was handled. */
+#define NEIGHBOUR_HANDLED 2
 
 
 /*
@@ -134,9 +186,9 @@ static void display_neighbours(const server_t* server);
 
 
 /*
- * Check if the client has something to say, and handle the requests if any. If
- * the client sent CMSG_INT_EXIT, the function return 1 to indicate we must stop.
- * Otherwise it return 0.
+ * Check if the client has something to say, and handle its requests if any, up
+ * to CLIENT_FRAMES_PER_LOOP of them. If the client sent CMSG_INT_EXIT, the
+ * function return 1 to indicate we must stop. Otherwise it return 0.
  */
 static int handle_client(server_t* server);
 
@@ -144,29 +196,53 @@ static int handle_client(server_t* server);
 
 
 /*
- * When a new socket is returned by accept_connection, handle it, i.e, if the
- * handshake has not been done, add it to the waiting list with a SOCKET_WAIT
- * status ; if the handshake has been done, add it to the waiting list with a
- * SOCKET_READY status.
+ * Wait up to timeout milliseconds for a frame of the client, and handle it if
+ * there is one. Return one of the CLIENT_* values below.
+ */
+static int handle_client_frame(server_t* server, int timeout);
+
+/* Nothing to read. */
+#define CLIENT_IDLE 0
+/* The client sent CMSG_INT_EXIT, or left. */
+#define CLIENT_STOP 1
+/* A frame was handled. */
+#define CLIENT_HANDLED 2
+
+
+/*
+ * When a new socket is returned by accept_connection, add it to the awaiting
+ * sockets, with a deadline to send its first request. If there are already
+ * MAX_AWAITING_SOCKETS of them, the oldest one is closed to make room. ip is
+ * the IP of the other extremity.
  */
-static void handle_new_socket(server_t* server, int new_socket);
+static void handle_new_socket(server_t* server, int new_socket, const char* ip);
 
 
 /*
- * After we accept a new socket, look at the result returned by attempt_accept.
+ * After we accept a new socket on the listening socket, look at the result
+ * returned by attempt_accept.
  *
- * If the local client connected and handshaked gracefully or if a remote client
- * connected gracefully, the function does nothing. If the local client handshaked
- * twice, the function issues a warning. If the local client send a bad paquet
- * during the handshake, the function kills the client, clears the server and
- * exit. Finally, if accept() failed earlier, the function displays the content
- * of errno. In all other cases, the function does nothing.
+ * If a remote client connected gracefully, and its IP does not connect too
+ * often, the socket is added to the awaiting sockets. If accept() failed
+ * earlier, the function displays the content of errno. In all other cases, the
+ * function does nothing.
  */
 static void handle_accept_result(server_t* server, int result);
 
 
 /*
- * Loop over the pending requests and execute them.
+ * Accept the local client on the control socket, if it is trying to connect,
+ * and perform the handshake. A peer running as another user is refused.
+ *
+ * If the local client send a bad paquet during the handshake, the function
+ * kills the client, clears the server and exit.
+ */
+static void accept_client(server_t* server);
+
+
+/*
+ * Loop over the pending requests and execute them. Nothing is done while we
+ * have no neighbour.
  */
 static void handle_pending_requests(server_t* server);
 
@@ -190,36 +266,42 @@ static void handle_pending_request(server_t* server, request_t* request);
 static void update_log_timers(server_t* server, long int diff);
 
 
-/*
- * Loop over the sockets that have a download initiated through them and see
- * if there is something to read on them. If so, handle the answer and close the
- * socket once it is done.
- */
-static void handle_pending_downloads(server_t* server);
-
-
-/*
- * Handle one specific download. The function returns 1 if the download is over
- * and the socket can safely be closed, otherwise it returns 0.
- */
-static int handle_pending_download(server_t* server, int sock);
-
-
 /******************************************************************************/
 
 
 int run_server(int first_machine, const char *listen_port,
-               const char *ip, const char *port) {
+               const char *ip, const char *port, const server_options_t* options,
+               const local_link_t* client_link) {
     server_t server;
-    server.client_socket    = 0;
+    /*
+     * Known before any socket is created, so that every abort_server closes
+     * the real link and the client sees the servent stop.
+     */
+    local_link_init(&server.client);
+    if (client_link != NULL) {
+        server.client = *client_link;
+    }
     server.listening_socket = 0;
+    server.control_socket   = -1;
     for (int i = 0; i < MAX_NEIGHBOURS; ++i) {
         server.neighbours[i].sock = -1;
-        server.neighbours[i].port = 0;
+        server.neighbours[i].ip = NULL;
+        server.neighbours[i].port = NULL;
+        server.neighbours[i].outbound_first = 0;
+        server.neighbours[i].nb_outbound = 0;
     }
     server.nb_neighbours    = 0;
-    server.handshake        = 0;
+    server.neighbours_index = hashmap_create(NULL);
+    server.handshake        = client_link != NULL;
     server.self_ip          = NULL;
+    server.self_port[0]     = '\0';
+    server.running          = 1;
+    server.admission        = NULL;
+    server.next_prune       = 0;
+    server.overloaded       = 0;
+    server.workers          = NULL;
+    server.transfers        = NULL;
+    int nb_workers = apply_options(&server, options);
 
     char host_name[NI_MAXHOST], port_number[NI_MAXSERV];
     int listening_socket = create_listening_socket(listen_port == NULL ? SERVER_LISTEN_PORT : listen_port,
@@ -228,13 +310,29 @@ int run_server(int first_machine, const char *listen_port,
     if (listening_socket < 0) {
         applog(LOG_LEVEL_FATAL, "[Server] Impossible de créer la socket "
                                 "d'écoute. Extinction.\n");
-        exit(EXIT_FAILURE);
+        abort_server(&server);
+        return EXIT_FAILURE;
     } else {
         applog(LOG_LEVEL_INFO, "[Server] Listening on %s:%s.\n",
                                host_name, port_number);
     }
 
     server.listening_socket = listening_socket;
+    strcpy(server.self_port, port_number);
+
+    /* Same process as the client: no control socket, no handshake. */
+    if (client_link == NULL) {
+        int control_socket = create_local_listening_socket(listen_port == NULL ? SERVER_LISTEN_PORT : listen_port,
+                                                           1);
+        if (control_socket < 0) {
+            applog(LOG_LEVEL_FATAL, "[Server] Impossible de créer la socket "
+                                    "locale. Extinction.\n");
+            abort_server(&server);
+            return EXIT_FAILURE;
+        }
+
+        server.control_socket = control_socket;
+    }
 
     if (first_machine == 0) {
         int res = join_network(&server, ip, port);
@@ -242,28 +340,75 @@ int run_server(int first_machine, const char *listen_port,
         if (res == -1) {
             applog(LOG_LEVEL_FATAL, "[Client] Impossible d'acquérir des voisins. "
                                     "Extinction.\n");
-            close(server.listening_socket);
-            exit(EXIT_FAILURE);
+            abort_server(&server);
+            return EXIT_FAILURE;
         }
     }
 
-    server.awaiting_sockets = list_create(compare_ints, add_new_socket);
-    server.pending_requests = list_create(NULL, add_new_request);
-    server.received_search_requests = list_create(NULL, add_new_search_request_log);
-    server.pending_downloads = list_create(NULL, add_new_socket);
-    signal(SIGINT, handle_sigint);
+    intrusive_list_init(&server.awaiting_sockets);
+    intrusive_list_init(&server.pending_requests);
+    server.received_search_requests = hashmap_create(free);
+    server.admission = hashmap_create(free);
+
+    server.workers = worker_pool_create(nb_workers, &server);
+    if (server.workers == NULL) {
+        applog(LOG_LEVEL_ERROR, "[Server] Impossible de créer les workers, les "
+                                "fichiers seront cherchés par la boucle.\n");
+        server.workers = worker_pool_create(0, &server);
+    }
+
+    server.transfers = transfer_engine_create();
+    if (server.transfers == NULL) {
+        applog(LOG_LEVEL_FATAL, "[Server] Impossible de démarrer le moteur de "
+                                "transferts. Extinction.\n");
+        leave_network(&server);
+        clear_server(&server);
+        return EXIT_FAILURE;
+    }
+
+    /* When embedded, the signals belong to the host application. */
+    if (client_link == NULL) {
+        signal(SIGINT, handle_sigint);
+    }
+
+    trace_start();
     loop(&server);
     leave_network(&server);
 
     clear_server(&server);
+    trace_stop();
     return EXIT_SUCCESS;
 }
 
 
+int apply_options(server_t* server, const server_options_t* options) {
+    server_options_t defaults = { 0, 0, 0 };
+    if (options == NULL) {
+        options = &defaults;
+    }
+
+    server->search_ttl = DEFAULT_TTL;
+    if (options->search_ttl > 0) {
+        server->search_ttl = options->search_ttl < UINT8_MAX ? options->search_ttl : UINT8_MAX;
+    }
+
+    server->max_neighbours = MAX_NEIGHBOURS;
+    if (options->max_neighbours > 0 && options->max_neighbours < MAX_NEIGHBOURS) {
+        server->max_neighbours = options->max_neighbours;
+    }
+
+    if (options->workers < 0) {
+        return 0;
+    }
+
+    return options->workers > 0 ? options->workers : WORKER_THREADS;
+}
+
+
 int loop(server_t* server) {
     int print_timer = 10 * IN_MILLISECONDS;
     int time_diff = LOOP_MIN_DURATION;
-    while (_loop == 1) {
+    while (server->running == 1 && interrupted == 0) {
         struct timespec begin;
         clock_gettime(CLOCK_REALTIME, &begin);
 
@@ -274,6 +419,11 @@ int loop(server_t* server) {
 
         handle_accept_result(server, res);
         handle_awaiting_sockets(server);
+        complete_jobs(server);
+
+        if (server->handshake == 0) {
+            accept_client(server);
+        }
 
         if (print_timer <= time_diff) {
             display_neighbours(server);
@@ -283,34 +433,76 @@ int loop(server_t* server) {
         }
 
         handle_neighbours(server);
-        handle_pending_downloads(server);
+        complete_jobs(server);
+
+        /* The workers look up the files of the searches while we poll. */
+        handle_pending_requests(server);
 
         if (handle_client(server) == 1) {
-            _loop = 0;
+            server->running = 0;
         }
 
-        /*
-         * If we don't have at least one neighbour, sending a request accross
-         * the network has no sense. Moreover, it means we don't know server->self_ip,
-         * and since the packets rely on it... Niah...
-         */
-        if (server->nb_neighbours != 0) {
-            handle_pending_requests(server);
-        }
+        metric_set(METRIC_PENDING_REQUESTS, server->pending_requests.length);
+        handle_pending_requests(server);
+        complete_jobs(server);
+
+        int nb_outbound = update_metrics(server);
+        flush_neighbours(server);
 
         update_log_timers(server, time_diff);
 
         time_diff = elapsed_time_since(&begin);
+        metric_inc(METRIC_LOOP_ITERATIONS);
+        metric_set(METRIC_LOOP_DURATION, time_diff);
+        update_admission(server, time_diff, nb_outbound);
+
         if (time_diff < LOOP_MIN_DURATION) {
-            millisleep(LOOP_MIN_DURATION - time_diff);
+            wait_for_workers(server, &begin);
             time_diff = LOOP_MIN_DURATION;
         }
+
+        metrics_tick(time_diff);
     }
 
+    metrics_write_output();
     return 0;
 }
 
 
+int update_metrics(const server_t* server) {
+    int nb_outbound = 0;
+    for (int i = 0; i < MAX_NEIGHBOURS; ++i) {
+        if (server->neighbours[i].sock != -1) {
+            nb_outbound += server->neighbours[i].nb_outbound;
+        }
+    }
+
+    metric_set(METRIC_NEIGHBOURS, server->nb_neighbours);
+    metric_set(METRIC_AWAITING_SOCKETS, server->awaiting_sockets.length);
+    metric_set(METRIC_OUTBOUND_PACKETS, nb_outbound);
+    metric_set(METRIC_WORKER_JOBS, worker_pool_pending(server->workers));
+    return nb_outbound;
+}
+
+
+void complete_jobs(server_t* server) {
+    complete_transfers(server);
+    if (worker_pool_complete(server->workers) > 0) {
+        flush_neighbours(server);
+    }
+}
+
+
+void wait_for_workers(server_t* server, const struct timespec* begin) {
+    int remaining;
+    while ((remaining = LOOP_MIN_DURATION - elapsed_time_since(begin)) > 0) {
+        if (worker_pool_wait(server->workers, remaining) == 1) {
+            complete_jobs(server);
+        }
+    }
+}
+
+
 void handle_accept_result(server_t *server, int result) {
     if (result == ACCEPT_ERR_TIMEOUT) {
         return;
@@ -322,40 +514,58 @@ void handle_accept_result(server_t *server, int result) {
         return;
     }
 
-    int socket = result;
-    char* ip = NULL, *port = NULL;
-    extract_ip_port_from_socket_s(socket, &ip, &port, 1);
-    if (ip == NULL) {
-        applog(LOG_LEVEL_WARNING, "[Server] inet_ntop failed. Erreur : %s.\n",
+    /* Only remote peers come through the listening socket. */
+    char ip[INET6_ADDRSTRLEN];
+    extract_ip_from_socket(result, ip, 1);
+    if (admit_connection(server, ip) == 0) {
+        close(result);
+        return;
+    }
+
+    applog(LOG_LEVEL_INFO, "[Server] Connexion acceptée (%d).\n", result);
+    handle_new_socket(server, result, ip);
+}
+
+
+void accept_client(server_t* server) {
+    int res = attempt_accept(server->control_socket, 0, NULL, NULL);
+    if (res == ACCEPT_ERR_TIMEOUT) {
+        return;
+    }
+
+    if (res == -1) {
+        applog(LOG_LEVEL_ERROR, "[Server] Erreur durant accept() (locale) : %s.\n",
                strerror(errno));
+        return;
+    }
 
-        if (errno == EAFNOSUPPORT) {
-            close(socket);
-        }
-    } else {
-        /* Check if we can handshake. */
-        applog(LOG_LEVEL_INFO, "[Server] Connexion acceptée depuis %s:%s.\n",
-               ip, port);
-
-        if (strcmp(ip, "127.0.0.1") == 0 ||
-            strcmp(ip, "0000:0000:0000:0000:0000:0000:0000:0001") == 0) {
-            int handshake_result = handshake(server, socket);
-            handle_handshake_result(server, handshake_result);
-            free(ip);
-            free(port);
-            return;
-        } else {
-            handle_new_socket(server, socket);
-        }
+    if (is_local_peer_trusted(res) == 0) {
+        applog(LOG_LEVEL_WARNING, "[Server] Connexion locale d'un autre "
+                                  "utilisateur refusée.\n");
+        close(res);
+        return;
     }
 
-    free(ip);
-    free(port);
+    int handshake_result = handshake(server, res);
+    handle_handshake_result(server, handshake_result);
 }
 
 
-void handle_new_socket(server_t* server, int new_socket) {
-    list_push_back(server->awaiting_sockets, &new_socket);
+void handle_new_socket(server_t* server, int new_socket, const char* ip) {
+    trace_connection_opened(new_socket);
+
+    if (server->awaiting_sockets.length >= MAX_AWAITING_SOCKETS) {
+        idle_socket_t* oldest = idle_socket_pop_expired(&server->awaiting_sockets, 0, 1);
+        applog(LOG_LEVEL_INFO, "[Server] Trop de connexions en attente, fermeture "
+                               "de la plus ancienne (%d).\n", oldest->sock);
+        close(oldest->sock);
+        free(oldest);
+        metric_inc(METRIC_EVICTED_OVERFLOW);
+    }
+
+    idle_socket_t* awaiting = idle_socket_push(&server->awaiting_sockets, new_socket,
+                                               AWAIT_IDLE_TIMEOUT);
+    strcpy(awaiting->ip, ip);
 }
 
 
@@ -364,17 +574,17 @@ int handshake(server_t* server, int client_socket) {
         return HANDSHAKE_ALREADY_SHAKED;
     }
 
-    server->client_socket = client_socket;
+    local_link_from_socket(&server->client, client_socket);
 
     opcode_t client_data;
-    read_from_fd(server->client_socket, &client_data, PKT_ID_SIZE);
+    read_from_fd(client_socket, &client_data, PKT_ID_SIZE);
 
     if (client_data != CMSG_INT_HANDSHAKE) {
         return HANDSHAKE_BAD_OPCODE;
     }
 
     opcode_t data = SMSG_INT_HANDSHAKE;
-    write_to_fd(server->client_socket, &data, PKT_ID_SIZE);
+    write_to_fd(client_socket, &data, PKT_ID_SIZE);
 
     server->handshake = 1;
 
@@ -404,65 +614,104 @@ void handle_handshake_result(server_t* server, int result) {
 
 
 void handle_awaiting_sockets(server_t* server) {
-    cell_t* prev = NULL;
-    for (cell_t* head = server->awaiting_sockets->head; head != NULL; ) {
-        int res = handle_awaiting_socket(server, *(int*)head->data);
-        if (res == AWAIT_EMPTY) {
-            prev = head;
-            head = head->next;
-        } else {
-            if (res == AWAIT_CLOSE) {
-                close(*(int*)head->data);
-            }
+    uint64_t now = metrics_now();
+    idle_socket_t* expired;
+    while ((expired = idle_socket_pop_expired(&server->awaiting_sockets, now, 0)) != NULL) {
+        applog(LOG_LEVEL_INFO, "[Server] Connexion muette fermée (%d).\n", expired->sock);
+        close(expired->sock);
+        free(expired);
+        metric_inc(METRIC_EVICTED_IDLE);
+    }
+
+    int nb_awaiting = server->awaiting_sockets.length;
+    if (nb_awaiting == 0) {
+        return;
+    }
+
+    struct pollfd pollers[MAX_AWAITING_SOCKETS];
+    idle_socket_t* awaiting[MAX_AWAITING_SOCKETS];
+    int i = 0;
+    for (list_node_t* node = server->awaiting_sockets.head; node != NULL; node = node->next) {
+        awaiting[i] = LIST_ENTRY(node, idle_socket_t, node);
+        pollers[i].fd = awaiting[i]->sock;
+        pollers[i].events = POLLIN;
+        pollers[i].revents = 0;
+        ++i;
+    }
+
+    if (poll(pollers, nb_awaiting, AWAIT_TIMEOUT) <= 0) {
+        return;
+    }
 
-            list_pop_at(server->awaiting_sockets, &prev, &head);
+    for (i = 0; i < nb_awaiting; i++) {
+        if (pollers[i].revents == 0) {
+            continue;
         }
+
+        int res = handle_awaiting_socket(server, awaiting[i]->sock, awaiting[i]->ip);
+        if (res == AWAIT_CLOSE) {
+            close(awaiting[i]->sock);
+        }
+
+        intrusive_list_remove(&server->awaiting_sockets, &awaiting[i]->node);
+        free(awaiting[i]);
     }
 }
 
 
-int handle_awaiting_socket(server_t* server, int socket) {
-    struct pollfd poller;
-    int res = poll_fd(&poller, socket, POLLIN, AWAIT_TIMEOUT);
-    if (res == 0) {
-        return AWAIT_EMPTY;
+int handle_awaiting_socket(server_t* server, int socket, const char* ip) {
+    opcode_t opcode;
+    if (read_from_fd(socket, &opcode, PKT_ID_SIZE) != PKT_ID_SIZE) {
+        return AWAIT_CLOSE;
     }
 
-    opcode_t opcode;
-    read_from_fd(socket, &opcode, PKT_ID_SIZE);
+    /* Decided on the opcode alone, before reading the rest of the request. */
+    if (admit_request(server, ip, opcode) == 0 || shed_request(server, opcode) == 1) {
+        return AWAIT_CLOSE;
+    }
+
+    uint64_t begin = metrics_now();
+    int result = AWAIT_CLOSE;
 
     switch (opcode) {
     case CMSG_NEIGHBOURS:
         applog(LOG_LEVEL_INFO, "[Client] Received CMSG_NEIGHBOURS\n");
+        trace_frame(TRACE_AWAITING, socket, &opcode, PKT_ID_SIZE);
         compute_and_send_neighbours(server, socket);
         break;
 
     case CMSG_JOIN:
         applog(LOG_LEVEL_INFO, "[Client] Received CMSG_JOIN\n");
-        if (handle_join_request(server, socket) == 0) {
-            return AWAIT_CLOSE;
-        } else {
-            return AWAIT_KEEP;
+        if (handle_join_request(server, socket) == 1) {
+            result = AWAIT_KEEP;
         }
         break;
 
     case CMSG_DOWNLOAD:
         handle_remote_download_request(server, socket);
-        return AWAIT_KEEP;
+        result = AWAIT_KEEP;
+        break;
 
     default:
+        trace_frame(TRACE_AWAITING, socket, &opcode, PKT_ID_SIZE);
         break;
     }
 
-    return AWAIT_CLOSE;
+    histogram_record_since(DISPATCH_AWAITING, opcode, begin);
+    return result;
 }
 
 
 int handle_neighbours(server_t* server) {
     for (int i = 0; i < MAX_NEIGHBOURS; i++) {
         if (server->neighbours[i].sock != -1) {
-            int remove = handle_neighbour(server, server->neighbours + i);
-            if (remove == 1) {
+            int res = NEIGHBOUR_HANDLED;
+            for (int n = 0; n < NEIGHBOUR_FRAMES_PER_LOOP && res == NEIGHBOUR_HANDLED; n++) {
+                res = handle_neighbour(server, server->neighbours + i,
+                                       n == 0 ? AWAIT_TIMEOUT : 0);
+            }
+
+            if (res == NEIGHBOUR_REMOVE) {
                 int res = handle_leave(server, server->neighbours + i);
                 if (res == 1) {
                     return 1;
@@ -475,33 +724,63 @@ int handle_neighbours(server_t* server) {
 }
 
 
-int handle_neighbour(server_t* server, socket_contact_t* neighbour) {
+int handle_neighbour(server_t* server, socket_contact_t* neighbour, int timeout) {
     int sock = neighbour->sock;
     struct pollfd poller;
-    int poll_res = poll_fd(&poller, sock, POLLIN, AWAIT_TIMEOUT);
+    int poll_res = poll_fd(&poller, sock, POLLIN, timeout);
 
     if (poll_res == 0) {
-        return 0;
+        return NEIGHBOUR_IDLE;
     }
 
     opcode_t opcode;
-    read_from_fd(sock, &opcode, PKT_ID_SIZE);
+    if (read_from_fd(sock, &opcode, PKT_ID_SIZE) != PKT_ID_SIZE) {
+        return NEIGHBOUR_REMOVE;
+    }
+
+    uint64_t begin = metrics_now();
+    int result = NEIGHBOUR_HANDLED;
+    int invalid = 0;
 
     switch (opcode) {
     case CMSG_SEARCH_REQUEST:
-        handle_remote_search_request(server, sock);
+        metric_inc(METRIC_QUERIES_IN);
+        /* The request has to be read anyway, to get to the next one. */
+        if (handle_remote_search_request(server, sock,
+                                         admit_request(server, neighbour->ip, opcode) == 1 &&
+                                         shed_request(server, opcode) == 0) == -1) {
+            invalid = 1;
+        }
         break;
 
     case CMSG_LEAVE:
         applog(LOG_LEVEL_INFO, "[Server] Received CMSG_LEAVE\n");
-        return 1;
+        trace_frame(TRACE_NEIGHBOUR, sock, &opcode, PKT_ID_SIZE);
+        result = NEIGHBOUR_REMOVE;
+        break;
 
     case SMSG_SEARCH_REQUEST:
-        handle_remote_search_answer(server, neighbour->sock);
+        metric_inc(METRIC_QUERY_ANSWERS_IN);
+        if (handle_remote_search_answer(server, neighbour->sock) == -1) {
+            invalid = 1;
+        }
+        break;
+
+    default:
+        trace_frame(TRACE_NEIGHBOUR, sock, &opcode, PKT_ID_SIZE);
         break;
     }
 
-    return 0;
+    histogram_record_since(DISPATCH_NEIGHBOUR, opcode, begin);
+
+    /* Where the frame ends is unknown, so nothing after it can be read either. */
+    if (invalid == 1) {
+        applog(LOG_LEVEL_WARNING, "[Server] Paquet %d invalide de %s:%s, voisin retiré.\n",
+               opcode, neighbour->ip, neighbour->port);
+        result = NEIGHBOUR_REMOVE;
+    }
+
+    return result;
 }
 
 
@@ -521,48 +800,96 @@ void display_neighbours(const server_t* server) {
 
 
 int handle_client(server_t* server) {
+    for (int n = 0; n < CLIENT_FRAMES_PER_LOOP; n++) {
+        int res = handle_client_frame(server, n == 0 ? HANDLE_CLIENT_TIMEOUT : 0);
+        if (res != CLIENT_HANDLED) {
+            return res == CLIENT_STOP;
+        }
+    }
+
+    return 0;
+}
+
+
+int handle_client_frame(server_t* server, int timeout) {
+    if (!local_link_is_open(&server->client)) {
+        return CLIENT_IDLE;
+    }
+
     struct pollfd poller;
-    int res = poll_fd(&poller, server->client_socket, POLLIN, HANDLE_CLIENT_TIMEOUT);
+    int res = poll_fd(&poller, local_link_fd(&server->client), POLLIN, timeout);
 
     if (res == 0) {
-        return 0;
+        return CLIENT_IDLE;
     }
 
     opcode_t opcode;
-    read_from_fd(server->client_socket, &opcode, PKT_ID_SIZE);
+    packet_reader_t reader;
+    res = local_link_receive(&server->client, &reader, &opcode);
+    if (res == 0) {
+        return CLIENT_IDLE;
+    } else if (res == -1) {
+        applog(LOG_LEVEL_WARNING, "[Local Server] Client disconnected\n");
+        local_link_close(&server->client);
+        leave_network(server);
+        return CLIENT_STOP;
+    }
+
+    trace_frame(TRACE_CLIENT, -1, reader.packet->data, reader.packet->size);
+
+    uint64_t begin = metrics_now();
+    int result = CLIENT_HANDLED;
 
     switch (opcode) {
     case CMSG_INT_EXIT:
         applog(LOG_LEVEL_INFO, "[Local Server] Received CMSG_INT_EXIT\n");
         leave_network(server);
-        return 1;
+        result = CLIENT_STOP;
+        break;
 
     case CMSG_INT_SEARCH:
         applog(LOG_LEVEL_INFO, "[Local Server] Received CMSG_INT_SEARCH\n");
-        handle_local_search_request(server);
-        return 0;
+        metric_inc(METRIC_LOCAL_SEARCHES);
+        handle_local_search_request(server, &reader);
+        break;
 
     case CMSG_INT_DOWNLOAD:
-        handle_local_download_request(server);
-        return 0;
+        metric_inc(METRIC_LOCAL_DOWNLOADS);
+        handle_local_download_request(server, &reader);
+        break;
 
     default:
-        return 0;
+        break;
     }
+
+    histogram_record_since(DISPATCH_CLIENT, opcode, begin);
+    packet_release(reader.packet);
+    return result;
 }
 
 
 void handle_pending_requests(server_t* server) {
-    cell_t* prev = NULL, *head = server->pending_requests->head;
-    while (head != NULL) {
-        request_t* request = (request_t*)head->data;
+    /*
+     * If we don't have at least one neighbour, sending a request accross
+     * the network has no sense. Moreover, it means we don't know server->self_ip,
+     * and since the packets rely on it... Niah...
+     */
+    if (server->nb_neighbours == 0) {
+        return;
+    }
+
+    list_node_t* node;
+    while ((node = intrusive_list_pop_front(&server->pending_requests)) != NULL) {
+        request_t* request = LIST_ENTRY(node, request_t, node);
         handle_pending_request(server, request);
-        list_pop_at(server->pending_requests, &prev, &head);
+        free(request);
     }
 }
 
 
 void handle_pending_request(server_t* server, request_t* request) {
+    uint64_t begin = metrics_now();
+
     switch (request->type) {
     case REQUEST_SEARCH_LOCAL:
         answer_local_search_request(server, request);
@@ -575,109 +902,75 @@ void handle_pending_request(server_t* server, request_t* request) {
     case REQUEST_DOWNLOAD_LOCAL:
         answer_local_download_request(server, request);
         break;
-
-    case REQUEST_DOWNLOAD_REMOTE:
-        answer_remote_download_request(server, request);
-        break;
     }
+
+    histogram_record_since(DISPATCH_REQUEST, request->type, begin);
 }
 
 
 void update_log_timers(server_t* server, long int diff) {
-    cell_t* prev = NULL, *head = server->received_search_requests->head;
-    while (head != NULL) {
-        search_request_log_t* log_request = (search_request_log_t*)head->data;
+    size_t index = 0;
+    hashmap_entry_t* entry;
+    while (hashmap_next(server->received_search_requests, &index, &entry) == 1) {
+        search_request_log_t* log_request = (search_request_log_t*)entry->value;
         if (log_request->delete_timer <= diff) {
-            list_pop_at(server->received_search_requests, &prev, &head);
+            free(hashmap_remove_at(server->received_search_requests, entry));
         } else {
-            prev = head;
-            head = head->next;
+            log_request->delete_timer -= diff;
         }
     }
 }
 
 
-void handle_pending_downloads(server_t* server) {
-    cell_t* prev = NULL, *head = server->pending_downloads->head;
-    while (head != NULL) {
-        int remove = handle_pending_download(server, *(int*)head->data);
-        if (remove) {
-            list_pop_at(server->pending_downloads, &prev, &head);
-        } else {
-            prev = head;
-            head = head->next;
-        }
+void clear_server(server_t* server) {
+    /* First, as the completions of the jobs still use the server. */
+    if (server->workers != NULL) {
+        worker_pool_destroy(&(server->workers));
     }
-}
-
 
-static int handle_pending_download(server_t* server, int sock) {
-    struct pollfd poller;
-    int res = poll_fd(&poller, sock, POLLIN, AWAIT_TIMEOUT);
-    if (res == 1) {
-        opcode_t opcode;
-        read_from_fd(sock, &opcode, PKT_ID_SIZE);
-
-        assert(opcode == SMSG_DOWNLOAD);
-        handle_remote_download_answer(server, sock);
-        return 1;
+    /*
+     * After the workers, whose completions start downloads, and before the
+     * client leaves, so that it hears about the downloads given up.
+     */
+    if (server->transfers != NULL) {
+        transfer_engine_stop(server->transfers);
+        complete_transfers(server);
+        transfer_engine_destroy(&(server->transfers));
     }
 
-    return 0;
-}
-
-
-void clear_server(server_t* server) {
     close(server->listening_socket);
-    close(server->client_socket);
+    if (server->control_socket != -1) {
+        close(server->control_socket);
+    }
+    local_link_close(&server->client);
 
     for (int i = 0; i < MAX_NEIGHBOURS; ++i) {
         if (server->neighbours[i].sock != -1) {
+            drop_neighbour_queue(server->neighbours + i);
             close(server->neighbours[i].sock);
+            free(server->neighbours[i].ip);
             free(server->neighbours[i].port);
         }
         server->neighbours[i].sock = -1;
     }
+    hashmap_destroy(&(server->neighbours_index));
 
-    for (cell_t* head = server->awaiting_sockets->head; head != NULL; head = head->next) {
-        close(*(int*)head);
-    }
-
-    for (cell_t* received_head = server->received_search_requests->head;
-         received_head != NULL; received_head = received_head->next) {
-        search_request_log_t* log = (search_request_log_t*)received_head->data;
-        const_free(log->filename);
-        const_free(log->source_ip);
-        const_free(log->source_port);
-    }
-    list_destroy(&(server->received_search_requests));
+    hashmap_destroy(&(server->received_search_requests));
+    hashmap_destroy(&(server->admission));
 
-    for (cell_t* awaiting_head = server->awaiting_sockets->head;
-         awaiting_head != NULL; awaiting_head = awaiting_head->next) {
-        int sock = *(int*)awaiting_head->data;
-        close(sock);
+    idle_socket_t* awaiting;
+    while ((awaiting = idle_socket_pop_expired(&server->awaiting_sockets, 0, 1)) != NULL) {
+        close(awaiting->sock);
+        free(awaiting);
     }
-    list_destroy(&(server->awaiting_sockets));
 
-    for (cell_t* pending_requests_head = server->pending_requests->head;
-         pending_requests_head != NULL; pending_requests_head = pending_requests_head->next) {
-        request_t* request = (request_t*)pending_requests_head->data;
+    list_node_t* node;
+    while ((node = intrusive_list_pop_front(&server->pending_requests)) != NULL) {
+        request_t* request = LIST_ENTRY(node, request_t, node);
 
         switch (request->type) {
-        case REQUEST_DOWNLOAD_LOCAL: {
-            download_request_t* download = (download_request_t*)request->request;
-            free(download->filename);
-            free(download->ip);
-            free(download->port);
-            break;
-        }
-
-        case REQUEST_DOWNLOAD_REMOTE: {
-            remote_download_request_t* download = (remote_download_request_t*)request->request;
-            free(download->filename);
-            close(download->socket);
+        case REQUEST_DOWNLOAD_LOCAL:
             break;
-        }
 
         case REQUEST_SEARCH_LOCAL: {
             local_search_request_t* search = (local_search_request_t*)request->request;
@@ -687,16 +980,7 @@ void clear_server(server_t* server) {
 
         case REQUEST_SEARCH_REMOTE: {
             search_request_t* search = (search_request_t*)request->request;
-            free(search->filename);
-            for (int i = 0; i < search->nb_ips; i++) {
-                free(search->ips[i]);
-                free(search->ports[i]);
-            }
-            free(search->ips);
-            free(search->ip_source);
-            free(search->ports);
-            free(search->port_source);
-            close(search->source_sock);
+            packet_release(search->frame);
             break;
         }
 
@@ -705,18 +989,33 @@ void clear_server(server_t* server) {
         }
 
         free(request->request);
+        free(request);
     }
-    list_destroy(&(server->pending_requests));
+}
 
-    for (cell_t* pending_downloads_head = server->pending_downloads->head;
-         pending_downloads_head != NULL; pending_downloads_head = pending_downloads_head->next) {
-        close(*(int*)pending_downloads_head->data);
+
+void abort_server(server_t* server) {
+    if (server->listening_socket > 0) {
+        close(server->listening_socket);
+    }
+    if (server->control_socket != -1) {
+        close(server->control_socket);
+    }
+    local_link_close(&server->client);
+
+    for (int i = 0; i < MAX_NEIGHBOURS; ++i) {
+        if (server->neighbours[i].sock != -1) {
+            close(server->neighbours[i].sock);
+            free(server->neighbours[i].ip);
+            free(server->neighbours[i].port);
+        }
     }
-    list_destroy(&(server->pending_downloads));
+    hashmap_destroy(&(server->neighbours_index));
+    free_not_null(server->self_ip);
 }
 
 
 void handle_sigint(int sigint) {
     UNUSED(sigint);
-    _loop = 0;
+    interrupted = 1;
 }
@@ -1,11 +1,37 @@
 #ifndef SERVER_H
 #define SERVER_H
 
+#include "channel.h"
+
 /* Port the server will listen to get requests. */
 #define SERVER_LISTEN_PORT "10001"
 
 
+/*
+ * Tunables of the servent. 0 keeps the default value (DEFAULT_TTL,
+ * MAX_NEIGHBOURS and WORKER_THREADS, see server_defines.h).
+ */
+typedef struct server_options_s {
+    /* TTL of the searches started by the servent. */
+    int search_ttl;
+    /* Number of neighbours accepted, at most MAX_NEIGHBOURS. */
+    int max_neighbours;
+    /*
+     * Number of threads looking up the files, at most WORKER_POOL_MAX_WORKERS.
+     * Negative to do it on the thread of the loop.
+     */
+    int workers;
+} server_options_t;
+
+
+/*
+ * Run the servent, with the tunables in options (NULL for the default ones). If
+ * client_link is NULL, the servent waits for its client on the control socket.
+ * Otherwise the client runs in the same process and client_link is used to talk
+ * to it.
+ */
 int run_server(int first_machine, const char* listen_port,
-               const char* ip, const char* port);
+               const char* ip, const char* port, const server_options_t* options,
+               const local_link_t* client_link);
 
 #endif /* SERVER_H */
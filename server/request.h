@@ -4,6 +4,8 @@
 #include <stdint.h>
 
 #include "list.h"
+#include "packet.h"
+#include "packets_decode.h"
 
 
 /*
@@ -16,8 +18,6 @@ typedef enum request_type_e {
     REQUEST_DOWNLOAD_LOCAL  = 1,
     /* Searching for a file (request from remote). */
     REQUEST_SEARCH_REMOTE   = 2,
-    /* Awaiting to upload a file (request from remote). */
-    REQUEST_DOWNLOAD_REMOTE = 3,
 } request_type_t;
 
 
@@ -29,6 +29,8 @@ typedef struct request_s {
     request_type_t type;
     /* Underlying data structure containing the informations. */
     void* request;
+    /* Link inside the list of pending requests. */
+    list_node_t node;
 } request_t;
 
 
@@ -37,75 +39,63 @@ typedef struct request_s {
  */
 typedef struct local_search_request_s {
     const char* name;
+    /* 1 if we have the file, set by the worker that looked it up. */
+    int has_file;
 } local_search_request_t;
 
 
 /*
- * Structure to hold a remote search request.
+ * Structure to hold a remote search request. The request is kept as it was
+ * received so it can be forwarded without being rebuilt: the fields of query
+ * point inside frame.
  */
 typedef struct search_request_s {
     /* Socket from which the request came from (ensure we don't loop). */
     int source_sock;
-
+    /* The request as received, opcode included. */
+    packet_t* frame;
     /* Fields of the request. See packets_doc.h for more informations. */
-    char* ip_source;
-    char* port_source;
-    char* filename;
-    uint8_t ttl;
-    uint8_t nb_ips;
-    char** ips;
-    char** ports;
+    search_query_t query;
+    /* 1 if we did not receive the request before. */
+    int unique;
+    /* 1 if we have the file, set by the worker that looked it up. */
+    int has_file;
 } search_request_t;
 
 
 /*
- * Structure to hold the informations relative to a given research.
+ * Structure to hold the informations relative to a given research. The entries
+ * are indexed by the file searched, followed by the IP and the port from which
+ * the request originated.
  */
 typedef struct search_request_log_s {
     /* The amount of time in milliseconds we will wait until the entry is removed. */
    long int delete_timer;
-   /* The IP from which the request originated. */
-   const char* source_ip;
-   /* The port from which the request originated. */
-   const char* source_port;
-   /* The file searched. */
-   const char* filename;
 } search_request_log_t;
 
 
 /*
- * Structure to hold the informations relative to a download request.
+ * Structure to hold the informations relative to a download request. The
+ * strings are stored inside the structure, so a request is a single block of
+ * memory.
  */
 typedef struct download_request_s {
     /* IP of the machine to contact. */
-    char* ip;
+    char ip[UINT8_MAX + 1];
     /* Port to contact on the machine. */
-    char* port;
+    char port[UINT8_MAX + 1];
     /* Name of the file we are searching. */
-    char* filename;
+    char filename[UINT8_MAX + 1];
+    /* 1 if we already have the file, set by the worker that looked it up. */
+    int has_file;
 } download_request_t;
 
 
-/*
- * Structure to hold the informations about a remote download request.
- */
-typedef struct remote_download_request_s {
-    /* Socket to which we answer. */
-    int socket;
-    /* Name of the file the remote wants to download. */
-    char* filename;
-} remote_download_request_t;
-
-
-/*
- * Add a coyp-in-heap of req inside a list (creating function).
- */
-LIST_CREATE_FN void* add_new_request(void* req);
-
 
 /*
- * Add a copy-in-heap of log inside a list (creating function).
+ * Allocate a request of the given type, wrapping data. The request is freed
+ * once it has been handled, data is freed by the handler.
  */
-LIST_CREATE_FN void* add_new_search_request_log(void* log_request);
+request_t* request_create(request_type_t type, void* data);
 
 #endif /* REQUEST_H */
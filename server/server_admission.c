@@ -0,0 +1,220 @@
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+
+#include "log.h"
+#include "metrics.h"
+#include "packets_defines.h"
+#include "server_internal.h"
+
+
+/*
+ * Limits of a token bucket: tokens given back per second, and tokens held at
+ * most. A rate of 0 means no limit.
+ */
+typedef struct bucket_limit_s {
+    double rate;
+    double burst;
+} bucket_limit_t;
+
+
+/* Limits of the connections of an IP. */
+static const bucket_limit_t connection_limit = {
+    ADMISSION_CONNECTIONS_RATE, ADMISSION_CONNECTIONS_BURST
+};
+
+
+/* Limits of the requests of an IP, per opcode (CMSG_LEAVE and CMSG_NEIGHBOUR_RESCUE have none). */
+static const bucket_limit_t request_limits[ADMISSION_OPCODES] = {
+    [CMSG_NEIGHBOURS]     = { ADMISSION_NEIGHBOURS_RATE, ADMISSION_NEIGHBOURS_BURST },
+    [CMSG_JOIN]           = { ADMISSION_JOIN_RATE, ADMISSION_JOIN_BURST },
+    [CMSG_SEARCH_REQUEST] = { ADMISSION_SEARCH_RATE, ADMISSION_SEARCH_BURST },
+    [CMSG_DOWNLOAD]       = { ADMISSION_DOWNLOAD_RATE, ADMISSION_DOWNLOAD_BURST },
+};
+
+
+/*
+ * Refill bucket for the time elapsed since it was last used, then take a token
+ * from it. Return 1 if there was one, 0 otherwise. A bucket never used starts
+ * full.
+ */
+static int token_bucket_take(token_bucket_t* bucket, const bucket_limit_t* limit,
+                             uint64_t now);
+
+
+/*
+ * Return the entry of ip, creating it if we know nothing about ip yet.
+ */
+static admission_entry_t* get_admission_entry(server_t* server, const char* ip,
+                                              uint64_t now);
+
+
+/*
+ * Return the number of bytes sent by the neighbours that we did not read yet.
+ * congested is set to 1 if they fill more than OVERLOAD_INBOUND_PERCENT
+ * percents of the receive buffer of a neighbour, 0 otherwise.
+ */
+static int count_inbound_bytes(const server_t* server, int* congested);
+
+
+/*
+ * Forget the IPs that did not send anything since ADMISSION_ENTRY_LIFETIME.
+ */
+static void prune_admission(server_t* server, uint64_t now);
+
+
+/******************************************************************************/
+
+
+int admit_connection(server_t* server, const char* ip) {
+    uint64_t now = metrics_now();
+    admission_entry_t* entry = get_admission_entry(server, ip, now);
+
+    if (token_bucket_take(&entry->connections, &connection_limit, now) == 0) {
+        applog(LOG_LEVEL_INFO, "[Server] Trop de connexions de %s, refusée.\n", ip);
+        metric_inc(METRIC_REFUSED_CONNECTIONS);
+        return 0;
+    }
+
+    return 1;
+}
+
+
+int admit_request(server_t* server, const char* ip, opcode_t opcode) {
+    if (opcode >= ADMISSION_OPCODES || request_limits[opcode].rate == 0) {
+        return 1;
+    }
+
+    uint64_t now = metrics_now();
+    admission_entry_t* entry = get_admission_entry(server, ip, now);
+
+    if (token_bucket_take(entry->requests + opcode, request_limits + opcode, now) == 0) {
+        applog(LOG_LEVEL_INFO, "[Server] Trop de requêtes %d de %s, refusée.\n",
+               opcode, ip);
+        metric_inc(METRIC_REFUSED_REQUESTS);
+        return 0;
+    }
+
+    return 1;
+}
+
+
+int shed_request(server_t* server, opcode_t opcode) {
+    if (server->overloaded == 0 ||
+        (opcode != CMSG_SEARCH_REQUEST && opcode != CMSG_DOWNLOAD)) {
+        return 0;
+    }
+
+    metric_inc(METRIC_SHED_REQUESTS);
+    return 1;
+}
+
+
+void update_admission(server_t* server, int loop_duration, int nb_outbound) {
+    int congested;
+    int nb_inbound = count_inbound_bytes(server, &congested);
+    int overloaded = loop_duration >= OVERLOAD_LOOP_DURATION ||
+                     nb_outbound > OVERLOAD_OUTBOUND_PACKETS ||
+                     congested == 1;
+
+    if (overloaded != server->overloaded) {
+        if (overloaded) {
+            applog(LOG_LEVEL_WARNING, "[Server] Surcharge (boucle de %d ms, %d "
+                                      "paquets à envoyer, %d octets à lire), les "
+                                      "recherches et téléchargements distants "
+                                      "sont ignorés.\n",
+                   loop_duration, nb_outbound, nb_inbound);
+        } else {
+            applog(LOG_LEVEL_WARNING, "[Server] Fin de la surcharge.\n");
+        }
+
+        server->overloaded = overloaded;
+    }
+
+    metric_set(METRIC_INBOUND_BYTES, nb_inbound);
+    metric_set(METRIC_OVERLOADED, overloaded);
+
+    uint64_t now = metrics_now();
+    if (now >= server->next_prune) {
+        prune_admission(server, now);
+        server->next_prune = now + (uint64_t)ADMISSION_ENTRY_LIFETIME * 1000000;
+    }
+}
+
+
+int token_bucket_take(token_bucket_t* bucket, const bucket_limit_t* limit,
+                      uint64_t now) {
+    if (bucket->last == 0) {
+        bucket->tokens = limit->burst;
+    } else {
+        bucket->tokens += (now - bucket->last) / 1e9 * limit->rate;
+        if (bucket->tokens > limit->burst) {
+            bucket->tokens = limit->burst;
+        }
+    }
+
+    bucket->last = now;
+
+    if (bucket->tokens < 1) {
+        return 0;
+    }
+
+    bucket->tokens -= 1;
+    return 1;
+}
+
+
+admission_entry_t* get_admission_entry(server_t* server, const char* ip,
+                                       uint64_t now) {
+    admission_entry_t* entry = hashmap_get_string(server->admission, ip);
+    if (entry == NULL) {
+        entry = calloc(1, sizeof(admission_entry_t));
+        hashmap_put(server->admission, ip, strlen(ip), entry);
+    }
+
+    entry->last_seen = now;
+    return entry;
+}
+
+
+int count_inbound_bytes(const server_t* server, int* congested) {
+    int nb_inbound = 0;
+    *congested = 0;
+    for (int i = 0; i < MAX_NEIGHBOURS; ++i) {
+        int sock = server->neighbours[i].sock;
+        int pending;
+        if (sock == -1 || ioctl(sock, FIONREAD, &pending) == -1) {
+            continue;
+        }
+
+        nb_inbound += pending;
+
+        int buffer_size;
+        socklen_t length = sizeof(buffer_size);
+        if (getsockopt(sock, SOL_SOCKET, SO_RCVBUF, &buffer_size, &length) == 0 &&
+            (long)pending * 100 > (long)buffer_size * OVERLOAD_INBOUND_PERCENT) {
+            *congested = 1;
+        }
+    }
+
+    return nb_inbound;
+}
+
+
+void prune_admission(server_t* server, uint64_t now) {
+    uint64_t lifetime = (uint64_t)ADMISSION_ENTRY_LIFETIME * 1000000;
+
+    size_t index = 0;
+    hashmap_entry_t* entry;
+    while (hashmap_next(server->admission, &index, &entry) == 1) {
+        admission_entry_t* admission = (admission_entry_t*)entry->value;
+        if (now - admission->last_seen >= lifetime) {
+            free(hashmap_remove_at(server->admission, entry));
+        }
+    }
+}
@@ -9,17 +9,33 @@
 
 
 /*
- * Maximum number of neighbours.
+ * Maximum number of neighbours. The servent can be told to keep fewer (see
+ * server_options_t).
  */
 #define MAX_NEIGHBOURS 5
 
 
+/*
+ * Maximum number of packets waiting to be sent to a single neighbour. When the
+ * queue is full, it is flushed before anything else is queued.
+ */
+#define MAX_OUTBOUND_PACKETS 32
+
+
 /*
  * Number of times we attempt to get neighbours.
  */
 #define JOIN_MAX_ATTEMPTS 5
 
 
+/*
+ * A join request without the rescue flag is accepted with a probability of
+ * JOIN_CHANCE / JOIN_CHANCE_MOD (when there is room for a neighbour).
+ */
+#define JOIN_CHANCE 50
+#define JOIN_CHANCE_MOD 100
+
+
 /*
  * Time interval to check if we have an incoming request on the listening
  * socket. This is in milliseconds.
@@ -28,12 +44,108 @@
 
 
 /*
- * Timeout (milliseconds) when we check if there is something to read on an
- * awaiting socket.
+ * Timeout (milliseconds) when we check if there is something to read on a
+ * neighbour, or on the awaiting sockets (all of them at once).
  */
 #define AWAIT_TIMEOUT 10
 
 
+/*
+ * Time (milliseconds) an accepted socket has to send its first request before
+ * it is closed.
+ */
+#define AWAIT_IDLE_TIMEOUT 5000
+
+
+/*
+ * Maximum number of accepted sockets waiting for their first request. When a
+ * new socket is accepted past this limit, the oldest one is closed.
+ */
+#define MAX_AWAITING_SOCKETS 64
+
+
+/*
+ * Time (milliseconds) an upload or a download can go without moving (waiting
+ * for the answer SMSG_DOWNLOAD included) before it fails. A transfer waiting
+ * for its turn fails as well after this time.
+ */
+#define TRANSFER_IDLE_TIMEOUT 60000
+
+
+/*
+ * The transfer engine (see server_transfers.c) moves at most
+ * TRANSFER_MAX_ACTIVE uploads and downloads at once, the others wait for their
+ * turn. Each time its socket is ready, a transfer moves at most
+ * TRANSFER_CHUNK_SIZE bytes, so that every transfer keeps moving. The engine
+ * wakes up at least every TRANSFER_POLL_TIMEOUT milliseconds to check the
+ * deadlines.
+ */
+#define TRANSFER_MAX_ACTIVE 16
+#define TRANSFER_CHUNK_SIZE (256 * 1024)
+#define TRANSFER_POLL_TIMEOUT 1000
+
+
+/*
+ * Token buckets of a remote IP (see admit_connection and admit_request): the
+ * rate at which tokens come back (per second) and the number of tokens a
+ * bucket holds at most, i.e. the burst let through after a quiet period. One
+ * token is taken by each accepted connection, and by each request of the given
+ * opcode. A rate of 0 means no limit.
+ */
+#define ADMISSION_CONNECTIONS_RATE 10
+#define ADMISSION_CONNECTIONS_BURST 40
+#define ADMISSION_NEIGHBOURS_RATE 10
+#define ADMISSION_NEIGHBOURS_BURST 20
+#define ADMISSION_JOIN_RATE 10
+#define ADMISSION_JOIN_BURST 20
+#define ADMISSION_SEARCH_RATE 1000
+#define ADMISSION_SEARCH_BURST 2000
+#define ADMISSION_DOWNLOAD_RATE 5
+#define ADMISSION_DOWNLOAD_BURST 10
+
+
+/*
+ * Time (milliseconds) after which we forget an IP that sent nothing. Its
+ * buckets are full again long before that, so forgetting it changes nothing.
+ */
+#define ADMISSION_ENTRY_LIFETIME 60000
+
+
+/*
+ * Maximum number of frames of a neighbour read per loop. A neighbour may
+ * forward many searches per loop: reading a single one would let them pile up
+ * in the socket.
+ */
+#define NEIGHBOUR_FRAMES_PER_LOOP 64
+
+
+/*
+ * The servent is overloaded when its previous loop lasted at least
+ * OVERLOAD_LOOP_DURATION milliseconds, or when, at its end, more than
+ * OVERLOAD_OUTBOUND_PACKETS packets were waiting for the neighbours or the
+ * bytes not read yet filled more than OVERLOAD_INBOUND_PERCENT percents of the
+ * receive buffer (SO_RCVBUF) of a neighbour. While overloaded, the remote
+ * search requests and downloads are dropped.
+ */
+#define OVERLOAD_LOOP_DURATION 200
+#define OVERLOAD_OUTBOUND_PACKETS (MAX_NEIGHBOURS * MAX_OUTBOUND_PACKETS / 2)
+#define OVERLOAD_INBOUND_PERCENT 50
+
+
+/*
+ * Maximum number of frames of the client read per loop. The client (batch
+ * mode, the library) may send its commands much faster than one per loop.
+ */
+#define CLIENT_FRAMES_PER_LOOP 64
+
+
+/*
+ * Default number of worker threads looking up the files, so that the loop does
+ * not wait for the disk (see server_options_t).
+ */
+#define WORKER_THREADS 4
+
+
 /*
  * Port on which the server will listen and to which clients will talk.
  */
@@ -51,4 +163,19 @@
  */
 #define SEARCH_DIRECTORY "files"
 
+
+/*
+ * Time (milliseconds) during which we remember a search request, so that it is
+ * not handled again when it comes back through another neighbour.
+ */
+#define SEARCH_LOG_LIFETIME 30000
+
+/*
+ * Default depth when we are searching for a file on the network. Each time a
+ * machine receives the packet (assuming it has not yet received it once),
+ * it decreases the TTL by one. When the TTL reaches 0, the machine responds
+ * to the original asker (by opening a direct connection).
+ */
+#define DEFAULT_TTL 10
+
 #endif /* SERVER_DEFINES_H */
@@ -4,51 +4,134 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+#include <netdb.h>
+
+#include "channel.h"
+#include "hashmap.h"
 #include "list.h"
+#include "packet.h"
 #include "request.h"
 #include "server_defines.h"
+#include "worker_pool.h"
 
 
 typedef struct list_s list_t;
 
 
+/* Thread moving the uploads and downloads (see server_transfers.c). */
+typedef struct transfer_engine_s transfer_engine_t;
+
+
 /*
  * Helper structure, storing a socket, and the port to contact the machine
  * at the other extremity (used when sending neighbours).
  */
 typedef struct socket_contact_s {
     int sock;
+    /* IP of the machine at the other extremity of the socket. */
+    char* ip;
     /* Port to connect to the machine where the other extremity of the socket
      * is present. */
     char* port;
+    /* Packets waiting to be sent to the neighbour (circular buffer). */
+    packet_t* outbound[MAX_OUTBOUND_PACKETS];
+    /* Index of the oldest packet inside outbound. */
+    int outbound_first;
+    /* Number of packets inside outbound. */
+    int nb_outbound;
 } socket_contact_t;
 
 
+/*
+ * A socket on which we wait for the other extremity (first request of an
+ * accepted socket), until its deadline.
+ */
+typedef struct idle_socket_s {
+    int sock;
+    /* Time (metrics_now) after which we stop waiting. */
+    uint64_t deadline;
+    /* IP of the other extremity. */
+    char ip[INET6_ADDRSTRLEN];
+    /* Link inside its queue. */
+    list_node_t node;
+} idle_socket_t;
+
+
 /* The structure to represent the server. */
 typedef struct server_s {
     /* Socket to wait for new connexions. */
     int listening_socket;
+    /* Local socket on which the client connects (see create_local_listening_socket). */
+    int control_socket;
     /* Array of sockets representing the neighbours. */
     socket_contact_t neighbours[MAX_NEIGHBOURS];
     /* Our current number of neighbours. */
     int nb_neighbours;
-    /* Socket to communicate with the client. */
-    int client_socket;
+    /* Neighbours indexed by IP and contact port (socket_contact_t). */
+    hashmap_t* neighbours_index;
+    /* Link to communicate with the client. */
+    local_link_t client;
     /* Indicate if we performed the handshake. */
     int handshake;
-    /* Awaiting sockets (i.e, we accepted but we have not yet dealt with them). */
-    list_t* awaiting_sockets;
-    /* Pending requests. */
-    list_t* pending_requests;
-    /* Search requests we received. */
-    list_t* received_search_requests;
-    /* Sockets that are pending download. */
-    list_t* pending_downloads;
+    /* As long as this equals 1, the servent continues its loop. */
+    int running;
+    /*
+     * Awaiting sockets (i.e, we accepted but we have not yet dealt with them),
+     * oldest first (idle_socket_t).
+     */
+    intrusive_list_t awaiting_sockets;
+    /* Pending requests, handled in order. */
+    intrusive_list_t pending_requests;
+    /* Search requests we received (search_request_log_t). */
+    hashmap_t* received_search_requests;
     /* Our own IP. */
     char* self_ip;
+    /* Port we listen on, as sent to the other machines. */
+    char self_port[NI_MAXSERV];
+    /* TTL of the searches we start. */
+    int search_ttl;
+    /* Number of neighbours we accept, at most MAX_NEIGHBOURS. */
+    int max_neighbours;
+    /* Token buckets of the remote IPs, indexed by IP (admission_entry_t). */
+    hashmap_t* admission;
+    /* Time (metrics_now) of the next look for quiet IPs in admission. */
+    uint64_t next_prune;
+    /* 1 if the servent is overloaded (see update_admission). */
+    int overloaded;
+    /* Workers looking up the files, so that the loop does not wait. */
+    worker_pool_t* workers;
+    /* Uploads and downloads, moved by their own thread. */
+    transfer_engine_t* transfers;
 } server_t;
 
 
+/*
+ * Token bucket: holds up to a burst of tokens, which come back at a given rate.
+ */
+typedef struct token_bucket_s {
+    double tokens;
+    /* Last time (metrics_now) the bucket was refilled, 0 if never used. */
+    uint64_t last;
+} token_bucket_t;
+
+
+/* Number of opcodes with a bucket (the CMSG sent by remote machines). */
+#define ADMISSION_OPCODES (CMSG_DOWNLOAD + 1)
+
+
+/*
+ * What we know about a remote IP to decide if it is admitted.
+ */
+typedef struct admission_entry_s {
+    /* Connections accepted from the IP. */
+    token_bucket_t connections;
+    /* Requests sent by the IP, per opcode. */
+    token_bucket_t requests[ADMISSION_OPCODES];
+    /* Last time (metrics_now) the IP sent something. */
+    uint64_t last_seen;
+} admission_entry_t;
+
+
 /*******************************************************************************
  * Join the network
  */
@@ -112,8 +195,8 @@ void handle_join_responses(server_t* server, list_t* targets);
  * accepted or refused the request, it won't add the the socket inside our
  * neighbours.
  *
- * Return 0 if the servent refused the request, return 1 if the servent accepted
- * the request.
+ * Return 0 if the servent refused the request (or closed the socket without
+ * answering), return 1 if the servent accepted the request.
  */
 int handle_join_response(int s);
 
@@ -197,41 +280,66 @@ void broadcast_packet(server_t* server, void* packet, size_t size);
 
 
 /*
- * Broadcast the packet to all the neighbours in the array.
+ * Queue the packet for all the neighbours we have, except the one communicating
+ * through except_sock. Each neighbour takes its own reference on the packet, so
+ * the same buffer is shared by every queue. The function returns the number of
+ * neighbours the packet was queued for.
  */
-void broadcast_packet_to(int* sockets, int nb_sockets, void* packet, size_t size);
+int broadcast_packet_except(server_t* server, packet_t* packet, int except_sock);
 
 
 /*
- * Read the informations about the request on the socket and create a request to
- * deal with it later.
+ * Queue the packet to be sent to neighbour during the next flush. The queue
+ * takes a reference on the packet.
  */
-void handle_remote_search_request(server_t* server, int sock);
+void queue_packet(socket_contact_t* neighbour, packet_t* packet);
 
 
 /*
- * Broadcast the leave packet to all neighbours.
+ * Send all the packets queued for neighbour and release them.
  */
-void leave_network(server_t* server);
+void flush_neighbour(socket_contact_t* neighbour);
 
 
 /*
- * Read the answer to a CMSG_SEARCH_REQUEST (SMSG answer) and forward the
- * informations to the local client, through SMSG_INT_SEARCH.
+ * Flush the queues of all our neighbours.
  */
-void handle_remote_search_answer(server_t* server, int sock);
+void flush_neighbours(server_t* server);
 
 
 /*
- * Read the answer to a CMSG_DOWNLOAD (SMSG_DOWNLOAD), write the file on the
- * disk and notifies the client the download is over.
+ * Release all the packets queued for neighbour without sending them.
  */
-void handle_remote_download_answer(server_t* server, int sock);
+void drop_neighbour_queue(socket_contact_t* neighbour);
 
 
 /*
  * Read the informations about the request on the socket and create a request to
- * deal with it later.
+ * deal with it later. If keep is 0, the request is read (so that the next one
+ * can be) but dropped. Return -1 if the request is truncated or too large, in
+ * which case the rest of the stream cannot be read, 0 otherwise.
+ */
+int handle_remote_search_request(server_t* server, int sock, int keep);
+
+
+/*
+ * Broadcast the leave packet to all neighbours.
+ */
+void leave_network(server_t* server);
+
+
+/*
+ * Read the answer to a CMSG_SEARCH_REQUEST (SMSG answer) and forward the
+ * informations to the local client, through SMSG_INT_SEARCH. Return -1 if the
+ * answer is truncated or too large, 0 otherwise.
+ */
+int handle_remote_search_answer(server_t* server, int sock);
+
+
+/*
+ * Read the name of the file asked for on the socket, then hand the socket over
+ * to the transfer engine, which sends the file. If the request is truncated,
+ * the socket is closed.
  */
 void handle_remote_download_request(server_t* server, int sock);
 
@@ -242,17 +350,17 @@ void handle_remote_download_request(server_t* server, int sock);
 
 
 /*
- * Read the informations about the request on the socket and store a request
+ * Read the informations about the request from reader and store a request
  * inside the server.
  */
-void handle_local_search_request(server_t* server);
+void handle_local_search_request(server_t* server, packet_reader_t* reader);
 
 
 /*
- * Read the informations about the request on the socket and store a request
+ * Read the informations about the request from reader and store a request
  * inside the server.
  */
-void handle_local_download_request(server_t* server);
+void handle_local_download_request(server_t* server, packet_reader_t* reader);
 
 
 /*******************************************************************************
@@ -260,10 +368,116 @@ void handle_local_download_request(server_t* server);
  */
 
 
+/*
+ * The answer_* functions hand the disk work over to server->workers: the lookup
+ * of the file is done by a worker, and the rest of the request (forwarding,
+ * answering the client, starting the download) by the loop once the worker is
+ * done.
+ */
 void answer_local_search_request(server_t* server, request_t* request);
 void answer_remote_search_request(server_t* server, request_t* request);
 void answer_local_download_request(server_t* server, request_t* request);
-void answer_remote_download_request(server_t* server, request_t* request);
+
+
+/*
+ * Tell the client how download ended (code, SMSG_INT_DOWNLOAD), then free it.
+ */
+void send_download_response(server_t* server, download_request_t* download,
+                            smsg_int_download_answer_codes_t code);
+
+
+/*
+ * Search the file filename inside the directory containing the downloadable
+ * files, using dirent. If a match is found, the function returns 1, otherwise
+ * it returns 0 (-1 if the directory cannot be read). Called by the workers.
+ */
+int search_file(const char* filename);
+
+
+/*******************************************************************************
+ * Transfers
+ */
+
+
+/*
+ * Start the thread of the transfer engine. Return NULL if it could not be
+ * started.
+ */
+transfer_engine_t* transfer_engine_create(void);
+
+
+/*
+ * Send the file filename (from SEARCH_DIRECTORY) through sock, on which the
+ * remote sent CMSG_DOWNLOAD, or tell the remote we do not have it. The engine
+ * takes over sock and filename.
+ */
+void transfer_engine_upload(transfer_engine_t* engine, int sock, char* filename);
+
+
+/*
+ * Connect to the remote of download, send CMSG_DOWNLOAD, then receive the
+ * answer and the file with it, all without blocking the loop. The engine takes
+ * over download, the client is told how the download ended by
+ * complete_transfers.
+ */
+void transfer_engine_download(transfer_engine_t* engine, download_request_t* download);
+
+
+/*
+ * Tell the client about the downloads the engine is done with, and release
+ * them. Return the number of downloads completed.
+ */
+int complete_transfers(server_t* server);
+
+
+/*
+ * Stop the thread of the engine. The transfers it still has are given up, and
+ * the downloads among them wait for complete_transfers.
+ */
+void transfer_engine_stop(transfer_engine_t* engine);
+
+
+/*
+ * Free an engine stopped by transfer_engine_stop.
+ */
+void transfer_engine_destroy(transfer_engine_t** engine);
+
+
+/*******************************************************************************
+ * Admission control
+ */
+
+
+/*
+ * Decide if a connection accepted from ip is kept, taking a token from its
+ * connections bucket. Return 1 if it is, 0 if ip connects too often.
+ */
+int admit_connection(server_t* server, const char* ip);
+
+
+/*
+ * Decide if a request (opcode) sent by ip is handled, taking a token from its
+ * bucket for opcode. This only looks at the opcode, so it is done before the
+ * rest of the request is read. Return 1 if it is, 0 if ip sends too many.
+ */
+int admit_request(server_t* server, const char* ip, opcode_t opcode);
+
+
+/*
+ * Return 1 if a remote request (opcode) must be dropped because the servent is
+ * overloaded, 0 otherwise. Only the requests the network can do without are
+ * dropped (searches and downloads), never the ones holding the overlay.
+ */
+int shed_request(server_t* server, opcode_t opcode);
+
+
+/*
+ * Update the overload state from the duration (milliseconds) of the previous
+ * loop, the number of packets it left for the neighbours and what they sent
+ * that is not read yet, then forget the IPs that have been quiet for
+ * ADMISSION_ENTRY_LIFETIME.
+ */
+void update_admission(server_t* server, int loop_duration, int nb_outbound);
 
 
 /*******************************************************************************
@@ -277,4 +491,20 @@ void answer_remote_download_request(server_t* server, request_t* request);
 LIST_CREATE_FN void* add_new_socket(void* s);
 
 
+/*
+ * Append sock at the end of queue, to be given up timeout milliseconds from
+ * now. Every socket of a queue gets the same timeout, so appending keeps the
+ * queue sorted by deadline: the sockets to give up on are always at its front,
+ * and checking the deadlines costs nothing when none has passed.
+ */
+idle_socket_t* idle_socket_push(intrusive_list_t* queue, int sock, int timeout);
+
+
+/*
+ * Unlink and return the oldest socket of queue if its deadline is before now
+ * (metrics_now), or if force is 1. Return NULL otherwise.
+ */
+idle_socket_t* idle_socket_pop_expired(intrusive_list_t* queue, uint64_t now, int force);
+
+
 #endif /* SERVER_INTERNAL_H */
@@ -1,6 +1,5 @@
 #define _GNU_SOURCE
 
-#include <assert.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
@@ -13,16 +12,18 @@
 
 #include "common.h"
 #include "log.h"
+#include "metrics.h"
 #include "networking.h"
 #include "packets_defines.h"
 #include "server_internal.h"
+#include "trace.h"
 #include "util.h"
 
 
 /*
  * Ensure that we are not adding the same IP again inside our list of neighbours.
- * This is achieved by looping over the array of neighbours and checking port
- * and ip port each, until we're done.
+ * This is achieved by looking up the IP and contact port in the index of the
+ * neighbours.
  *
  * The function return 0 if the IP:port is present, 1 if we can safely add.
  */
@@ -56,7 +57,6 @@ int join_network_through(server_t* server, const char* ip, const char* port,
         return 0;
     }
 
-    printf("toto\n");
     applog(LOG_LEVEL_INFO, "[Client] Joining network through %s:%s\n", ip, port);
 
     int socket = send_neighbours_request(ip, port);
@@ -67,17 +67,15 @@ int join_network_through(server_t* server, const char* ip, const char* port,
     if (server->self_ip == NULL) {
         char* self_ip, *self_port;
         extract_ip_port_from_socket_s(socket, &self_ip, &self_port, 0);
-        applog(LOG_LEVEL_INFO, "Deduced self IP: %s\n", self_ip);
+        applog(LOG_LEVEL_INFO, "[Client] Deduced self IP: %s\n", self_ip);
         server->self_ip = self_ip;
 
-        free(self_ip);
         free(self_port);
     }
 
     opcode_t opcode;
-    read_from_fd(socket, &opcode, PKT_ID_SIZE);
-
-    if (opcode != SMSG_NEIGHBOURS) {
+    if (read_from_fd(socket, &opcode, PKT_ID_SIZE) != PKT_ID_SIZE ||
+        opcode != SMSG_NEIGHBOURS) {
         close(socket);
         return -1;
     }
@@ -105,7 +103,8 @@ int join_network_through(server_t* server, const char* ip, const char* port,
         applog(LOG_LEVEL_INFO, "[Client] Received neighbour %s:%s\n",
                                current_ip, current_port);
         if (server->self_ip != NULL) {
-            if(strcmp(current_ip, server->self_ip) == 0) {
+            if (strcmp(current_ip, server->self_ip) == 0 &&
+                strcmp(current_port, server->self_port) == 0) {
                 applog(LOG_LEVEL_WARNING, "[Client] Received ourselves as neighbour. Ignoring.\n");
                 continue;
             }
@@ -204,24 +203,23 @@ void handle_join_responses(server_t* server, list_t* targets) {
 
 // Handle SMSG_JOIN (Client)
 int handle_join_response(int s) {
+    /* The other extremity may close without answering (see admit_request). */
     opcode_t opcode;
-    read_from_fd(s, &opcode, PKT_ID_SIZE);
-
-    assert(opcode == SMSG_JOIN);
+    if (read_from_fd(s, &opcode, PKT_ID_SIZE) != PKT_ID_SIZE || opcode != SMSG_JOIN) {
+        return 0;
+    }
 
     applog(LOG_LEVEL_INFO, "[Client] Received SMSG_JOIN (%d)\n", s);
 
     uint8_t answer;
-    read_from_fd(s, &answer, sizeof(uint8_t));
+    if (read_from_fd(s, &answer, sizeof(uint8_t)) != sizeof(uint8_t)) {
+        return 0;
+    }
 
     return answer;
 }
 
 
-#define JOIN_CHANCE 50
-#define JOIN_CHANCE_MOD 100
-
-
 // Handle CMSG_JOIN (Server)
 int handle_join_request(server_t* server, int sock) {
     if (server->self_ip == NULL) {
@@ -229,19 +227,26 @@ int handle_join_request(server_t* server, int sock) {
         applog(LOG_LEVEL_INFO, "[Server] Deduced self IP : %s\n", server->self_ip);
     }
 
+    packet_reader_t reader;
+    packet_reader_begin(&reader, sock, CMSG_JOIN);
+
     uint8_t rescue;
-    read_from_fd(sock, &rescue, sizeof(uint8_t));
+    string_view_t port_view;
+    if (packet_read_u8(&reader, &rescue) == -1 ||
+        packet_read_view(&reader, &port_view) == -1) {
+        packet_release(reader.packet);
+        return 0;
+    }
 
-    uint8_t port_length;
-    read_from_fd(sock, &port_length, sizeof(uint8_t));
+    trace_frame(TRACE_AWAITING, sock, reader.packet->data, reader.packet->size);
 
-    char* port = malloc(port_length + 1);
-    read_from_fd(sock, port, port_length);
-    port[port_length] = '\0';
+    char port[UINT8_MAX + 1];
+    string_view_to_cstring(&port_view, port);
+    packet_release(reader.packet);
 
     uint8_t answer = 0;
 
-    if (server->nb_neighbours == MAX_NEIGHBOURS) {
+    if (server->nb_neighbours >= server->max_neighbours) {
         answer = 0;
     } else {
         if (rescue == 1) {
@@ -256,63 +261,50 @@ int handle_join_request(server_t* server, int sock) {
     }
 
     answer_join_request(server, sock, answer);
+    metric_inc(answer == 1 ? METRIC_JOINS_ACCEPTED : METRIC_JOINS_REFUSED);
 
     if (answer == 1) {
         add_neighbour(server, sock, port);
     }
 
-    free(port);
-
     return answer;
 }
 
 
 int ensure_absent_ip(const server_t* server, const char* ip, const char* port) {
-    for (int i = 0; i < MAX_NEIGHBOURS; i++) {
-        if (server->neighbours[i].sock != -1) {
-            char* sock_ip, *sock_port;
-            extract_ip_port_from_socket_s(server->neighbours[i].sock,
-                                          &sock_ip, &sock_port, 1);
-            if (strcmp(sock_ip, ip) == 0 && strcmp(sock_port, port) == 0) {
-                /* Damn... No unique_ptr to help us clean memory. :( */
-                free(sock_ip);
-                free(sock_port);
-                return 0;
-            }
+    char key[HASHMAP_MAX_KEY_SIZE];
+    size_t key_length = hashmap_compose_key(key, 2, ip, port);
 
-            free(sock_ip);
-            free(sock_port);
-        }
-    }
-
-    return 1;
+    return hashmap_get(server->neighbours_index, key, key_length) == NULL;
 }
 
 
 int handle_leave(server_t* server, socket_contact_t* departed) {
+    char key[HASHMAP_MAX_KEY_SIZE];
+    size_t key_length = hashmap_compose_key(key, 2, departed->ip, departed->port);
+    hashmap_remove(server->neighbours_index, key, key_length);
+
+    drop_neighbour_queue(departed);
     close(departed->sock);
     departed->sock = -1;
+    free_reset(&(departed->ip));
     free_reset(&(departed->port));
 
     --server->nb_neighbours;
+    metric_inc(METRIC_NEIGHBOURS_LEFT);
 
     if (server->nb_neighbours < MIN_NEIGHBOURS) {
         for (int i = 0; i < MAX_NEIGHBOURS; i++) {
             if (server->neighbours[i].sock != -1) {
-                char* contact_ip, *contact_port;
-                extract_ip_port_from_socket_s(server->neighbours[i].sock,
-                                              &contact_ip, &contact_port, 1);
-
                 /*
-                 * Technically this means the other end is closed, so we could
-                 * remove it right now, but why complicate the function with
-                 * recursion that might make us loop weirdly ?
+                 * The contact port, not the port at the other end of the
+                 * socket: when the neighbour connected to us, the latter is
+                 * only an ephemeral port. Copied, since joining may change the
+                 * neighbours.
                  */
-                if (strcmp(contact_ip, "") == 0 || strcmp(contact_port, "") == 0) {
-                    free(contact_ip);
-                    free(contact_port);
-                    continue;
-                }
+                char* contact_ip = NULL, *contact_port = NULL;
+                set_string(&contact_ip, server->neighbours[i].ip);
+                set_string(&contact_port, server->neighbours[i].port);
 
                 join_network_through(server, contact_ip, contact_port, JOIN_MAX_ATTEMPTS);
                 free(contact_ip);
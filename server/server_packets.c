@@ -13,33 +13,25 @@
 #include "networking.h"
 #include "packets_defines.h"
 #include "server_internal.h"
+#include "trace.h"
 #include "util.h"
 
 
 // SMSG_JOIN (S -> C)
 void answer_join_request(server_t* server, int s, uint8_t join) {
-    void* data = malloc(PKT_ID_SIZE + sizeof(uint8_t) + sizeof(uint8_t) + 5);
-    char* ptr = data;
-
-    opcode_t opcode = SMSG_JOIN;
-    write_to_packet(&ptr, &opcode, PKT_ID_SIZE);
-    write_to_packet(&ptr, &join, sizeof(uint8_t));
+    packet_t* packet = packet_begin(SMSG_JOIN);
+    packet_append_u8(packet, join);
 
     if (join == 1) {
         // Trailing '\0' not included
-        char listening_port[6];
-        extract_port_from_socket(server->listening_socket, listening_port, 0);
-
-        uint8_t port_length = strlen(listening_port);
-        write_to_packet(&ptr, &port_length, sizeof(uint8_t));
-        write_to_packet(&ptr, listening_port, port_length);
+        packet_append_string(packet, server->self_port);
     }
 
-    write_to_fd(s, data, (intptr_t)ptr - (intptr_t)data);
+    packet_send(packet, s);
 
     applog(LOG_LEVEL_INFO, "[Server] Sent SMSG_JOIN\n");
 
-    free(data);
+    packet_release(packet);
 }
 
 
@@ -71,25 +63,18 @@ int send_join_request(server_t* server, const char* ip,
         return -1;
     }
 
-    void* data = malloc(PKT_ID_SIZE + sizeof(uint8_t) + sizeof(uint8_t) + 5);
-    char* ptr = data;
+    trace_connection_opened(socket);
 
-    opcode_t opcode = CMSG_JOIN;
-    write_to_packet(&ptr, &opcode, PKT_ID_SIZE);
-    write_to_packet(&ptr, &rescue, sizeof(uint8_t));
+    packet_t* packet = packet_begin(CMSG_JOIN);
+    packet_append_u8(packet, rescue);
 
-    char listening_port[6];
-    extract_port_from_socket(server->listening_socket, listening_port, 0);
+    packet_append_string(packet, server->self_port);
 
-    uint8_t port_length = strlen(listening_port);
-    write_to_packet(&ptr, &port_length, sizeof(uint8_t));
-    write_to_packet(&ptr, listening_port, port_length);
-
-    write_to_fd(socket, data, (intptr_t)ptr - (intptr_t)data);
+    packet_send(packet, socket);
 
     applog(LOG_LEVEL_INFO, "[Client] Sent CMSG_JOIN\n");
 
-    free(data);
+    packet_release(packet);
 
     return socket;
 }
@@ -98,36 +83,20 @@ int send_join_request(server_t* server, const char* ip,
 // SMSG_NEIGHBOURS (S -> C)
 void send_neighbours_list(int s, char **ips, char **ports,
                           uint8_t nb_neighbours) {
-    void* data = malloc(PKT_ID_SIZE + sizeof(uint8_t) +
-                        nb_neighbours * (INET6_ADDRSTRLEN + 5 + 2 * sizeof(uint8_t)));
-    char* ptr = data;
-
-    opcode_t opcode = SMSG_NEIGHBOURS;
-    applog(LOG_LEVEL_INFO, "packet = %p, ptr = %p\n", data, ptr);
-    write_to_packet(&ptr, &opcode, PKT_ID_SIZE);
-    applog(LOG_LEVEL_INFO, "packet = %p, ptr = %p\n", data, ptr);
-    write_to_packet(&ptr, &nb_neighbours, sizeof(uint8_t));
-    applog(LOG_LEVEL_INFO, "packet = %p, ptr = %p\n", data, ptr);
+    packet_t* packet = packet_begin(SMSG_NEIGHBOURS);
+    packet_append_u8(packet, nb_neighbours);
 
     // Trailing '\0' not written
     for (int i = 0; i < nb_neighbours; i++) {
-        const char* ip = ips[i];
-        uint8_t ip_length = strlen(ip);
-
-        const char* port = ports[i];
-        uint8_t port_length = strlen(port);
-
-        write_to_packet(&ptr, &ip_length, sizeof(uint8_t));
-        write_to_packet(&ptr, ip, ip_length);
-        write_to_packet(&ptr, &port_length, sizeof(uint8_t));
-        write_to_packet(&ptr, port, port_length);
+        packet_append_string(packet, ips[i]);
+        packet_append_string(packet, ports[i]);
     }
 
-    write_to_fd(s, data, (intptr_t)ptr - (intptr_t)data);
+    packet_send(packet, s);
 
     applog(LOG_LEVEL_INFO, "[Server] Sent SMSG_NEIGHBOURS\n");
 
-    free(data);
+    packet_release(packet);
 }
 
 
@@ -140,14 +109,69 @@ void broadcast_packet(server_t* server, void* packet, size_t size) {
 }
 
 
-void broadcast_packet_to(int* sockets, int nb_sockets, void* packet, size_t size) {
-    for (int i = 0; i < nb_sockets; i++) {
-        write_to_fd(sockets[i], packet, size);
+int broadcast_packet_except(server_t* server, packet_t* packet, int except_sock) {
+    int nb_queued = 0;
+    for (int i = 0; i < MAX_NEIGHBOURS; ++i) {
+        int sock = server->neighbours[i].sock;
+        if (sock != -1 && sock != except_sock) {
+            queue_packet(server->neighbours + i, packet);
+            ++nb_queued;
+        }
+    }
+
+    return nb_queued;
+}
+
+
+void queue_packet(socket_contact_t* neighbour, packet_t* packet) {
+    if (neighbour->nb_outbound == MAX_OUTBOUND_PACKETS) {
+        flush_neighbour(neighbour);
+    }
+
+    int index = (neighbour->outbound_first + neighbour->nb_outbound) % MAX_OUTBOUND_PACKETS;
+    packet_retain(packet);
+    neighbour->outbound[index] = packet;
+    ++neighbour->nb_outbound;
+}
+
+
+void flush_neighbour(socket_contact_t* neighbour) {
+    while (neighbour->nb_outbound > 0) {
+        packet_t* packet = neighbour->outbound[neighbour->outbound_first];
+        write_to_fd(neighbour->sock, packet->data, packet->size);
+        packet_release(packet);
+
+        neighbour->outbound[neighbour->outbound_first] = NULL;
+        neighbour->outbound_first = (neighbour->outbound_first + 1) % MAX_OUTBOUND_PACKETS;
+        --neighbour->nb_outbound;
+    }
+}
+
+
+void flush_neighbours(server_t* server) {
+    for (int i = 0; i < MAX_NEIGHBOURS; ++i) {
+        if (server->neighbours[i].sock != -1) {
+            flush_neighbour(server->neighbours + i);
+        }
+    }
+}
+
+
+void drop_neighbour_queue(socket_contact_t* neighbour) {
+    while (neighbour->nb_outbound > 0) {
+        packet_release(neighbour->outbound[neighbour->outbound_first]);
+
+        neighbour->outbound[neighbour->outbound_first] = NULL;
+        neighbour->outbound_first = (neighbour->outbound_first + 1) % MAX_OUTBOUND_PACKETS;
+        --neighbour->nb_outbound;
     }
+    neighbour->outbound_first = 0;
 }
 
 
 void leave_network(server_t* server) {
+    flush_neighbours(server);
+
     opcode_t opcode = CMSG_LEAVE;
     broadcast_packet(server, &opcode, PKT_ID_SIZE);
 }
@@ -0,0 +1,765 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <arpa/inet.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "metrics.h"
+#include "networking.h"
+#include "packets_defines.h"
+#include "server_internal.h"
+#include "trace.h"
+#include "util.h"
+
+
+/* Longest header of SMSG_DOWNLOAD: opcode, answer code, three strings and a length. */
+#define TRANSFER_HEADER_SIZE (PKT_ID_SIZE + 1 + 3 * (1 + UINT8_MAX) + sizeof(uint32_t))
+
+
+/*
+ * What a step of a transfer did (see upload_step and download_step).
+ */
+#define TRANSFER_WAITING 0
+#define TRANSFER_MOVED 1
+#define TRANSFER_OVER 2
+
+
+typedef enum transfer_kind_e {
+    /* We send a file to the machine which sent CMSG_DOWNLOAD. */
+    TRANSFER_UPLOAD,
+    /* We receive a file, after sending CMSG_DOWNLOAD. */
+    TRANSFER_DOWNLOAD,
+} transfer_kind_t;
+
+
+typedef struct transfer_s {
+    /* Link inside the queues between the loop and the engine. */
+    mpsc_node_t node;
+    /* Link inside the active or waiting transfers of the engine. */
+    list_node_t link;
+    transfer_kind_t kind;
+    /* Non-blocking socket to the other machine, -1 until a download connects. */
+    int sock;
+    /* File sent or written, -1 until it is opened (or if it cannot be). */
+    int file;
+    /* Upload: name of the file asked for. */
+    char* filename;
+    /* Download: what the client asked for. */
+    download_request_t* download;
+    /*
+     * Upload: header of SMSG_DOWNLOAD. Download: CMSG_DOWNLOAD, sent once the
+     * connection is established. And how much of it was sent.
+     */
+    packet_t* header;
+    size_t header_sent;
+    /* Download: 1 once CMSG_DOWNLOAD is sent. */
+    int request_sent;
+    /* Download: beginning of SMSG_DOWNLOAD, until its header is complete. */
+    char received[TRANSFER_HEADER_SIZE];
+    size_t nb_received;
+    /* 1 once the header of a download is complete. */
+    int has_header;
+    /* Length of the file, and bytes of it moved so far. */
+    uint32_t length;
+    uint32_t done;
+    /* Time (metrics_now) the transfer became active. */
+    uint64_t start;
+    /* Time (metrics_now) after which the transfer fails if it does not move. */
+    uint64_t deadline;
+    /* Download: what the client is told once it is over. */
+    smsg_int_download_answer_codes_t result;
+} transfer_t;
+
+
+struct transfer_engine_s {
+    /* Transfers given by the loop, not seen by the engine yet. */
+    mpsc_queue_t incoming;
+    /* Downloads over, waiting for the loop to tell the client. */
+    mpsc_queue_t finished;
+    /* Counts the transfers given, the engine sleeps on it. */
+    int event_fd;
+    /* Set to 1 when the engine must stop. */
+    atomic_int stop;
+    pthread_t thread;
+    /* Only used by the thread of the engine from here. */
+    /* Transfers moving, at most TRANSFER_MAX_ACTIVE. */
+    intrusive_list_t active;
+    /* Transfers waiting for a place among the active ones, oldest first. */
+    intrusive_list_t waiting;
+    /* Where the content of the downloads is received (TRANSFER_CHUNK_SIZE bytes). */
+    char* buffer;
+};
+
+
+/*
+ * Main function of the engine: move the active transfers when their socket is
+ * ready, until the engine is stopped.
+ */
+static void* transfer_engine_main(void* args);
+
+
+/*
+ * Give transfer to the engine, from the loop.
+ */
+static void give_transfer(transfer_engine_t* engine, transfer_t* transfer);
+
+
+/*
+ * Take the transfers given by the loop, then move the oldest waiting ones to
+ * the active transfers while there is room, failing the ones that waited for
+ * too long.
+ */
+static void activate_transfers(transfer_engine_t* engine, uint64_t now);
+
+
+/*
+ * Open the file of an upload and build the header of SMSG_DOWNLOAD: the
+ * length of the file, or the answer telling we do not have it.
+ */
+static void start_upload(transfer_t* transfer);
+
+
+/*
+ * Start the connection of a download to the remote, without waiting, and
+ * build CMSG_DOWNLOAD. Return -1 if the connection cannot be started, 0
+ * otherwise.
+ */
+static int start_download_request(transfer_t* transfer);
+
+
+/*
+ * Send the header of a transfer (SMSG_DOWNLOAD for an upload, CMSG_DOWNLOAD
+ * for a download) as far as the socket accepts it. Return TRANSFER_OVER on
+ * error, TRANSFER_MOVED if something was sent, TRANSFER_WAITING otherwise.
+ */
+static int send_header(transfer_t* transfer);
+
+
+/*
+ * Send what the socket of an upload accepts, at most TRANSFER_CHUNK_SIZE bytes
+ * of the file. Return TRANSFER_OVER once everything is sent, or on error.
+ */
+static int upload_step(transfer_t* transfer);
+
+
+/*
+ * Send CMSG_DOWNLOAD once connected, then receive what the socket of a
+ * download has, at most TRANSFER_CHUNK_SIZE bytes of the file, and write it. Return TRANSFER_OVER once the file is complete or
+ * the answer is an error (transfer->result tells which).
+ */
+static int download_step(transfer_engine_t* engine, transfer_t* transfer);
+
+
+/*
+ * Look for the end of the header of SMSG_DOWNLOAD among the bytes received.
+ * Return its size, 0 if more bytes are needed, -1 if the header is invalid.
+ * The length of the file is stored in transfer.
+ */
+static int parse_download_header(transfer_t* transfer);
+
+
+/*
+ * Write the bytes of the file received with the header of a download.
+ * Return -1 on error, 0 otherwise.
+ */
+static int start_download(transfer_t* transfer, int header_size);
+
+
+/*
+ * End transfer, already removed from the active or waiting ones: an upload is
+ * freed, a download is given back to the loop (see complete_transfers).
+ */
+static void end_transfer(transfer_engine_t* engine, transfer_t* transfer);
+
+
+/*
+ * End a transfer which is given up: the client of a download is told the
+ * remote is offline.
+ */
+static void give_up_transfer(transfer_engine_t* engine, transfer_t* transfer);
+
+
+/*
+ * Release what transfer holds, but its socket and its download.
+ */
+static void free_transfer(transfer_t* transfer);
+
+
+/******************************************************************************/
+
+
+transfer_engine_t* transfer_engine_create(void) {
+    transfer_engine_t* engine = aligned_alloc(WORKER_POOL_CACHE_LINE, sizeof(transfer_engine_t));
+    mpsc_queue_init(&engine->incoming);
+    mpsc_queue_init(&engine->finished);
+    atomic_init(&engine->stop, 0);
+    intrusive_list_init(&engine->active);
+    intrusive_list_init(&engine->waiting);
+    engine->buffer = malloc(TRANSFER_CHUNK_SIZE);
+
+    engine->event_fd = eventfd(0, EFD_CLOEXEC);
+    if (engine->event_fd == -1 ||
+        pthread_create(&engine->thread, NULL, transfer_engine_main, engine) != 0) {
+        if (engine->event_fd != -1) {
+            close(engine->event_fd);
+        }
+        free(engine->buffer);
+        free(engine);
+        return NULL;
+    }
+
+    return engine;
+}
+
+
+void transfer_engine_upload(transfer_engine_t* engine, int sock, char* filename) {
+    transfer_t* transfer = calloc(1, sizeof(transfer_t));
+    transfer->kind = TRANSFER_UPLOAD;
+    transfer->sock = sock;
+    transfer->file = -1;
+    transfer->filename = filename;
+
+    give_transfer(engine, transfer);
+}
+
+
+void transfer_engine_download(transfer_engine_t* engine, download_request_t* download) {
+    transfer_t* transfer = calloc(1, sizeof(transfer_t));
+    transfer->kind = TRANSFER_DOWNLOAD;
+    transfer->sock = -1;
+    transfer->file = -1;
+    transfer->download = download;
+    transfer->result = ANSWER_CODE_REMOTE_OFFLINE;
+
+    give_transfer(engine, transfer);
+}
+
+
+int complete_transfers(server_t* server) {
+    int nb_completed = 0;
+    mpsc_node_t* node;
+    while ((node = mpsc_queue_pop(&server->transfers->finished)) != NULL) {
+        transfer_t* transfer = (transfer_t*)((char*)node - offsetof(transfer_t, node));
+
+        /*
+         * Only the opcode is captured, not the content of the file. The engine
+         * opened the connection, the capture only learns about it here.
+         */
+        if (transfer->nb_received > 0) {
+            opcode_t opcode = SMSG_DOWNLOAD;
+            trace_connection_opened(transfer->sock);
+            trace_frame(TRACE_DOWNLOAD, transfer->sock, &opcode, PKT_ID_SIZE);
+        }
+
+        if (transfer->sock != -1) {
+            close(transfer->sock);
+        }
+        send_download_response(server, transfer->download, transfer->result);
+        free(transfer);
+        ++nb_completed;
+    }
+
+    return nb_completed;
+}
+
+
+void transfer_engine_stop(transfer_engine_t* engine) {
+    atomic_store_explicit(&engine->stop, 1, memory_order_release);
+
+    uint64_t one = 1;
+    write_to_fd(engine->event_fd, &one, sizeof(uint64_t));
+    pthread_join(engine->thread, NULL);
+}
+
+
+void transfer_engine_destroy(transfer_engine_t** engine) {
+    transfer_engine_t* destroyed = *engine;
+
+    /* Downloads nobody completed: there is no client left to tell. */
+    mpsc_node_t* node;
+    while ((node = mpsc_queue_pop(&destroyed->finished)) != NULL) {
+        transfer_t* transfer = (transfer_t*)((char*)node - offsetof(transfer_t, node));
+        if (transfer->sock != -1) {
+            close(transfer->sock);
+        }
+        free(transfer->download);
+        free(transfer);
+    }
+
+    close(destroyed->event_fd);
+    free(destroyed->buffer);
+    free(destroyed);
+    *engine = NULL;
+}
+
+
+void* transfer_engine_main(void* args) {
+    transfer_engine_t* engine = (transfer_engine_t*)args;
+
+    /* A remote leaving in the middle of an upload is an error, not a signal. */
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    while (atomic_load_explicit(&engine->stop, memory_order_acquire) == 0) {
+        activate_transfers(engine, metrics_now());
+
+        int nb_active = engine->active.length;
+        struct pollfd pollers[TRANSFER_MAX_ACTIVE + 1];
+        transfer_t* transfers[TRANSFER_MAX_ACTIVE];
+        int nb_pending = 0;
+
+        pollers[0].fd = engine->event_fd;
+        pollers[0].events = POLLIN;
+        pollers[0].revents = 0;
+
+        int i = 0;
+        for (list_node_t* link = engine->active.head; link != NULL; link = link->next) {
+            transfers[i] = LIST_ENTRY(link, transfer_t, link);
+            pollers[i + 1].fd = transfers[i]->sock;
+            /* A download sends CMSG_DOWNLOAD before it receives anything. */
+            pollers[i + 1].events = transfers[i]->kind == TRANSFER_UPLOAD ||
+                                    transfers[i]->request_sent == 0 ? POLLOUT : POLLIN;
+            pollers[i + 1].revents = 0;
+            if (transfers[i]->kind == TRANSFER_DOWNLOAD && transfers[i]->has_header == 0) {
+                ++nb_pending;
+            }
+            ++i;
+        }
+
+        metric_set(METRIC_ACTIVE_TRANSFERS, nb_active);
+        metric_set(METRIC_WAITING_TRANSFERS, engine->waiting.length);
+        metric_set(METRIC_PENDING_DOWNLOADS, nb_pending);
+
+        if (poll(pollers, nb_active + 1, TRANSFER_POLL_TIMEOUT) == -1 && errno != EINTR) {
+            applog(LOG_LEVEL_ERROR, "[Server] Erreur durant poll() des transferts : %s.\n",
+                   strerror(errno));
+        }
+
+        if (pollers[0].revents != 0) {
+            uint64_t count;
+            read_from_fd(engine->event_fd, &count, sizeof(uint64_t));
+        }
+
+        uint64_t now = metrics_now();
+        for (i = 0; i < nb_active; i++) {
+            transfer_t* transfer = transfers[i];
+
+            int step = TRANSFER_WAITING;
+            if (pollers[i + 1].revents != 0) {
+                step = transfer->kind == TRANSFER_UPLOAD ? upload_step(transfer)
+                                                         : download_step(engine, transfer);
+            }
+
+            if (step == TRANSFER_OVER) {
+                intrusive_list_remove(&engine->active, &transfer->link);
+                end_transfer(engine, transfer);
+            } else if (step == TRANSFER_MOVED) {
+                transfer->deadline = now + (uint64_t)TRANSFER_IDLE_TIMEOUT * 1000000;
+            } else if (now >= transfer->deadline) {
+                applog(LOG_LEVEL_WARNING, "[Server] Transfert de %s bloqué depuis %d ms, "
+                                          "abandonné.\n",
+                       transfer->kind == TRANSFER_UPLOAD ? transfer->filename
+                                                         : transfer->download->filename,
+                       TRANSFER_IDLE_TIMEOUT);
+                metric_inc(METRIC_EVICTED_IDLE);
+                intrusive_list_remove(&engine->active, &transfer->link);
+                give_up_transfer(engine, transfer);
+            }
+        }
+    }
+
+    list_node_t* link;
+    while ((link = intrusive_list_pop_front(&engine->active)) != NULL) {
+        give_up_transfer(engine, LIST_ENTRY(link, transfer_t, link));
+    }
+    while ((link = intrusive_list_pop_front(&engine->waiting)) != NULL) {
+        give_up_transfer(engine, LIST_ENTRY(link, transfer_t, link));
+    }
+
+    mpsc_node_t* node;
+    while ((node = mpsc_queue_pop(&engine->incoming)) != NULL) {
+        give_up_transfer(engine, (transfer_t*)((char*)node - offsetof(transfer_t, node)));
+    }
+
+    return NULL;
+}
+
+
+void give_transfer(transfer_engine_t* engine, transfer_t* transfer) {
+    /* The deadline of a waiting transfer runs from now. */
+    transfer->deadline = metrics_now() + (uint64_t)TRANSFER_IDLE_TIMEOUT * 1000000;
+    if (transfer->sock != -1) {
+        fcntl(transfer->sock, F_SETFL, fcntl(transfer->sock, F_GETFL) | O_NONBLOCK);
+    }
+
+    mpsc_queue_push(&engine->incoming, &transfer->node);
+
+    uint64_t one = 1;
+    write_to_fd(engine->event_fd, &one, sizeof(uint64_t));
+}
+
+
+void activate_transfers(transfer_engine_t* engine, uint64_t now) {
+    mpsc_node_t* node;
+    while ((node = mpsc_queue_pop(&engine->incoming)) != NULL) {
+        transfer_t* transfer = (transfer_t*)((char*)node - offsetof(transfer_t, node));
+        intrusive_list_push_back(&engine->waiting, &transfer->link);
+    }
+
+    while (engine->waiting.length > 0) {
+        transfer_t* transfer = LIST_ENTRY(engine->waiting.head, transfer_t, link);
+
+        if (now >= transfer->deadline) {
+            applog(LOG_LEVEL_WARNING, "[Server] Trop de transferts en cours, transfert "
+                                      "abandonné.\n");
+            intrusive_list_pop_front(&engine->waiting);
+            metric_inc(METRIC_DROPPED_TRANSFERS);
+            give_up_transfer(engine, transfer);
+            continue;
+        }
+
+        if (engine->active.length >= TRANSFER_MAX_ACTIVE) {
+            break;
+        }
+
+        intrusive_list_pop_front(&engine->waiting);
+        transfer->start = now;
+        transfer->deadline = now + (uint64_t)TRANSFER_IDLE_TIMEOUT * 1000000;
+        if (transfer->kind == TRANSFER_UPLOAD) {
+            start_upload(transfer);
+        } else if (start_download_request(transfer) == -1) {
+            give_up_transfer(engine, transfer);
+            continue;
+        }
+
+        intrusive_list_push_back(&engine->active, &transfer->link);
+    }
+}
+
+
+void start_upload(transfer_t* transfer) {
+    char* full_name = malloc(strlen(SEARCH_DIRECTORY) + 1 + strlen(transfer->filename) + 1);
+    sprintf(full_name, "%s/%s", SEARCH_DIRECTORY, transfer->filename);
+
+    /* Only the files of SEARCH_DIRECTORY itself can be downloaded. */
+    struct stat status;
+    if (strchr(transfer->filename, '/') == NULL) {
+        transfer->file = open(full_name, O_RDONLY | O_CLOEXEC);
+    }
+    if (transfer->file != -1 &&
+        (fstat(transfer->file, &status) == -1 || !S_ISREG(status.st_mode) ||
+         (uint64_t)status.st_size > UINT32_MAX)) {
+        close(transfer->file);
+        transfer->file = -1;
+    }
+    free(full_name);
+
+    transfer->header = packet_begin(SMSG_DOWNLOAD);
+    if (transfer->file == -1) {
+        char ip[INET6_ADDRSTRLEN], port[6];
+        extract_ip_port_from_socket(transfer->sock, ip, port, 0);
+
+        packet_append_u8(transfer->header, ANSWER_CODE_REMOTE_NOT_FOUND);
+        packet_append_string(transfer->header, ip);
+        packet_append_string(transfer->header, port);
+        packet_append_string(transfer->header, transfer->filename);
+        return;
+    }
+
+    transfer->length = status.st_size;
+    packet_append_u8(transfer->header, ANSWER_CODE_REMOTE_FOUND);
+    packet_append_string(transfer->header, transfer->filename);
+    packet_append(transfer->header, &transfer->length, sizeof(uint32_t));
+}
+
+
+int start_download_request(transfer_t* transfer) {
+    download_request_t* download = transfer->download;
+    int res = start_connect_to(download->ip, download->port, &transfer->sock);
+    if (res != CONNECT_OK && res != CONNECT_IN_PROGRESS) {
+        return -1;
+    }
+
+    transfer->header = packet_begin(CMSG_DOWNLOAD);
+    packet_append_string(transfer->header, download->filename);
+    return 0;
+}
+
+
+int send_header(transfer_t* transfer) {
+    packet_t* header = transfer->header;
+    ssize_t sent = send(transfer->sock, header->data + transfer->header_sent,
+                        header->size - transfer->header_sent, MSG_NOSIGNAL);
+    if (sent == -1) {
+        return errno == EAGAIN || errno == EWOULDBLOCK ? TRANSFER_WAITING : TRANSFER_OVER;
+    }
+
+    transfer->header_sent += sent;
+    return TRANSFER_MOVED;
+}
+
+
+int upload_step(transfer_t* transfer) {
+    int moved = TRANSFER_WAITING;
+    if (transfer->header_sent < transfer->header->size) {
+        moved = send_header(transfer);
+        if (moved != TRANSFER_MOVED || transfer->header_sent < transfer->header->size) {
+            return moved;
+        }
+    }
+
+    /* The content of the file goes from the page cache to the socket. */
+    size_t length = transfer->length - transfer->done;
+    if (length > TRANSFER_CHUNK_SIZE) {
+        length = TRANSFER_CHUNK_SIZE;
+    }
+
+    if (length > 0) {
+        ssize_t sent = sendfile(transfer->sock, transfer->file, NULL, length);
+        if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return moved;
+        } else if (sent <= 0) {
+            applog(LOG_LEVEL_ERROR, "[Server] Envoi de %s interrompu après %u octets.\n",
+                   transfer->filename, transfer->done);
+            return TRANSFER_OVER;
+        }
+
+        transfer->done += sent;
+        metric_add(METRIC_BYTES_UPLOADED, sent);
+    }
+
+    if (transfer->done < transfer->length) {
+        return TRANSFER_MOVED;
+    }
+
+    if (transfer->file != -1) {
+        double duration = (metrics_now() - transfer->start) / 1e9;
+        applog(LOG_LEVEL_INFO, "[Server] %s envoyé : %u octets en %.3f s.\n",
+               transfer->filename, transfer->length, duration);
+    }
+
+    return TRANSFER_OVER;
+}
+
+
+int download_step(transfer_engine_t* engine, transfer_t* transfer) {
+    if (transfer->request_sent == 0) {
+        if (transfer->header_sent == 0 && get_connect_result(transfer->sock) == -1) {
+            applog(LOG_LEVEL_ERROR, "[Server] Impossible de se connecter à %s:%s pour "
+                                    "%s.\n", transfer->download->ip,
+                   transfer->download->port, transfer->download->filename);
+            return TRANSFER_OVER;
+        }
+
+        int step = send_header(transfer);
+        if (transfer->header_sent == transfer->header->size) {
+            transfer->request_sent = 1;
+        }
+
+        return step;
+    }
+
+    if (transfer->has_header == 0) {
+        ssize_t received = recv(transfer->sock, transfer->received + transfer->nb_received,
+                                TRANSFER_HEADER_SIZE - transfer->nb_received, 0);
+        if (received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return TRANSFER_WAITING;
+        } else if (received <= 0) {
+            return TRANSFER_OVER;
+        }
+
+        transfer->nb_received += received;
+
+        int header_size = parse_download_header(transfer);
+        if (header_size == -1 ||
+            (header_size == 0 && transfer->nb_received == TRANSFER_HEADER_SIZE)) {
+            applog(LOG_LEVEL_ERROR, "[Server] Réponse invalide de %s:%s pour %s.\n",
+                   transfer->download->ip, transfer->download->port,
+                   transfer->download->filename);
+            return TRANSFER_OVER;
+        } else if (header_size == 0) {
+            return TRANSFER_MOVED;
+        }
+
+        transfer->has_header = 1;
+        if (transfer->result == ANSWER_CODE_REMOTE_NOT_FOUND) {
+            return TRANSFER_OVER;
+        }
+
+        if (start_download(transfer, header_size) == -1) {
+            transfer->result = ANSWER_CODE_REMOTE_OFFLINE;
+            return TRANSFER_OVER;
+        }
+    } else {
+        size_t length = transfer->length - transfer->done;
+        if (length > TRANSFER_CHUNK_SIZE) {
+            length = TRANSFER_CHUNK_SIZE;
+        }
+
+        ssize_t received = recv(transfer->sock, engine->buffer, length, 0);
+        if (received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return TRANSFER_WAITING;
+        } else if (received <= 0) {
+            applog(LOG_LEVEL_ERROR, "[Server] Téléchargement de %s interrompu après "
+                                    "%u octets.\n", transfer->download->filename,
+                   transfer->done);
+            transfer->result = ANSWER_CODE_REMOTE_OFFLINE;
+            return TRANSFER_OVER;
+        }
+
+        if (write_to_fd(transfer->file, engine->buffer, received) == -1) {
+            transfer->result = ANSWER_CODE_REMOTE_OFFLINE;
+            return TRANSFER_OVER;
+        }
+
+        transfer->done += received;
+        metric_add(METRIC_BYTES_DOWNLOADED, received);
+    }
+
+    if (transfer->done < transfer->length) {
+        return TRANSFER_MOVED;
+    }
+
+    double duration = (metrics_now() - transfer->start) / 1e9;
+    applog(LOG_LEVEL_INFO, "[Server] %s téléchargé : %u octets en %.3f s.\n",
+           transfer->download->filename, transfer->length, duration);
+    return TRANSFER_OVER;
+}
+
+
+int parse_download_header(transfer_t* transfer) {
+    const unsigned char* received = (const unsigned char*)transfer->received;
+    size_t nb_received = transfer->nb_received;
+
+    if (received[0] != SMSG_DOWNLOAD) {
+        return -1;
+    }
+
+    size_t offset = PKT_ID_SIZE + 1;
+    if (nb_received < offset) {
+        return 0;
+    }
+
+    /* An error ends with the IP, the port and the name, a file with its name and length. */
+    int nb_strings;
+    uint8_t code = received[PKT_ID_SIZE];
+    if (code == ANSWER_CODE_REMOTE_NOT_FOUND) {
+        nb_strings = 3;
+    } else if (code == ANSWER_CODE_REMOTE_FOUND) {
+        nb_strings = 1;
+    } else {
+        return -1;
+    }
+
+    for (int i = 0; i < nb_strings; i++) {
+        if (nb_received < offset + 1) {
+            return 0;
+        }
+        offset += 1 + received[offset];
+    }
+
+    if (code == ANSWER_CODE_REMOTE_FOUND) {
+        if (nb_received < offset + sizeof(uint32_t)) {
+            return 0;
+        }
+        memcpy(&transfer->length, received + offset, sizeof(uint32_t));
+        offset += sizeof(uint32_t);
+    }
+
+    if (nb_received < offset) {
+        return 0;
+    }
+
+    transfer->result = code;
+    return offset;
+}
+
+
+int start_download(transfer_t* transfer, int header_size) {
+    const char* filename = transfer->download->filename;
+    char* pathname = malloc(strlen(SEARCH_DIRECTORY) + 1 + strlen(filename) + 1);
+    sprintf(pathname, "%s/%s", SEARCH_DIRECTORY, filename);
+
+    mkdir(SEARCH_DIRECTORY, 0777);
+    transfer->file = open(pathname, O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, 0666);
+    free(pathname);
+
+    if (transfer->file == -1) {
+        applog(LOG_LEVEL_ERROR, "[Server] Impossible de créer %s : %s.\n", filename,
+               strerror(errno));
+        return -1;
+    }
+
+    /* The beginning of the file may have come with the header. */
+    size_t length = transfer->nb_received - header_size;
+    if (length > transfer->length) {
+        length = transfer->length;
+    }
+
+    if (length > 0) {
+        if (write_to_fd(transfer->file, transfer->received + header_size, length) == -1) {
+            return -1;
+        }
+
+        transfer->done = length;
+        metric_add(METRIC_BYTES_DOWNLOADED, length);
+    }
+
+    return 0;
+}
+
+
+void end_transfer(transfer_engine_t* engine, transfer_t* transfer) {
+    if (transfer->kind == TRANSFER_UPLOAD) {
+        close(transfer->sock);
+        free_transfer(transfer);
+        free(transfer);
+        return;
+    }
+
+    /* A file received in part is useless. */
+    if (transfer->file != -1 && transfer->result != ANSWER_CODE_REMOTE_FOUND) {
+        char* pathname = malloc(strlen(SEARCH_DIRECTORY) + 1 +
+                                strlen(transfer->download->filename) + 1);
+        sprintf(pathname, "%s/%s", SEARCH_DIRECTORY, transfer->download->filename);
+        unlink(pathname);
+        free(pathname);
+    }
+
+    free_transfer(transfer);
+    mpsc_queue_push(&engine->finished, &transfer->node);
+}
+
+
+void give_up_transfer(transfer_engine_t* engine, transfer_t* transfer) {
+    transfer->result = ANSWER_CODE_REMOTE_OFFLINE;
+    end_transfer(engine, transfer);
+}
+
+
+void free_transfer(transfer_t* transfer) {
+    if (transfer->file != -1) {
+        close(transfer->file);
+        transfer->file = -1;
+    }
+
+    packet_release(transfer->header);
+    transfer->header = NULL;
+    free(transfer->filename);
+    transfer->filename = NULL;
+}
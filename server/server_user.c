@@ -3,59 +3,41 @@
 #include <stdint.h>
 
 #include "log.h"
+#include "packets_decode.h"
+#include "packets_defines.h"
 #include "server_internal.h"
 #include "util.h"
 
-void handle_local_search_request(server_t* server) {
-    uint8_t name_len;
-    read_from_fd(server->client_socket, &name_len, sizeof(uint8_t));
+void handle_local_search_request(server_t* server, packet_reader_t* reader) {
+    string_view_t view;
+    if (packet_read_view(reader, &view) == -1) {
+        return;
+    }
 
-    char* name = malloc(name_len + 1);
-    read_from_fd(server->client_socket, name, name_len);
-    name[name_len] = '\0';
+    char* name = string_view_dup(&view);
 
     applog(LOG_LEVEL_INFO, "[Local Server] Searching file %s\n", name);
 
-    request_t main_request;
-    main_request.type = REQUEST_SEARCH_LOCAL;
-
     local_search_request_t* request = malloc(sizeof(local_search_request_t));
     request->name = name;
 
-    main_request.request = request;
-
-    list_push_back(server->pending_requests, &main_request);
+    request_t* main_request = request_create(REQUEST_SEARCH_LOCAL, request);
+    intrusive_list_push_back(&server->pending_requests, &main_request->node);
 }
 
 
-void handle_local_download_request(server_t* server) {
-    uint8_t name_length, ip_length, port_length;
-
-    read_from_fd(server->client_socket, &ip_length, sizeof(uint8_t));
-    char* ip = malloc(ip_length + 1);
-    read_from_fd(server->client_socket, ip, ip_length);
-
-    read_from_fd(server->client_socket, &port_length, sizeof(uint8_t));
-    char* port = malloc(port_length + 1);
-    read_from_fd(server->client_socket, port, port_length);
-
-    read_from_fd(server->client_socket, &name_length, sizeof(uint8_t));
-    char* filename = malloc(name_length + 1);
-    read_from_fd(server->client_socket, filename, name_length);
-
-    ip[ip_length] = '\0';
-    port[port_length] = '\0';
-    filename[name_length] = '\0';
-
-    request_t request;
-    request.type = REQUEST_DOWNLOAD_LOCAL;
+void handle_local_download_request(server_t* server, packet_reader_t* reader) {
+    download_target_t target;
+    if (decode_download_target(reader, &target) == -1) {
+        return;
+    }
 
+    /* The request outlives the frame, so it gets its own copy of the strings. */
     download_request_t* download_request = malloc(sizeof(download_request_t));
-    download_request->filename = filename;
-    download_request->ip = ip;
-    download_request->port = port;
-
-    request.request = download_request;
+    string_view_to_cstring(&target.ip, download_request->ip);
+    string_view_to_cstring(&target.port, download_request->port);
+    string_view_to_cstring(&target.filename, download_request->filename);
 
-    list_push_back(server->pending_requests, &request);
+    request_t* request = request_create(REQUEST_DOWNLOAD_LOCAL, download_request);
+    intrusive_list_push_back(&server->pending_requests, &request->node);
 }
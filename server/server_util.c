@@ -9,6 +9,7 @@
 #include <sys/types.h>
 
 #include "log.h"
+#include "metrics.h"
 #include "packets_defines.h"
 #include "server_internal.h"
 #include "util.h"
@@ -39,6 +40,31 @@ void* add_new_socket(void* s) {
 }
 
 
+idle_socket_t* idle_socket_push(intrusive_list_t* queue, int sock, int timeout) {
+    idle_socket_t* entry = malloc(sizeof(idle_socket_t));
+    entry->sock = sock;
+    entry->deadline = metrics_now() + (uint64_t)timeout * 1000000;
+    intrusive_list_push_back(queue, &entry->node);
+
+    return entry;
+}
+
+
+idle_socket_t* idle_socket_pop_expired(intrusive_list_t* queue, uint64_t now, int force) {
+    if (queue->head == NULL) {
+        return NULL;
+    }
+
+    idle_socket_t* oldest = LIST_ENTRY(queue->head, idle_socket_t, node);
+    if (!force && oldest->deadline > now) {
+        return NULL;
+    }
+
+    intrusive_list_pop_front(queue);
+    return oldest;
+}
+
+
 // Build data for SMSG_NEIGHBOURS (Server)
 void compute_and_send_neighbours(server_t* server, int s) {
     uint8_t nb_neighbours = 0;
@@ -71,24 +97,30 @@ void compute_and_send_neighbours(server_t* server, int s) {
 
 
 void add_neighbour(server_t* server, int s, const char *contact_port) {
-    if (server->nb_neighbours == MAX_NEIGHBOURS) {
+    if (server->nb_neighbours >= server->max_neighbours) {
         return;
     }
 
     char* ip = extract_ip_from_socket_s(s, 1);
     applog(LOG_LEVEL_INFO, "[Client] Adding neighbour %s, contact %s (%d)\n",
                            ip, contact_port, s);
-    free(ip);
 
     for (int i = 0; i < MAX_NEIGHBOURS; i++) {
-        if (server->neighbours[i].sock == -1) {
-            server->neighbours[i].sock = s;
-            set_string(&(server->neighbours[i].port), contact_port);
+        socket_contact_t* neighbour = server->neighbours + i;
+        if (neighbour->sock == -1) {
+            neighbour->sock = s;
+            neighbour->ip = ip;
+            set_string(&(neighbour->port), contact_port);
             ++server->nb_neighbours;
+
+            char key[HASHMAP_MAX_KEY_SIZE];
+            size_t key_length = hashmap_compose_key(key, 2, ip, contact_port);
+            hashmap_put(server->neighbours_index, key, key_length, neighbour);
             return;
         }
     }
 
+    free(ip);
     applog(LOG_LEVEL_ERROR, "[Client] Neighbour not added !\n");
 }
 
@@ -0,0 +1,176 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "metrics.h"
+#include "trace.h"
+
+
+/* Size of the buffer of the output file: records are written in batches. */
+#define TRACE_BUFFER_SIZE (1 << 20)
+
+
+/*
+ * Return the identifier of the connection on fd, giving it a new one if it has
+ * none yet.
+ */
+static uint32_t get_connection_id(int fd);
+
+
+/* File the frames are captured in, NULL if none. */
+static const char* output_path = NULL;
+/* The open output file, NULL when nothing is captured. */
+static FILE* output = NULL;
+/* Start of the capture (metrics_now). */
+static uint64_t start_time = 0;
+
+/*
+ * Identifier of the connection on each file descriptor, 0 if the descriptor
+ * has not been seen since it was opened.
+ */
+static uint32_t* connection_ids = NULL;
+static int nb_connection_ids = 0;
+/* Next identifier given, 0 being the local client. */
+static uint32_t next_connection_id = 1;
+
+
+/******************************************************************************/
+
+
+void trace_set_output(const char* path) {
+    output_path = path;
+}
+
+
+int trace_start(void) {
+    if (output_path == NULL) {
+        return 0;
+    }
+
+    output = fopen(output_path, "wb");
+    if (output == NULL) {
+        applog(LOG_LEVEL_ERROR, "[Server] Impossible de créer la capture %s.\n",
+               output_path);
+        return -1;
+    }
+
+    setvbuf(output, NULL, _IOFBF, TRACE_BUFFER_SIZE);
+
+    uint32_t version = TRACE_VERSION;
+    fwrite(TRACE_MAGIC, 1, TRACE_MAGIC_SIZE, output);
+    fwrite(&version, sizeof(version), 1, output);
+
+    start_time = metrics_now();
+    next_connection_id = 1;
+    return 0;
+}
+
+
+void trace_stop(void) {
+    if (output != NULL) {
+        fclose(output);
+        output = NULL;
+    }
+
+    free(connection_ids);
+    connection_ids = NULL;
+    nb_connection_ids = 0;
+}
+
+
+int trace_enabled(void) {
+    return output != NULL;
+}
+
+
+void trace_connection_opened(int fd) {
+    if (output != NULL && fd >= 0 && fd < nb_connection_ids) {
+        connection_ids[fd] = 0;
+    }
+}
+
+
+void trace_frame(trace_channel_t channel, int fd, const void* frame, size_t size) {
+    if (output == NULL) {
+        return;
+    }
+
+    uint64_t time = (metrics_now() - start_time) / 1000;
+    uint32_t connection = fd < 0 ? 0 : get_connection_id(fd);
+    uint8_t channel_byte = channel;
+    uint32_t length = size < TRACE_MAX_FRAME_SIZE ? size : TRACE_MAX_FRAME_SIZE;
+
+    char header[TRACE_RECORD_HEADER_SIZE];
+    memcpy(header, &time, sizeof(time));
+    memcpy(header + 8, &connection, sizeof(connection));
+    memcpy(header + 12, &channel_byte, sizeof(channel_byte));
+    memcpy(header + 13, &length, sizeof(length));
+
+    fwrite(header, 1, sizeof(header), output);
+    fwrite(frame, 1, length, output);
+}
+
+
+FILE* trace_reader_open(const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        return NULL;
+    }
+
+    char magic[TRACE_MAGIC_SIZE];
+    uint32_t version;
+    if (fread(magic, 1, TRACE_MAGIC_SIZE, file) != TRACE_MAGIC_SIZE ||
+        memcmp(magic, TRACE_MAGIC, TRACE_MAGIC_SIZE) != 0 ||
+        fread(&version, sizeof(version), 1, file) != 1 || version != TRACE_VERSION) {
+        fclose(file);
+        return NULL;
+    }
+
+    return file;
+}
+
+
+int trace_read_record(FILE* file, trace_record_t* record, void* frame) {
+    char header[TRACE_RECORD_HEADER_SIZE];
+    size_t res = fread(header, 1, sizeof(header), file);
+    if (res == 0 && feof(file)) {
+        return 0;
+    } else if (res != sizeof(header)) {
+        return -1;
+    }
+
+    memcpy(&record->time, header, sizeof(record->time));
+    memcpy(&record->connection, header + 8, sizeof(record->connection));
+    memcpy(&record->channel, header + 12, sizeof(record->channel));
+    memcpy(&record->length, header + 13, sizeof(record->length));
+
+    if (record->length > TRACE_MAX_FRAME_SIZE || record->channel >= TRACE_CHANNELS_COUNT ||
+        fread(frame, 1, record->length, file) != record->length) {
+        return -1;
+    }
+
+    return 1;
+}
+
+
+uint32_t get_connection_id(int fd) {
+    if (fd >= nb_connection_ids) {
+        int size = nb_connection_ids == 0 ? 64 : nb_connection_ids;
+        while (size <= fd) {
+            size *= 2;
+        }
+
+        connection_ids = realloc(connection_ids, size * sizeof(uint32_t));
+        memset(connection_ids + nb_connection_ids, 0,
+               (size - nb_connection_ids) * sizeof(uint32_t));
+        nb_connection_ids = size;
+    }
+
+    if (connection_ids[fd] == 0) {
+        connection_ids[fd] = next_connection_id++;
+    }
+
+    return connection_ids[fd];
+}
@@ -0,0 +1,126 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "common.h"
+
+
+/*
+ * Capture of the traffic received by the servent. When an output file is set
+ * (see trace_set_output), every frame read by the main loop is appended to it,
+ * so that the same traffic can be fed again to a servent later on (see
+ * bench/replay.c).
+ *
+ * The file starts with TRACE_MAGIC and TRACE_VERSION (4 bytes), followed by
+ * the records. A record is a header of TRACE_RECORD_HEADER_SIZE bytes:
+ *  - time (8 bytes): microseconds since the start of the capture ;
+ *  - connection (4 bytes): identifier of the connection the frame came from,
+ *    0 for the local client ;
+ *  - channel (1 byte): where the frame was read (trace_channel_t) ;
+ *  - length (4 bytes): size of the frame ;
+ * and the frame itself, opcode included, as it was received. Integers are in
+ * the byte order of the machine that wrote the file: a file written on a
+ * machine with another byte order is rejected because of its version.
+ *
+ * The files of SMSG_DOWNLOAD are not captured: only the opcode is recorded.
+ *
+ * The recorder is only used by the thread of the servent.
+ */
+
+
+/* Where a frame was read, like dispatch_site_t (see metrics.h). */
+typedef enum trace_channel_e {
+    /* First request on an accepted socket (handle_awaiting_socket). */
+    TRACE_AWAITING,
+    /* Packet from a neighbour (handle_neighbour). */
+    TRACE_NEIGHBOUR,
+    /* Packet from the local client (handle_client). */
+    TRACE_CLIENT,
+    /* Answer to one of our downloads (handle_pending_download). */
+    TRACE_DOWNLOAD,
+
+    TRACE_CHANNELS_COUNT
+} trace_channel_t;
+
+
+#define TRACE_MAGIC "GNUTRACE"
+#define TRACE_MAGIC_SIZE 8
+#define TRACE_VERSION 1
+#define TRACE_RECORD_HEADER_SIZE 17
+
+
+/*
+ * Largest frame kept in a record. Larger frames are cut: they cannot come from
+ * a neighbour anyway (see PACKET_MAX_FRAME_SIZE).
+ */
+#define TRACE_MAX_FRAME_SIZE 65536
+
+
+/* Header of a record, as read by trace_read_record. */
+typedef struct trace_record_s {
+    uint64_t time;
+    uint32_t connection;
+    uint8_t channel;
+    uint32_t length;
+} trace_record_t;
+
+
+/*
+ * Set the file the frames are captured in, NULL (the default) to capture
+ * nothing. path is not copied. Must be called before the servent starts.
+ */
+void trace_set_output(const char* path);
+
+
+/*
+ * Create the output file, if any, and start the clock of the capture. Return
+ * -1 if the file could not be created (nothing is captured then), 0 otherwise.
+ */
+ERROR_CODES_USUAL int trace_start(void);
+
+
+/*
+ * Flush and close the output file.
+ */
+void trace_stop(void);
+
+
+/*
+ * Return 1 if the frames are being captured, 0 otherwise.
+ */
+int trace_enabled(void);
+
+
+/*
+ * Indicate that fd is a new connection: the frames read from it from now on
+ * get a new identifier, even if the descriptor was used by another connection
+ * before.
+ */
+void trace_connection_opened(int fd);
+
+
+/*
+ * Append the frame of size bytes, read from fd on channel, to the capture.
+ * fd is -1 for the local client.
+ */
+void trace_frame(trace_channel_t channel, int fd, const void* frame, size_t size);
+
+
+/*
+ * Open a capture for reading and check its header. Return NULL if the file
+ * cannot be opened or is not a capture.
+ */
+FILE* trace_reader_open(const char* path);
+
+
+/*
+ * Read the next record of file: its header goes in record and its frame in
+ * frame (at least TRACE_MAX_FRAME_SIZE bytes). Return 1 if a record was read,
+ * 0 at the end of the file, -1 if the file is truncated or corrupted.
+ */
+int trace_read_record(FILE* file, trace_record_t* record, void* frame);
+
+#endif /* TRACE_H */
@@ -0,0 +1,305 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "util.h"
+#include "worker_pool.h"
+
+
+typedef struct job_s {
+    /* Link inside the queue of a worker, then inside the finished jobs. */
+    mpsc_node_t node;
+    job_run_fn run;
+    job_complete_fn complete;
+    void* data;
+} job_t;
+
+
+typedef struct worker_s {
+    /* Jobs given to the worker. */
+    mpsc_queue_t jobs;
+    /* Counts the jobs pushed (and the request to stop), the worker sleeps on it. */
+    int event_fd;
+    /* Jobs given to the worker and not run yet. */
+    atomic_int nb_jobs;
+    pthread_t thread;
+    worker_pool_t* pool;
+} worker_t;
+
+
+struct worker_pool_s {
+    /* Jobs run by the workers, waiting to be completed. */
+    mpsc_queue_t done;
+    /* Counts the jobs pushed to done, the owner sleeps on it. */
+    int done_fd;
+    worker_t* workers[WORKER_POOL_MAX_WORKERS];
+    int nb_workers;
+    /* Given to the completions. */
+    void* context;
+    /* Jobs submitted and not completed, only used by the owner. */
+    int nb_pending;
+    /* Set to 1 when the workers must stop, once their queue is empty. */
+    atomic_int stop;
+};
+
+
+/*
+ * Main function of a worker: run the jobs of its queue, and sleep when it is
+ * empty.
+ */
+static void* worker_main(void* args);
+
+
+/*
+ * Stop and join the first nb_workers workers of pool, then free them.
+ */
+static void stop_workers(worker_pool_t* pool, int nb_workers);
+
+
+/******************************************************************************/
+
+
+void mpsc_queue_init(mpsc_queue_t* queue) {
+    atomic_init(&queue->stub.next, NULL);
+    atomic_init(&queue->head, &queue->stub);
+    queue->tail = &queue->stub;
+}
+
+
+void mpsc_queue_push(mpsc_queue_t* queue, mpsc_node_t* node) {
+    atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+    mpsc_node_t* previous = atomic_exchange_explicit(&queue->head, node, memory_order_acq_rel);
+    /* Until this store, the consumer cannot see node (nor what comes after). */
+    atomic_store_explicit(&previous->next, node, memory_order_release);
+}
+
+
+mpsc_node_t* mpsc_queue_pop(mpsc_queue_t* queue) {
+    mpsc_node_t* tail = queue->tail;
+    mpsc_node_t* next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+    if (tail == &queue->stub) {
+        if (next == NULL) {
+            return NULL;
+        }
+
+        queue->tail = next;
+        tail = next;
+        next = atomic_load_explicit(&next->next, memory_order_acquire);
+    }
+
+    if (next != NULL) {
+        queue->tail = next;
+        return tail;
+    }
+
+    /* tail is the last node: a producer is pushing after it, or nobody is. */
+    if (tail != atomic_load_explicit(&queue->head, memory_order_acquire)) {
+        return NULL;
+    }
+
+    /* Put the stub back behind tail, so that tail can leave the queue. */
+    mpsc_queue_push(queue, &queue->stub);
+
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (next != NULL) {
+        queue->tail = next;
+        return tail;
+    }
+
+    return NULL;
+}
+
+
+worker_pool_t* worker_pool_create(int nb_workers, void* context) {
+    if (nb_workers > WORKER_POOL_MAX_WORKERS) {
+        nb_workers = WORKER_POOL_MAX_WORKERS;
+    }
+
+    worker_pool_t* pool = aligned_alloc(WORKER_POOL_CACHE_LINE, sizeof(worker_pool_t));
+    mpsc_queue_init(&pool->done);
+    pool->done_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (pool->done_fd == -1) {
+        applog(LOG_LEVEL_ERROR, "[Server] Impossible de créer l'eventfd des workers.\n");
+        free(pool);
+        return NULL;
+    }
+
+    pool->nb_workers = 0;
+    pool->context = context;
+    pool->nb_pending = 0;
+    atomic_init(&pool->stop, 0);
+
+    for (int i = 0; i < nb_workers; i++) {
+        worker_t* worker = aligned_alloc(WORKER_POOL_CACHE_LINE, sizeof(worker_t));
+        mpsc_queue_init(&worker->jobs);
+        atomic_init(&worker->nb_jobs, 0);
+        worker->pool = pool;
+        worker->event_fd = eventfd(0, EFD_CLOEXEC);
+
+        if (worker->event_fd == -1 ||
+            pthread_create(&worker->thread, NULL, worker_main, worker) != 0) {
+            applog(LOG_LEVEL_ERROR, "[Server] Impossible de créer le worker %d.\n", i);
+            if (worker->event_fd != -1) {
+                close(worker->event_fd);
+            }
+            free(worker);
+            stop_workers(pool, pool->nb_workers);
+            close(pool->done_fd);
+            free(pool);
+            return NULL;
+        }
+
+        pool->workers[pool->nb_workers++] = worker;
+    }
+
+    return pool;
+}
+
+
+void worker_pool_submit(worker_pool_t* pool, job_run_fn run, job_complete_fn complete,
+                        void* data) {
+    if (pool->nb_workers == 0) {
+        run(data);
+        if (complete != NULL) {
+            complete(pool->context, data);
+        }
+        return;
+    }
+
+    job_t* job = malloc(sizeof(job_t));
+    job->run = run;
+    job->complete = complete;
+    job->data = data;
+
+    worker_t* target = pool->workers[0];
+    int target_jobs = atomic_load_explicit(&target->nb_jobs, memory_order_relaxed);
+    for (int i = 1; i < pool->nb_workers && target_jobs > 0; i++) {
+        int nb_jobs = atomic_load_explicit(&pool->workers[i]->nb_jobs, memory_order_relaxed);
+        if (nb_jobs < target_jobs) {
+            target = pool->workers[i];
+            target_jobs = nb_jobs;
+        }
+    }
+
+    atomic_fetch_add_explicit(&target->nb_jobs, 1, memory_order_relaxed);
+    ++pool->nb_pending;
+    mpsc_queue_push(&target->jobs, &job->node);
+
+    uint64_t one = 1;
+    write_to_fd(target->event_fd, &one, sizeof(uint64_t));
+}
+
+
+int worker_pool_complete(worker_pool_t* pool) {
+    int nb_completed = 0;
+    mpsc_node_t* node;
+    while ((node = mpsc_queue_pop(&pool->done)) != NULL) {
+        job_t* job = (job_t*)((char*)node - offsetof(job_t, node));
+        if (job->complete != NULL) {
+            job->complete(pool->context, job->data);
+        }
+
+        free(job);
+        --pool->nb_pending;
+        ++nb_completed;
+    }
+
+    return nb_completed;
+}
+
+
+int worker_pool_wait(worker_pool_t* pool, int timeout) {
+    if (pool->nb_pending == 0) {
+        millisleep(timeout);
+        return 0;
+    }
+
+    struct pollfd pollfd = { pool->done_fd, POLLIN, 0 };
+    if (poll(&pollfd, 1, timeout) <= 0) {
+        return 0;
+    }
+
+    uint64_t count;
+    read(pool->done_fd, &count, sizeof(uint64_t));
+    return 1;
+}
+
+
+int worker_pool_pending(const worker_pool_t* pool) {
+    return pool->nb_pending;
+}
+
+
+void worker_pool_destroy(worker_pool_t** pool) {
+    stop_workers(*pool, (*pool)->nb_workers);
+    worker_pool_complete(*pool);
+
+    close((*pool)->done_fd);
+    free(*pool);
+    *pool = NULL;
+}
+
+
+void* worker_main(void* args) {
+    worker_t* worker = (worker_t*)args;
+    worker_pool_t* pool = worker->pool;
+
+    while (1) {
+        mpsc_node_t* node;
+        while ((node = mpsc_queue_pop(&worker->jobs)) != NULL) {
+            job_t* job = (job_t*)((char*)node - offsetof(job_t, node));
+            job->run(job->data);
+
+            atomic_fetch_sub_explicit(&worker->nb_jobs, 1, memory_order_relaxed);
+            mpsc_queue_push(&pool->done, &job->node);
+
+            uint64_t one = 1;
+            write_to_fd(pool->done_fd, &one, sizeof(uint64_t));
+        }
+
+        /*
+         * The queue may look empty while a job is being pushed: its count comes
+         * right after, and wakes us up.
+         */
+        if (atomic_load_explicit(&pool->stop, memory_order_acquire) == 1 &&
+            atomic_load_explicit(&worker->nb_jobs, memory_order_relaxed) == 0) {
+            break;
+        }
+
+        uint64_t count;
+        if (read_from_fd(worker->event_fd, &count, sizeof(uint64_t)) == -1 &&
+            errno != EINTR) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+
+void stop_workers(worker_pool_t* pool, int nb_workers) {
+    atomic_store_explicit(&pool->stop, 1, memory_order_release);
+
+    for (int i = 0; i < nb_workers; i++) {
+        uint64_t one = 1;
+        write_to_fd(pool->workers[i]->event_fd, &one, sizeof(uint64_t));
+    }
+
+    for (int i = 0; i < nb_workers; i++) {
+        pthread_join(pool->workers[i]->thread, NULL);
+        close(pool->workers[i]->event_fd);
+        free(pool->workers[i]);
+    }
+
+    pool->nb_workers = 0;
+}
@@ -0,0 +1,122 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <stdatomic.h>
+
+
+/*
+ * Pool of worker threads running the jobs the loop of the servent cannot afford
+ * to wait for (searching the disk).
+ *
+ * A job has two parts: run, executed by a worker, and complete, executed by
+ * the thread owning the pool (the loop) when it calls worker_pool_complete.
+ * Only complete may touch the state of the owner, run only works on the data
+ * of the job. Jobs travel through lock-free MPSC queues: each worker has its
+ * own queue (it sleeps on an eventfd until a job comes), and the finished jobs
+ * come back through a single queue, shared by the workers, which also signal
+ * an eventfd the owner can sleep on (worker_pool_wait).
+ */
+
+
+/* Size of a cache line, to keep the ends of a queue apart. */
+#define WORKER_POOL_CACHE_LINE 64
+
+
+/* Maximum number of workers of a pool. */
+#define WORKER_POOL_MAX_WORKERS 64
+
+
+/*
+ * Link of an element inside a mpsc_queue_t, to embed in the element.
+ */
+typedef struct mpsc_node_s {
+    _Atomic(struct mpsc_node_s*) next;
+} mpsc_node_t;
+
+
+/*
+ * Intrusive lock-free queue, with any number of producers and a single
+ * consumer. Pushing never waits. The queue always holds at least one node
+ * (stub when it is empty), the consumer pops from tail and the producers push
+ * at head.
+ */
+typedef struct mpsc_queue_s {
+    /* Last node pushed, only exchanged by the producers. */
+    _Alignas(WORKER_POOL_CACHE_LINE) _Atomic(mpsc_node_t*) head;
+    /* Next node to pop, only used by the consumer. */
+    _Alignas(WORKER_POOL_CACHE_LINE) mpsc_node_t* tail;
+    mpsc_node_t stub;
+} mpsc_queue_t;
+
+
+void mpsc_queue_init(mpsc_queue_t* queue);
+
+
+/*
+ * Push node at the end of queue. Can be called from any thread.
+ */
+void mpsc_queue_push(mpsc_queue_t* queue, mpsc_node_t* node);
+
+
+/*
+ * Pop the oldest node of queue. Return NULL if the queue is empty, or if the
+ * oldest node is still being pushed (it is then popped by a later call). Only
+ * called by the consumer.
+ */
+mpsc_node_t* mpsc_queue_pop(mpsc_queue_t* queue);
+
+
+/* Work of a job, done by a worker. */
+typedef void (*job_run_fn)(void* data);
+/* End of a job, done by the owner of the pool, context being the one of the pool. */
+typedef void (*job_complete_fn)(void* context, void* data);
+
+
+typedef struct worker_pool_s worker_pool_t;
+
+
+/*
+ * Create a pool of nb_workers threads (at most WORKER_POOL_MAX_WORKERS).
+ * context is given to the completions. With 0 workers, the jobs are run and
+ * completed right away by worker_pool_submit. Return NULL if the threads could
+ * not be created.
+ */
+worker_pool_t* worker_pool_create(int nb_workers, void* context);
+
+
+/*
+ * Give a job to the worker with the fewest jobs. complete can be NULL if
+ * nothing has to be done once run is over.
+ */
+void worker_pool_submit(worker_pool_t* pool, job_run_fn run, job_complete_fn complete,
+                        void* data);
+
+
+/*
+ * Complete the jobs finished by the workers, in the calling thread. Return the
+ * number of jobs completed.
+ */
+int worker_pool_complete(worker_pool_t* pool);
+
+
+/*
+ * Sleep up to timeout milliseconds, or until a worker finishes a job. Return 1
+ * if one did (the job is completed by the next worker_pool_complete), 0
+ * otherwise.
+ */
+int worker_pool_wait(worker_pool_t* pool, int timeout);
+
+
+/*
+ * Return the number of jobs submitted and not completed yet.
+ */
+int worker_pool_pending(const worker_pool_t* pool);
+
+
+/*
+ * Wait for the workers to run the jobs they have, complete them, then stop the
+ * workers and free the pool.
+ */
+void worker_pool_destroy(worker_pool_t** pool);
+
+#endif /* WORKER_POOL_H */